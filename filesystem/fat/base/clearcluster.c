@@ -32,15 +32,11 @@
 ----------------------------------------------------------------------------*/
 int32_t ClearCluster(int32_t HandleNumber)
 {
-    int32_t Device = Handle[HandleNumber].Device,i,RetValue;
+    int32_t Device = Handle[HandleNumber].Device,RetValue;
     int32_t SectorNumber = Handle[HandleNumber].CurrentSector;
     
-    for(i=0; i< MediaTable[Device].SectorsPerCluster; i++)
-    {
-        if((RetValue = FSEraseSector(Device,SectorNumber)) <0)
-			return RetValue;
-        SectorNumber++;
-    }
+    if((RetValue = FSEraseSectors(Device,SectorNumber,MediaTable[Device].SectorsPerCluster)) <0)
+		return RetValue;
     return SUCCESS;
 }
 
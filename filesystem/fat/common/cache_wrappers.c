@@ -94,40 +94,27 @@ RtStatus_t FSWriteSector_BypassCache(int32_t deviceNumber, int32_t sectorNumber,
     return media_cache_write(&pb);
 }
 
-// Used only in clearcluster() in the FAT filesystem. Can replace with call to writesector.
 RtStatus_t FSEraseSector(int32_t deviceNumber, int32_t sectorNumber)
+{
+    return FSEraseSectors(deviceNumber, sectorNumber, 1);
+}
+
+// Used by clearcluster() in the FAT filesystem. The media cache keeps track of the zeroed
+// sectors without holding a buffer for each of them.
+RtStatus_t FSEraseSectors(int32_t deviceNumber, int32_t sectorNumber, int32_t count)
 {
     MediaCacheParamBlock_t pb = {0};
-    RtStatus_t status;
-    uint8_t * buffer;
 
-    // Acquire a buffer to hold the empty sector.
-    status = media_buffer_acquire(kMediaBufferType_Sector, 0, (SECTOR_BUFFER **)&buffer);
-    if (status != SUCCESS)
-    {
-        return status;
-    }
-    
-    // Clear the sector buffer to all zeroes.
-    memset(buffer, 0, MediaTable[deviceNumber].BytesPerSector);
-    
-    // Setup param block for write.
+    // Setup param block for the write.
     pb.drive = deviceNumber;
     pb.sector = sectorNumber;
-    pb.buffer = buffer;
-    pb.writeOffset = 0;
-    pb.writeByteCount = MediaTable[deviceNumber].BytesPerSector;
+    pb.requestSectorCount = count;
     pb.mode = WRITE_TYPE_RANDOM;
     pb.weight = GetSectorWeight(deviceNumber, sectorNumber);
     pb.flags = kMediaCacheFlag_ApplyWeight;
     
-    // Write the empty sector.
-    status = media_cache_write(&pb);
-    
-    // Let go of the sector buffer.
-    media_buffer_release((SECTOR_BUFFER *)buffer);
-    
-    return status;
+    // Zero the sectors.
+    return media_cache_write_zeroes(&pb);
 }
 
 //! Param block fields:
@@ -19,6 +19,7 @@ extern const uint8_t DriveLetter[];
 RtStatus_t FSWriteSector(int32_t deviceNumber, int32_t sectorNumber, int32_t destOffset, uint8_t * sourceBuffer, int32_t sourceOffset, int32_t numBytesToWrite, int32_t writeType);
 RtStatus_t FSWriteSector_BypassCache(int32_t deviceNumber, int32_t sectorNumber, int32_t destOffset, uint8_t * sourceBuffer, int32_t sourceOffset, int32_t numBytesToWrite, int32_t writeType);
 RtStatus_t FSEraseSector(int32_t deviceNumber, int32_t sectorNumber);
+RtStatus_t FSEraseSectors(int32_t deviceNumber, int32_t sectorNumber, int32_t count);
 int32_t * FSReadSector(int32_t deviceNumber, int32_t sectorNumber, int32_t writeType, uint32_t * token);
 int32_t * FSReadSector_BypassCache(int32_t deviceNumber, int32_t sectorNumber, int32_t writeType, uint8_t *pBuffer, uint32_t * token);
 RtStatus_t FSReleaseSector(uint32_t token);
@@ -78,6 +78,21 @@
 //! This mechanism keeps from repeatedly allocating and freeing buffers during
 //! bursts of activity, while allowing efficient use of memory during idle time.
 //!
+//! Free buffers are kept on a list for each combination of type and flags, and
+//! buffers are looked up by address in a hash table. Acquiring a free buffer,
+//! releasing a buffer, and retaining one take constant time and never block;
+//! only allocating and freeing temporary buffers take the buffer manager's mutex.
+//! The number of buffers the manager can hold at once, permanent and temporary
+//! together, is set by the MAX_BUFFER_COUNT build option.
+//!
+//! The first few threads to acquire a sector or auxiliary buffer are each given a
+//! small cache of free buffers. A thread's acquires and releases are served from
+//! its own cache first, without disabling interrupts, and the cache is refilled
+//! from and drained to the shared lists a few buffers at a time. When the shared
+//! lists run dry, the buffers cached by other threads are taken back, those of idle
+//! threads first, before a temporary buffer is allocated. A buffer sitting in a
+//! thread's cache reports itself as in use with a reference count of zero.
+//!
 //! @{
 //! \file media_buffer_manager.h
 //! \brief Public API to manage shared buffers for media code.
@@ -179,9 +194,60 @@ enum _media_buffer_properties
     //! acquired before then. If the buffer is not temporary, then the result will be -1
     //! (0xffffffff). If the buffer is temporary but currently in use by someone, the result will
     //! be zero.
-    kMediaBufferProperty_Timeout = 'btmo'
+    kMediaBufferProperty_Timeout = 'btmo',
+    
+    //! \name Buffer manager properties
+    //!
+    //! These properties describe the buffer manager as a whole rather than a single buffer.
+    //! They are read by passing NULL for the buffer, and only from a thread.
+    //@{
+    
+    //! \brief Most buffers of each type that have been out of the pool at once.
+    //! \em [uint32_t[#kMediaBufferType_Count]]
+    //!
+    //! Buffers cached by a thread count as out of the pool. Temporary buffers are included,
+    //! so a high-water mark above the number of permanent buffers of a type means the pool
+    //! for that type is too small.
+    kMediaBufferProperty_HighWaterMarks = 'bhwm',
+    
+    //! \brief Number of temporary buffers that have been allocated. \em [uint32_t]
+    kMediaBufferProperty_TemporaryAllocations = 'btal',
+    
+    //! \brief Number of temporary buffers that had to be realigned. \em [uint32_t]
+    kMediaBufferProperty_RealignedAllocations = 'bral',
+    
+    //! \brief Number of acquires that were given a buffer of a larger type. \em [uint32_t]
+    kMediaBufferProperty_MismatchedSizeAllocations = 'bmis',
+    
+    //! \brief Number of acquires that found no suitable buffer in the pool. \em [uint32_t]
+    kMediaBufferProperty_ExhaustedCount = 'bex#',
+    
+    //! \brief Total microseconds spent in acquires that found no suitable buffer in the
+    //!     pool. \em [uint64_t]
+    //!
+    //! This covers waiting for the buffer manager's mutex, taking back buffers cached by
+    //! other threads, and allocating a temporary buffer.
+    kMediaBufferProperty_ExhaustedTime = 'bext',
+    
+    //! \brief The call sites holding the most buffers right now.
+    //! \em [MediaBufferHolder_t[#MEDIA_BUFFER_TOP_HOLDER_COUNT]]
+    //!
+    //! Entries are sorted by the number of buffers held, most first. Unused entries are
+    //! zero. A site that keeps showing up here while the system is idle is leaking buffers.
+    kMediaBufferProperty_TopHolders = 'bhld'
+    
+    //@}
 };
 
+//! \brief Number of call sites reported by the #kMediaBufferProperty_TopHolders property.
+#define MEDIA_BUFFER_TOP_HOLDER_COUNT (4)
+
+//! \brief A call site holding buffers, as reported by #kMediaBufferProperty_TopHolders.
+typedef struct _media_buffer_holder {
+    uint32_t callSite;      //!< Return address of the media_buffer_acquire() call. Where the compiler can't provide it, this is the acquiring thread instead.
+    uint32_t bufferCount;   //!< Number of buffers acquired there that are still held.
+} MediaBufferHolder_t;
+
 //@}
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -270,11 +336,14 @@ RtStatus_t media_buffer_retain(SECTOR_BUFFER * buffer);
 //! released.
 //!
 //! Permanent buffers that are released are made immediately available to other
-//! callers, as soon as this function returns.
+//! callers, as soon as this function returns. A sector or auxiliary buffer may first
+//! go to the calling thread's cache, from which other threads can only take it
+//! once the shared lists run dry.
 //!
 //! Temporary buffers are not immediately deallocated. They become available
 //! for other callers for a limited amount of time, currently 200 ms. If not
-//! re-acquired during that time, the temporary buffer is freed for good.
+//! re-acquired during that time, the temporary buffer is freed for good within
+//! another 50 ms.
 //! However, if the buffer is used again before the timeout expires then the
 //! process starts over again when it is next released.
 //!
@@ -289,7 +358,20 @@ RtStatus_t media_buffer_release(SECTOR_BUFFER * buffer);
 
 //! \brief Reads an arbitrary property of a buffer.
 //!
+//! Properties of the buffer manager as a whole are read by passing NULL for
+//! \a buffer. These are collected in every build, unlike the detailed statistics
+//! enabled by RECORD_BUFFER_STATS.
+//!
+//! \param[in] buffer The buffer to read a property of, or NULL.
+//! \param[in] whichProperty One of the property selectors.
+//! \param[out] value Storage for the property's value, of the type documented
+//!     for the selector.
+//!
 //! \retval SUCCESS
+//! \retval ERROR_DDI_MEDIABUFMGR_INVALID_BUFFER The buffer is not under control of
+//!     the buffer manager.
+//! \retval ERROR_DDI_MEDIABUFMGR_INVALID_PROPERTY The property is unknown, or does not
+//!     apply to a buffer or to the buffer manager as was asked.
 RtStatus_t media_buffer_get_property(SECTOR_BUFFER * buffer, uint32_t whichProperty, void * value);
 
 #ifdef __cplusplus
@@ -28,13 +28,15 @@
 #include "os/thi/os_thi_api.h"
 #include "os/dpc/os_dpc_api.h"
 #include "os/vmi/os_vmi_api.h"
+#include "hw/profile/hw_profile.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 // Definitions
 ///////////////////////////////////////////////////////////////////////////////
 
-#if !defined(INT32_MAX)
-    #define INT32_MAX (0x7fffffffL)
+// Buffer indexes are stored in 8-bit fields.
+#if MAX_BUFFER_COUNT > 127
+    #error "MAX_BUFFER_COUNT is too large"
 #endif
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -61,14 +63,34 @@ bool g_mediaBufferManagerLogAllocations = false;
 ///////////////////////////////////////////////////////////////////////////////
 
 static size_t media_buffer_get_type_size(MediaBufferType_t bufferType);
+static unsigned media_buffer_hash(SECTOR_BUFFER * buffer);
+static int media_buffer_find(SECTOR_BUFFER * buffer);
+static int media_buffer_find_unlocked(SECTOR_BUFFER * buffer);
+static void media_buffer_hash_insert(int index);
+static void media_buffer_hash_remove(int index);
+static void media_buffer_push_free(int index);
+static void media_buffer_unlink_free(int index);
+static void media_buffer_push_idle(int index);
+static void media_buffer_unlink_idle(int index);
 static RtStatus_t media_buffer_add_internal(MediaBufferType_t bufferType, uint32_t bufferFlags, uint32_t refCount, SECTOR_BUFFER * buffer, SECTOR_BUFFER * originalBuffer, unsigned * insertIndex);
-static bool media_buffer_search(size_t length, bool exactLengthMatch, uint32_t flags, unsigned * result);
+static int media_buffer_take_free(size_t length, uint32_t flags, bool allowLarger);
+static void media_buffer_count_out(unsigned bufferType, int delta);
+static void media_buffer_take_buffer(int index, MediaBufferType_t bufferType);
+static void media_buffer_return_buffer(int index);
+static SECTOR_BUFFER * media_buffer_dispose_locked(int index);
+static MediaBufferMagazine_t * media_buffer_get_magazine(bool canClaim);
+static bool media_buffer_magazine_acquire(MediaBufferMagazine_t * magazine, MediaBufferType_t bufferType, size_t typeSize, uint32_t requiredFlags, uint32_t callSite, SECTOR_BUFFER ** buffer);
+static bool media_buffer_magazine_release(SECTOR_BUFFER * buffer);
+static void media_buffer_reclaim_magazines(uint32_t idleTicks);
+static void media_buffer_dispose_expired_cached(MediaBufferMagazine_t * magazine);
+static bool media_buffer_take_global(MediaBufferMagazine_t * magazine, MediaBufferType_t bufferType, size_t typeSize, uint32_t requiredFlags, uint32_t callSite, SECTOR_BUFFER ** buffer);
+static RtStatus_t media_buffer_create_temporary(MediaBufferType_t bufferType, size_t typeSize, uint32_t requiredFlags, uint32_t callSite, SECTOR_BUFFER ** buffer);
 static SECTOR_BUFFER * media_buffer_allocate_internal(size_t length, uint32_t flags, bool physicallyContiguous);
 static bool media_buffer_is_contiguous(SECTOR_BUFFER * buffer, size_t length);
 static SECTOR_BUFFER * media_buffer_allocate(size_t length, uint32_t flags, uint32_t * resultFlags, SECTOR_BUFFER ** original);
-static void media_buffer_shrink_slots(void);
-static void media_buffer_setup_next_timeout(void);
 static void media_buffer_dispose_temporary(uint32_t unused);
+static void media_buffer_get_top_holders(MediaBufferHolder_t * holders);
+static RtStatus_t media_buffer_get_manager_property(uint32_t whichProperty, void * value);
 
 #if RECORD_BUFFER_STATS
 static void media_buffer_update_stats(MediaBufferStatistics_t * stats, bool isAcquire);
@@ -115,12 +137,232 @@ static size_t media_buffer_get_type_size(MediaBufferType_t bufferType)
     }
 }
 
+//! \brief Returns the home slot of a buffer address in the hash table.
+static inline unsigned media_buffer_hash(SECTOR_BUFFER * buffer)
+{
+    // Buffers are usually aligned to a cache line, so the low bits carry no information.
+    return ((uint32_t)buffer >> 5) % BUFFER_HASH_SIZE;
+}
+
+//! \brief Looks up the index of a buffer from its address.
+//!
+//! \param buffer Address of the buffer, as returned to the caller.
+//!
+//! \return The index of the buffer in the buffer array.
+//! \retval NO_BUFFER The buffer is not under control of the buffer manager.
+//!
+//! \pre IRQs must be disabled.
+static int media_buffer_find(SECTOR_BUFFER * buffer)
+{
+    unsigned slot = media_buffer_hash(buffer);
+    int index;
+
+    // The table is never full, so there is always an empty slot to end the probe. The
+    // data pointer is read as volatile so the read is not moved out of a generation check.
+    while ((index = g_mediaBufferManagerContext.hash[slot]) != NO_BUFFER)
+    {
+        if (((volatile MediaBufferInfo_t *)g_mediaBufferManagerContext.buffers)[index].data == buffer)
+        {
+            return index;
+        }
+
+        slot = (slot + 1) % BUFFER_HASH_SIZE;
+    }
+
+    return NO_BUFFER;
+}
+
+//! \brief Looks up the index of a buffer without disabling IRQs.
+//!
+//! The lookup is repeated if the hash table was changed while it was in progress.
+//! This is only safe for a buffer that the caller holds a reference to, since the
+//! buffer could otherwise be disposed of as soon as this function returns.
+//!
+//! \param buffer Address of the buffer, as returned to the caller.
+//!
+//! \return The index of the buffer in the buffer array.
+//! \retval NO_BUFFER The buffer is not under control of the buffer manager.
+static int media_buffer_find_unlocked(SECTOR_BUFFER * buffer)
+{
+    uint32_t generation;
+    int index;
+
+    do {
+        generation = g_mediaBufferManagerContext.hashGeneration;
+        index = media_buffer_find(buffer);
+    } while ((generation & 1) || generation != g_mediaBufferManagerContext.hashGeneration);
+
+    return index;
+}
+
+//! \brief Adds a buffer to the hash table.
+//!
+//! \pre The buffer's data pointer must be set.
+//! \pre IRQs must be disabled.
+static void media_buffer_hash_insert(int index)
+{
+    unsigned slot = media_buffer_hash(g_mediaBufferManagerContext.buffers[index].data);
+
+    while (g_mediaBufferManagerContext.hash[slot] != NO_BUFFER)
+    {
+        slot = (slot + 1) % BUFFER_HASH_SIZE;
+    }
+
+    g_mediaBufferManagerContext.hashGeneration++;
+    g_mediaBufferManagerContext.hash[slot] = index;
+    g_mediaBufferManagerContext.hashGeneration++;
+}
+
+//! \brief Removes a buffer from the hash table.
+//!
+//! Entries following the removed one in its probe sequence are shifted back into the
+//! hole when their own probe sequences pass through it, so no tombstones are needed.
+//!
+//! \pre The buffer's data pointer must still be set.
+//! \pre IRQs must be disabled.
+static void media_buffer_hash_remove(int index)
+{
+    unsigned hole = media_buffer_hash(g_mediaBufferManagerContext.buffers[index].data);
+    unsigned slot;
+    int other;
+
+    while (g_mediaBufferManagerContext.hash[hole] != index)
+    {
+        assert(g_mediaBufferManagerContext.hash[hole] != NO_BUFFER);
+        hole = (hole + 1) % BUFFER_HASH_SIZE;
+    }
+
+    g_mediaBufferManagerContext.hashGeneration++;
+
+    slot = hole;
+    for (;;)
+    {
+        unsigned home;
+
+        slot = (slot + 1) % BUFFER_HASH_SIZE;
+        other = g_mediaBufferManagerContext.hash[slot];
+        if (other == NO_BUFFER)
+        {
+            break;
+        }
+
+        // Move the entry if the hole is no further from its home slot than it is now.
+        home = media_buffer_hash(g_mediaBufferManagerContext.buffers[other].data);
+        if ((slot + BUFFER_HASH_SIZE - home) % BUFFER_HASH_SIZE >= (slot + BUFFER_HASH_SIZE - hole) % BUFFER_HASH_SIZE)
+        {
+            g_mediaBufferManagerContext.hash[hole] = other;
+            hole = slot;
+        }
+    }
+
+    g_mediaBufferManagerContext.hash[hole] = NO_BUFFER;
+    g_mediaBufferManagerContext.hashGeneration++;
+}
+
+//! \brief Puts a buffer at the head of the free list of its class.
+//!
+//! The most recently released buffer is handed out first, which leaves temporary
+//! buffers that are not needed at the tail of the list to time out.
+//!
+//! \pre IRQs must be disabled.
+static void media_buffer_push_free(int index)
+{
+    MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[index];
+    int8_t * head = &g_mediaBufferManagerContext.freeHeads[info->bufferClass];
+
+    info->prev = NO_BUFFER;
+    info->next = *head;
+    if (*head != NO_BUFFER)
+    {
+        g_mediaBufferManagerContext.buffers[*head].prev = index;
+    }
+    *head = index;
+}
+
+//! \brief Removes a buffer from the free list of its class.
+//!
+//! \pre IRQs must be disabled.
+static void media_buffer_unlink_free(int index)
+{
+    MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[index];
+
+    if (info->prev != NO_BUFFER)
+    {
+        g_mediaBufferManagerContext.buffers[info->prev].next = info->next;
+    }
+    else
+    {
+        g_mediaBufferManagerContext.freeHeads[info->bufferClass] = info->next;
+    }
+
+    if (info->next != NO_BUFFER)
+    {
+        g_mediaBufferManagerContext.buffers[info->next].prev = info->prev;
+    }
+
+    info->next = NO_BUFFER;
+    info->prev = NO_BUFFER;
+}
+
+//! \brief Appends a released temporary buffer to the idle list.
+//!
+//! \pre IRQs must be disabled.
+static void media_buffer_push_idle(int index)
+{
+    MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[index];
+
+    info->nextIdle = NO_BUFFER;
+    info->prevIdle = g_mediaBufferManagerContext.idleTail;
+    if (g_mediaBufferManagerContext.idleTail != NO_BUFFER)
+    {
+        g_mediaBufferManagerContext.buffers[g_mediaBufferManagerContext.idleTail].nextIdle = index;
+    }
+    else
+    {
+        g_mediaBufferManagerContext.idleHead = index;
+    }
+    g_mediaBufferManagerContext.idleTail = index;
+}
+
+//! \brief Removes a temporary buffer from the idle list.
+//!
+//! \pre IRQs must be disabled.
+static void media_buffer_unlink_idle(int index)
+{
+    MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[index];
+
+    if (info->prevIdle != NO_BUFFER)
+    {
+        g_mediaBufferManagerContext.buffers[info->prevIdle].nextIdle = info->nextIdle;
+    }
+    else
+    {
+        g_mediaBufferManagerContext.idleHead = info->nextIdle;
+    }
+
+    if (info->nextIdle != NO_BUFFER)
+    {
+        g_mediaBufferManagerContext.buffers[info->nextIdle].prevIdle = info->prevIdle;
+    }
+    else
+    {
+        g_mediaBufferManagerContext.idleTail = info->prevIdle;
+    }
+
+    info->nextIdle = NO_BUFFER;
+    info->prevIdle = NO_BUFFER;
+}
+
 //! \brief Internal add function that returns the new buffer's index.
 //!
+//! A buffer that is added with a reference count of zero goes on its free list,
+//! otherwise it is in use by the caller.
 static RtStatus_t media_buffer_add_internal(MediaBufferType_t bufferType, uint32_t bufferFlags, uint32_t refCount, SECTOR_BUFFER * buffer, SECTOR_BUFFER * originalBuffer, unsigned * insertIndex)
 {
-    unsigned i;
+    int i;
     MediaBufferInfo_t * info;
+    size_t length = media_buffer_get_type_size(bufferType);
+    bool irqState;
 
     assert(buffer != NULL);
     assert(((uint32_t)buffer & 0x3) == 0); // Make sure the buffer is word aligned.
@@ -136,26 +378,28 @@ static RtStatus_t media_buffer_add_internal(MediaBufferType_t bufferType, uint32
         return ERROR_DDI_MEDIABUFMGR_NO_ROOM;
     }
 
-    // Find an empty slot to insert the new buffer into. If we don't find one,
-    // then when the loop is finished i will point at the next unused slot.
-    for (i=0; i < g_mediaBufferManagerContext.slotCount; ++i)
-    {
-        if (g_mediaBufferManagerContext.buffers[i].data == NULL)
-        {
-            break;
-        }
-    }
+    // Disable interrupts while the lists are modified.
+    irqState = hw_core_EnableIrqInterrupt(false);
 
-    assert(i <= MAX_BUFFER_COUNT);
+    // Take an unused slot to insert the new buffer into.
+    i = g_mediaBufferManagerContext.unusedHead;
+    assert(i != NO_BUFFER);
+    info = &g_mediaBufferManagerContext.buffers[i];
+    g_mediaBufferManagerContext.unusedHead = info->next;
 
     // Fill in new buffer information.
-    info = &g_mediaBufferManagerContext.buffers[i];
-    info->length = media_buffer_get_type_size(bufferType);
+    info->length = length;
     info->data = buffer;
     info->flags = bufferFlags;
     info->refCount = refCount;
     info->timeout = 0;
     info->originalBuffer = originalBuffer;
+    info->bufferClass = bufferType * BUFFER_FLAG_COMBINATIONS + (bufferFlags & BUFFER_CLASS_FLAGS_MASK);
+    info->next = NO_BUFFER;
+    info->prev = NO_BUFFER;
+    info->nextIdle = NO_BUFFER;
+    info->prevIdle = NO_BUFFER;
+    info->holder = 0;
 
 #if RECORD_BUFFER_STATS
     // In debug builds we keep track of the buffer's type for statistics
@@ -163,16 +407,22 @@ static RtStatus_t media_buffer_add_internal(MediaBufferType_t bufferType, uint32
     info->bufferType = bufferType;
 #endif // RECORD_BUFFER_STATS
 
-    // Increment buffer count and free count.
-    g_mediaBufferManagerContext.bufferCount++;
-    g_mediaBufferManagerContext.freeCount++;
+    media_buffer_hash_insert(i);
 
-    // Increment the used count if we added to the end.
-    if (i == g_mediaBufferManagerContext.slotCount)
+    // Increment buffer count, and the free count if nobody holds the buffer.
+    g_mediaBufferManagerContext.bufferCount++;
+    if (refCount == 0)
+    {
+        media_buffer_push_free(i);
+        g_mediaBufferManagerContext.freeCount++;
+    }
+    else
     {
-        g_mediaBufferManagerContext.slotCount++;
+        media_buffer_count_out(bufferType, 1);
     }
 
+    hw_core_EnableIrqInterrupt(irqState);
+
     // Return the index of the newly added buffer.
     if (insertIndex)
     {
@@ -190,68 +440,66 @@ RtStatus_t media_buffer_add(MediaBufferType_t bufferType, uint32_t bufferFlags,
     return media_buffer_add_internal(bufferType, bufferFlags, 0, buffer, NULL, NULL);
 }
 
-//! \brief Searches the buffer list for a free buffer with the desired attributes.
+//! \brief Takes a free buffer with the desired attributes off its free list.
+//!
+//! A buffer whose size matches the request exactly is preferred over a larger one,
+//! and a buffer with exactly the requested flags over one with additional flags.
+//! Only the head of each free list is examined, so the cost does not depend on the
+//! number of buffers.
 //!
 //! \param[in] length Desired length in bytes of the buffer.
-//! \param[in] exactLengthMatch Whether \a length must match the buffer's size
-//!     exactly, or the buffer can be larger than the requested size.
 //! \param[in] flags Flags that the buffer must have set.
-//! \param[out] result On successful exit, this parameter is set to the index
-//!     of the buffer that was found.
+//! \param[in] allowLarger Whether a buffer larger than \a length may be taken.
 //!
-//! \retval true A matching, free buffer was found. The \a result parameter holds
-//!     the index of the matching buffer.
-//! \retval false No buffer is available that matches the request.
+//! \return The index of the buffer that was taken.
+//! \retval NO_BUFFER No buffer is available that matches the request.
 //!
-//! \todo Improve the search algorithm. Right now it is only a simple linear search.
-static bool media_buffer_search(size_t length, bool exactLengthMatch, uint32_t flags, unsigned * result)
+//! \pre IRQs must be disabled.
+static int media_buffer_take_free(size_t length, uint32_t flags, bool allowLarger)
 {
-    unsigned i;
-
-    assert(result != NULL);
-
-    // Search for free buffer.
-    for (i=0; i < g_mediaBufferManagerContext.slotCount; ++i)
+    unsigned requiredCombination = flags & BUFFER_CLASS_FLAGS_MASK;
+    unsigned passCount = allowLarger ? 2 : 1;
+    unsigned pass;
+    unsigned extraFlags;
+    unsigned bufferType;
+
+    // The first pass only accepts an exact length match.
+    for (pass = 0; pass < passCount; ++pass)
     {
-        MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[i];
-        bool isMatch;
+        bool exactLengthMatch = (pass == 0);
 
-        // Skip the buffer if it's data pointer is null.
-        if (info->data == NULL)
+        // Walk the flag combinations that include all required flags, starting with
+        // the one that has no extra flags.
+        for (extraFlags = 0; extraFlags < BUFFER_FLAG_COMBINATIONS; ++extraFlags)
         {
-            continue;
-        }
+            if (extraFlags & requiredCombination)
+            {
+                continue;
+            }
 
-        // A buffer matches the request if:
-        // - it is not busy
-        // - the request flags are set on the buffer
-        // - exactLengthMatch is:
-        //   - true: length matches exactly
-        //   - false: buffer length is >= the request length
-        isMatch = ((info->flags & kMediaBufferFlag_InUse) == 0)
-            && (((info->flags & ~kMediaBufferManager_InternalFlagsMask) & flags) == flags);
+            for (bufferType = 0; bufferType < kMediaBufferType_Count; ++bufferType)
+            {
+                unsigned bufferClass = bufferType * BUFFER_FLAG_COMBINATIONS + (requiredCombination | extraFlags);
+                int index = g_mediaBufferManagerContext.freeHeads[bufferClass];
+                size_t bufferLength;
 
-        if (exactLengthMatch)
-        {
-            // Length must match exactly.
-            isMatch = isMatch && (info->length == length);
-        }
-        else
-        {
-            // Match as long as the buffer's length is large enough for the request.
-            isMatch = isMatch && (info->length >= length);
-        }
+                if (index == NO_BUFFER)
+                {
+                    continue;
+                }
 
-        // Return the buffer index if we've hit a match.
-        if (isMatch)
-        {
-            *result = i;
-            return true;
+                bufferLength = g_mediaBufferManagerContext.buffers[index].length;
+                if (exactLengthMatch ? (bufferLength == length) : (bufferLength >= length))
+                {
+                    media_buffer_unlink_free(index);
+                    return index;
+                }
+            }
         }
     }
 
     // No buffer is available that matches the request.
-    return false;
+    return NO_BUFFER;
 }
 
 //! \brief Allocate a buffer modified by the flags.
@@ -489,443 +737,760 @@ static void media_buffer_update_stats(MediaBufferStatistics_t * stats, bool isAc
 }
 #endif // RECORD_BUFFER_STATS
 
-// See media_buffer_manager.h for the documentation for this function.
-RtStatus_t media_buffer_acquire(MediaBufferType_t bufferType, uint32_t requiredFlags, SECTOR_BUFFER ** buffer)
+//! \brief Updates the number of buffers of a type that are out of the pool.
+//!
+//! \param bufferType Type the buffer was added with.
+//! \param delta One when a buffer leaves the pool, minus one when it comes back.
+//!
+//! \pre IRQs must be disabled.
+static inline void media_buffer_count_out(unsigned bufferType, int delta)
 {
-    size_t typeSize = media_buffer_get_type_size(bufferType);
-    SECTOR_BUFFER * data;
-    RtStatus_t status;
-
-    assert(buffer != NULL);
-    assert(g_mediaBufferManagerContext.isInited);
-
-    // Acquire mutex.
-    tx_mutex_get(&g_mediaBufferManagerContext.mutex, TX_WAIT_FOREVER);
+    unsigned count = g_mediaBufferManagerContext.outCount[bufferType] + delta;
 
-    // Is there a free buffer available?
-    if (g_mediaBufferManagerContext.freeCount > 0)
+    g_mediaBufferManagerContext.outCount[bufferType] = count;
+    if (count > g_mediaBufferManagerContext.highWaterMarks[bufferType])
     {
-        unsigned matchIndex;
-        bool isMatch;
-
-        // Try a first time to find a matching free buffer that has the exact
-        // length being requested and matches all flags.
-        isMatch = media_buffer_search(typeSize, true, requiredFlags, &matchIndex);
-
-        // If that doesn't pan out, try again to find a buffer at least as large
-        // as the requested size and has all flags set.
-        if (!isMatch)
-        {
-            isMatch = media_buffer_search(typeSize, false, requiredFlags, &matchIndex);
-        }
-
-        // Handle when we've found a buffer the caller can use.
-        if (isMatch)
-        {
-            // Mark the buffer as used and set the return value.
-            MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[matchIndex];
-            info->flags |= kMediaBufferFlag_InUse;
-            info->refCount = 1;
-            *buffer = info->data;
-
-            g_mediaBufferManagerContext.freeCount--;
+        g_mediaBufferManagerContext.highWaterMarks[bufferType] = count;
+    }
+}
 
-            // Deal with temporary buffers.
-            if (info->flags & kMediaBufferFlag_Temporary)
-            {
-                // Clear the timeout.
-                info->timeout = 0;
+//! \brief Marks a buffer that was taken off its free list as in use.
+//!
+//! The caller sets the buffer's reference count.
+//!
+//! \param index Index of the buffer.
+//! \param bufferType Type of buffer that was requested, for telemetry.
+//!
+//! \pre IRQs must be disabled.
+static void media_buffer_take_buffer(int index, MediaBufferType_t bufferType)
+{
+    MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[index];
 
-                // If this was the buffer that was next going to timeout, deactivate
-                // the timer.
-                if (g_mediaBufferManagerContext.nextTimeout == matchIndex)
-                {
-                    // Kill the timer, it will be reactivated below if needed.
-                    tx_timer_deactivate(&g_mediaBufferManagerContext.timeoutTimer);
+    info->flags |= kMediaBufferFlag_InUse;
+    g_mediaBufferManagerContext.freeCount--;
+    media_buffer_count_out(info->bufferClass / BUFFER_FLAG_COMBINATIONS, 1);
 
-                    // See if there is a next buffer to timeout. This will update
-                    // the nextTimeout field of the context.
-                    media_buffer_setup_next_timeout();
-                }
+    if (info->bufferClass / BUFFER_FLAG_COMBINATIONS != bufferType)
+    {
+        g_mediaBufferManagerContext.mismatchedSizeAllocs++;
+    }
 
-                // If this buffer was queued to be disposed, cancel that.
-                if (g_mediaBufferManagerContext.bufferToDispose == matchIndex)
-                {
-                    g_mediaBufferManagerContext.bufferToDispose = NO_NEXT_TIMEOUT;
-                }
-            }
+    // A temporary buffer no longer times out once it is in use again.
+    if (info->flags & kMediaBufferFlag_Temporary)
+    {
+        info->timeout = 0;
+        media_buffer_unlink_idle(index);
+    }
 
 #if RECORD_BUFFER_STATS
-            // Update statistics.
-            if (info->flags & kMediaBufferFlag_Temporary)
-            {
-                media_buffer_update_stats(&g_mediaBufferManagerContext.tempStats, true);
-                media_buffer_update_stats(&g_mediaBufferManagerContext.tempTypeStats[info->bufferType], true);
-            }
-            else
-            {
-                media_buffer_update_stats(&g_mediaBufferManagerContext.permStats, true);
-                media_buffer_update_stats(&g_mediaBufferManagerContext.permTypeStats[info->bufferType], true);
-            }
-
-            if (info->bufferType != bufferType)
-            {
-                g_mediaBufferManagerContext.mismatchedSizeAllocs++;
-            }
-
-            // Log the permanent allocation.
-            if (g_mediaBufferManagerLogAllocations)
-            {
-                tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
-                    "bufmgr: allocated perm buffer %x [#%d, size=%d, flags=%x]\n", (uint32_t)info->data, matchIndex, typeSize, requiredFlags);
-            }
-#endif // RECORD_BUFFER_STATS
-
-            tx_mutex_put(&g_mediaBufferManagerContext.mutex);
-            return SUCCESS;
-        }
+    // Update statistics.
+    if (info->flags & kMediaBufferFlag_Temporary)
+    {
+        media_buffer_update_stats(&g_mediaBufferManagerContext.tempStats, true);
+        media_buffer_update_stats(&g_mediaBufferManagerContext.tempTypeStats[info->bufferType], true);
     }
-
+    else
     {
-        SECTOR_BUFFER * originalBuffer = NULL;
-        uint32_t resultFlags;
-        uint32_t bufferFlags;
-
-        // There are no buffers available in the list, or no match was found,
-        // so create a temporary one.
-        data = media_buffer_allocate(typeSize, requiredFlags, &resultFlags, &originalBuffer);
+        media_buffer_update_stats(&g_mediaBufferManagerContext.permStats, true);
+        media_buffer_update_stats(&g_mediaBufferManagerContext.permTypeStats[info->bufferType], true);
+    }
+#endif // RECORD_BUFFER_STATS
+}
 
-        // Error out if the allocation failed.
-        if (!data)
-        {
-            tx_mutex_put(&g_mediaBufferManagerContext.mutex);
-            return ERROR_DDI_MEDIABUFMGR_ALLOC_FAILED;
-        }
+//! \brief Puts a buffer that nobody holds any more back on its free list.
+//!
+//! A temporary buffer starts timing out.
+//!
+//! \pre The buffer's reference count must be zero.
+//! \pre IRQs must be disabled.
+static void media_buffer_return_buffer(int index)
+{
+    MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[index];
 
-        // Build the combined flags that are set for this buffer when it is added below.
-        // The buffer is marked as temporary and in use. Marking it as temporary
-        // will cause it to be freed when the caller releases it.
-        bufferFlags = requiredFlags | resultFlags | kMediaBufferFlag_Temporary | kMediaBufferFlag_InUse;
+    assert(info->refCount == 0);
 
+    if (info->flags & kMediaBufferFlag_Temporary)
+    {
+        // Reset the buffer's timeout. The idle list stays in timeout order
+        // because every temporary buffer gets the same timeout.
+        info->timeout = tx_time_get() + OS_MSECS_TO_TICKS(TEMPORARY_BUFFER_TIMEOUT_MS);
+        media_buffer_push_idle(index);
+    }
 #if RECORD_BUFFER_STATS
+    else
+    {
         // Update statistics.
-        media_buffer_update_stats(&g_mediaBufferManagerContext.tempStats, true);
-        media_buffer_update_stats(&g_mediaBufferManagerContext.tempTypeStats[bufferType], true);
+        media_buffer_update_stats(&g_mediaBufferManagerContext.permStats, false);
+        media_buffer_update_stats(&g_mediaBufferManagerContext.permTypeStats[info->bufferType], false);
+    }
+#endif // RECORD_BUFFER_STATS
 
-        // Increment the number of new temporary buffers allocated.
-        g_mediaBufferManagerContext.tempStats.newAllocs++;
-        g_mediaBufferManagerContext.tempTypeStats[bufferType].newAllocs++;
+    // Now make this buffer available for another caller to use.
+    info->flags &= ~kMediaBufferFlag_InUse;
+    media_buffer_push_free(index);
+    media_buffer_count_out(info->bufferClass / BUFFER_FLAG_COMBINATIONS, -1);
 
-        // Increment realigned buffer count if appropriate.
-        if (resultFlags & kMediaBufferFlag_Realigned)
-        {
-            g_mediaBufferManagerContext.tempStats.realignedAllocs++;
-            g_mediaBufferManagerContext.tempTypeStats[bufferType].realignedAllocs++;
-        }
+    // Increment the number of available buffers.
+    g_mediaBufferManagerContext.freeCount++;
+}
 
-        // Log the temporary allocation.
-        if (g_mediaBufferManagerLogAllocations)
-        {
-            tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
-                "bufmgr: allocated temp buffer %x [size=%d, flags=%x]\n", (uint32_t)data, typeSize, bufferFlags);
-        }
-#endif // RECORD_BUFFER_STATS
+//! \brief Removes a temporary buffer from the buffer manager.
+//!
+//! \return The pointer that must be passed to free() to dispose of the buffer's memory.
+//!
+//! \pre The buffer must not be on any free list, idle list or thread cache.
+//! \pre IRQs must be disabled.
+static SECTOR_BUFFER * media_buffer_dispose_locked(int index)
+{
+    MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[index];
+    SECTOR_BUFFER * toFree;
 
-        // Add the new buffer to our list with the combined flags and a
-        // reference count of 1.
-        status = media_buffer_add_internal(bufferType, bufferFlags, 1, data, originalBuffer, NULL);
-        if (status != SUCCESS)
-        {
-            if (resultFlags & kMediaBufferFlag_Realigned)
-            {
-                free(originalBuffer);
-            }
-            else
-            {
-                free(data);
-            }
+    media_buffer_hash_remove(index);
 
-            tx_mutex_put(&g_mediaBufferManagerContext.mutex);
-            return status;
-        }
+    // A buffer disposed of from a thread's cache was still out of the pool.
+    if (info->flags & kMediaBufferFlag_InUse)
+    {
+        media_buffer_count_out(info->bufferClass / BUFFER_FLAG_COMBINATIONS, -1);
+    }
+
+#if RECORD_BUFFER_STATS
+    // Update statistics.
+    media_buffer_update_stats(&g_mediaBufferManagerContext.tempStats, false);
+    media_buffer_update_stats(&g_mediaBufferManagerContext.tempTypeStats[info->bufferType], false);
+#endif // RECORD_BUFFER_STATS
 
-        // Return this new buffer to the caller.
-        *buffer = data;
+    // If we realigned the buffer then we have to pass the actual pointer back
+    // and not the aligned one.
+    toFree = (info->flags & kMediaBufferFlag_Realigned) ? info->originalBuffer : info->data;
 
-        // Decrement the free count. buffer_add() increments it so we need to
-        // counter this.
-        g_mediaBufferManagerContext.freeCount--;
-    }
+    // Return the slot to the unused list.
+    memset(info, 0, sizeof(*info));
+    info->next = g_mediaBufferManagerContext.unusedHead;
+    g_mediaBufferManagerContext.unusedHead = index;
 
-    // Release mutex.
-    tx_mutex_put(&g_mediaBufferManagerContext.mutex);
+    // Decrement the number of buffers in the array.
+    g_mediaBufferManagerContext.bufferCount--;
+    g_mediaBufferManagerContext.temporaryCount--;
 
-    return SUCCESS;
+    return toFree;
 }
 
-//! \brief Determine if the slot count can be reduced.
+//! \brief Returns the calling thread's buffer cache.
 //!
-//! The array of buffers is examined starting at the end and moving towards
-//! the beginning, stopping as soon as a valid entry is found. If there
-//! were one or more contiguous invalid entries starting at the end, the
-//! active slot count is reduced. This helps to speed searches for buffers
-//! in media_buffer_acquire().
-static void media_buffer_shrink_slots(void)
+//! \param canClaim Whether a thread that has no cache yet is given an unused one.
+//!
+//! \return The calling thread's cache.
+//! \retval NULL The caller is not a thread, or it has no cache and none could be given to it.
+static MediaBufferMagazine_t * media_buffer_get_magazine(bool canClaim)
 {
-    int i;
+    TX_THREAD * thread = tx_thread_identify();
+    MediaBufferMagazine_t * magazine = NULL;
+    unsigned i;
+    bool irqState;
 
-    // Scan the buffer array backwards. When we exit the loop, i will
-    // be set to the number of slots from the first to the last valid one.
-    for (i = g_mediaBufferManagerContext.slotCount; i > 0; --i)
+    // Timers and ISRs have no cache.
+    if (!thread)
     {
-        // Exit the loop when the slot prior to this one is valid.
-        if (g_mediaBufferManagerContext.buffers[i - 1].data)
-        {
-            break;
-        }
+        return NULL;
     }
 
-    // Shrink it!
-    g_mediaBufferManagerContext.slotCount = i;
+    for (i = 0; i < MEDIA_BUFFER_MAGAZINE_COUNT; ++i)
+    {
+        if (g_mediaBufferManagerContext.magazines[i].owner == thread)
+        {
+            return &g_mediaBufferManagerContext.magazines[i];
+        }
+    }
+
+    if (!canClaim)
+    {
+        return NULL;
+    }
+
+    // Claim an unused cache. Another thread may be claiming one at the same time.
+    irqState = hw_core_EnableIrqInterrupt(false);
+    for (i = 0; i < MEDIA_BUFFER_MAGAZINE_COUNT; ++i)
+    {
+        if (!g_mediaBufferManagerContext.magazines[i].owner)
+        {
+            magazine = &g_mediaBufferManagerContext.magazines[i];
+            magazine->lastUsed = tx_time_get();
+            magazine->owner = thread;
+            break;
+        }
+    }
+    hw_core_EnableIrqInterrupt(irqState);
+
+    return magazine;
 }
 
-// See media_buffer_manager.h for the documentation for this function.
-RtStatus_t media_buffer_retain(SECTOR_BUFFER * buffer)
+//! \brief Takes a buffer from the calling thread's cache.
+//!
+//! \param magazine The calling thread's cache.
+//!
+//! \retval true A buffer was returned through \a buffer.
+//! \retval false The cache holds no buffer that fits the request.
+static bool media_buffer_magazine_acquire(MediaBufferMagazine_t * magazine, MediaBufferType_t bufferType, size_t typeSize, uint32_t requiredFlags, uint32_t callSite, SECTOR_BUFFER ** buffer)
 {
+    volatile int8_t * cached = magazine->buffers[bufferType];
+    MediaBufferInfo_t * info;
+    int index = NO_BUFFER;
     unsigned i;
-    RtStatus_t result = ERROR_DDI_MEDIABUFMGR_INVALID_BUFFER;
-
-    assert(buffer != NULL);
-    assert(g_mediaBufferManagerContext.isInited);
 
-    // Acquire mutex.
-    tx_mutex_get(&g_mediaBufferManagerContext.mutex, TX_WAIT_FOREVER);
+    magazine->isBusy = true;
+    magazine->lastUsed = tx_time_get();
 
-    // Scan the buffer array looking for a matching data pointer.
-    for (i=0; i < g_mediaBufferManagerContext.slotCount; ++i)
+    // Take the most recently cached buffer that fits, filling its place with the last one.
+    for (i = magazine->count[bufferType]; i > 0; --i)
     {
-        MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[i];
-
-        // Is this the matching buffer?
-        if (info->data == buffer)
+        info = &g_mediaBufferManagerContext.buffers[cached[i - 1]];
+        if (info->length == typeSize && (info->flags & requiredFlags) == requiredFlags)
         {
-            // Add one reference.
-            ++info->refCount;
-
-            result = SUCCESS;
+            index = cached[i - 1];
+            magazine->count[bufferType]--;
+            cached[i - 1] = cached[magazine->count[bufferType]];
             break;
         }
     }
 
-    // Put the mutex and return the status code.
-    tx_mutex_put(&g_mediaBufferManagerContext.mutex);
-    return result;
+    magazine->isBusy = false;
+
+    if (index == NO_BUFFER)
+    {
+        return false;
+    }
+
+    // The buffer has been marked in use since it left the pool, so nobody else touches it.
+    info = &g_mediaBufferManagerContext.buffers[index];
+    info->refCount = 1;
+    info->timeout = 0;
+    info->holder = callSite;
+    *buffer = info->data;
+
+    return true;
 }
 
-// See media_buffer_manager.h for the documentation for this function.
-RtStatus_t media_buffer_release(SECTOR_BUFFER * buffer)
+//! \brief Puts a buffer that the caller holds the last reference to in its thread's cache.
+//!
+//! When the cache is full, its oldest buffers of the same type are first returned to
+//! the pool as a batch.
+//!
+//! \retval true The buffer was cached.
+//! \retval false The buffer has to be released to the pool.
+static bool media_buffer_magazine_release(SECTOR_BUFFER * buffer)
 {
+    MediaBufferMagazine_t * magazine = media_buffer_get_magazine(false);
+    volatile int8_t * cached;
+    MediaBufferInfo_t * info;
+    unsigned bufferType;
+    int index;
     unsigned i;
-    RtStatus_t result = ERROR_DDI_MEDIABUFMGR_INVALID_BUFFER;
 
-    assert(buffer != NULL);
-    assert(g_mediaBufferManagerContext.isInited);
+    if (!magazine)
+    {
+        return false;
+    }
 
-    // Acquire mutex.
-    tx_mutex_get(&g_mediaBufferManagerContext.mutex, TX_WAIT_FOREVER);
+    // The caller's reference keeps the buffer from being disposed of, so it can be
+    // looked up without disabling IRQs.
+    index = media_buffer_find_unlocked(buffer);
+    if (index == NO_BUFFER)
+    {
+        return false;
+    }
 
-    // Scan the buffer array looking for a matching data pointer.
-    for (i=0; i < g_mediaBufferManagerContext.slotCount; ++i)
+    info = &g_mediaBufferManagerContext.buffers[index];
+    bufferType = info->bufferClass / BUFFER_FLAG_COMBINATIONS;
+    if (bufferType >= MEDIA_BUFFER_MAGAZINE_TYPES || info->refCount != 1)
     {
-        MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[i];
+        return false;
+    }
+
+    cached = magazine->buffers[bufferType];
+    magazine->isBusy = true;
+    magazine->lastUsed = tx_time_get();
+
+    // Make room by returning the oldest buffers to the pool.
+    if (magazine->count[bufferType] == MEDIA_BUFFER_MAGAZINE_DEPTH)
+    {
+        bool irqState = hw_core_EnableIrqInterrupt(false);
 
-        if (info->data == buffer)
+        for (i = 0; i < MEDIA_BUFFER_MAGAZINE_BATCH; ++i)
         {
-            // Decrement the reference count.
-            if (--info->refCount > 0)
-            {
-                // There are still references to the buffer, so don't actually
-                // release it yet!
-                result = SUCCESS;
-                break;
-            }
-            
-            // Different actions depending on whether the buffer is temporary.
-            if (info->flags & kMediaBufferFlag_Temporary)
-            {
-                // Temporary buffer.
+            media_buffer_return_buffer(cached[i]);
+        }
+        for (i = MEDIA_BUFFER_MAGAZINE_BATCH; i < MEDIA_BUFFER_MAGAZINE_DEPTH; ++i)
+        {
+            cached[i - MEDIA_BUFFER_MAGAZINE_BATCH] = cached[i];
+        }
+        magazine->count[bufferType] -= MEDIA_BUFFER_MAGAZINE_BATCH;
 
-#if RECORD_BUFFER_STATS
-                // Log the release.
-                if (g_mediaBufferManagerLogAllocations)
-                {
-                    tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
-                        "bufmgr: temp buffer %x will timeout in %d ms\n", (uint32_t)info->data, TEMPORARY_BUFFER_TIMEOUT_MS);
-                }
-#endif // RECORD_BUFFER_STATS
+        hw_core_EnableIrqInterrupt(irqState);
+    }
 
-                // Reset the buffer's timeout.
-                info->timeout = tx_time_get() + OS_MSECS_TO_TICKS(TEMPORARY_BUFFER_TIMEOUT_MS);
+    // A cached temporary buffer times out just like one in the pool.
+    info->refCount = 0;
+    if (info->flags & kMediaBufferFlag_Temporary)
+    {
+        info->timeout = tx_time_get() + OS_MSECS_TO_TICKS(TEMPORARY_BUFFER_TIMEOUT_MS);
+    }
 
-                // If there is not already a temp buffer waiting to timeout, set this one up.
-                if (g_mediaBufferManagerContext.nextTimeout == NO_NEXT_TIMEOUT)
-                {
-                    g_mediaBufferManagerContext.nextTimeout = i;
+    cached[magazine->count[bufferType]] = index;
+    magazine->count[bufferType]++;
 
-                    tx_timer_change(&g_mediaBufferManagerContext.timeoutTimer, OS_MSECS_TO_TICKS(TEMPORARY_BUFFER_TIMEOUT_MS), 0);
-                    tx_timer_activate(&g_mediaBufferManagerContext.timeoutTimer);
-                }
-            }
-            else
-            {
-                // Permanent buffer.
+    magazine->isBusy = false;
 
-#if RECORD_BUFFER_STATS
-                // Update statistics.
-                media_buffer_update_stats(&g_mediaBufferManagerContext.permStats, false);
-                media_buffer_update_stats(&g_mediaBufferManagerContext.permTypeStats[info->bufferType], false);
+    return true;
+}
+
+//! \brief Returns the buffers cached by idle threads to the pool.
+//!
+//! \param idleTicks How long a thread must not have used its cache for. When zero, the
+//!     buffers of every thread that is not using its cache at this moment are returned.
+static void media_buffer_reclaim_magazines(uint32_t idleTicks)
+{
+    unsigned i;
+    unsigned bufferType;
 
-                // Log the release.
-                if (g_mediaBufferManagerLogAllocations)
+    for (i = 0; i < MEDIA_BUFFER_MAGAZINE_COUNT; ++i)
+    {
+        MediaBufferMagazine_t * magazine = &g_mediaBufferManagerContext.magazines[i];
+        bool irqState = hw_core_EnableIrqInterrupt(false);
+
+        if (magazine->owner && !magazine->isBusy && tx_time_get() - magazine->lastUsed >= idleTicks)
+        {
+            for (bufferType = 0; bufferType < MEDIA_BUFFER_MAGAZINE_TYPES; ++bufferType)
+            {
+                while (magazine->count[bufferType])
                 {
-                    tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
-                        "bufmgr: releasing perm buffer %x [#%d]\n", (uint32_t)info->data, i);
+                    magazine->count[bufferType]--;
+                    media_buffer_return_buffer(magazine->buffers[bufferType][magazine->count[bufferType]]);
                 }
-#endif // RECORD_BUFFER_STATS
             }
+        }
+
+        hw_core_EnableIrqInterrupt(irqState);
+    }
+}
+
+//! \brief Disposes of the expired temporary buffers in a thread's cache.
+//!
+//! A cache that its owner is using at this moment is left alone until the timer
+//! fires again.
+//!
+//! \pre The mutex must be held.
+static void media_buffer_dispose_expired_cached(MediaBufferMagazine_t * magazine)
+{
+    SECTOR_BUFFER * toFree[MEDIA_BUFFER_MAGAZINE_TYPES * MEDIA_BUFFER_MAGAZINE_DEPTH];
+    unsigned disposeCount = 0;
+    unsigned bufferType;
+    unsigned i;
+    bool irqState = hw_core_EnableIrqInterrupt(false);
 
-            // Now make this buffer available for another caller to use.
-            info->flags &= ~kMediaBufferFlag_InUse;
+    if (!magazine->isBusy)
+    {
+        uint32_t now = tx_time_get();
 
-            // Increment the number of available buffers.
-            g_mediaBufferManagerContext.freeCount++;
+        for (bufferType = 0; bufferType < MEDIA_BUFFER_MAGAZINE_TYPES; ++bufferType)
+        {
+            volatile int8_t * cached = magazine->buffers[bufferType];
 
-            // All good, so return success. We can exit the loop now.
-            result = SUCCESS;
-            break;
+            // Walk backwards, so the buffer moved into a disposed buffer's place has
+            // already been checked.
+            for (i = magazine->count[bufferType]; i > 0; --i)
+            {
+                MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[cached[i - 1]];
+
+                if ((info->flags & kMediaBufferFlag_Temporary) && (int32_t)(now - info->timeout) >= 0)
+                {
+                    toFree[disposeCount++] = media_buffer_dispose_locked(cached[i - 1]);
+                    magazine->count[bufferType]--;
+                    cached[i - 1] = cached[magazine->count[bufferType]];
+                }
+            }
         }
     }
 
-    // Put the mutex and return the status code.
-    tx_mutex_put(&g_mediaBufferManagerContext.mutex);
-    return result;
+    hw_core_EnableIrqInterrupt(irqState);
+
+    for (i = 0; i < disposeCount; ++i)
+    {
+#if RECORD_BUFFER_STATS
+        // Log the release.
+        if (g_mediaBufferManagerLogAllocations)
+        {
+            tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
+                "bufmgr: freeing temp buffer %x\n", (uint32_t)toFree[i]);
+        }
+#endif // RECORD_BUFFER_STATS
+
+        free(toFree[i]);
+    }
 }
 
-//! \brief Look for the next temporary buffer to timeout and set up the timer.
+//! \brief Takes a buffer from the pool, and tops up the calling thread's cache.
+//!
+//! The pool is only touched with interrupts disabled instead of with the mutex held.
+//!
+//! \param magazine The calling thread's cache, or NULL if it has none.
 //!
-//! \pre The media buffer manager's mutex must have already been acquired.
-//! \post g_mediaBufferManagerContext.nextTimeout is set to the index of the
-//!     temporary buffer that will timeout next.
-static void media_buffer_setup_next_timeout(void)
+//! \retval true A buffer was returned through \a buffer.
+//! \retval false The pool holds no buffer that fits the request.
+static bool media_buffer_take_global(MediaBufferMagazine_t * magazine, MediaBufferType_t bufferType, size_t typeSize, uint32_t requiredFlags, uint32_t callSite, SECTOR_BUFFER ** buffer)
 {
+    MediaBufferInfo_t * info;
+    int index;
     unsigned i;
-    int nextToTimeout = NO_NEXT_TIMEOUT;
-    int timeoutTicks = INT32_MAX;
-    int scanStartTime = tx_time_get();
+    bool irqState = hw_core_EnableIrqInterrupt(false);
 
-    // Search for another inactive temporary buffer.
-    for (i = 0; i < g_mediaBufferManagerContext.slotCount; ++i)
+    index = media_buffer_take_free(typeSize, requiredFlags, true);
+    if (index != NO_BUFFER)
     {
-        MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[i];
-
-        // Is this a valid, inactive, temporary buffer?
-        if (info->data && (info->flags & kMediaBufferFlag_Temporary) && !(info->flags & kMediaBufferFlag_InUse))
+        info = &g_mediaBufferManagerContext.buffers[index];
+        media_buffer_take_buffer(index, bufferType);
+        info->refCount = 1;
+        info->holder = callSite;
+        *buffer = info->data;
+
+        // Move more buffers of exactly the requested kind into the cache, so the next
+        // requests from this thread don't have to come back to the pool.
+        for (i = 1; magazine && i < MEDIA_BUFFER_MAGAZINE_BATCH && magazine->count[bufferType] < MEDIA_BUFFER_MAGAZINE_DEPTH; ++i)
         {
-            // Convert absolute timeout to relative time. The timeout time should hopefully
-            // be bigger than the current time, although this is not guaranteed.
-            int ticks = info->timeout - scanStartTime;
-
-            // Make sure we never have a negative time.
-            if (ticks < 0)
+            int extra = media_buffer_take_free(typeSize, requiredFlags, false);
+            if (extra == NO_BUFFER)
             {
-                ticks = 0;
+                break;
             }
 
-            // Keep track of the buffer with the lowest interval to timeout.
-            if (ticks < timeoutTicks)
+            info = &g_mediaBufferManagerContext.buffers[extra];
+            media_buffer_take_buffer(extra, bufferType);
+            if (info->flags & kMediaBufferFlag_Temporary)
             {
-                timeoutTicks = ticks;
-                nextToTimeout = i;
+                info->timeout = tx_time_get() + OS_MSECS_TO_TICKS(TEMPORARY_BUFFER_TIMEOUT_MS);
             }
+
+            magazine->buffers[bufferType][magazine->count[bufferType]] = extra;
+            magazine->count[bufferType]++;
         }
     }
 
-    // Do we have another buffer waiting to timeout?
-    if (nextToTimeout != NO_NEXT_TIMEOUT)
+    hw_core_EnableIrqInterrupt(irqState);
+
+#if RECORD_BUFFER_STATS
+    // Log the permanent allocation.
+    if (index != NO_BUFFER && g_mediaBufferManagerLogAllocations)
     {
-        // Delay at least two ticks.
-        if (timeoutTicks == 0)
+        tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
+            "bufmgr: allocated perm buffer %x [#%d, size=%d, flags=%x]\n", (uint32_t)*buffer, index, typeSize, requiredFlags);
+    }
+#endif // RECORD_BUFFER_STATS
+
+    return index != NO_BUFFER;
+}
+
+//! \brief Allocates a new temporary buffer for the caller.
+//!
+//! \pre The mutex must be held.
+static RtStatus_t media_buffer_create_temporary(MediaBufferType_t bufferType, size_t typeSize, uint32_t requiredFlags, uint32_t callSite, SECTOR_BUFFER ** buffer)
+{
+    SECTOR_BUFFER * data;
+    SECTOR_BUFFER * originalBuffer = NULL;
+    uint32_t resultFlags;
+    uint32_t bufferFlags;
+    RtStatus_t status;
+    unsigned index;
+#if RECORD_BUFFER_STATS
+    bool irqState;
+#endif // RECORD_BUFFER_STATS
+
+    data = media_buffer_allocate(typeSize, requiredFlags, &resultFlags, &originalBuffer);
+
+    // Error out if the allocation failed.
+    if (!data)
+    {
+        return ERROR_DDI_MEDIABUFMGR_ALLOC_FAILED;
+    }
+
+    // Build the combined flags that are set for this buffer when it is added below.
+    // The buffer is marked as temporary and in use. Marking it as temporary
+    // will cause it to be freed when the caller releases it.
+    bufferFlags = requiredFlags | resultFlags | kMediaBufferFlag_Temporary | kMediaBufferFlag_InUse;
+
+    // Add the new buffer to our list with the combined flags and a
+    // reference count of 1.
+    status = media_buffer_add_internal(bufferType, bufferFlags, 1, data, originalBuffer, &index);
+    if (status != SUCCESS)
+    {
+        if (resultFlags & kMediaBufferFlag_Realigned)
+        {
+            free(originalBuffer);
+        }
+        else
         {
-            timeoutTicks = 2;
+            free(data);
         }
 
-        tx_timer_change(&g_mediaBufferManagerContext.timeoutTimer, timeoutTicks, 0);
+        return status;
+    }
+
+    // The buffer is already marked in use, so nobody else changes it.
+    g_mediaBufferManagerContext.buffers[index].holder = callSite;
+
+    // Update telemetry.
+    g_mediaBufferManagerContext.temporaryAllocs++;
+    if (resultFlags & kMediaBufferFlag_Realigned)
+    {
+        g_mediaBufferManagerContext.realignedAllocs++;
+    }
+
+#if RECORD_BUFFER_STATS
+    // Update statistics.
+    irqState = hw_core_EnableIrqInterrupt(false);
+    media_buffer_update_stats(&g_mediaBufferManagerContext.tempStats, true);
+    media_buffer_update_stats(&g_mediaBufferManagerContext.tempTypeStats[bufferType], true);
+
+    // Increment the number of new temporary buffers allocated.
+    g_mediaBufferManagerContext.tempStats.newAllocs++;
+    g_mediaBufferManagerContext.tempTypeStats[bufferType].newAllocs++;
+
+    // Increment realigned buffer count if appropriate.
+    if (resultFlags & kMediaBufferFlag_Realigned)
+    {
+        g_mediaBufferManagerContext.tempStats.realignedAllocs++;
+        g_mediaBufferManagerContext.tempTypeStats[bufferType].realignedAllocs++;
+    }
+    hw_core_EnableIrqInterrupt(irqState);
+
+    // Log the temporary allocation.
+    if (g_mediaBufferManagerLogAllocations)
+    {
+        tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
+            "bufmgr: allocated temp buffer %x [size=%d, flags=%x]\n", (uint32_t)data, typeSize, bufferFlags);
+    }
+#endif // RECORD_BUFFER_STATS
+
+    // Start checking for expired temporary buffers, if that isn't happening already.
+    g_mediaBufferManagerContext.temporaryCount++;
+    if (!g_mediaBufferManagerContext.isTimerActive)
+    {
+        tx_timer_change(&g_mediaBufferManagerContext.timeoutTimer, OS_MSECS_TO_TICKS(TEMPORARY_BUFFER_CHECK_MS), OS_MSECS_TO_TICKS(TEMPORARY_BUFFER_CHECK_MS));
         tx_timer_activate(&g_mediaBufferManagerContext.timeoutTimer);
+        g_mediaBufferManagerContext.isTimerActive = true;
     }
 
-    g_mediaBufferManagerContext.nextTimeout = nextToTimeout;
+    // Return this new buffer to the caller.
+    *buffer = data;
+
+    return SUCCESS;
 }
 
-//! \brief Deferred procedure call to dispose of a temporary buffer.
-//!
-static void media_buffer_dispose_temporary(uint32_t unused)
+// See media_buffer_manager.h for the documentation for this function.
+RtStatus_t media_buffer_acquire(MediaBufferType_t bufferType, uint32_t requiredFlags, SECTOR_BUFFER ** buffer)
 {
-    MediaBufferInfo_t * info;
+    size_t typeSize = media_buffer_get_type_size(bufferType);
+    uint32_t callSite = MEDIA_BUFFER_CALL_SITE();
+    MediaBufferMagazine_t * magazine = NULL;
+    RtStatus_t status = SUCCESS;
+    uint64_t exhaustedStart;
+
+    assert(buffer != NULL);
+    assert(g_mediaBufferManagerContext.isInited);
+
+    // Try the calling thread's own cache first, which needs no locking at all.
+    if (bufferType < MEDIA_BUFFER_MAGAZINE_TYPES)
+    {
+        magazine = media_buffer_get_magazine(true);
+        if (magazine && media_buffer_magazine_acquire(magazine, bufferType, typeSize, requiredFlags, callSite, buffer))
+        {
+            return SUCCESS;
+        }
+    }
+
+    // Then try the pool.
+    if (media_buffer_take_global(magazine, bufferType, typeSize, requiredFlags, callSite, buffer))
+    {
+        return SUCCESS;
+    }
+
+    // The pool is exhausted as far as this request goes. Time how long it takes to get a buffer anyway.
+    exhaustedStart = hw_profile_GetMicroseconds();
 
     // Acquire mutex.
     tx_mutex_get(&g_mediaBufferManagerContext.mutex, TX_WAIT_FOREVER);
 
-    // Check to make sure there is still a buffer to dispose and someone hasn't
-    // come along and acquired it between when the timer fired and the DPC
-    // actually started executing.
-    if (g_mediaBufferManagerContext.bufferToDispose == NO_NEXT_TIMEOUT)
+    // Buffers cached by other threads go back to the pool before anything is allocated,
+    // starting with the caches of idle threads so that busy ones keep theirs if possible.
+    media_buffer_reclaim_magazines(OS_MSECS_TO_TICKS(MEDIA_BUFFER_MAGAZINE_IDLE_MS));
+    if (!media_buffer_take_global(magazine, bufferType, typeSize, requiredFlags, callSite, buffer))
     {
-        tx_mutex_put(&g_mediaBufferManagerContext.mutex);
-        return;
+        media_buffer_reclaim_magazines(0);
+        if (!media_buffer_take_global(magazine, bufferType, typeSize, requiredFlags, callSite, buffer))
+        {
+            // There are no buffers available in the pool, or no match was found,
+            // so create a temporary one.
+            status = media_buffer_create_temporary(bufferType, typeSize, requiredFlags, callSite, buffer);
+        }
     }
 
-    assert(g_mediaBufferManagerContext.bufferToDispose >= 0 && g_mediaBufferManagerContext.bufferToDispose < g_mediaBufferManagerContext.slotCount);
+    g_mediaBufferManagerContext.exhaustedCount++;
+    g_mediaBufferManagerContext.exhaustedTime += hw_profile_GetMicroseconds() - exhaustedStart;
 
-    // Get the buffer info.
-    info = &g_mediaBufferManagerContext.buffers[g_mediaBufferManagerContext.bufferToDispose];
+    // Release mutex.
+    tx_mutex_put(&g_mediaBufferManagerContext.mutex);
 
-#if RECORD_BUFFER_STATS
-    // Update statistics.
-    media_buffer_update_stats(&g_mediaBufferManagerContext.tempStats, false);
-    media_buffer_update_stats(&g_mediaBufferManagerContext.tempTypeStats[info->bufferType], false);
+    return status;
+}
+
+// See media_buffer_manager.h for the documentation for this function.
+RtStatus_t media_buffer_retain(SECTOR_BUFFER * buffer)
+{
+    int i;
+    RtStatus_t result = ERROR_DDI_MEDIABUFMGR_INVALID_BUFFER;
+    bool irqState;
+
+    assert(buffer != NULL);
+    assert(g_mediaBufferManagerContext.isInited);
+
+    irqState = hw_core_EnableIrqInterrupt(false);
+
+    // Look up the buffer by its address.
+    i = media_buffer_find(buffer);
+    if (i != NO_BUFFER)
+    {
+        // Add one reference.
+        ++g_mediaBufferManagerContext.buffers[i].refCount;
+
+        result = SUCCESS;
+    }
+
+    hw_core_EnableIrqInterrupt(irqState);
+    return result;
+}
+
+// See media_buffer_manager.h for the documentation for this function.
+RtStatus_t media_buffer_release(SECTOR_BUFFER * buffer)
+{
+    int i;
+    RtStatus_t result = ERROR_DDI_MEDIABUFMGR_INVALID_BUFFER;
+    bool isReleased = false;
+    bool isTemporary = false;
+    bool irqState;
+
+    assert(buffer != NULL);
+    assert(g_mediaBufferManagerContext.isInited);
+
+    // The last reference to a sector or auxiliary buffer goes to the calling thread's cache.
+    if (media_buffer_magazine_release(buffer))
+    {
+        return SUCCESS;
+    }
+
+    irqState = hw_core_EnableIrqInterrupt(false);
+
+    // Look up the buffer by its address.
+    i = media_buffer_find(buffer);
+    if (i != NO_BUFFER)
+    {
+        MediaBufferInfo_t * info = &g_mediaBufferManagerContext.buffers[i];
+
+        assert(info->refCount > 0);
+        result = SUCCESS;
 
+        // Decrement the reference count. While there are still references to the
+        // buffer, don't actually release it yet!
+        if (--info->refCount == 0)
+        {
+            isTemporary = (info->flags & kMediaBufferFlag_Temporary) != 0;
+            media_buffer_return_buffer(i);
+            isReleased = true;
+        }
+    }
+
+    hw_core_EnableIrqInterrupt(irqState);
+
+#if RECORD_BUFFER_STATS
     // Log the release.
-    if (g_mediaBufferManagerLogAllocations)
+    if (isReleased && g_mediaBufferManagerLogAllocations)
     {
-        tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
-            "bufmgr: freeing temp buffer %x\n", (uint32_t)info->data);
+        if (isTemporary)
+        {
+            tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
+                "bufmgr: temp buffer %x will timeout in %d ms\n", (uint32_t)buffer, TEMPORARY_BUFFER_TIMEOUT_MS);
+        }
+        else
+        {
+            tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
+                "bufmgr: releasing perm buffer %x [#%d]\n", (uint32_t)buffer, i);
+        }
     }
 #endif // RECORD_BUFFER_STATS
 
-    // Dispose of this temporary buffer. If we realigned the buffer then we have to
-    // pass the actual pointer back and not the aligned one.
-    if (info->flags & kMediaBufferFlag_Realigned)
+    return result;
+}
+
+//! \brief Deferred procedure call to dispose of expired temporary buffers.
+//!
+//! Expired buffers in the thread caches are disposed of first. Then buffers are
+//! disposed of from the head of the idle list until one is found that has not expired
+//! yet. The timer is stopped once there are no temporary buffers left.
+static void media_buffer_dispose_temporary(uint32_t unused)
+{
+    unsigned m;
+
+    // Acquire mutex.
+    tx_mutex_get(&g_mediaBufferManagerContext.mutex, TX_WAIT_FOREVER);
+
+    for (m = 0; m < MEDIA_BUFFER_MAGAZINE_COUNT; ++m)
     {
-        free(info->originalBuffer);
+        if (g_mediaBufferManagerContext.magazines[m].owner)
+        {
+            media_buffer_dispose_expired_cached(&g_mediaBufferManagerContext.magazines[m]);
+        }
     }
-    else
+
+    for (;;)
     {
-        free(info->data);
-    }
-    memset(info, 0, sizeof(*info));
+        SECTOR_BUFFER * toFree;
+        int i;
+        bool irqState = hw_core_EnableIrqInterrupt(false);
+
+        // Stop at the first buffer that has not expired. Someone may have come along and
+        // acquired a buffer between when the timer fired and the DPC started executing,
+        // in which case it is no longer on the idle list.
+        i = g_mediaBufferManagerContext.idleHead;
+        if (i == NO_BUFFER || (int32_t)(tx_time_get() - g_mediaBufferManagerContext.buffers[i].timeout) < 0)
+        {
+            hw_core_EnableIrqInterrupt(irqState);
+            break;
+        }
 
-    // Decrement the number of buffers in the array.
-    g_mediaBufferManagerContext.bufferCount--;
-    g_mediaBufferManagerContext.freeCount--;
+        // Take the buffer off every list, so it can no longer be acquired.
+        media_buffer_unlink_idle(i);
+        media_buffer_unlink_free(i);
+        toFree = media_buffer_dispose_locked(i);
+        g_mediaBufferManagerContext.freeCount--;
 
-    // Decrement the slot count if possible.
-    media_buffer_shrink_slots();
+        hw_core_EnableIrqInterrupt(irqState);
 
-    // Search for another buffer to timeout.
-    media_buffer_setup_next_timeout();
+#if RECORD_BUFFER_STATS
+        // Log the release.
+        if (g_mediaBufferManagerLogAllocations)
+        {
+            tss_logtext_Print(LOGTEXT_VERBOSITY_ALL | LOGTEXT_EVENT_DDI_NAND_GROUP,
+                "bufmgr: freeing temp buffer %x\n", (uint32_t)toFree);
+        }
+#endif // RECORD_BUFFER_STATS
 
-    // No buffer pending disposal.
-    g_mediaBufferManagerContext.bufferToDispose = NO_NEXT_TIMEOUT;
+        // Dispose of this temporary buffer.
+        free(toFree);
+    }
+
+    // Stop the timer when there is nothing left to time out.
+    if (g_mediaBufferManagerContext.temporaryCount == 0 && g_mediaBufferManagerContext.isTimerActive)
+    {
+        tx_timer_deactivate(&g_mediaBufferManagerContext.timeoutTimer);
+        g_mediaBufferManagerContext.isTimerActive = false;
+    }
 
     // Release the mutex.
     tx_mutex_put(&g_mediaBufferManagerContext.mutex);
@@ -935,104 +1500,218 @@ static void media_buffer_dispose_temporary(uint32_t unused)
 //!
 //! All this timer function does is queue up a DPC to do the actual work. This
 //! is necessary because application timers have severe limits on the ThreadX
-//! APIs that can be called.
+//! APIs that can be called. The timer is periodic, so if the DPC can't be queued
+//! it is simply tried again the next time the timer fires.
  __STATIC_TEXT void media_buffer_timeout(ULONG unused)
 {
-    RtStatus_t status;
+    // Post DPC to do the dirty work.
+    os_dpc_Send(OS_DPC_HIGH_LEVEL_DPC, media_buffer_dispose_temporary, 0, TX_NO_WAIT);
+}
 
-    // We want to dispose of the buffer that just timed out.
-    g_mediaBufferManagerContext.bufferToDispose = g_mediaBufferManagerContext.nextTimeout;
+//! \brief Finds the call sites that hold the most buffers.
+//!
+//! \param[out] holders Receives #MEDIA_BUFFER_TOP_HOLDER_COUNT entries, sorted by the
+//!     number of buffers held. Unused entries are zero.
+static void media_buffer_get_top_holders(MediaBufferHolder_t * holders)
+{
+    uint32_t sites[MAX_BUFFER_COUNT];
+    bool isCounted[MAX_BUFFER_COUNT];
+    unsigned siteCount = 0;
+    unsigned i;
+    unsigned j;
+    bool irqState;
 
-    // Post DPC to do the dirty work.
-    status = os_dpc_Send(OS_DPC_HIGH_LEVEL_DPC, media_buffer_dispose_temporary, 0, TX_NO_WAIT);
+    memset(holders, 0, sizeof(MediaBufferHolder_t) * MEDIA_BUFFER_TOP_HOLDER_COUNT);
 
-    // If we can't queue the DPC, set the timer up to fire again in a little bit.
-    if (status != SUCCESS)
+    // Collect the call site of every buffer that a caller holds. Buffers in a thread's
+    // cache have no references and are not held by anyone.
+    irqState = hw_core_EnableIrqInterrupt(false);
+    for (i = 0; i < MAX_BUFFER_COUNT; ++i)
     {
-        tx_timer_change(&g_mediaBufferManagerContext.timeoutTimer, OS_MSECS_TO_TICKS(TIMER_RETRY_DELAY_MS), 0);
-        tx_timer_activate(&g_mediaBufferManagerContext.timeoutTimer);
+        if (g_mediaBufferManagerContext.buffers[i].data && g_mediaBufferManagerContext.buffers[i].refCount)
+        {
+            sites[siteCount++] = g_mediaBufferManagerContext.buffers[i].holder;
+        }
+    }
+    hw_core_EnableIrqInterrupt(irqState);
+
+    memset(isCounted, 0, sizeof(isCounted));
+
+    // Count the buffers held by each site, keeping the sites that hold the most in order.
+    for (i = 0; i < siteCount; ++i)
+    {
+        MediaBufferHolder_t holder;
+
+        if (isCounted[i])
+        {
+            continue;
+        }
+
+        holder.callSite = sites[i];
+        holder.bufferCount = 0;
+        for (j = i; j < siteCount; ++j)
+        {
+            if (sites[j] == holder.callSite)
+            {
+                isCounted[j] = true;
+                holder.bufferCount++;
+            }
+        }
+
+        for (j = MEDIA_BUFFER_TOP_HOLDER_COUNT; j > 0 && holders[j - 1].bufferCount < holder.bufferCount; --j)
+        {
+            if (j < MEDIA_BUFFER_TOP_HOLDER_COUNT)
+            {
+                holders[j] = holders[j - 1];
+            }
+        }
+
+        if (j < MEDIA_BUFFER_TOP_HOLDER_COUNT)
+        {
+            holders[j] = holder;
+        }
     }
 }
 
-__INIT_TEXT RtStatus_t media_buffer_get_property(SECTOR_BUFFER * buffer, uint32_t whichProperty, void * value)
+//! \brief Reads a property of the buffer manager as a whole.
+//!
+//! \retval SUCCESS
+//! \retval ERROR_DDI_MEDIABUFMGR_INVALID_PROPERTY The property does not apply to the
+//!     buffer manager.
+static RtStatus_t media_buffer_get_manager_property(uint32_t whichProperty, void * value)
 {
+    RtStatus_t result = SUCCESS;
     unsigned i;
-    RtStatus_t result = ERROR_DDI_MEDIABUFMGR_INVALID_BUFFER;
-    MediaBufferInfo_t * info = NULL;
+    bool irqState;
 
-    assert(buffer != NULL);
-    assert(value != NULL);
-    assert(g_mediaBufferManagerContext.isInited);
+    // Holders are collected from the buffer array, which needs no mutex.
+    if (whichProperty == kMediaBufferProperty_TopHolders)
+    {
+        media_buffer_get_top_holders((MediaBufferHolder_t *)value);
+        return SUCCESS;
+    }
 
-    // Acquire mutex.
+    // The mutex keeps the counters that are changed with it held steady, and IRQs are
+    // disabled for the ones that are changed without it.
     tx_mutex_get(&g_mediaBufferManagerContext.mutex, TX_WAIT_FOREVER);
+    irqState = hw_core_EnableIrqInterrupt(false);
 
-    // Scan the buffer array looking for a matching data pointer.
-    for (i=0; i < g_mediaBufferManagerContext.slotCount; ++i)
+    switch (whichProperty)
     {
-        info = &g_mediaBufferManagerContext.buffers[i];
+        case kMediaBufferProperty_HighWaterMarks:
+            for (i = 0; i < kMediaBufferType_Count; ++i)
+            {
+                ((uint32_t *)value)[i] = g_mediaBufferManagerContext.highWaterMarks[i];
+            }
+            break;
 
-        if (info->data == buffer)
-        {
-            // Found our buffer, so exit the scan loop!
+        case kMediaBufferProperty_TemporaryAllocations:
+            *(uint32_t *)value = g_mediaBufferManagerContext.temporaryAllocs;
             break;
-        }
+
+        case kMediaBufferProperty_RealignedAllocations:
+            *(uint32_t *)value = g_mediaBufferManagerContext.realignedAllocs;
+            break;
+
+        case kMediaBufferProperty_MismatchedSizeAllocations:
+            *(uint32_t *)value = g_mediaBufferManagerContext.mismatchedSizeAllocs;
+            break;
+
+        case kMediaBufferProperty_ExhaustedCount:
+            *(uint32_t *)value = g_mediaBufferManagerContext.exhaustedCount;
+            break;
+
+        case kMediaBufferProperty_ExhaustedTime:
+            *(uint64_t *)value = g_mediaBufferManagerContext.exhaustedTime;
+            break;
+
+        default:
+            result = ERROR_DDI_MEDIABUFMGR_INVALID_PROPERTY;
     }
-    
-    if (info)
+
+    hw_core_EnableIrqInterrupt(irqState);
+    tx_mutex_put(&g_mediaBufferManagerContext.mutex);
+
+    return result;
+}
+
+// See media_buffer_manager.h for the documentation for this function.
+__INIT_TEXT RtStatus_t media_buffer_get_property(SECTOR_BUFFER * buffer, uint32_t whichProperty, void * value)
+{
+    int i;
+    RtStatus_t result = ERROR_DDI_MEDIABUFMGR_INVALID_BUFFER;
+    MediaBufferInfo_t info;
+    bool irqState;
+
+    assert(value != NULL);
+    assert(g_mediaBufferManagerContext.isInited);
+
+    if (!buffer)
+    {
+        return media_buffer_get_manager_property(whichProperty, value);
+    }
+
+    // Look up the buffer and copy its information, so the properties agree with each other.
+    irqState = hw_core_EnableIrqInterrupt(false);
+    i = media_buffer_find(buffer);
+    if (i != NO_BUFFER)
     {
+        info = g_mediaBufferManagerContext.buffers[i];
+    }
+    hw_core_EnableIrqInterrupt(irqState);
+
+    if (i != NO_BUFFER)
+    {
+        result = SUCCESS;
+
         switch (whichProperty)
         {
             case kMediaBufferProperty_Size:
-                *(uint32_t *)value = info->length;
+                *(uint32_t *)value = info.length;
                 break;
-                
-#if RECORD_BUFFER_STATS
+
             case kMediaBufferProperty_Type:
-                *(MediaBufferType_t *)value = info->bufferType;
+                *(MediaBufferType_t *)value = (MediaBufferType_t)(info.bufferClass / BUFFER_FLAG_COMBINATIONS);
                 break;
-#endif // RECORD_BUFFER_STATS
-                
+
             case kMediaBufferProperty_Flags:
-                *(uint32_t *)value = info->flags;
+                *(uint32_t *)value = info.flags;
                 break;
-                
+
             case kMediaBufferProperty_IsTemporary:
-                *(bool *)value = (info->flags & kMediaBufferFlag_Temporary) != 0;
+                *(bool *)value = (info.flags & kMediaBufferFlag_Temporary) != 0;
                 break;
-                
+
             case kMediaBufferProperty_IsInUse:
-                *(bool *)value = (info->flags & kMediaBufferFlag_InUse) != 0;
+                *(bool *)value = (info.flags & kMediaBufferFlag_InUse) != 0;
                 break;
-            
+
             case kMediaBufferProperty_ReferenceCount:
-                *(uint32_t *)value = info->refCount;
+                *(uint32_t *)value = info.refCount;
                 break;
-                
+
             case kMediaBufferProperty_Timeout:
-                if (!(info->flags & kMediaBufferFlag_Temporary))
+                if (!(info.flags & kMediaBufferFlag_Temporary))
                 {
                     // Set the result for permanent buffers to -1.
                     *(uint32_t *)value = (uint32_t)-1;
                 }
-                else if (info->flags & kMediaBufferFlag_InUse)
+                else if (info.flags & kMediaBufferFlag_InUse)
                 {
                     // Temp buffers that are currently in use don't have a timeout, yet.
                     *(uint32_t *)value = 0;
                 }
                 else
                 {
-                    *(uint32_t *)value = info->timeout;
+                    *(uint32_t *)value = info.timeout;
                 }
                 break;
-                
+
             default:
                 result = ERROR_DDI_MEDIABUFMGR_INVALID_PROPERTY;
         }
     }
-    
-    // Put the mutex and return the status code.
-    tx_mutex_put(&g_mediaBufferManagerContext.mutex);
+
     return result;
 }
 
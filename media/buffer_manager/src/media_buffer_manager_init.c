@@ -63,9 +63,7 @@ const char kMediaBufferTimeoutTimerName[] = "bm:to";
 RtStatus_t media_buffer_init(void)
 {
     UINT txStatus;
-#if (SECTOR_BUFFER_COUNT > 0) || (AUX_BUFFER_COUNT > 0)
     int i;
-#endif    
 
     // Only initialise once.
     if (g_mediaBufferManagerContext.isInited)
@@ -87,9 +85,19 @@ RtStatus_t media_buffer_init(void)
         return os_thi_ConvertTxStatus(txStatus);
     }
     
+    // All lists start out empty, except for the list of unused slots.
+    memset(g_mediaBufferManagerContext.freeHeads, NO_BUFFER, sizeof(g_mediaBufferManagerContext.freeHeads));
+    memset((void *)g_mediaBufferManagerContext.hash, NO_BUFFER, sizeof(g_mediaBufferManagerContext.hash));
+    g_mediaBufferManagerContext.idleHead = NO_BUFFER;
+    g_mediaBufferManagerContext.idleTail = NO_BUFFER;
+    g_mediaBufferManagerContext.unusedHead = NO_BUFFER;
+    for (i = MAX_BUFFER_COUNT - 1; i >= 0; --i)
+    {
+        g_mediaBufferManagerContext.buffers[i].next = g_mediaBufferManagerContext.unusedHead;
+        g_mediaBufferManagerContext.unusedHead = i;
+    }
+
     // Init the rest.
-    g_mediaBufferManagerContext.nextTimeout = NO_NEXT_TIMEOUT;
-    g_mediaBufferManagerContext.bufferToDispose = NO_NEXT_TIMEOUT;
     g_mediaBufferManagerContext.isInited = true;
     
 #if SECTOR_BUFFER_COUNT > 0
@@ -25,6 +25,7 @@
 #include "components/telemetry/tss_logtext.h"
 #include "os/dmi/os_dmi_api.h"
 #include "hw/core/vmemory.h"
+#include "hw/core/hw_core.h"
 #include "drivers/media/sectordef.h"
 #include <stdlib.h>
 #include <string.h>
@@ -38,17 +39,82 @@
     #define RECORD_BUFFER_STATS 0
 #endif
 
+//! \def MAX_BUFFER_COUNT
+//!
 //! \brief Maximum number of buffers that can be tracked at once.
-#define MAX_BUFFER_COUNT (10)
+//!
+//! This is the depth of the pool, counting both permanent and temporary buffers. It
+//! may be overridden at build time.
+#if !defined(MAX_BUFFER_COUNT)
+    #define MAX_BUFFER_COUNT (16)
+#endif
+
+//! \brief Number of slots in the hash table used to look up buffers by address.
+//!
+//! Twice the number of buffers keeps the probe sequences short.
+#define BUFFER_HASH_SIZE (MAX_BUFFER_COUNT * 2)
 
-//! \brief Used to indicate that there is no temporary buffer waiting to time out.
-#define NO_NEXT_TIMEOUT (-1)
+//! \brief Value of a buffer index that refers to no buffer.
+#define NO_BUFFER (-1)
 
 //! \brief Timeout in milliseconds for temporary buffers.
 #define TEMPORARY_BUFFER_TIMEOUT_MS (200)
 
-//! \brief Number of milliseconds to delay before attempting to post a DPC again.
-#define TIMER_RETRY_DELAY_MS (50)
+//! \brief Interval in milliseconds between checks for expired temporary buffers.
+//!
+//! The timer only runs while there are temporary buffers. A temporary buffer is
+//! freed between #TEMPORARY_BUFFER_TIMEOUT_MS and this much later.
+#define TEMPORARY_BUFFER_CHECK_MS (50)
+
+//! \brief Number of flag combinations that free lists are kept for.
+#define BUFFER_FLAG_COMBINATIONS (4)
+
+//! \brief Mask of the flags that select a buffer's free list.
+#define BUFFER_CLASS_FLAGS_MASK (kMediaBufferFlag_NCNB | kMediaBufferFlag_FastMemory)
+
+//! \brief Number of free lists, one for each buffer type and flag combination.
+#define BUFFER_CLASS_COUNT (kMediaBufferType_Count * BUFFER_FLAG_COMBINATIONS)
+
+//! \def MEDIA_BUFFER_MAGAZINE_COUNT
+//!
+//! \brief Number of threads that can have their own cache of buffers.
+//!
+//! Caches are given out to the first threads that acquire a buffer, and stay with
+//! them. May be overridden at build time.
+#if !defined(MEDIA_BUFFER_MAGAZINE_COUNT)
+    #define MEDIA_BUFFER_MAGAZINE_COUNT (4)
+#endif
+
+//! \brief Number of buffer types that are cached per thread.
+//!
+//! Only sector and auxiliary buffers are cached; their types are the first two.
+#define MEDIA_BUFFER_MAGAZINE_TYPES (2)
+
+//! \brief Most buffers of each type that a thread's cache holds.
+#define MEDIA_BUFFER_MAGAZINE_DEPTH (4)
+
+//! \brief Number of buffers moved between a thread's cache and the pool at once.
+#define MEDIA_BUFFER_MAGAZINE_BATCH (2)
+
+//! \brief Time in milliseconds after which a thread's cache is considered idle.
+//!
+//! When the pool runs dry, buffers cached by idle threads are returned to it before
+//! those cached by the other threads.
+#define MEDIA_BUFFER_MAGAZINE_IDLE_MS (100)
+
+//! \def MEDIA_BUFFER_CALL_SITE
+//!
+//! \brief Identifies the code that is acquiring a buffer.
+//!
+//! Must be used directly within media_buffer_acquire(). Evaluates to the return
+//! address where the compiler provides it, and to the calling thread otherwise.
+#if !defined(MEDIA_BUFFER_CALL_SITE)
+    #if defined(__GNUC__)
+        #define MEDIA_BUFFER_CALL_SITE() ((uint32_t)__builtin_return_address(0))
+    #else
+        #define MEDIA_BUFFER_CALL_SITE() ((uint32_t)tx_thread_identify())
+    #endif
+#endif
 
 //! \brief Internal flags applied to buffers.
 //!
@@ -68,17 +134,23 @@ enum _media_buffer_internal_flags
 //! \brief Buffer information.
 //!
 //! This structure holds information about each buffer being controlled by the
-//! media buffer manager. The global context has an array of these structures,
-//! where the first #MediaBufferManagerContext_t::slotCount elements are potentially
-//! valid. For any given instance of one of these structs, it is valid if and
-//! only if the #MediaBufferInfo_t::data field is non-zero.
+//! media buffer manager. The global context has an array of these structures.
+//! For any given instance of one of these structs, it is valid if and only if
+//! the #MediaBufferInfo_t::data field is non-zero.
+//!
+//! A buffer that is not in use is linked through the \a next and \a prev fields on the
+//! free list of its class, which is determined by the type it was added with and its
+//! flags. Unused elements of the array are linked through \a next on the list of unused
+//! slots instead.
 //!
 //! Temporary buffers, those that are dynamically allocated at runtime, are
 //! retained for a certain length of time after they are released back to the
 //! buffer manager. The #MediaBufferInfo_t::timeout field here will be set to the
 //! system clock time in ticks when the temporary buffer should finally be freed.
 //! Until that time, the buffer is available to match incoming requests, and if
-//! it is used the timeout is reset.
+//! it is used the timeout is reset. Released temporary buffers are also linked
+//! through the \a nextIdle and \a prevIdle fields on the idle list, in the order they
+//! were released, which is the order in which they time out.
 //!
 //! The #MediaBufferInfo_t::bufferType field is an optional field only present
 //! when buffer statistics are enabled. Normally the #MediaBufferInfo_t::length
@@ -92,6 +164,12 @@ typedef struct _buffer_info {
     uint32_t timeout;       //!< Absolute time in ticks when this buffer expires. Only applies to temporary buffers.
     SECTOR_BUFFER * originalBuffer; //!< If the buffer has been realigned, then this field points to the original
                                     //! result of the allocation; this is the pointer that should be passed to free().
+    uint8_t bufferClass;    //!< Index of the free list the buffer goes on when it is not in use.
+    int8_t next;            //!< Next buffer on the free list or unused slot list.
+    int8_t prev;            //!< Previous buffer on the free list.
+    int8_t nextIdle;        //!< Next temporary buffer on the idle list, which times out later.
+    int8_t prevIdle;        //!< Previous temporary buffer on the idle list.
+    uint32_t holder;        //!< Call site that last acquired the buffer. See #MEDIA_BUFFER_CALL_SITE.
 
 #if RECORD_BUFFER_STATS
     //! \name Statistics
@@ -107,6 +185,24 @@ typedef struct _buffer_info {
 #endif // RECORD_BUFFER_STATS
 } MediaBufferInfo_t;
 
+//! \brief Cache of buffers for one thread.
+//!
+//! Buffers in a thread's cache are out of the pool as far as the rest of the buffer
+//! manager is concerned: they are marked in use, with a reference count of zero. The
+//! owning thread takes buffers from and returns buffers to its cache without disabling
+//! interrupts, setting \a isBusy while it does. Other threads only look at a cache with
+//! interrupts disabled, and leave it alone while it is busy.
+//!
+//! Once a cache is given to a thread it is never given to another one, so a thread can
+//! find its cache by comparing \a owner without any locking.
+typedef struct _media_buffer_magazine {
+    TX_THREAD * volatile owner;     //!< Thread that owns the cache, or NULL if it is unused.
+    volatile bool isBusy;           //!< Set by the owner while it changes the cache.
+    volatile uint32_t lastUsed;     //!< Time in ticks when the owner last used the cache.
+    volatile uint8_t count[MEDIA_BUFFER_MAGAZINE_TYPES];    //!< Number of cached buffers of each type.
+    volatile int8_t buffers[MEDIA_BUFFER_MAGAZINE_TYPES][MEDIA_BUFFER_MAGAZINE_DEPTH];  //!< Indexes of cached buffers, most recently cached last.
+} MediaBufferMagazine_t;
+
 #if RECORD_BUFFER_STATS
 //! \brief Statistics information about buffer usage.
 typedef struct _media_buffer_statistics {
@@ -122,12 +218,21 @@ typedef struct _media_buffer_statistics {
 //!
 //! The array of buffer structures, #MediaBufferManagerContext_t::buffers, holds
 //! information about all of the buffers under the control of the media buffer
-//! manager. The first #MediaBufferManagerContext_t::slotCount elements in the array
-//! are the only ones that may be valid, but not all of them are required to be so.
-//! If #MediaBufferManagerContext_t::bufferCount is less than the used slot count,
-//! then invalid (unused) buffer array elements are present and must be skipped.
-//! The requirements for a valid buffer structure are described in the documentation for
-//! #MediaBufferInfo_t.
+//! manager. The requirements for a valid buffer structure are described in the
+//! documentation for #MediaBufferInfo_t.
+//!
+//! Every valid buffer is in the #MediaBufferManagerContext_t::hash table, which maps
+//! buffer addresses to array indexes with linear probing, so that a buffer is found
+//! without searching the array when it is retained or released. The table is changed
+//! with IRQs disabled, and #MediaBufferManagerContext_t::hashGeneration is incremented
+//! before and after each change, so a thread that looks up a buffer without disabling
+//! IRQs can tell whether it was preempted by a change and has to look again.
+//!
+//! Acquiring and releasing a buffer that is already known to the buffer manager only
+//! moves it between the free lists and the callers, which is done with IRQs disabled
+//! rather than with the mutex held. The mutex serialises the slower operations that
+//! add and dispose of buffers, and the arrays and lists they change are also only
+//! modified with IRQs disabled.
 typedef struct _media_buffer_manager_context {
     //! \name General
     //@{
@@ -137,12 +242,14 @@ typedef struct _media_buffer_manager_context {
     
     //! \name Buffer array
     //!
-    //! Only bufferCount buffers out of the first slotCount elements of the buffer
-    //! array are valid. And out of those, only freeCount buffers are available for
-    //! use by clients of the buffer manager.
+    //! Only bufferCount buffers of the buffer array are valid. And out of those, only
+    //! freeCount buffers are available for use by clients of the buffer manager.
     //@{
     MediaBufferInfo_t buffers[MAX_BUFFER_COUNT]; //!< Array of buffers.
-    unsigned slotCount;     //!< The number of buffer array entries that must be searched.
+    int8_t freeHeads[BUFFER_CLASS_COUNT];   //!< First buffer on the free list of each class, or #NO_BUFFER.
+    int8_t unusedHead;      //!< First unused element of the buffer array, or #NO_BUFFER.
+    volatile int8_t hash[BUFFER_HASH_SIZE];    //!< Buffer indexes by address, or #NO_BUFFER for an empty slot.
+    volatile uint32_t hashGeneration;   //!< Incremented before and after each change to the hash table.
     unsigned bufferCount;   //!< The number of buffers of all types in the buffers array.
     unsigned freeCount;     //!< The number of unused buffers of all types in the buffers array.
     //@}
@@ -153,8 +260,30 @@ typedef struct _media_buffer_manager_context {
     //! to the buffer manager.
     //@{
     TX_TIMER timeoutTimer;  //!< ThreadX timer used to time out temporary buffers.
-    int nextTimeout;        //!< Index of the temporary buffer that will next time out. #NO_NEXT_TIMEOUT if there is none.
-    int bufferToDispose;    //!< Index of temporary buffer that has timed out and should be permanently disposed of. Will be set to #NO_NEXT_TIMEOUT if there is no buffer to dispose.
+    bool isTimerActive;     //!< Whether the timer is running. Changed with the mutex held.
+    unsigned temporaryCount;    //!< Number of temporary buffers, whether in use or idle.
+    int8_t idleHead;        //!< Temporary buffer that will time out next, or #NO_BUFFER.
+    int8_t idleTail;        //!< Temporary buffer that was released last, or #NO_BUFFER.
+    //@}
+
+    //! \name Thread caches
+    //@{
+    MediaBufferMagazine_t magazines[MEDIA_BUFFER_MAGAZINE_COUNT];  //!< Caches of buffers for the busiest threads.
+    //@}
+
+    //! \name Telemetry
+    //!
+    //! These fields are kept in every build and are cheap to update. They are read
+    //! through the buffer manager properties of media_buffer_get_property(). The out of
+    //! pool counts are changed with IRQs disabled, the rest with the mutex held.
+    //@{
+    uint8_t outCount[kMediaBufferType_Count];       //!< Number of buffers of each type that are out of the pool.
+    uint8_t highWaterMarks[kMediaBufferType_Count]; //!< Highest value of each outCount.
+    unsigned temporaryAllocs;       //!< Number of temporary buffers that were allocated.
+    unsigned realignedAllocs;       //!< Number of temporary buffers that had to be realigned.
+    unsigned mismatchedSizeAllocs;  //!< Number of allocations where a buffer was selected that wasn't a perfect match in size.
+    unsigned exhaustedCount;        //!< Number of acquires that found no suitable buffer in the pool.
+    uint64_t exhaustedTime;         //!< Microseconds spent in those acquires.
     //@}
 
 #if RECORD_BUFFER_STATS
@@ -169,7 +298,6 @@ typedef struct _media_buffer_manager_context {
     MediaBufferStatistics_t tempStats;   //!< Statistics for temporary buffers.
     MediaBufferStatistics_t permTypeStats[kMediaBufferType_Count]; //!< Statistics for permanent buffers by type.
     MediaBufferStatistics_t tempTypeStats[kMediaBufferType_Count]; //!< Statistics for temporary buffers by type.
-    unsigned mismatchedSizeAllocs;  //!< Number of allocations where a buffer was selected that wasn't a perfect match in size.
     //@}
 #endif // RECORD_BUFFER_STATS
 } MediaBufferManagerContext_t;
@@ -0,0 +1,285 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright(C) SigmaTel, Inc. 2003-2007
+//
+// Filename:    buffer_manager_stress.c
+// Description: Stress test and benchmark of buffer acquire and release.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "drivers/media/buffer_manager/media_buffer_manager.h"
+#include "hw/profile/hw_profile.h"
+#include "os/threadx/tx_api.h"
+#include <stdlib.h>
+#include <string.h>
+
+//! Number of threads acquiring and releasing buffers at the same time.
+#define STRESS_THREAD_COUNT 3
+
+//! Number of acquire or release operations each thread performs.
+#define STRESS_OPERATION_COUNT 100000
+
+//! Most buffers that a thread holds at once.
+#define STRESS_MAX_HELD 6
+
+//! Stack size in bytes of each stress thread.
+#define STRESS_STACK_SIZE 4000
+
+//! Priority of the stress threads, just below the test thread that waits for them.
+#define STRESS_PRIORITY 10
+
+//! Ticks each stress thread runs before the next one of the same priority gets a turn.
+#define STRESS_TIME_SLICE 1
+
+//! State and results of one stress thread.
+typedef struct _stress_worker {
+    TX_THREAD thread;
+    uint32_t stack[STRESS_STACK_SIZE / 4];
+    unsigned index;             //!< Number of the thread, stored in the buffers it holds.
+    uint32_t seed;              //!< State of the thread's own random number generator.
+    unsigned acquireCount;
+    unsigned releaseCount;
+    uint64_t acquireTime;
+    uint64_t releaseTime;
+    RtStatus_t status;          //!< First error the thread hit, or SUCCESS.
+} StressWorker_t;
+
+static StressWorker_t s_workers[STRESS_THREAD_COUNT];
+
+//! Put by each stress thread when it is done.
+static TX_SEMAPHORE s_doneSemaphore;
+
+//! \brief Returns the next number from a thread's random sequence.
+//!
+//! rand() shares its state between threads, so each thread has its own generator.
+static uint32_t stress_random(StressWorker_t * worker)
+{
+    worker->seed = worker->seed * 1103515245 + 12345;
+    return worker->seed >> 16;
+}
+
+//! \brief Acquires and releases buffers at random.
+//!
+//! Every buffer a thread acquires is stamped with the thread number and a sequence
+//! number, and the stamp is checked again before the buffer is released. A buffer
+//! given to two threads at once will have been restamped by the other one.
+static void stress_thread(ULONG param)
+{
+    static const uint32_t kFlags[] = { kMediaBufferFlag_None, kMediaBufferFlag_NCNB };
+    StressWorker_t * worker = &s_workers[param];
+    SECTOR_BUFFER * held[STRESS_MAX_HELD];
+    uint32_t stamps[STRESS_MAX_HELD];
+    unsigned heldCount = 0;
+    uint64_t start;
+    RtStatus_t status = SUCCESS;
+    int i;
+
+    for (i = 0; i < STRESS_OPERATION_COUNT && status == SUCCESS; ++i)
+    {
+        // Acquire when nothing is held, release when everything is, otherwise pick at random.
+        if (heldCount == 0 || (heldCount < STRESS_MAX_HELD && (stress_random(worker) & 1)))
+        {
+            MediaBufferType_t bufferType = (stress_random(worker) & 3) ? kMediaBufferType_Sector : kMediaBufferType_Auxiliary;
+            uint32_t flags = kFlags[stress_random(worker) % (sizeof(kFlags) / sizeof(kFlags[0]))];
+
+            start = hw_profile_GetMicroseconds();
+            status = media_buffer_acquire(bufferType, flags, &held[heldCount]);
+            worker->acquireTime += hw_profile_GetMicroseconds() - start;
+            if (status)
+            {
+                printf("Thread %u: media_buffer_acquire failed: 0x%08x\n", worker->index, status);
+                break;
+            }
+
+            stamps[heldCount] = (worker->index << 24) | (worker->acquireCount & 0xffffff);
+            held[heldCount][0] = stamps[heldCount];
+
+            ++heldCount;
+            ++worker->acquireCount;
+        }
+        else
+        {
+            unsigned which = stress_random(worker) % heldCount;
+
+            if (held[which][0] != stamps[which])
+            {
+                printf("Thread %u: buffer 0x%08x is also held by thread %u\n", worker->index, (uint32_t)held[which], held[which][0] >> 24);
+                status = ERROR_GENERIC;
+                break;
+            }
+
+            start = hw_profile_GetMicroseconds();
+            status = media_buffer_release(held[which]);
+            worker->releaseTime += hw_profile_GetMicroseconds() - start;
+            if (status)
+            {
+                printf("Thread %u: media_buffer_release failed: 0x%08x\n", worker->index, status);
+                break;
+            }
+
+            held[which] = held[--heldCount];
+            stamps[which] = stamps[heldCount];
+            ++worker->releaseCount;
+        }
+
+        // Let temporary buffers time out now and then.
+        if ((i & 0x3fff) == 0x3fff)
+        {
+            tx_thread_sleep(1);
+        }
+    }
+
+    // Return everything that is still held.
+    while (heldCount)
+    {
+        RtStatus_t releaseStatus = media_buffer_release(held[--heldCount]);
+        if (releaseStatus && status == SUCCESS)
+        {
+            printf("Thread %u: media_buffer_release failed: 0x%08x\n", worker->index, releaseStatus);
+            status = releaseStatus;
+        }
+    }
+
+    worker->status = status;
+    tx_semaphore_put(&s_doneSemaphore);
+}
+
+//! \brief Checks the buffer manager's statistics against what the stress threads did.
+//!
+//! \param acquireCount Number of acquires made by the stress threads.
+//! \param baseTemporaryAllocs Temporary allocations made before the threads started.
+//! \param baseExhaustedCount Exhausted pool count before the threads started.
+static RtStatus_t stress_check_statistics(unsigned acquireCount, uint32_t baseTemporaryAllocs, uint32_t baseExhaustedCount)
+{
+    uint32_t highWaterMarks[kMediaBufferType_Count];
+    uint32_t temporaryAllocs;
+    uint32_t exhaustedCount;
+    uint64_t exhaustedTime;
+    MediaBufferHolder_t holders[MEDIA_BUFFER_TOP_HOLDER_COUNT];
+    unsigned i;
+
+    media_buffer_get_property(NULL, kMediaBufferProperty_HighWaterMarks, highWaterMarks);
+    media_buffer_get_property(NULL, kMediaBufferProperty_TemporaryAllocations, &temporaryAllocs);
+    media_buffer_get_property(NULL, kMediaBufferProperty_ExhaustedCount, &exhaustedCount);
+    media_buffer_get_property(NULL, kMediaBufferProperty_ExhaustedTime, &exhaustedTime);
+    media_buffer_get_property(NULL, kMediaBufferProperty_TopHolders, holders);
+
+    printf("Stress: high-water marks %u sector, %u auxiliary, %u page\n", highWaterMarks[kMediaBufferType_Sector], highWaterMarks[kMediaBufferType_Auxiliary], highWaterMarks[kMediaBufferType_NANDPage]);
+    printf("Stress: %u temporary allocations, pool exhausted %u times for %u us\n", temporaryAllocs, exhaustedCount, (uint32_t)exhaustedTime);
+
+    temporaryAllocs -= baseTemporaryAllocs;
+    exhaustedCount -= baseExhaustedCount;
+
+    // Both types were held by several threads at once.
+    if (highWaterMarks[kMediaBufferType_Sector] == 0 || highWaterMarks[kMediaBufferType_Auxiliary] == 0)
+    {
+        printf("Stress: a high-water mark was not recorded\n");
+        return ERROR_GENERIC;
+    }
+
+    // Temporary buffers are only allocated by acquires that found the pool exhausted,
+    // and there can't be more of those than acquires.
+    if (temporaryAllocs > exhaustedCount || exhaustedCount > acquireCount)
+    {
+        printf("Stress: pool exhausted %u times, which does not fit %u temporary allocations and %u acquires\n", exhaustedCount, temporaryAllocs, acquireCount);
+        return ERROR_GENERIC;
+    }
+
+    // Every buffer was released, so nobody may be holding one.
+    for (i = 0; i < MEDIA_BUFFER_TOP_HOLDER_COUNT; ++i)
+    {
+        if (holders[i].bufferCount)
+        {
+            printf("Stress: call site 0x%08x still holds %u buffers\n", holders[i].callSite, holders[i].bufferCount);
+            return ERROR_GENERIC;
+        }
+    }
+
+    return SUCCESS;
+}
+
+RtStatus_t BufferManagerStressTest(void)
+{
+    unsigned acquireCount = 0;
+    unsigned releaseCount = 0;
+    uint64_t acquireTime = 0;
+    uint64_t releaseTime = 0;
+    uint32_t baseTemporaryAllocs;
+    uint32_t baseExhaustedCount;
+    RtStatus_t status = SUCCESS;
+    unsigned i;
+
+    // Only check what the stress threads do.
+    media_buffer_get_property(NULL, kMediaBufferProperty_TemporaryAllocations, &baseTemporaryAllocs);
+    media_buffer_get_property(NULL, kMediaBufferProperty_ExhaustedCount, &baseExhaustedCount);
+
+    status = tx_semaphore_create(&s_doneSemaphore, "stress:done", 0);
+    if (status)
+    {
+        printf("tx_semaphore_create failed: 0x%08x\n", status);
+        return status;
+    }
+
+    // The threads share a priority and a short time slice, so they are switched in the
+    // middle of acquires and releases.
+    for (i = 0; i < STRESS_THREAD_COUNT; ++i)
+    {
+        StressWorker_t * worker = &s_workers[i];
+
+        memset(worker, 0, sizeof(*worker));
+        worker->index = i + 1;
+        worker->seed = i + 1;
+
+        status = tx_thread_create(&worker->thread,
+                        "BUFMGR STRESS",
+                        stress_thread,
+                        i,
+                        worker->stack,
+                        STRESS_STACK_SIZE,
+                        STRESS_PRIORITY,
+                        STRESS_PRIORITY,
+                        STRESS_TIME_SLICE,
+                        TX_AUTO_START);
+        if (status)
+        {
+            printf("tx_thread_create failed: 0x%08x\n", status);
+            return status;
+        }
+    }
+
+    // Wait for every thread, then get rid of them. A thread may not have returned yet
+    // when its semaphore put wakes this one, so it is terminated before it is deleted.
+    for (i = 0; i < STRESS_THREAD_COUNT; ++i)
+    {
+        tx_semaphore_get(&s_doneSemaphore, TX_WAIT_FOREVER);
+    }
+    for (i = 0; i < STRESS_THREAD_COUNT; ++i)
+    {
+        StressWorker_t * worker = &s_workers[i];
+
+        tx_thread_terminate(&worker->thread);
+        tx_thread_delete(&worker->thread);
+
+        if (worker->status && status == SUCCESS)
+        {
+            status = worker->status;
+        }
+
+        acquireCount += worker->acquireCount;
+        releaseCount += worker->releaseCount;
+        acquireTime += worker->acquireTime;
+        releaseTime += worker->releaseTime;
+    }
+    tx_semaphore_delete(&s_doneSemaphore);
+
+    if (status)
+    {
+        return status;
+    }
+
+    printf("Stress: %u threads\n", STRESS_THREAD_COUNT);
+    printf("Stress: %u acquires, %u us total, %u ns each\n", acquireCount, (uint32_t)acquireTime, (uint32_t)(acquireTime * 1000 / acquireCount));
+    printf("Stress: %u releases, %u us total, %u ns each\n", releaseCount, (uint32_t)releaseTime, (uint32_t)(releaseTime * 1000 / releaseCount));
+
+    // Report what the buffer manager saw, to size the pool against, and check it.
+    return stress_check_statistics(acquireCount, baseTemporaryAllocs, baseExhaustedCount);
+}
+
@@ -17,6 +17,8 @@
 
 extern unsigned char __ghsbegin_heap[];
 
+RtStatus_t BufferManagerStressTest(void);
+
 SECTOR_BUFFER g_test_buffer_1[1000] __OCRAM_BSS_NCNB;
 
 #if (EXTRAS_STATIC_SECTOR_BUFFERS > 0)
@@ -226,6 +228,10 @@ RtStatus_t test_main(ULONG param)
 
     status = BufferManagerTest();
     if (status == SUCCESS)
+    {
+        status = BufferManagerStressTest();
+    }
+    if (status == SUCCESS)
     {
         printf("Test passed!\r\n");
     }
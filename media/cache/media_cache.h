@@ -157,6 +157,26 @@ enum media_cache_weights
     kMediaCacheWeight_High = 10
 };
 
+//! \brief Replacement policies for choosing which cache entry to reuse on a miss.
+//!
+//! \see media_cache_init_with_policy()
+enum media_cache_policy
+{
+    //! Weighted least recently used. A weight on a sector moves it away from the
+    //! LRU end of the list when it is inserted. This is the default policy.
+    kMediaCachePolicy_LRU = 0,
+    
+    //! Scan resistant 2Q policy. Sectors read only once, such as those of a large
+    //! sequential file read, are kept in a small probation queue and are evicted
+    //! before sectors that have been reused, like FAT and directory sectors. Sectors
+    //! written or read with a weight above #kMediaCacheWeight_Low skip the probation
+    //! queue, and weights still position sectors within the main queue.
+    kMediaCachePolicy_2Q = 1
+};
+
+//! Typedef for the replacement policy enumeration.
+typedef enum media_cache_policy MediaCachePolicy_t;
+
 /*!
  * \brief Param block structure for media cache read/write API.
  *
@@ -183,6 +203,133 @@ struct media_cache_param_block
 //! Typedef for media cache param block structure.
 typedef struct media_cache_param_block MediaCacheParamBlock_t;
 
+/*!
+ * \brief One element of the result of a vectored cache read.
+ *
+ * Each element describes the data of a single cache entry, which holds one native
+ * sector. Consecutive elements hold consecutive sectors, but their buffers are not
+ * necessarily contiguous in memory.
+ *
+ * \see media_cache_read_vec()
+ */
+struct media_cache_iovec
+{
+    uint8_t * buffer;       //!< Pointer to the sector data.
+    uint32_t sectorCount;   //!< Number of sectors at \a buffer, in the units used for the read.
+    uint32_t token;         //!< Token for the cache entry holding \a buffer.
+};
+
+//! Typedef for the vectored read result element.
+typedef struct media_cache_iovec MediaCacheIovec_t;
+
+//! \brief Completion callback for media_cache_read_async().
+//!
+//! \param status Result of the read. If it is not SUCCESS, nothing has to be released.
+//! \param pb The param block with its \a buffer, \a actualSectorCount, and \a token fields
+//!     filled in as by media_cache_read(). This is a copy of the caller's param block,
+//!     and is only valid until the callback returns.
+//! \param refcon The value passed to media_cache_read_async().
+typedef void (*MediaCacheReadCallback_t)(RtStatus_t status, MediaCacheParamBlock_t * pb, void * refcon);
+
+/*!
+ * \brief Configuration of the background write-back flusher.
+ *
+ * Watermarks are expressed as a percentage of the total number of cache entries.
+ * When the number of dirty entries reaches \a highWatermark, the flusher thread
+ * starts writing back dirty entries, oldest first, and keeps going until the
+ * number of dirty entries drops to \a lowWatermark. Independently of the
+ * watermarks, any entry that has been dirty for longer than \a maxAgeMs is
+ * written back.
+ *
+ * \see media_cache_set_flusher()
+ */
+struct media_cache_flusher_config
+{
+    bool isEnabled;             //!< Set to true to run the flusher thread.
+    uint8_t highWatermark;      //!< Percentage of dirty entries at which write-back starts. Zero disables watermark write-back.
+    uint8_t lowWatermark;       //!< Percentage of dirty entries at which write-back stops. Must not be greater than \a highWatermark.
+    uint32_t maxAgeMs;          //!< Maximum milliseconds an entry may stay dirty. Zero disables age based write-back.
+};
+
+//! Typedef for the flusher configuration structure.
+typedef struct media_cache_flusher_config MediaCacheFlusherConfig_t;
+
+/*!
+ * \brief Share of the media cache entries set aside for a drive.
+ *
+ * Both limits are percentages of the current number of cache entries, so they follow
+ * the cache when it is resized. The default is a minimum of 0 and a maximum of 100,
+ * which leaves the drive to compete for entries with every other drive.
+ *
+ * \see media_cache_set_partition()
+ */
+struct media_cache_partition
+{
+    uint8_t minPercent;     //!< Percentage of the entries that other drives can't take away from the drive.
+    uint8_t maxPercent;     //!< Percentage of the entries the drive may own at most. Must not be less than \a minPercent.
+};
+
+//! Typedef for the partition structure.
+typedef struct media_cache_partition MediaCachePartition_t;
+
+/*!
+ * \brief Current and possible sizes of the media cache.
+ *
+ * \see media_cache_get_size_info()
+ */
+struct media_cache_size_info
+{
+    uint32_t entryCount;        //!< Current number of cache entries.
+    uint32_t minEntryCount;     //!< Smallest number of entries the cache can be resized to, which is its size after media_cache_init().
+    uint32_t maxEntryCount;     //!< Largest number of entries the cache can be resized to.
+    uint32_t missCount;         //!< Number of cache misses since the ghost hit counts were last reset.
+    uint32_t maxGhostEntries;   //!< Largest number of extra entries that media_cache_get_ghost_hits() can estimate hits for.
+};
+
+//! Typedef for the size information structure.
+typedef struct media_cache_size_info MediaCacheSizeInfo_t;
+
+//! \brief Operations whose latency is measured by the cache.
+//!
+//! \see media_cache_get_latency()
+enum media_cache_latency_op
+{
+    kMediaCacheLatency_ReadHit = 0,     //!< media_cache_read() or media_cache_read_vec() that found every sector in the cache.
+    kMediaCacheLatency_ReadMiss,        //!< media_cache_read() or media_cache_read_vec() that had to read from media.
+    kMediaCacheLatency_Write,           //!< media_cache_write().
+    kMediaCacheLatency_PinnedWrite,     //!< media_cache_pinned_write(), up to the return of the buffer.
+    kMediaCacheLatency_Flush,           //!< media_cache_flush() of a sector or the drive, or the drive's part of a flush of all drives.
+    kMediaCacheLatency_EvictionWriteBack,   //!< Writing back dirty sectors to make room for a miss.
+    
+    kMediaCacheLatencyOpCount           //!< Number of measured operations.
+};
+
+//! Typedef for the latency operation enumeration.
+typedef enum media_cache_latency_op MediaCacheLatencyOp_t;
+
+//! Number of buckets in a latency histogram.
+#define MEDIA_CACHE_LATENCY_BUCKET_COUNT (24)
+
+/*!
+ * \brief Histogram of the latencies of one operation on one drive.
+ *
+ * Bucket 0 counts operations that took less than one microsecond. Bucket \a n counts
+ * those that took from 2^(n-1) up to 2^n - 1 microseconds, except that the last bucket
+ * also counts everything slower, which is anything over about four seconds.
+ *
+ * \see media_cache_get_latency()
+ */
+struct media_cache_latency_histogram
+{
+    uint32_t count;             //!< Number of operations measured.
+    uint32_t maxMicroseconds;   //!< Latency of the slowest operation.
+    uint64_t totalMicroseconds; //!< Sum of the latencies of all operations.
+    uint32_t buckets[MEDIA_CACHE_LATENCY_BUCKET_COUNT]; //!< Number of operations in each latency range.
+};
+
+//! Typedef for the latency histogram structure.
+typedef struct media_cache_latency_histogram MediaCacheLatencyHistogram_t;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Prototypes
 ///////////////////////////////////////////////////////////////////////////////
@@ -211,6 +358,23 @@ extern "C" {
 //!     this error is returned.
 RtStatus_t media_cache_init(uint8_t * cacheBuffer, uint32_t cacheBufferLength);
 
+//! \brief Initalizes the media sector cache with a given replacement policy.
+//!
+//! This function is the same as media_cache_init(), except that it lets the caller
+//! select the policy used to choose which entry to reuse on a cache miss.
+//! media_cache_init() uses #kMediaCachePolicy_LRU.
+//!
+//! \param cacheBuffer Pointer to a block of memory that will be used to hold cached
+//!     media sectors. See media_cache_init() for the requirements.
+//! \param cacheBufferLength The number of bytes in the buffer pointed to by \a cacheBuffer.
+//! \param policy The replacement policy.
+//!
+//! \retval SUCCESS The media cache was successfully initialized.
+//! \retval ERROR_DDI_MEDIA_CACHE_INVALID_BUFFER The buffer is too small or not data
+//!     cache aligned.
+//! \retval ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER The \a policy value is unknown.
+RtStatus_t media_cache_init_with_policy(uint8_t * cacheBuffer, uint32_t cacheBufferLength, MediaCachePolicy_t policy);
+
 //! \brief Clean up the media cache and free allocated memory.
 //!
 //! \retval SUCCESS The media cache was shut down and all dynamically allocated memory
@@ -251,6 +415,91 @@ RtStatus_t media_cache_shutdown(void);
 //!     the actual number of sectors that the drive has.
 RtStatus_t media_cache_read(MediaCacheParamBlock_t * pb);
 
+//! \brief Performs a cached read of a run of sectors.
+//!
+//! This function is like media_cache_read(), except that it is not limited to the sectors
+//! of a single cache entry or short chain of entries. All of the cache entries needed for
+//! the requested run of sectors are located and retained while the cache is locked once.
+//! Sectors that are not in the cache are read in groups of the drive's optimal transfer
+//! size using a multisector transaction. One element of \a iov is filled in for each
+//! cache entry, in sector order, and all of them are released together with a single
+//! call to media_cache_release_vec().
+//!
+//! Fewer sectors than requested may be returned. The run is limited to the number of
+//! elements in \a iov and to half of the cache entries, and stops early if no more
+//! entries can be reused without waiting or if an error occurs after the first sector.
+//! Check \a actualSectorCount and call again for the remaining sectors.
+//!
+//! \note If an error is returned, there is no need to call media_cache_release_vec().
+//!
+//! \par Param block fields:
+//! - \b => \em weight
+//! - \b => \em drive
+//! - \b => \em sector
+//! - \b => \em flags
+//! - \b X \em buffer
+//! - \b => \em requestSectorCount
+//! - \b <= \em actualSectorCount
+//! - \b X \em token
+//! - \b X \em writeOffset
+//! - \b X \em writeByteCount
+//! - \b X \em mode
+//!
+//! \par Honored flags:
+//! - #kMediaCacheFlag_UseNativeSectors
+//! - #kMediaCacheFlag_BypassCache
+//! - #kMediaCacheFlag_NoPartitionOffset
+//! - #kMediaCacheFlag_ApplyWeight
+//!
+//! \param pb Pointer to the parameter block.
+//! \param iov Array that receives one element per cache entry returned.
+//! \param[in,out] iovCount On entry, the number of elements in \a iov. On return, the number
+//!     of elements that were filled in.
+//! \retval SUCCESS At least the first sector was read.
+//! \retval ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER The \a iov array has no elements.
+//! \retval ERROR_DDI_LDL_LDRIVE_INVALID_DRIVE_NUMBER An invalid drive number was passed in the param block.
+//! \retval ERROR_DDI_LDL_LDRIVE_SECTOR_OUT_OF_BOUNDS The sector passed in the param block is larger than
+//!     the actual number of sectors that the drive has.
+RtStatus_t media_cache_read_vec(MediaCacheParamBlock_t * pb, MediaCacheIovec_t * iov, uint32_t * iovCount);
+
+//! \brief Performs a cached read without waiting for the media.
+//!
+//! This function is like media_cache_read(), except that the result is passed to
+//! \a callback instead of being returned. If the sector is already in the cache, the
+//! read completes and the callback is invoked before this function returns. Otherwise
+//! the read is queued to the cache I/O thread, which loads the sector and then invokes
+//! the callback. Requests for a sector that is already being loaded wait for that load
+//! instead of starting another one.
+//!
+//! The callback is invoked exactly once for each request this function accepts, with
+//! no cache locks held. When invoked from the I/O thread, it should return quickly
+//! since other requests wait for it. It may call media_cache_release() and issue new
+//! reads, but a synchronous read from the callback delays every queued request.
+//!
+//! The I/O thread is started by the first call to this function, and is stopped by
+//! media_cache_shutdown() after it has completed every queued request.
+//!
+//! \par Param block fields:
+//! Same as media_cache_read(). The param block is copied, so it does not have to
+//! remain valid after this function returns.
+//!
+//! \par Honored flags:
+//! - #kMediaCacheFlag_UseNativeSectors
+//! - #kMediaCacheFlag_BypassCache
+//! - #kMediaCacheFlag_NoPartitionOffset
+//! - #kMediaCacheFlag_ApplyWeight
+//!
+//! \param pb Pointer to the parameter block.
+//! \param callback Function invoked with the result of the read.
+//! \param refcon Arbitrary value passed to \a callback.
+//! \retval SUCCESS The read was either completed or queued. The callback has the result.
+//! \retval ERROR_DDI_MEDIA_CACHE_QUEUE_FULL Too many reads are queued already. The
+//!     callback will not be invoked.
+//! \retval ERROR_DDI_LDL_LDRIVE_INVALID_DRIVE_NUMBER An invalid drive number was passed in the param block.
+//! \retval ERROR_DDI_LDL_LDRIVE_SECTOR_OUT_OF_BOUNDS The sector passed in the param block is larger than
+//!     the actual number of sectors that the drive has.
+RtStatus_t media_cache_read_async(MediaCacheParamBlock_t * pb, MediaCacheReadCallback_t callback, void * refcon);
+
 //! \brief Performs a cached write operation.
 //!
 //! Use this function to write a buffer that you already have to a given sector.
@@ -292,6 +541,43 @@ RtStatus_t media_cache_read(MediaCacheParamBlock_t * pb);
 //!     the actual number of sectors that the drive has.
 RtStatus_t media_cache_write(MediaCacheParamBlock_t * pb);
 
+//! \brief Fills a run of sectors with zeroes.
+//!
+//! This has the same effect as a media_cache_write() of a buffer of zeroes to each
+//! sector, but native sectors that are zeroed entirely take no cache entry. They are
+//! remembered as zero sectors, and written back together in runs of sequential
+//! sectors from a single buffer of zeroes. A zero sector only gets an entry again if it is read or
+//! written before it is written back, and then the entry is filled with zeroes rather
+//! than read from media. Sectors that only partly cover a native sector, or whose
+//! native sector has an owner, are written through the cache like any other write.
+//!
+//! \par Param block fields:
+//! - \b => \em weight
+//! - \b => \em drive
+//! - \b => \em sector
+//! - \b => \em flags
+//! - \b X \em buffer
+//! - \b => \em requestSectorCount
+//! - \b X \em actualSectorCount
+//! - \b X \em token
+//! - \b X \em writeOffset
+//! - \b X \em writeByteCount
+//! - \b => \em mode
+//!
+//! \par Honored flags:
+//! - #kMediaCacheFlag_UseNativeSectors
+//! - #kMediaCacheFlag_NoPartitionOffset
+//! - #kMediaCacheFlag_WriteThrough
+//! - #kMediaCacheFlag_ApplyWeight
+//!
+//! \param pb Pointer to the parameter block. \a requestSectorCount is the number of
+//!     sectors to zero, starting with \a sector.
+//! \retval SUCCESS
+//! \retval ERROR_DDI_LDL_LDRIVE_INVALID_DRIVE_NUMBER An invalid drive number was passed in the param block.
+//! \retval ERROR_DDI_LDL_LDRIVE_SECTOR_OUT_OF_BOUNDS The run of sectors extends past the end of
+//!     the drive.
+RtStatus_t media_cache_write_zeroes(MediaCacheParamBlock_t * pb);
+
 //! \brief Returns a sector buffer into which the caller can write.
 //!
 //! Unlike media_cache_write(), this function does not take a buffer from the caller
@@ -400,8 +686,167 @@ RtStatus_t media_cache_flush(MediaCacheParamBlock_t * pb);
 //! \retval SUCCESS The specified cache entry was unlocked.
 RtStatus_t media_cache_release(uint32_t token);
 
+//! \brief Releases all cache entries returned by a vectored read.
+//!
+//! The cache is locked only once for the whole batch. The token of each element may
+//! instead be passed to media_cache_release() individually.
+//!
+//! \param iov The array filled in by media_cache_read_vec().
+//! \param iovCount Number of elements of \a iov that were filled in.
+//! \retval SUCCESS All of the entries were released.
+RtStatus_t media_cache_release_vec(const MediaCacheIovec_t * iov, uint32_t iovCount);
+
+//! \brief Sets the maximum read-ahead window.
+//!
+//! When a drive is read sequentially, the media cache loads sectors ahead of the
+//! caller so that subsequent reads hit. The read-ahead window starts at the drive's
+//! optimal transfer size and grows each time more sectors are read ahead, up to
+//! \a maxSectors. It shrinks again when sectors that were read ahead are evicted
+//! without being used. The window is also never more than a quarter of the cache entries.
+//!
+//! Read-ahead only reuses clean cache entries. It never waits for an entry to become
+//! free and never flushes a dirty entry to make room. The sectors are loaded by the
+//! cache I/O thread, so the reader that triggers read-ahead does not wait for them.
+//! The thread is started by the first read-ahead if no asynchronous read has started it.
+//!
+//! \param maxSectors Maximum number of native sectors to read ahead of a sequential
+//!     reader. Pass 0 to disable read-ahead. The default is set at build time by
+//!     the CACHE_READ_AHEAD_WINDOW macro.
+//! \retval SUCCESS The new window was applied.
+RtStatus_t media_cache_set_read_ahead(uint32_t maxSectors);
+
+//! \brief Configures the background write-back flusher.
+//!
+//! Without the flusher, dirty cache entries are only written to media when they are
+//! evicted or explicitly flushed, so the whole cost of a write-back lands on whichever
+//! thread happens to miss. When enabled, a low priority thread writes dirty entries back
+//! ahead of time, based on the watermarks and age limit in \a config. The flusher
+//! writes sequential runs of dirty sectors together, one group at a time, and gives
+//! up the cache between groups whenever another thread is waiting for it.
+//!
+//! The flusher is disabled by default. It can be reconfigured at any time, and is
+//! stopped by media_cache_shutdown().
+//!
+//! \param config The new flusher configuration. Passing a config with \a isEnabled set
+//!     to false stops the flusher thread.
+//! \retval SUCCESS The configuration was applied.
+//! \retval ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER A watermark is out of range.
+RtStatus_t media_cache_set_flusher(const MediaCacheFlusherConfig_t * config);
+
+//! \brief Sets the share of the cache entries reserved for and available to a drive.
+//!
+//! Entries owned by a drive that has no more than its minimum are never taken by
+//! other drives, and free entries are held back for drives that have not reached
+//! their minimum yet. A drive never takes more entries than its maximum. Between the
+//! two, a drive borrows whatever free entries other drives don't need, and gives
+//! entries back to drives below their even share of the cache as they miss.
+//!
+//! A drive that owns more entries than a new maximum gives the extra entries up as
+//! other drives need them, rather than right away.
+//!
+//! \param drive Tag of the drive. The drive is assigned a shard of the cache if it
+//!     hasn't been accessed through the cache yet.
+//! \param partition The drive's new limits.
+//! \retval SUCCESS The limits were applied.
+//! \retval ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER The limits are out of range, or the
+//!     minimums of all drives would add up to more than 100 percent.
+//! \retval ERROR_DDI_MEDIA_CACHE_TOO_MANY_DRIVES Every shard is in use by another drive.
+RtStatus_t media_cache_set_partition(uint8_t drive, const MediaCachePartition_t * partition);
+
+//! \brief Grows or shrinks the media cache.
+//!
+//! Entries that are added get sector buffers allocated from physically contiguous
+//! memory. They are put in the free pool, and the contents of the cache are kept.
+//!
+//! When shrinking, the sectors held by the entries being removed are moved into clean
+//! or unused entries that remain, evicting clean sectors from the LRU end of the
+//! shards. Only when no clean entry is left is a sector dropped from the cache, and a
+//! dirty one is written back to media first. The function waits for any owners of the
+//! entries being removed to release them.
+//!
+//! The cache can't shrink below the size it was given by media_cache_init(). The
+//! buffers of those entries are part of the buffer passed to media_cache_init(), so
+//! removing them would not free any memory.
+//!
+//! \param targetEntries The new number of cache entries. It must be within the
+//!     \a minEntryCount and \a maxEntryCount reported by media_cache_get_size_info().
+//! \retval SUCCESS The cache now has \a targetEntries entries.
+//! \retval ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER \a targetEntries is out of range.
+//! \retval ERROR_OS_MEMORY_MANAGER_NOMEMORY Not every new buffer could be allocated. The
+//!     cache keeps the entries that were added.
+//! \retval ERROR_DDI_MEDIA_CACHE_TIMEOUT An entry being removed was not released in time.
+//!     The cache keeps the entries that were not yet removed.
+//! \retval other Writing back a dirty sector failed. The cache keeps the entries that
+//!     were not yet removed.
+RtStatus_t media_cache_resize(uint32_t targetEntries);
+
+//! \brief Returns the current and largest possible size of the cache.
+//!
+//! \param[out] info The size information.
+//! \retval SUCCESS \a info was filled in.
+RtStatus_t media_cache_get_size_info(MediaCacheSizeInfo_t * info);
+
+//! \brief Estimates how many more hits a larger cache would have gotten.
+//!
+//! The cache remembers the sectors it evicted most recently. A miss on one of those
+//! sectors would have been a hit if the cache had been larger by at least the number
+//! of sectors evicted since. The count covers misses since media_cache_init() or the
+//! last call to media_cache_reset_ghost_hits(), and can be compared to the \a missCount
+//! reported by media_cache_get_size_info() to decide whether resizing is worthwhile.
+//!
+//! \param extraEntries Number of entries the cache would be larger by. Values greater
+//!     than the \a maxGhostEntries reported by media_cache_get_size_info() are reduced
+//!     to it.
+//! \param[out] extraHits Number of misses that would have been hits.
+//! \retval SUCCESS \a extraHits was filled in.
+RtStatus_t media_cache_get_ghost_hits(uint32_t extraEntries, uint32_t * extraHits);
+
+//! \brief Clears the miss and ghost hit counts.
+void media_cache_reset_ghost_hits(void);
+
+//! \brief Returns the latency histogram of one operation on a drive.
+//!
+//! Latencies are measured from the call into the cache to its return, so they include
+//! time spent waiting for other users of the drive. They are always recorded, and cover
+//! the time since the drive was first used or since the last call to
+//! media_cache_reset_latency() for it.
+//!
+//! \param drive Tag of the drive.
+//! \param op The operation.
+//! \param[out] histogram The histogram. It is all zeroes if the drive has not been used.
+//! \retval SUCCESS \a histogram was filled in.
+//! \retval ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER \a op is out of range.
+RtStatus_t media_cache_get_latency(uint8_t drive, MediaCacheLatencyOp_t op, MediaCacheLatencyHistogram_t * histogram);
+
+//! \brief Estimates a latency percentile of one operation on a drive.
+//!
+//! The result is the upper bound of the histogram bucket holding the percentile, but
+//! never more than the slowest latency measured. For example, passing 990 returns a
+//! latency that at least 99% of the operations did not exceed.
+//!
+//! \param drive Tag of the drive.
+//! \param op The operation.
+//! \param permille The percentile in tenths of a percent, from 0 to 1000.
+//! \param[out] microseconds The latency. Zero if no operations have been measured.
+//! \retval SUCCESS \a microseconds was filled in.
+//! \retval ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER \a op or \a permille is out of range.
+RtStatus_t media_cache_get_latency_percentile(uint8_t drive, MediaCacheLatencyOp_t op, uint32_t permille, uint32_t * microseconds);
+
+//! \brief Clears the latency histograms of every operation on a drive.
+void media_cache_reset_latency(uint8_t drive);
+
+//! \brief Returns the cache to the size it was given by media_cache_init().
+//! \see media_cache_resize()
 RtStatus_t media_cache_resume(void);
+
+//! \brief Grows the cache by up to a number of entries.
+//!
+//! The cache is only grown as far as the \a maxEntryCount reported by
+//! media_cache_get_size_info().
+//!
+//! \see media_cache_resize()
 RtStatus_t media_cache_increase(int cacheNumIncreased);
+
 RtStatus_t media_cache_DiscardDrive (int iDrive);
 #ifdef __cplusplus
 }
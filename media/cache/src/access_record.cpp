@@ -76,6 +76,9 @@ void cache_RecordAccess(const MediaCacheEntry * cache, bool isWrite, bool didHit
 {
     if (g_cacheRecordAccessInfo)
     {
+        // The records are shared by all shards.
+        SimpleMutex lockContext(g_mediaCacheContext.mutex);
+        
         // Update access info.
         MediaCacheAccessInfo * record = cache_FindAccessInfo(cache);
         if (record)
@@ -93,6 +96,9 @@ void cache_RecordAccess(const MediaCacheEntry * cache, bool isWrite, bool didHit
 
     if (g_cacheRecordHistory)
     {
+        // The history is shared by all shards.
+        SimpleMutex lockContext(g_mediaCacheContext.mutex);
+        
         // Update history.
         MediaCacheOperationInfo * history = g_mediaCacheContext.operationHistory.tail;
         if (history && history->drive == cache->drive && ((history->op == MediaCacheOperationInfo::kWrite && isWrite) || (history->op == MediaCacheOperationInfo::kRead && !isWrite)))
@@ -122,6 +128,9 @@ void cache_RecordFlush(const MediaCacheEntry * cache)
 {
     if (g_cacheRecordHistory)
     {
+        // The history is shared by all shards.
+        SimpleMutex lockContext(g_mediaCacheContext.mutex);
+        
         // Update history.
         MediaCacheOperationInfo * history;
         unsigned entryIndex = cache->getArrayIndex(g_mediaCacheContext.entries);
@@ -139,6 +148,9 @@ void cache_RecordEvict(const MediaCacheEntry * cache, bool didFlush)
 {
     if (g_cacheRecordHistory)
     {
+        // The history is shared by all shards.
+        SimpleMutex lockContext(g_mediaCacheContext.mutex);
+        
         // Update history.
         MediaCacheOperationInfo * history;
         history = new MediaCacheOperationInfo(cache->drive, cache->sector, MediaCacheOperationInfo::kEvict);
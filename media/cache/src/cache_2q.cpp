@@ -0,0 +1,262 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \file cache_2q.cpp
+//! \ingroup media_cache_internal
+//! \brief Implementation of the 2Q replacement policy for the media cache.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "cacheutil.h"
+#include <stdlib.h>
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants
+////////////////////////////////////////////////////////////////////////////////
+
+//! Percentage of the listed entries that the probation queue may hold before it
+//! becomes the source of victims.
+const unsigned kProbationTargetPercent = 25;
+
+//! Number of ghost buckets per ghost key. Membership is tested by bucket, so this
+//! bounds the rate of false ghost hits at one in this many.
+const unsigned kGhostBucketsPerKey = 8;
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+MediaCacheTwoQueueList::MediaCacheTwoQueueList(int minWeight, int maxWeight, unsigned windowSize, unsigned ghostCapacity)
+:   WeightedLRUList(minWeight, maxWeight, windowSize),
+    m_probation(minWeight, maxWeight, 0),
+    m_minWeight(minWeight),
+    m_ghostKeys(NULL),
+    m_ghostCapacity(0),
+    m_ghostHead(0),
+    m_ghostCount(0),
+    m_ghostCounts(NULL),
+    m_ghostShift(0)
+{
+    setGhostCapacity(ghostCapacity);
+}
+
+MediaCacheTwoQueueList::~MediaCacheTwoQueueList()
+{
+    if (m_ghostKeys)
+    {
+        free(m_ghostKeys);
+    }
+    if (m_ghostCounts)
+    {
+        free(m_ghostCounts);
+    }
+}
+
+bool MediaCacheTwoQueueList::setGhostCapacity(unsigned ghostCapacity)
+{
+    ghostCapacity = std::max<unsigned>(ghostCapacity, 1);
+
+    // Pick a power of two bucket count.
+    unsigned bits = 4;
+    while ((1U << bits) < ghostCapacity * kGhostBucketsPerKey)
+    {
+        ++bits;
+    }
+
+    uint32_t * keys = (uint32_t *)malloc(ghostCapacity * sizeof(uint32_t));
+    uint16_t * counts = (uint16_t *)malloc((1U << bits) * sizeof(uint16_t));
+    if (!keys || !counts)
+    {
+        free(keys);
+        free(counts);
+        return false;
+    }
+    memset(counts, 0, (1U << bits) * sizeof(uint16_t));
+
+    uint32_t * oldKeys = m_ghostKeys;
+    uint16_t * oldCounts = m_ghostCounts;
+    unsigned oldCapacity = m_ghostCapacity;
+    unsigned oldHead = m_ghostHead;
+    unsigned oldCount = m_ghostCount;
+
+    m_ghostKeys = keys;
+    m_ghostCounts = counts;
+    m_ghostCapacity = ghostCapacity;
+    m_ghostShift = 32 - bits;
+    m_ghostHead = 0;
+    m_ghostCount = 0;
+
+    // Carry over the newest keys, oldest first so they keep their order.
+    unsigned keptCount = std::min(oldCount, ghostCapacity);
+    for (unsigned i = oldCount - keptCount; i < oldCount; ++i)
+    {
+        addGhost(oldKeys[(oldHead + i) % oldCapacity]);
+    }
+
+    free(oldKeys);
+    free(oldCounts);
+    return true;
+}
+
+uint32_t MediaCacheTwoQueueList::getKey(const MediaCacheEntry * entry)
+{
+    return entry->sector ^ (static_cast<uint32_t>(entry->drive) << 24);
+}
+
+void MediaCacheTwoQueueList::addGhost(uint32_t key)
+{
+    // Forget the oldest key to make room.
+    if (m_ghostCount == m_ghostCapacity)
+    {
+        m_ghostCounts[getBucket(m_ghostKeys[m_ghostHead])]--;
+        m_ghostHead = (m_ghostHead + 1) % m_ghostCapacity;
+        m_ghostCount--;
+    }
+
+    m_ghostKeys[(m_ghostHead + m_ghostCount) % m_ghostCapacity] = key;
+    m_ghostCounts[getBucket(key)]++;
+    m_ghostCount++;
+}
+
+bool MediaCacheTwoQueueList::isProbationOverTarget() const
+{
+    unsigned probationCount = m_probation.getSize();
+    unsigned totalCount = probationCount + WeightedLRUList::getSize();
+    return probationCount * 100 > totalCount * kProbationTargetPercent;
+}
+
+void MediaCacheTwoQueueList::insert(Node * node)
+{
+    MediaCacheEntry * entry = static_cast<MediaCacheEntry *>(node);
+    assert(entry->queue == kCache2QQueue_None);
+
+    // The entry was already listed with its current contents, so this is a hit.
+    bool isHit = entry->isValid && !entry->isQueueNew;
+
+    if (!entry->isValid)
+    {
+        // Invalid entries go to the head of probation, to be reused first. Whatever
+        // ends up in the entry next is new to the cache.
+        entry->homeQueue = kCache2QQueue_Probation;
+        entry->isQueueNew = 1;
+    }
+    else if (entry->isQueueNew)
+    {
+        // The entry was just loaded. It only bypasses probation if the sector was
+        // evicted from probation recently, or if the caller says it is important.
+        if (entry->weight > m_minWeight || isGhost(getKey(entry)))
+        {
+            entry->homeQueue = kCache2QQueue_Main;
+        }
+        else
+        {
+            entry->homeQueue = kCache2QQueue_Probation;
+        }
+        entry->isQueueNew = 0;
+    }
+
+    if (entry->homeQueue == kCache2QQueue_Main)
+    {
+        WeightedLRUList::insert(node);
+    }
+    else if (isHit)
+    {
+        // Probation is a FIFO, so a hit leaves the entry where it was.
+        m_probation.reinsert(node);
+    }
+    else
+    {
+        m_probation.insert(node);
+    }
+    entry->queue = entry->homeQueue;
+}
+
+WeightedLRUList::Node * MediaCacheTwoQueueList::select()
+{
+    MediaCacheEntry * entry = static_cast<MediaCacheEntry *>(m_probation.getHead());
+
+    // Take from probation if it has an invalid entry waiting to be reused, if it is
+    // over its target size, or if the main queue is empty.
+    if (!entry || (entry->isValid && !isProbationOverTarget() && !WeightedLRUList::isEmpty()))
+    {
+        entry = static_cast<MediaCacheEntry *>(WeightedLRUList::getHead());
+    }
+
+    if (!entry)
+    {
+        return NULL;
+    }
+
+    // Sectors that were only ever on probation are remembered by the ghost list.
+    if (entry->queue == kCache2QQueue_Probation)
+    {
+        m_probation.remove(entry);
+        if (entry->isValid)
+        {
+            addGhost(getKey(entry));
+        }
+    }
+    else
+    {
+        WeightedLRUList::remove(entry);
+    }
+
+    entry->queue = kCache2QQueue_None;
+    entry->isQueueNew = 1;
+
+    return entry;
+}
+
+void MediaCacheTwoQueueList::deselect(Node * node)
+{
+    MediaCacheEntry * entry = static_cast<MediaCacheEntry *>(node);
+    assert(entry->queue == kCache2QQueue_None);
+
+    // The entry goes back to the head of the queue it came from, with its contents
+    // no longer treated as new.
+    if (entry->homeQueue == kCache2QQueue_Main)
+    {
+        WeightedLRUList::deselect(node);
+    }
+    else
+    {
+        entry->homeQueue = kCache2QQueue_Probation;
+        m_probation.deselect(node);
+    }
+    entry->queue = entry->homeQueue;
+    entry->isQueueNew = 0;
+}
+
+void MediaCacheTwoQueueList::remove(Node * node)
+{
+    MediaCacheEntry * entry = static_cast<MediaCacheEntry *>(node);
+
+    // Entries that are already off the lists are ignored.
+    if (entry->queue == kCache2QQueue_Main)
+    {
+        WeightedLRUList::remove(node);
+    }
+    else if (entry->queue == kCache2QQueue_Probation)
+    {
+        m_probation.remove(node);
+    }
+    entry->queue = kCache2QQueue_None;
+}
+
+bool MediaCacheTwoQueueList::isEmpty() const
+{
+    return WeightedLRUList::isEmpty() && m_probation.isEmpty();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
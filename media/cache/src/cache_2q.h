@@ -0,0 +1,140 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \file cache_2q.h
+//! \ingroup media_cache_internal
+//! \brief Declaration of the 2Q replacement policy for the media cache.
+////////////////////////////////////////////////////////////////////////////////
+#if !defined(__cache_2q_h__)
+#define __cache_2q_h__
+
+#include "wlru.h"
+
+struct MediaCacheEntry;
+
+////////////////////////////////////////////////////////////////////////////////
+// Definitions
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Values for the queue fields of a cache entry used by the 2Q policy.
+enum cache_2q_queues
+{
+    kCache2QQueue_None = 0,     //!< The entry is not linked into either queue.
+    kCache2QQueue_Probation,    //!< The FIFO queue for sectors seen only once recently.
+    kCache2QQueue_Main          //!< The LRU queue for sectors that have proven to be reused.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Classes
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief Scan resistant replacement list using the 2Q algorithm.
+ *
+ * Sectors loaded into the cache for the first time go into a small probation
+ * queue. When they are evicted from it, their keys are remembered in a ghost
+ * list that holds no data. A sector that misses again while its key is still in
+ * the ghost list has shown that it is reused over a longer period, so it is
+ * admitted to the main queue. Repeated hits on an entry in the probation queue,
+ * such as a series of nominal sector reads of one native sector, don't count.
+ * A long sequential read therefore only ever cycles through the probation queue,
+ * and leaves the hot FAT and directory sectors in the main queue alone.
+ *
+ * The probation queue is a FIFO. An entry that is hit while on probation goes back
+ * to the place it had before it was taken out of the queue for the access, so a
+ * sector leaves probation a fixed number of loads after it came in, no matter how
+ * often it was used in the meantime.
+ *
+ * Victims are taken from the probation queue while it holds more than its
+ * target share of the entries, and from the main queue otherwise. Invalid
+ * entries are always put at the head of the probation queue so they are reused
+ * first, just like in the plain LRU list.
+ *
+ * Weights are honored in two ways. An entry loaded with any weight above the
+ * minimum skips probation and goes directly into the main queue, and insertions
+ * into the main queue use the same weighted placement as WeightedLRUList. The
+ * main queue is the base list, and the probation queue is a second, unweighted
+ * list.
+ *
+ * Which queue an entry belongs to is tracked in fields of MediaCacheEntry, so
+ * this class can only hold cache entries.
+ *
+ * \ingroup media_cache_internal
+ */
+class MediaCacheTwoQueueList : public WeightedLRUList
+{
+public:
+    //! \brief Constructor.
+    //! \param minWeight Lowest entry weight. Entries with this weight start out on probation.
+    //! \param maxWeight Highest entry weight.
+    //! \param windowSize Weighting window of the main queue. Pass 0 to disable weighting.
+    //! \param ghostCapacity Number of keys of evicted entries remembered by the ghost list.
+    MediaCacheTwoQueueList(int minWeight, int maxWeight, unsigned windowSize, unsigned ghostCapacity);
+
+    //! \brief Destructor.
+    virtual ~MediaCacheTwoQueueList();
+
+    //! \brief Returns whether the ghost list was successfully allocated.
+    bool isValid() const { return m_ghostKeys != NULL && m_ghostCounts != NULL; }
+
+    //! \brief Changes the number of keys the ghost list remembers.
+    //!
+    //! The most recently added keys are kept. If the new ghost list cannot be
+    //! allocated, the old one is left in place.
+    //!
+    //! \param ghostCapacity New number of keys. A value of 0 is treated as 1.
+    //! \retval true The ghost list was resized.
+    //! \retval false There was not enough memory.
+    bool setGhostCapacity(unsigned ghostCapacity);
+
+    //! \name List operations
+    //@{
+    virtual void insert(Node * node);
+    virtual Node * select();
+    virtual void deselect(Node * node);
+    virtual void remove(Node * node);
+    virtual bool isEmpty() const;
+    //@}
+
+protected:
+    WeightedLRUList m_probation;    //!< The probation queue.
+    int m_minWeight;                //!< Minimum entry weight.
+    uint32_t * m_ghostKeys;         //!< Ring buffer of the keys in the ghost list, oldest first.
+    unsigned m_ghostCapacity;       //!< Number of elements in \a m_ghostKeys.
+    unsigned m_ghostHead;           //!< Index of the oldest key in \a m_ghostKeys.
+    unsigned m_ghostCount;          //!< Number of keys in the ghost list.
+    uint16_t * m_ghostCounts;       //!< Number of ghost keys that hash to each bucket.
+    unsigned m_ghostShift;          //!< Right shift applied to a hash product to get a bucket.
+
+    //! \brief Returns the ghost list key for an entry.
+    static uint32_t getKey(const MediaCacheEntry * entry);
+
+    //! \brief Returns the ghost bucket for a key.
+    inline unsigned getBucket(uint32_t key) const
+    {
+        return static_cast<uint32_t>(key * 0x9e3779b1U) >> m_ghostShift;
+    }
+
+    //! \brief Adds a key to the ghost list, dropping the oldest one if it is full.
+    void addGhost(uint32_t key);
+
+    //! \brief Returns whether a key may be in the ghost list.
+    bool isGhost(uint32_t key) const { return m_ghostCounts[getBucket(key)] != 0; }
+
+    //! \brief Returns whether the probation queue should give up the next victim.
+    bool isProbationOverTarget() const;
+};
+
+#endif // __cache_2q_h__
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
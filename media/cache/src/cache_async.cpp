@@ -0,0 +1,384 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \addtogroup media_cache_internal
+//! @{
+//! \file cache_async.cpp
+//! \brief Asynchronous media cache reads, served by the cache I/O thread.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "cacheutil.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+static void cache_async_Thread(uint32_t arg);
+static RtStatus_t cache_async_Start();
+static RtStatus_t cache_async_Queue(const MediaCacheParamBlock_t * pb, unsigned nativeSector, MediaCacheReadCallback_t callback, void * refcon);
+static void cache_async_Append(MediaCacheAsyncRequest * request);
+static void cache_async_Complete(MediaCacheAsyncRequest * request, RtStatus_t status);
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+void cache_async_Init()
+{
+    MediaCacheAsyncReader & async = g_mediaCacheContext.async;
+
+    memset(&async, 0, sizeof(async));
+
+    for (unsigned i = 0; i < CACHE_ASYNC_REQUEST_COUNT; ++i)
+    {
+        async.requests[i].next = async.freeHead;
+        async.freeHead = &async.requests[i];
+    }
+}
+
+//! \pre The context mutex must be locked.
+static RtStatus_t cache_async_Start()
+{
+    MediaCacheAsyncReader & async = g_mediaCacheContext.async;
+
+    // The semaphores live until the cache is shut down.
+    if (!async.isSemCreated)
+    {
+        RtStatus_t status = os_thi_ConvertTxStatus(tx_semaphore_create(&async.wakeSem, "mc:io", 0));
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+        status = os_thi_ConvertTxStatus(tx_semaphore_create(&async.exitSem, "mc:io:exit", 0));
+        if (status != SUCCESS)
+        {
+            tx_semaphore_delete(&async.wakeSem);
+            return status;
+        }
+        async.isSemCreated = true;
+    }
+
+    async.shouldExit = false;
+
+    os_txi_ThreadAllocate(&async.thread,
+        "mc:io",
+        cache_async_Thread,
+        0,
+        DMI_MEM_SOURCE_DONTCARE,
+        CACHE_IO_STACK_SIZE,
+        CACHE_IO_PRIORITY,
+        CACHE_IO_PRIORITY,
+        TX_NO_TIME_SLICE,
+        TX_AUTO_START);
+    if (!async.thread)
+    {
+        return ERROR_GENERIC;   //! \todo Better error!
+    }
+
+    return SUCCESS;
+}
+
+//! The semaphore is put once for every queued request before the exit request, so the
+//! thread completes the whole queue before it sees the exit flag.
+//!
+//! \pre No shard may be locked by the caller, since the I/O thread may be waiting for
+//!     a shard lock.
+void cache_async_Stop()
+{
+    MediaCacheAsyncReader & async = g_mediaCacheContext.async;
+
+    if (!async.thread)
+    {
+        return;
+    }
+
+    async.shouldExit = true;
+    tx_semaphore_put(&async.wakeSem);
+    tx_semaphore_get(&async.exitSem, TX_WAIT_FOREVER);
+
+    os_txi_ThreadRelease(async.thread);
+    async.thread = NULL;
+}
+
+//! A request for a sector that is already queued or being loaded is chained to the
+//! request loading it, behind any other waiters, so callbacks are invoked in the order
+//! the reads were made.
+//!
+//! \retval SUCCESS The request was queued.
+//! \retval ERROR_DDI_MEDIA_CACHE_QUEUE_FULL No request is free.
+//!
+//! \pre No shard may be locked by the caller, following the lock order.
+static RtStatus_t cache_async_Queue(const MediaCacheParamBlock_t * pb, unsigned nativeSector, MediaCacheReadCallback_t callback, void * refcon)
+{
+    MediaCacheAsyncReader & async = g_mediaCacheContext.async;
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    if (!async.thread)
+    {
+        RtStatus_t status = cache_async_Start();
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    MediaCacheAsyncRequest * request = async.freeHead;
+    if (!request)
+    {
+        return ERROR_DDI_MEDIA_CACHE_QUEUE_FULL;
+    }
+    async.freeHead = request->next;
+
+    request->pb = *pb;
+    request->callback = callback;
+    request->refcon = refcon;
+    request->nativeSector = nativeSector;
+    request->readAheadCount = 0;
+    request->next = NULL;
+    request->nextWaiter = NULL;
+
+    // Look for a load of the same sector, starting with the one in progress.
+    MediaCacheAsyncRequest * loader = async.active;
+    if (!loader || loader->pb.drive != pb->drive || loader->nativeSector != nativeSector)
+    {
+        for (loader = async.queueHead; loader; loader = loader->next)
+        {
+            if (loader->pb.drive == pb->drive && loader->nativeSector == nativeSector)
+            {
+                break;
+            }
+        }
+    }
+
+    if (loader)
+    {
+        while (loader->nextWaiter)
+        {
+            loader = loader->nextWaiter;
+        }
+        loader->nextWaiter = request;
+        return SUCCESS;
+    }
+
+    cache_async_Append(request);
+
+    return SUCCESS;
+}
+
+//! The fill is queued behind the reads already waiting, and a read of \a startSector
+//! made while it is queued waits for it rather than loading the sector itself.
+//!
+//! \retval SUCCESS The fill was queued.
+//! \retval ERROR_DDI_MEDIA_CACHE_QUEUE_FULL No request is free.
+//!
+//! \pre The caller may hold the drive's shard lock, since the context mutex is taken
+//!     after shard locks.
+RtStatus_t cache_async_QueueReadAhead(DriveTag_t drive, unsigned startSector, unsigned count)
+{
+    MediaCacheAsyncReader & async = g_mediaCacheContext.async;
+
+    assert(count > 0);
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    if (!async.thread)
+    {
+        RtStatus_t status = cache_async_Start();
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    MediaCacheAsyncRequest * request = async.freeHead;
+    if (!request)
+    {
+        return ERROR_DDI_MEDIA_CACHE_QUEUE_FULL;
+    }
+    async.freeHead = request->next;
+
+    memset(&request->pb, 0, sizeof(request->pb));
+    request->pb.drive = drive;
+    request->callback = NULL;
+    request->refcon = NULL;
+    request->nativeSector = startSector;
+    request->readAheadCount = count;
+    request->next = NULL;
+    request->nextWaiter = NULL;
+
+    cache_async_Append(request);
+
+    return SUCCESS;
+}
+
+//! \pre The context mutex must be locked.
+static void cache_async_Append(MediaCacheAsyncRequest * request)
+{
+    MediaCacheAsyncReader & async = g_mediaCacheContext.async;
+
+    if (async.queueTail)
+    {
+        async.queueTail->next = request;
+    }
+    else
+    {
+        async.queueHead = request;
+    }
+    async.queueTail = request;
+
+    tx_semaphore_put(&async.wakeSem);
+}
+
+//! The request is returned to the pool before the callback is invoked, so the callback
+//! can make another asynchronous read even when every request was in use. Read-ahead
+//! fills have no callback.
+//!
+//! \pre No cache lock may be held.
+static void cache_async_Complete(MediaCacheAsyncRequest * request, RtStatus_t status)
+{
+    MediaCacheParamBlock_t pb = request->pb;
+    MediaCacheReadCallback_t callback = request->callback;
+    void * refcon = request->refcon;
+
+    {
+        SimpleMutex lockContext(g_mediaCacheContext.mutex);
+        request->next = g_mediaCacheContext.async.freeHead;
+        g_mediaCacheContext.async.freeHead = request;
+    }
+
+    if (callback)
+    {
+        callback(status, &pb, refcon);
+    }
+}
+
+//! \param arg Unused.
+static void cache_async_Thread(uint32_t arg)
+{
+    MediaCacheAsyncReader & async = g_mediaCacheContext.async;
+
+    while (true)
+    {
+        tx_semaphore_get(&async.wakeSem, TX_WAIT_FOREVER);
+
+        // Take the oldest request off the queue. It keeps gaining waiters while it loads.
+        MediaCacheAsyncRequest * request;
+        {
+            SimpleMutex lockContext(g_mediaCacheContext.mutex);
+            request = async.queueHead;
+            if (request)
+            {
+                async.queueHead = request->next;
+                if (!async.queueHead)
+                {
+                    async.queueTail = NULL;
+                }
+                async.active = request;
+            }
+        }
+
+        if (!request)
+        {
+            if (async.shouldExit)
+            {
+                break;
+            }
+            continue;
+        }
+
+        RtStatus_t status = SUCCESS;
+        if (request->readAheadCount)
+        {
+            cache_CompleteReadAhead(request->pb.drive, request->nativeSector, request->readAheadCount);
+        }
+        else
+        {
+            status = media_cache_read(&request->pb);
+        }
+
+        // No more waiters can be added once the request is no longer active.
+        MediaCacheAsyncRequest * waiter;
+        {
+            SimpleMutex lockContext(g_mediaCacheContext.mutex);
+            async.active = NULL;
+            waiter = request->nextWaiter;
+        }
+
+        cache_async_Complete(request, status);
+
+        // Each waiter makes its own read with its own param block, which finds the entry
+        // that was just loaded unless it has been evicted again already.
+        while (waiter)
+        {
+            MediaCacheAsyncRequest * nextWaiter = waiter->nextWaiter;
+            cache_async_Complete(waiter, media_cache_read(&waiter->pb));
+            waiter = nextWaiter;
+        }
+    }
+
+    tx_semaphore_put(&async.exitSem);
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_read_async(MediaCacheParamBlock_t * pb, MediaCacheReadCallback_t callback, void * refcon)
+{
+    RtStatus_t status;
+
+    assert(g_mediaCacheContext.isInited);
+    assert(pb->requestSectorCount > 0);
+    assert(callback);
+
+    // Check the request and find the native sector it needs.
+    unsigned nativeSector;
+    unsigned subsectorOffset;
+    status = cache_AdjustAndConvertSector(pb, &nativeSector, &subsectorOffset, NULL);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    // Get the drive's shard, which may be assigned now if the drive is new to the cache.
+    MediaCacheShard * shard;
+    status = cache_GetShard(pb->drive, &shard);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    // A sector the cache can supply without reading media is read right away. The
+    // shard stays locked across the read so the entry can't be evicted in between.
+    MediaCacheParamBlock_t result = *pb;
+    bool isCached;
+    {
+        MediaCacheLock lockCache(shard);
+
+        isCached = cache_index_LookupSectorEntry(pb->drive, nativeSector) || cache_zero_Contains(shard, nativeSector);
+        if (isCached)
+        {
+            status = media_cache_read(&result);
+        }
+    }
+
+    if (isCached)
+    {
+        callback(status, &result, refcon);
+        return SUCCESS;
+    }
+
+    return cache_async_Queue(pb, nativeSector, callback, refcon);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
+//! @}
@@ -0,0 +1,147 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \file cache_index.cpp
+//! \ingroup media_cache_internal
+//! \brief Implementation of the hashed sector index for the media cache.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "cacheutil.h"
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+MediaCacheIndex::MediaCacheIndex(MediaCacheEntry * entries, unsigned entryCount)
+:   m_entries(entries),
+    m_slots(NULL),
+    m_mask(0),
+    m_shift(0),
+    m_count(0)
+{
+    // The slot stores entry indices in 16 bits, with one value reserved for empty slots.
+    // This is the same limit imposed by the entry index field of cache tokens.
+    assert(entryCount < kEmptySlot);
+
+    // Pick a power of two table size that keeps the load factor at or below one half.
+    unsigned bits = 3;
+    while ((1U << bits) < entryCount * 2)
+    {
+        ++bits;
+    }
+    unsigned tableSize = 1U << bits;
+    m_mask = tableSize - 1;
+    m_shift = 32 - bits;
+
+    m_slots = (Slot *)malloc(tableSize * sizeof(Slot));
+    if (m_slots)
+    {
+        for (unsigned i = 0; i < tableSize; ++i)
+        {
+            m_slots[i].entryIndex = kEmptySlot;
+        }
+    }
+}
+
+MediaCacheIndex::~MediaCacheIndex()
+{
+    if (m_slots)
+    {
+        free(m_slots);
+    }
+}
+
+int MediaCacheIndex::findSlot(unsigned drive, unsigned sector) const
+{
+    unsigned i = hash(drive, sector);
+
+    // The table is never more than half full, so there is always an empty slot to stop on.
+    while (m_slots[i].entryIndex != kEmptySlot)
+    {
+        if (m_slots[i].sector == sector && m_slots[i].drive == drive)
+        {
+            return i;
+        }
+
+        i = (i + 1) & m_mask;
+    }
+
+    return -1;
+}
+
+MediaCacheEntry * MediaCacheIndex::find(unsigned drive, unsigned sector) const
+{
+    int i = findSlot(drive, sector);
+    if (i < 0)
+    {
+        return NULL;
+    }
+
+    return &m_entries[m_slots[i].entryIndex];
+}
+
+void MediaCacheIndex::insert(MediaCacheEntry * entry)
+{
+    assert(findSlot(entry->drive, entry->sector) < 0);
+
+    unsigned i = hash(entry->drive, entry->sector);
+    while (m_slots[i].entryIndex != kEmptySlot)
+    {
+        i = (i + 1) & m_mask;
+    }
+
+    m_slots[i].sector = entry->sector;
+    m_slots[i].drive = entry->drive;
+    m_slots[i].entryIndex = entry->getArrayIndex(m_entries);
+    ++m_count;
+}
+
+void MediaCacheIndex::remove(MediaCacheEntry * entry)
+{
+    int found = findSlot(entry->drive, entry->sector);
+    assert(found >= 0);
+    if (found < 0)
+    {
+        return;
+    }
+    assert(&m_entries[m_slots[found].entryIndex] == entry);
+
+    // Backward shift deletion. Walk the cluster following the hole, and move back into the
+    // hole any slot whose home position is not between the hole and its current position.
+    // This keeps every remaining key reachable from its home slot without tombstones.
+    unsigned hole = found;
+    unsigned i = hole;
+    while (true)
+    {
+        i = (i + 1) & m_mask;
+        if (m_slots[i].entryIndex == kEmptySlot)
+        {
+            break;
+        }
+
+        unsigned home = hash(m_slots[i].drive, m_slots[i].sector);
+        bool homeInRange = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!homeInRange)
+        {
+            m_slots[hole] = m_slots[i];
+            hole = i;
+        }
+    }
+
+    m_slots[hole].entryIndex = kEmptySlot;
+    --m_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,116 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \file cache_index.h
+//! \ingroup media_cache_internal
+//! \brief Declaration of the hashed sector index for the media cache.
+////////////////////////////////////////////////////////////////////////////////
+#if !defined(__cache_index_h__)
+#define __cache_index_h__
+
+extern "C" {
+#include "types.h"
+}
+
+struct MediaCacheEntry;
+
+////////////////////////////////////////////////////////////////////////////////
+// Classes
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief Hash table mapping a drive and native sector pair to a cache entry.
+ *
+ * The index is an open addressing table with linear probing. Each slot holds
+ * a copy of the key along with the array index of the cache entry, so a
+ * lookup only touches the slot array and never dereferences an entry that
+ * does not match. Removal uses backward shift deletion, so no tombstones are
+ * ever left behind and probe sequences stay short no matter how many
+ * evictions have taken place.
+ *
+ * The table is sized once, when the cache is initialized, to at least twice
+ * the number of cache entries rounded up to a power of two. Because only valid
+ * cache entries are ever inserted, the load factor can never exceed one half
+ * and the table never needs to grow.
+ *
+ * Like the rest of the media cache, the index is not thread safe by itself.
+ * The cache mutex must be held across all calls.
+ *
+ * \ingroup media_cache_internal
+ */
+class MediaCacheIndex
+{
+public:
+    //! \brief Constructor.
+    //! \param entries The array of cache entries that will be indexed.
+    //! \param entryCount Number of elements in \a entries.
+    MediaCacheIndex(MediaCacheEntry * entries, unsigned entryCount);
+
+    //! \brief Destructor.
+    ~MediaCacheIndex();
+
+    //! \brief Returns whether the slot array was successfully allocated.
+    bool isValid() const { return m_slots != NULL; }
+
+    //! \brief Look up the entry for a sector.
+    //! \return The cache entry holding \a sector of \a drive, or NULL if there is none.
+    MediaCacheEntry * find(unsigned drive, unsigned sector) const;
+
+    //! \brief Add a cache entry, using its current drive and sector as the key.
+    //! \pre No other entry with the same key is in the index.
+    void insert(MediaCacheEntry * entry);
+
+    //! \brief Remove a cache entry.
+    //! \pre The entry's drive and sector fields must not have changed since it was inserted.
+    void remove(MediaCacheEntry * entry);
+
+    //! \brief Returns the number of entries currently in the index.
+    unsigned getCount() const { return m_count; }
+
+protected:
+
+    //! \brief One slot of the hash table.
+    struct Slot
+    {
+        uint32_t sector;    //!< Native sector number of the entry.
+        uint8_t drive;      //!< Drive tag of the entry.
+        uint8_t _pad;       //!< Unused.
+        uint16_t entryIndex;    //!< Index into the entry array, or #kEmptySlot.
+    };
+
+    //! Value of Slot::entryIndex for an unused slot.
+    static const uint16_t kEmptySlot = 0xffff;
+
+    MediaCacheEntry * m_entries;    //!< Base of the indexed entry array.
+    Slot * m_slots;     //!< The hash table.
+    unsigned m_mask;    //!< Table size minus one. The table size is always a power of two.
+    unsigned m_shift;   //!< Right shift applied to the hash product to get a slot number.
+    unsigned m_count;   //!< Number of occupied slots.
+
+    //! \brief Compute the home slot for a key.
+    //!
+    //! Uses Fibonacci hashing, taking the high bits of the product, so that runs of
+    //! sequential sectors are spread across the table rather than clustered.
+    inline unsigned hash(unsigned drive, unsigned sector) const
+    {
+        uint32_t key = sector ^ (static_cast<uint32_t>(drive) << 24);
+        return static_cast<uint32_t>(key * 0x9e3779b1U) >> m_shift;
+    }
+
+    //! \brief Returns the slot holding the given key, or -1 if there is none.
+    int findSlot(unsigned drive, unsigned sector) const;
+};
+
+#endif // __cache_index_h__
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \addtogroup media_cache_internal
+//! @{
+//! \file cache_latency.cpp
+//! \brief Latency histograms of the media cache operations.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "cacheutil.h"
+#include <algorithm>
+#include "arm_ghs.h" // for __CLZ32
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Returns the histogram bucket for a latency.
+static inline unsigned cache_latency_GetBucket(uint32_t microseconds)
+{
+    if (microseconds == 0)
+    {
+        return 0;
+    }
+
+    unsigned bucket = 32 - __CLZ32(microseconds);
+    return bucket < MEDIA_CACHE_LATENCY_BUCKET_COUNT ? bucket : MEDIA_CACHE_LATENCY_BUCKET_COUNT - 1;
+}
+
+//! Records are made by every cache operation, so this only takes a few instructions
+//! with interrupts disabled instead of locking anything.
+void cache_latency_Record(MediaCacheShard * shard, MediaCacheLatencyOp_t op, uint64_t microseconds)
+{
+    uint32_t latency = microseconds > 0xffffffffULL ? 0xffffffff : static_cast<uint32_t>(microseconds);
+    unsigned bucket = cache_latency_GetBucket(latency);
+    MediaCacheLatencyHistogram_t & histogram = shard->latency[op];
+
+    // Disable interrupts while modifying the counts.
+    bool irqState = hw_core_EnableIrqInterrupt(false);
+
+    histogram.count++;
+    histogram.totalMicroseconds += latency;
+    if (latency > histogram.maxMicroseconds)
+    {
+        histogram.maxMicroseconds = latency;
+    }
+    histogram.buckets[bucket]++;
+
+    hw_core_EnableIrqInterrupt(irqState);
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_get_latency(uint8_t drive, MediaCacheLatencyOp_t op, MediaCacheLatencyHistogram_t * histogram)
+{
+    assert(g_mediaCacheContext.isInited);
+    assert(histogram);
+
+    if (op >= kMediaCacheLatencyOpCount)
+    {
+        return ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER;
+    }
+
+    MediaCacheShard * shard = cache_FindShard(drive);
+    if (!shard)
+    {
+        memset(histogram, 0, sizeof(*histogram));
+        return SUCCESS;
+    }
+
+    // Copy with interrupts disabled so the counts agree with each other.
+    bool irqState = hw_core_EnableIrqInterrupt(false);
+    *histogram = shard->latency[op];
+    hw_core_EnableIrqInterrupt(irqState);
+
+    return SUCCESS;
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_get_latency_percentile(uint8_t drive, MediaCacheLatencyOp_t op, uint32_t permille, uint32_t * microseconds)
+{
+    assert(microseconds);
+
+    if (permille > 1000)
+    {
+        return ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER;
+    }
+
+    MediaCacheLatencyHistogram_t histogram;
+    RtStatus_t status = media_cache_get_latency(drive, op, &histogram);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    *microseconds = 0;
+    if (histogram.count == 0)
+    {
+        return SUCCESS;
+    }
+
+    // Find the bucket holding the operation at the requested rank, counting from one.
+    uint64_t rank = (static_cast<uint64_t>(histogram.count) * permille + 999) / 1000;
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    unsigned bucket;
+    for (bucket = 0; bucket < MEDIA_CACHE_LATENCY_BUCKET_COUNT - 1; ++bucket)
+    {
+        seen += histogram.buckets[bucket];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+
+    // Bucket n holds latencies below 2^n microseconds. The last one has no upper bound.
+    uint32_t upperBound = bucket < MEDIA_CACHE_LATENCY_BUCKET_COUNT - 1 ? (1U << bucket) - 1 : histogram.maxMicroseconds;
+    *microseconds = std::min(upperBound, histogram.maxMicroseconds);
+
+    return SUCCESS;
+}
+
+// See media_cache.h for the documentation of this function.
+void media_cache_reset_latency(uint8_t drive)
+{
+    assert(g_mediaCacheContext.isInited);
+
+    MediaCacheShard * shard = cache_FindShard(drive);
+    if (!shard)
+    {
+        return;
+    }
+
+    bool irqState = hw_core_EnableIrqInterrupt(false);
+    memset(shard->latency, 0, sizeof(shard->latency));
+    hw_core_EnableIrqInterrupt(irqState);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
+//! @}
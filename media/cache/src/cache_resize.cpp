@@ -0,0 +1,592 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \addtogroup media_cache_internal
+//! @{
+//! \file cache_resize.cpp
+//! \brief Runtime resizing of the media cache, and estimates of the hits a larger cache would get.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "cacheutil.h"
+#include <stdlib.h>
+#include <algorithm>
+#include "os/dmi/os_dmi_api.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants
+////////////////////////////////////////////////////////////////////////////////
+
+//! Value of an unused slot in the ghost list. Index keys are never negative.
+const int64_t kEmptyGhostKey = -1;
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+static RtStatus_t cache_resize_AddEntry(unsigned entryIndex);
+static void cache_resize_FreeBuffer(unsigned entryIndex);
+static RtStatus_t cache_resize_WaitForOwners(unsigned firstEntry);
+static void cache_resize_Unlist(MediaCacheEntry * entry);
+static void cache_resize_Relist(MediaCacheEntry * entry);
+static MediaCacheEntry * cache_resize_TakeClean(MediaCacheShard * shard);
+static MediaCacheEntry * cache_resize_SelectVictim();
+static void cache_resize_MoveEntry(MediaCacheEntry * from, MediaCacheEntry * to);
+static RtStatus_t cache_resize_RetireEntry(MediaCacheEntry * entry);
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+//! The table of grown entry buffers has a slot for every descriptor after those of
+//! the initial entries. The ghost list is left empty if #CACHE_GHOST_COUNT is 0.
+//!
+//! \retval SUCCESS The state was allocated.
+//! \retval ERROR_OS_MEMORY_MANAGER_NOMEMORY There was not enough memory.
+RtStatus_t cache_InitResizing()
+{
+    unsigned extraCount = g_mediaCacheContext.entryCapacity - g_mediaCacheContext.initialEntryCount;
+    g_mediaCacheContext.extraBuffers = NULL;
+    if (extraCount)
+    {
+        g_mediaCacheContext.extraBuffers = (void **)malloc(extraCount * sizeof(void *));
+        if (!g_mediaCacheContext.extraBuffers)
+        {
+            return ERROR_OS_MEMORY_MANAGER_NOMEMORY;
+        }
+        memset(g_mediaCacheContext.extraBuffers, 0, extraCount * sizeof(void *));
+    }
+
+    MediaCacheGhostList & ghosts = g_mediaCacheContext.ghosts;
+    memset(&ghosts, 0, sizeof(ghosts));
+    if (CACHE_GHOST_COUNT)
+    {
+        ghosts.keys = (int64_t *)malloc(CACHE_GHOST_COUNT * sizeof(int64_t));
+        ghosts.hits = (uint32_t *)malloc(CACHE_GHOST_COUNT * sizeof(uint32_t));
+        if (!ghosts.keys || !ghosts.hits)
+        {
+            return ERROR_OS_MEMORY_MANAGER_NOMEMORY;
+        }
+
+        ghosts.capacity = CACHE_GHOST_COUNT;
+        std::fill(ghosts.keys, ghosts.keys + ghosts.capacity, kEmptyGhostKey);
+        memset(ghosts.hits, 0, ghosts.capacity * sizeof(uint32_t));
+    }
+
+    return SUCCESS;
+}
+
+//! \pre All shards and the context mutex must be locked.
+void cache_DisposeResizing()
+{
+    for (unsigned i = g_mediaCacheContext.initialEntryCount; i < g_mediaCacheContext.entryCount; ++i)
+    {
+        cache_resize_FreeBuffer(i);
+    }
+    free(g_mediaCacheContext.extraBuffers);
+    g_mediaCacheContext.extraBuffers = NULL;
+
+    MediaCacheGhostList & ghosts = g_mediaCacheContext.ghosts;
+    free(ghosts.keys);
+    free(ghosts.hits);
+    memset(&ghosts, 0, sizeof(ghosts));
+}
+
+//! The max chained entries is never greater than half the total number of entries.
+//! If the chain can encompass the all entries, then we can end up in a deadlock in
+//! the SCSI code that overlaps two reads or two pinned writes in a single thread. We
+//! subtract 1 from the value because the chain always includes the base entry but
+//! the max entries count does not.
+void cache_UpdateMaxChainedEntries()
+{
+    g_mediaCacheContext.maxChainedEntries = std::min<unsigned>(CACHE_MAX_CHAINED_ENTRIES, g_mediaCacheContext.entryCount / 2);
+    if (g_mediaCacheContext.maxChainedEntries > 0)
+    {
+        g_mediaCacheContext.maxChainedEntries--;
+    }
+}
+
+//! \param entry A valid entry whose sector is leaving the cache to make room for another.
+//!
+//! \pre The context mutex may or may not be held by the caller.
+void cache_ghost_AddEvicted(const MediaCacheEntry * entry)
+{
+    MediaCacheGhostList & ghosts = g_mediaCacheContext.ghosts;
+    if (!ghosts.capacity)
+    {
+        return;
+    }
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    ghosts.keys[ghosts.next] = cache_BuildIndexKey(entry->drive, entry->sector);
+    ghosts.next = (ghosts.next + 1) % ghosts.capacity;
+}
+
+//! The ring is searched from the newest key back, so the position where the key is
+//! found is the number of sectors evicted after it. The key is cleared once found, since
+//! the sector is about to be cached again.
+//!
+//! \param drive Tag of the drive that missed.
+//! \param sector Native sector that missed.
+void cache_ghost_CheckMiss(DriveTag_t drive, unsigned sector)
+{
+    MediaCacheGhostList & ghosts = g_mediaCacheContext.ghosts;
+    if (!ghosts.capacity)
+    {
+        return;
+    }
+
+    int64_t key = cache_BuildIndexKey(drive, sector);
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    ghosts.missCount++;
+
+    unsigned slot = ghosts.next;
+    for (unsigned distance = 0; distance < ghosts.capacity; ++distance)
+    {
+        slot = (slot ? slot : ghosts.capacity) - 1;
+        if (ghosts.keys[slot] == key)
+        {
+            ghosts.hits[distance]++;
+            ghosts.keys[slot] = kEmptyGhostKey;
+            break;
+        }
+    }
+}
+
+//! \brief Construct an entry that is not in use, allocating a buffer for it.
+//!
+//! \param entryIndex Index of the descriptor, which must not be in use and must come
+//!     after the initial entries, since the cache never shrinks below those.
+//! \retval SUCCESS The entry was constructed and is not in any list yet.
+//! \retval ERROR_OS_MEMORY_MANAGER_NOMEMORY The buffer could not be allocated.
+static RtStatus_t cache_resize_AddEntry(unsigned entryIndex)
+{
+    assert(entryIndex >= g_mediaCacheContext.initialEntryCount);
+    MediaCacheEntry * entry = &g_mediaCacheContext.entries[entryIndex];
+
+    unsigned bufferSize = g_mediaCacheContext.entryBufferSize;
+    uint8_t * block = (uint8_t *)os_dmi_malloc_phys_contiguous(bufferSize);
+    uint8_t * buffer = block;
+
+    // The buffer must be aligned to a data cache line. If it isn't, allocate one
+    // line more and align it by hand.
+    if (block && ((uint32_t)block & (BUFFER_CACHE_LINE_MULTIPLE - 1)) != 0)
+    {
+        free(block);
+        block = (uint8_t *)os_dmi_malloc_phys_contiguous(bufferSize + BUFFER_CACHE_LINE_MULTIPLE);
+        buffer = (uint8_t *)(((uint32_t)block + (BUFFER_CACHE_LINE_MULTIPLE - 1)) & ~(BUFFER_CACHE_LINE_MULTIPLE - 1));
+    }
+
+    if (!block)
+    {
+        return ERROR_OS_MEMORY_MANAGER_NOMEMORY;
+    }
+
+    g_mediaCacheContext.extraBuffers[entryIndex - g_mediaCacheContext.initialEntryCount] = block;
+    new(entry) MediaCacheEntry(buffer);
+
+    return SUCCESS;
+}
+
+//! \brief Free the buffer of an entry that was allocated by resizing.
+static void cache_resize_FreeBuffer(unsigned entryIndex)
+{
+    assert(entryIndex >= g_mediaCacheContext.initialEntryCount);
+
+    void *& block = g_mediaCacheContext.extraBuffers[entryIndex - g_mediaCacheContext.initialEntryCount];
+    free(block);
+    block = NULL;
+    g_mediaCacheContext.entries[entryIndex].buffer = NULL;
+}
+
+//! \brief Wait until no entry at or after \a firstEntry has an owner.
+//!
+//! Waiting unlocks the shard of the entry, which lets other threads change the owners
+//! of any entry of that shard. So the entries are checked again until a pass finds
+//! them all unowned without having to wait.
+//!
+//! \retval SUCCESS None of the entries have owners, and all shards are locked.
+//! \retval ERROR_DDI_MEDIA_CACHE_TIMEOUT An entry was not released in time.
+//!
+//! \pre All shards must be locked, and the context mutex must not be.
+static RtStatus_t cache_resize_WaitForOwners(unsigned firstEntry)
+{
+    bool didWait;
+    do
+    {
+        didWait = false;
+        for (unsigned i = firstEntry; i < g_mediaCacheContext.entryCount; ++i)
+        {
+            MediaCacheEntry * entry = &g_mediaCacheContext.entries[i];
+            if (entry->shard != CACHE_NO_SHARD && entry->refcount)
+            {
+                RtStatus_t status = entry->waitUntilUnowned();
+                if (status != SUCCESS)
+                {
+                    return status;
+                }
+                didWait = true;
+            }
+        }
+    } while (didWait);
+
+    return SUCCESS;
+}
+
+//! \brief Take an unowned entry out of the free pool or its shard's LRU list.
+//!
+//! The entry keeps its sector, index slot, and place in the dirty list.
+static void cache_resize_Unlist(MediaCacheEntry * entry)
+{
+    if (entry->shard == CACHE_NO_SHARD)
+    {
+        g_mediaCacheContext.freeList->remove(entry);
+    }
+    else
+    {
+        entry->getShard().lru->remove(entry);
+    }
+}
+
+//! \brief Return an entry taken out by cache_resize_Unlist() to its list.
+static void cache_resize_Relist(MediaCacheEntry * entry)
+{
+    if (entry->shard == CACHE_NO_SHARD)
+    {
+        g_mediaCacheContext.freeList->insertBack(entry);
+    }
+    else
+    {
+        entry->getShard().lru->insert(entry);
+    }
+}
+
+//! \brief Evict the entry at the LRU end of a shard, if it is clean.
+//!
+//! \return The entry, invalid and back in no shard, or NULL if the shard has no unowned
+//!     entries or the next one to be evicted is dirty.
+static MediaCacheEntry * cache_resize_TakeClean(MediaCacheShard * shard)
+{
+    MediaCacheEntry * entry = static_cast<MediaCacheEntry *>(shard->lru->select());
+    if (!entry)
+    {
+        return NULL;
+    }
+    else if (entry->isValid && entry->isDirty)
+    {
+        shard->lru->deselect(entry);
+        return NULL;
+    }
+
+    if (entry->isValid)
+    {
+        cache_RecordEvict(entry, false);
+        cache_ghost_AddEvicted(entry);
+        cache_index_RemoveSectorEntry(entry);
+    }
+
+    entry->reset();
+    entry->shard = CACHE_NO_SHARD;
+    shard->entryCount--;
+
+    return entry;
+}
+
+//! \brief Find an entry that can take over the sector of an entry being removed.
+//!
+//! Entries in the free pool are used first. After that, a clean entry is evicted from
+//! the LRU end of the shard that owns the most entries, or of any other shard if that
+//! shard's next victim is dirty.
+//!
+//! \return An invalid entry that is in no list and owned by no shard, or NULL if only
+//!     dirty entries are left to evict.
+static MediaCacheEntry * cache_resize_SelectVictim()
+{
+    MediaCacheEntry * entry = static_cast<MediaCacheEntry *>(g_mediaCacheContext.freeList->getHead());
+    if (entry)
+    {
+        g_mediaCacheContext.freeList->remove(entry);
+        return entry;
+    }
+
+    MediaCacheShard * largest = NULL;
+    unsigned i;
+    for (i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        MediaCacheShard * shard = &g_mediaCacheContext.shards[i];
+        if (shard->isAssigned && (!largest || shard->entryCount > largest->entryCount))
+        {
+            largest = shard;
+        }
+    }
+    if (!largest)
+    {
+        return NULL;
+    }
+
+    entry = cache_resize_TakeClean(largest);
+    for (i = 0; !entry && i < CACHE_SHARD_COUNT; ++i)
+    {
+        MediaCacheShard * shard = &g_mediaCacheContext.shards[i];
+        if (shard != largest && shard->isAssigned)
+        {
+            entry = cache_resize_TakeClean(shard);
+        }
+    }
+
+    return entry;
+}
+
+//! \brief Move the sector held by an entry into another entry.
+//!
+//! \a to takes over the contents, the index slot, and the place in the dirty list of
+//! \a from, and is inserted into the shard's LRU list. \a from is left valid but no
+//! longer indexed or dirty.
+//!
+//! \param from A valid, unowned entry that is in no list.
+//! \param to An invalid entry that is in no list and owned by no shard.
+static void cache_resize_MoveEntry(MediaCacheEntry * from, MediaCacheEntry * to)
+{
+    MediaCacheShard & shard = from->getShard();
+
+    cache_index_RemoveSectorEntry(from);
+
+    memcpy(to->buffer, from->buffer, g_mediaCacheContext.entryBufferSize);
+    to->isValid = 1;
+    to->isReadAhead = from->isReadAhead;
+    to->drive = from->drive;
+    to->sector = from->sector;
+    to->weight = from->weight;
+    to->homeQueue = from->homeQueue;
+    to->isQueueNew = 0;
+    to->shard = from->shard;
+    to->copyOrder(from);
+
+#if CACHE_STATISTICS
+    to->timestamp = from->timestamp;
+    to->creationTimestamp = from->creationTimestamp;
+    to->readCount = from->readCount;
+    to->writeCount = from->writeCount;
+#endif // CACHE_STATISTICS
+
+    cache_index_AddSectorEntry(to);
+
+    // Take over the place in the dirty list, so the flusher still sees the sector's age.
+    if (from->isDirty)
+    {
+        if (from->dirtyNext == from)
+        {
+            to->dirtyPrev = to;
+            to->dirtyNext = to;
+        }
+        else
+        {
+            to->dirtyPrev = from->dirtyPrev;
+            to->dirtyNext = from->dirtyNext;
+            to->dirtyPrev->dirtyNext = to;
+            to->dirtyNext->dirtyPrev = to;
+        }
+        if (shard.dirtyHead == from)
+        {
+            shard.dirtyHead = to;
+        }
+
+        to->isDirty = 1;
+        to->dirtyTime = from->dirtyTime;
+        from->isDirty = 0;
+        from->dirtyPrev = NULL;
+        from->dirtyNext = NULL;
+    }
+
+    shard.entryCount++;
+    shard.lru->insert(to);
+}
+
+//! \brief Remove an entry from the cache, keeping its sector in another entry if possible.
+//!
+//! \param entry An unowned entry that is in no list.
+//! \retval SUCCESS The entry is no longer owned by any shard.
+//! \retval other The sector had to be dropped, but writing it back failed. The entry
+//!     is unchanged.
+static RtStatus_t cache_resize_RetireEntry(MediaCacheEntry * entry)
+{
+    if (entry->shard == CACHE_NO_SHARD)
+    {
+        return SUCCESS;
+    }
+
+    MediaCacheShard & shard = entry->getShard();
+
+    if (entry->isValid)
+    {
+        MediaCacheEntry * victim = cache_resize_SelectVictim();
+        if (victim)
+        {
+            cache_resize_MoveEntry(entry, victim);
+        }
+        else
+        {
+            // Every entry that is left is dirty, so this sector leaves the cache.
+            bool wasDirty = entry->isDirty;
+            RtStatus_t status = entry->flush();
+            if (status != SUCCESS)
+            {
+                return status;
+            }
+
+            cache_RecordEvict(entry, wasDirty);
+            cache_ghost_AddEvicted(entry);
+            cache_index_RemoveSectorEntry(entry);
+        }
+    }
+
+    entry->reset();
+    entry->shard = CACHE_NO_SHARD;
+    shard.entryCount--;
+
+    return SUCCESS;
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_resize(uint32_t targetEntries)
+{
+    assert(g_mediaCacheContext.isInited);
+
+    if (targetEntries < g_mediaCacheContext.initialEntryCount || targetEntries > g_mediaCacheContext.entryCapacity)
+    {
+        return ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER;
+    }
+
+    // Lock every shard of the cache.
+    MediaCacheLockAll lockCache;
+    RtStatus_t status = SUCCESS;
+    unsigned count = g_mediaCacheContext.entryCount;
+
+    if (targetEntries < count)
+    {
+        // This may unlock shards, so it must be done before the context is locked.
+        status = cache_resize_WaitForOwners(targetEntries);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    // Grow by adding new entries to the free pool.
+    while (count < targetEntries)
+    {
+        status = cache_resize_AddEntry(count);
+        if (status != SUCCESS)
+        {
+            break;
+        }
+
+        g_mediaCacheContext.freeList->insertBack(&g_mediaCacheContext.entries[count]);
+        count++;
+    }
+
+    // Shrink by retiring entries from the end of the array. They are all taken out of
+    // their lists first, so that none of them is picked to take over another's sector.
+    if (count > targetEntries)
+    {
+        unsigned i;
+        for (i = targetEntries; i < count; ++i)
+        {
+            cache_resize_Unlist(&g_mediaCacheContext.entries[i]);
+        }
+
+        while (count > targetEntries)
+        {
+            status = cache_resize_RetireEntry(&g_mediaCacheContext.entries[count - 1]);
+            if (status != SUCCESS)
+            {
+                break;
+            }
+
+            cache_resize_FreeBuffer(count - 1);
+            count--;
+        }
+
+        // Put back whatever could not be retired.
+        for (i = targetEntries; i < count; ++i)
+        {
+            cache_resize_Relist(&g_mediaCacheContext.entries[i]);
+        }
+    }
+
+    g_mediaCacheContext.entryCount = count;
+    cache_UpdateMaxChainedEntries();
+    cache_ResizeShards();
+
+    return status;
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_get_size_info(MediaCacheSizeInfo_t * info)
+{
+    assert(g_mediaCacheContext.isInited);
+    assert(info);
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    info->entryCount = g_mediaCacheContext.entryCount;
+    info->minEntryCount = g_mediaCacheContext.initialEntryCount;
+    info->maxEntryCount = g_mediaCacheContext.entryCapacity;
+    info->missCount = g_mediaCacheContext.ghosts.missCount;
+    info->maxGhostEntries = g_mediaCacheContext.ghosts.capacity;
+
+    return SUCCESS;
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_get_ghost_hits(uint32_t extraEntries, uint32_t * extraHits)
+{
+    assert(g_mediaCacheContext.isInited);
+    assert(extraHits);
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    // A miss found at distance d would have hit with d + 1 more entries.
+    const MediaCacheGhostList & ghosts = g_mediaCacheContext.ghosts;
+    unsigned limit = std::min<unsigned>(extraEntries, ghosts.capacity);
+    uint32_t hits = 0;
+    for (unsigned distance = 0; distance < limit; ++distance)
+    {
+        hits += ghosts.hits[distance];
+    }
+
+    *extraHits = hits;
+    return SUCCESS;
+}
+
+// See media_cache.h for the documentation of this function.
+void media_cache_reset_ghost_hits(void)
+{
+    assert(g_mediaCacheContext.isInited);
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    MediaCacheGhostList & ghosts = g_mediaCacheContext.ghosts;
+    ghosts.missCount = 0;
+    if (ghosts.hits)
+    {
+        memset(ghosts.hits, 0, ghosts.capacity * sizeof(uint32_t));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
+//! @}
@@ -0,0 +1,463 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \file cache_shard.cpp
+//! \ingroup media_cache_internal
+//! \brief Assignment of media cache shards and distribution of entries between them.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "cacheutil.h"
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+static RtStatus_t cache_shard_Allocate(MediaCacheShard * shard);
+static void cache_shard_Free(MediaCacheShard * shard);
+static MediaCacheEntry * cache_shard_Steal(MediaCacheShard * shard);
+static unsigned cache_shard_GetMinEntries(const MediaCacheShard * shard);
+static unsigned cache_shard_GetMaxEntries(const MediaCacheShard * shard);
+static unsigned cache_shard_GetTarget(const MediaCacheShard * shard);
+static bool cache_shard_CanTakeFree(const MediaCacheShard * shard);
+static unsigned cache_shard_GetGhostCapacity();
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Allocates a shard's index, LRU list, and flush list, and clears its state.
+//!
+//! The index and flush list are sized for the entire entry array, including entries the
+//! cache may grow into later, since any number of entries may end up being owned by the
+//! shard. The kind of LRU list depends on the replacement policy selected when the cache
+//! was initialized.
+static RtStatus_t cache_shard_Allocate(MediaCacheShard * shard)
+{
+    unsigned entryCapacity = g_mediaCacheContext.entryCapacity;
+
+    shard->index = new MediaCacheIndex(g_mediaCacheContext.entries, entryCapacity);
+    shard->flushList = (MediaCacheEntry **)malloc(entryCapacity * sizeof(MediaCacheEntry *));
+
+    bool isLruValid;
+    if (g_mediaCacheContext.policy == kMediaCachePolicy_2Q)
+    {
+        MediaCacheTwoQueueList * lru = new MediaCacheTwoQueueList(kMediaCacheWeight_Low, kMediaCacheWeight_High, g_mediaCacheContext.lruWindowSize, cache_shard_GetGhostCapacity());
+        isLruValid = lru && lru->isValid();
+        shard->lru = lru;
+    }
+    else
+    {
+        shard->lru = new WeightedLRUList(kMediaCacheWeight_Low, kMediaCacheWeight_High, g_mediaCacheContext.lruWindowSize);
+        isLruValid = shard->lru != NULL;
+    }
+
+    if (!shard->index || !shard->index->isValid() || !isLruValid || !shard->flushList)
+    {
+        cache_shard_Free(shard);
+        return ERROR_OS_MEMORY_MANAGER_NOMEMORY;
+    }
+
+    shard->entryCount = 0;
+    shard->dirtyHead = NULL;
+    shard->dirtyCount = 0;
+
+    MediaCacheReadAheadStream & stream = shard->readAhead;
+    stream.lastSector = 0;
+    stream.nextSector = 0;
+    stream.runLength = 0;
+    stream.window = 0;
+    stream.limit = std::min<unsigned>(g_mediaCacheContext.readAheadMaxWindow, 0xffff);
+    stream.isFillQueued = false;
+
+    return SUCCESS;
+}
+
+//! \brief Disposes of a shard's index, LRU list, and flush list.
+static void cache_shard_Free(MediaCacheShard * shard)
+{
+    delete shard->index;
+    shard->index = NULL;
+
+    delete shard->lru;
+    shard->lru = NULL;
+
+    free(shard->flushList);
+    shard->flushList = NULL;
+}
+
+//! Drives are assigned shards in the order they are first accessed, and keep them until
+//! the cache is shut down. The lookup of an assigned shard does not lock anything.
+//!
+//! \param drive Tag of the drive.
+//! \param[out] shard The drive's shard.
+//! \retval SUCCESS The drive has a shard.
+//! \retval ERROR_DDI_MEDIA_CACHE_TOO_MANY_DRIVES Every shard is in use by another drive.
+//! \retval ERROR_OS_MEMORY_MANAGER_NOMEMORY The shard's index could not be allocated.
+//!
+//! \pre The caller must not hold the context mutex.
+RtStatus_t cache_GetShard(DriveTag_t drive, MediaCacheShard ** shard)
+{
+    assert(shard);
+
+    *shard = cache_FindShard(drive);
+    if (*shard)
+    {
+        return SUCCESS;
+    }
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    // Another thread may have assigned a shard while we waited for the lock.
+    *shard = cache_FindShard(drive);
+    if (*shard)
+    {
+        return SUCCESS;
+    }
+
+    if (g_mediaCacheContext.shardCount >= CACHE_SHARD_COUNT)
+    {
+        return ERROR_DDI_MEDIA_CACHE_TOO_MANY_DRIVES;
+    }
+
+    unsigned shardIndex = g_mediaCacheContext.shardCount;
+    MediaCacheShard * newShard = &g_mediaCacheContext.shards[shardIndex];
+    assert(!newShard->isAssigned);
+
+    RtStatus_t status = cache_shard_Allocate(newShard);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    newShard->drive = drive;
+    newShard->isAssigned = true;
+    g_mediaCacheContext.shardCount++;
+
+    // Publish the shard last, since lookups don't take the lock.
+    g_mediaCacheContext.shardOfDrive[drive] = shardIndex;
+
+    *shard = newShard;
+    return SUCCESS;
+}
+
+//! \brief Returns the number of entries reserved for a shard.
+static unsigned cache_shard_GetMinEntries(const MediaCacheShard * shard)
+{
+    return g_mediaCacheContext.entryCount * shard->minPercent / 100;
+}
+
+//! The limit is never below the longest chain of entries, so that a chained read or
+//! pinned write can always be satisfied by the shard's own entries.
+static unsigned cache_shard_GetMaxEntries(const MediaCacheShard * shard)
+{
+    return std::max<unsigned>(g_mediaCacheContext.entryCount * shard->maxPercent / 100, g_mediaCacheContext.maxChainedEntries);
+}
+
+//! \brief Returns the number of entries a shard is entitled to keep when others need entries.
+//!
+//! This is an even share of the cache, clamped to the shard's partition limits.
+static unsigned cache_shard_GetTarget(const MediaCacheShard * shard)
+{
+    unsigned fairShare = g_mediaCacheContext.entryCount / std::max<unsigned>(g_mediaCacheContext.shardCount, 1);
+    return std::min(std::max(fairShare, cache_shard_GetMinEntries(shard)), cache_shard_GetMaxEntries(shard));
+}
+
+//! A shard below its minimum may always take a free entry. Any other shard has to
+//! leave enough free entries for the other shards to reach their minimums.
+//!
+//! \pre The context mutex must be locked. The entry counts of the other shards are
+//!     only read, so they are a hint.
+static bool cache_shard_CanTakeFree(const MediaCacheShard * shard)
+{
+    if (shard->entryCount < cache_shard_GetMinEntries(shard))
+    {
+        return true;
+    }
+
+    unsigned reserved = 0;
+    for (unsigned i = 0; i < g_mediaCacheContext.shardCount; ++i)
+    {
+        const MediaCacheShard * other = &g_mediaCacheContext.shards[i];
+        unsigned minEntries = cache_shard_GetMinEntries(other);
+        if (other != shard && other->entryCount < minEntries)
+        {
+            reserved += minEntries - other->entryCount;
+        }
+    }
+
+    return static_cast<unsigned>(g_mediaCacheContext.freeList->getSize()) > reserved;
+}
+
+//! Entries are only taken from a shard that owns more than its target share of the
+//! cache, and only when \a shard owns less than its own target or has nothing to reuse
+//! itself. This lets a drive that is accessed after the free pool has run out build up
+//! a working set, without letting drives take entries back and forth on every miss.
+//! Since the target is never below a shard's minimum, entries reserved for a shard are
+//! never taken.
+//!
+//! The other shard is locked with a non-blocking attempt, because its owner may be
+//! waiting for a shard that we hold. Normally only a clean entry from the LRU end is
+//! taken, so that no media access is made on behalf of the other drive. When \a shard
+//! has no unowned entry of its own, a dirty entry is written back and taken instead.
+//! Otherwise a drive whose reads find every other entry dirty would wait forever, since
+//! nothing else makes those entries clean unless the background flusher is running.
+//!
+//! \return An invalid entry now owned by \a shard and not in any list, or NULL.
+//!
+//! \pre The shard must be locked.
+static MediaCacheEntry * cache_shard_Steal(MediaCacheShard * shard)
+{
+    if (shard->entryCount >= cache_shard_GetTarget(shard) && !shard->lru->isEmpty())
+    {
+        return NULL;
+    }
+
+    // Pick the shard that owns the most entries beyond its target. The counts are only
+    // read here, so this is just a hint until the shard is locked.
+    MediaCacheShard * victim = NULL;
+    unsigned victimExcess = 0;
+    for (unsigned i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        MediaCacheShard * other = &g_mediaCacheContext.shards[i];
+        if (other == shard || !other->isAssigned)
+        {
+            continue;
+        }
+
+        unsigned target = cache_shard_GetTarget(other);
+        if (other->entryCount > target && other->entryCount - target > victimExcess)
+        {
+            victim = other;
+            victimExcess = other->entryCount - target;
+        }
+    }
+
+    if (!victim || tx_mutex_get(&victim->mutex, TX_NO_WAIT) != TX_SUCCESS)
+    {
+        return NULL;
+    }
+
+    MediaCacheEntry * entry = static_cast<MediaCacheEntry *>(victim->lru->select());
+    bool didFlush = false;
+    if (entry && entry->isValid && entry->isDirty)
+    {
+        // Leave dirty entries for the other shard's own evictions to write back, unless
+        // this shard has nothing to reuse.
+        if (shard->lru->isEmpty() && entry->flush() == SUCCESS)
+        {
+            didFlush = true;
+        }
+        else
+        {
+            victim->lru->deselect(entry);
+            entry = NULL;
+        }
+    }
+
+    if (entry)
+    {
+        if (entry->isValid)
+        {
+            cache_RecordEvict(entry, didFlush);
+            cache_ghost_AddEvicted(entry);
+            cache_index_RemoveSectorEntry(entry);
+        }
+
+        entry->reset();
+        entry->shard = shard - g_mediaCacheContext.shards;
+        victim->entryCount--;
+        shard->entryCount++;
+    }
+
+    tx_mutex_put(&victim->mutex);
+
+    return entry;
+}
+
+//! Entries are taken from the free pool first. If the pool is empty and \a canSteal is
+//! true, an entry may be taken from another shard. Otherwise the entry at the LRU end of
+//! the shard's own list is returned. A shard that owns as many entries as its maximum
+//! always reuses its own.
+//!
+//! \param shard The shard that needs an entry.
+//! \param canSteal Whether an entry may be taken from another shard.
+//! \return An entry owned by \a shard that is no longer in any list, or NULL if there
+//!     is none available right now. The entry may still be valid and dirty.
+//!
+//! \pre The shard must be locked.
+MediaCacheEntry * cache_shard_SelectEntry(MediaCacheShard * shard, bool canSteal)
+{
+    MediaCacheEntry * entry;
+    bool canGrow = shard->entryCount < cache_shard_GetMaxEntries(shard);
+
+    // Entries are only put in the pool by media_cache_resize() and cache_ResetShards(),
+    // which hold the locks of all shards. While this shard is locked, other shards can
+    // only take entries out, so finding the pool empty without the context mutex is
+    // final. A pool that looks non-empty is checked again under the mutex.
+    if (canGrow && !g_mediaCacheContext.freeList->isEmpty())
+    {
+        SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+        entry = cache_shard_CanTakeFree(shard) ? static_cast<MediaCacheEntry *>(g_mediaCacheContext.freeList->getHead()) : NULL;
+        if (entry)
+        {
+            g_mediaCacheContext.freeList->remove(entry);
+            entry->shard = shard - g_mediaCacheContext.shards;
+            shard->entryCount++;
+            return entry;
+        }
+    }
+
+    if (canSteal && canGrow)
+    {
+        entry = cache_shard_Steal(shard);
+        if (entry)
+        {
+            return entry;
+        }
+    }
+
+    return static_cast<MediaCacheEntry *>(shard->lru->select());
+}
+
+unsigned cache_GetDirtyCount()
+{
+    unsigned dirtyCount = 0;
+
+    // Each count is only read, so the total is approximate while other shards are busy.
+    for (unsigned i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        dirtyCount += g_mediaCacheContext.shards[i].dirtyCount;
+    }
+
+    return dirtyCount;
+}
+
+//! \brief Returns the number of evicted sectors a 2Q list remembers.
+//!
+//! This is half of what the cache holds, as recommended for 2Q.
+static unsigned cache_shard_GetGhostCapacity()
+{
+    return g_mediaCacheContext.entryCount / 2;
+}
+
+//! Used whenever the entry array is (re)built. Every entry is put in the free pool, and
+//! the index, LRU, and flush list of each assigned shard are reallocated to match the
+//! new array. Drives keep their shards.
+//!
+//! \pre The entries must have been constructed. All shards and the context mutex must
+//!     be locked, unless the cache is still being initialized.
+RtStatus_t cache_ResetShards()
+{
+    unsigned i;
+
+    g_mediaCacheContext.freeList->clear();
+    for (i = 0; i < g_mediaCacheContext.entryCount; ++i)
+    {
+        MediaCacheEntry * entry = &g_mediaCacheContext.entries[i];
+        entry->shard = CACHE_NO_SHARD;
+        g_mediaCacheContext.freeList->insertBack(entry);
+    }
+
+    for (i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        MediaCacheShard * shard = &g_mediaCacheContext.shards[i];
+        cache_shard_Free(shard);
+
+        if (shard->isAssigned)
+        {
+            RtStatus_t status = cache_shard_Allocate(shard);
+            if (status != SUCCESS)
+            {
+                return status;
+            }
+        }
+    }
+
+    return SUCCESS;
+}
+
+//! Only the 2Q ghost lists depend on the entry count. A ghost list that cannot be
+//! resized for lack of memory keeps its old size, which is still correct, just less
+//! accurate.
+//!
+//! \pre All shards must be locked.
+void cache_ResizeShards()
+{
+    if (g_mediaCacheContext.policy != kMediaCachePolicy_2Q)
+    {
+        return;
+    }
+
+    for (unsigned i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        MediaCacheShard * shard = &g_mediaCacheContext.shards[i];
+        if (shard->isAssigned && shard->lru)
+        {
+            static_cast<MediaCacheTwoQueueList *>(shard->lru)->setGhostCapacity(cache_shard_GetGhostCapacity());
+        }
+    }
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_set_partition(uint8_t drive, const MediaCachePartition_t * partition)
+{
+    assert(g_mediaCacheContext.isInited);
+    assert(partition);
+
+    if (partition->maxPercent > 100 || partition->minPercent > partition->maxPercent)
+    {
+        return ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER;
+    }
+
+    MediaCacheShard * shard;
+    RtStatus_t status = cache_GetShard(drive, &shard);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    SimpleMutex lockContext(g_mediaCacheContext.mutex);
+
+    // The reserved entries of all drives have to fit in the cache.
+    unsigned totalMinPercent = partition->minPercent;
+    for (unsigned i = 0; i < g_mediaCacheContext.shardCount; ++i)
+    {
+        if (&g_mediaCacheContext.shards[i] != shard)
+        {
+            totalMinPercent += g_mediaCacheContext.shards[i].minPercent;
+        }
+    }
+    if (totalMinPercent > 100)
+    {
+        return ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER;
+    }
+
+    shard->minPercent = partition->minPercent;
+    shard->maxPercent = partition->maxPercent;
+
+    return SUCCESS;
+}
+
+//! \pre All shards must be locked.
+void cache_DisposeShards()
+{
+    for (unsigned i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        cache_shard_Free(&g_mediaCacheContext.shards[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
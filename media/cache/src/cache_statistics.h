@@ -12,13 +12,16 @@
 ///////////////////////////////////////////////////////////////////////////////
 //! \file cache_statistics.h
 //! \ingroup media_cache_internal
-//! \brief Contains internal declarations for media cache index utilities.
+//! \brief Internal declarations for media cache statistics and latency measurement.
 ////////////////////////////////////////////////////////////////////////////////
 #if !defined(__cache_statistics_h__)
 #define __cache_statistics_h__
 
+#include "drivers/media/cache/media_cache.h"
+
 extern "C" {
 #include "types.h"
+#include "hw/profile/hw_profile.h"
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -30,7 +33,9 @@ extern "C" {
 
 //! \def CACHE_STATISTICS
 //!
-//! Set this define to 1 to enable statistics recording.
+//! Set this define to 1 to record access times and counts for each cache entry, and
+//! the average time spent in the sector index. Operation latencies are recorded
+//! regardless of this option; see media_cache_get_latency().
 #if !defined(CACHE_STATISTICS)
     #define CACHE_STATISTICS 0
 #endif
@@ -41,40 +46,9 @@ extern "C" {
 // Types
 ////////////////////////////////////////////////////////////////////////////////
 
-#if CACHE_STATISTICS
+struct MediaCacheShard;
 
-/*!
- * \brief Cache statistics for a single drive.
- * \ingroup media_cache_internal
- */
-struct MediaCacheDriveStatistics
-{
-    unsigned readCount;     //!< Number of read accesses.
-    unsigned writeCount;    //!< Number of write accesses.
-    unsigned evictionCount; //!< Times a valid cache entry was evicted.
-    unsigned dirtyEvictionCount;    //!< How many evictions had to flush a dirty entry.
-    unsigned hits;      //!< Count of cache hits.
-    unsigned misses;    //!< Count of cache misses.
-    unsigned errors;    //!< Number of errors for this drive.
-    float hitRatio; //!< Ratio of hits to misses, where 1.0 is all hits and 0.0 is all misses.
-    
-    void hit()
-    {
-        hits++;
-        computeHitRatio();
-    }
-    
-    void miss()
-    {
-        misses++;
-        computeHitRatio();
-    }
-    
-    void computeHitRatio()
-    {
-        hitRatio = (float)hits / (float)(hits + misses);
-    }
-};
+#if CACHE_STATISTICS
 
 /*!
  * \brief Struct used for computing average operation times.
@@ -102,6 +76,8 @@ struct MediaCacheAverageTime
     }
 };
 
+#endif // CACHE_STATISTICS
+
 /*!
  * \brief Bare bones microsecond timer class.
  * \ingroup media_cache_internal
@@ -125,7 +101,58 @@ protected:
     uint64_t m_start;   //!< The start timestamp in microseconds.
 };
 
-#endif // CACHE_STATISTICS
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Adds one operation's latency to a shard's histogram for that operation.
+//!
+//! The shard lock doesn't have to be held.
+void cache_latency_Record(MediaCacheShard * shard, MediaCacheLatencyOp_t op, uint64_t microseconds);
+
+////////////////////////////////////////////////////////////////////////////////
+// Classes
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief Records the latency of a cache operation when it goes out of scope.
+ *
+ * Create an instance before locking the shard, so that the time spent waiting for
+ * the lock is included. If the operation turns out to be a different one than it
+ * started as, such as a read that misses, call setOp() before returning.
+ *
+ * \ingroup media_cache_internal
+ */
+class MediaCacheLatencyRecorder
+{
+public:
+    //! \brief Constructor; takes the start timestamp.
+    //! \param shard Shard to record the latency in. Nothing is recorded if this is NULL.
+    //! \param op The operation being timed.
+    inline MediaCacheLatencyRecorder(MediaCacheShard * shard, MediaCacheLatencyOp_t op)
+    :   m_timer(),
+        m_shard(shard),
+        m_op(op)
+    {
+    }
+    
+    //! \brief Destructor; records the elapsed time.
+    inline ~MediaCacheLatencyRecorder()
+    {
+        if (m_shard)
+        {
+            cache_latency_Record(m_shard, m_op, m_timer.getElapsed());
+        }
+    }
+    
+    //! \brief Changes the operation the latency is recorded for.
+    inline void setOp(MediaCacheLatencyOp_t op) { m_op = op; }
+
+protected:
+    SimpleTimer m_timer;        //!< Measures the operation.
+    MediaCacheShard * m_shard;  //!< Shard to record the latency in.
+    MediaCacheLatencyOp_t m_op; //!< Operation to record the latency for.
+};
 
 #endif // __cache_statistics_h__
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,456 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \addtogroup media_cache_internal
+//! @{
+//! \file cache_zero.cpp
+//! \brief Zero sectors, which are held by the media cache without a buffer.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "cacheutil.h"
+#include <algorithm>
+#include "drivers/media/buffer_manager/media_buffer_manager.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+static unsigned cache_zero_GetBucket(uint32_t sector);
+static void cache_zero_Link(MediaCacheShard * shard, unsigned position);
+static void cache_zero_Unlink(MediaCacheShard * shard, unsigned position);
+static void cache_zero_Rehash(MediaCacheShard * shard);
+static int cache_zero_Find(MediaCacheShard * shard, uint32_t sector);
+static void cache_zero_Remove(MediaCacheShard * shard, unsigned position);
+static RtStatus_t cache_zero_Add(MediaCacheShard * shard, uint32_t sector, bool * isAdded);
+static RtStatus_t cache_zero_WriteRun(DriveTag_t drive, uint32_t startSector, unsigned count, SECTOR_BUFFER * zeroes);
+static RtStatus_t cache_zero_WriteSorted(MediaCacheShard * shard, unsigned maxCount);
+static RtStatus_t cache_zero_WriteNominal(MediaCacheParamBlock_t * pb, uint32_t sector, unsigned count, SECTOR_BUFFER ** zeroes);
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Returns the hash bucket of a zero sector.
+//!
+//! Sectors are mostly zeroed in runs, which the low bits of the sector number spread
+//! evenly over the buckets.
+static unsigned cache_zero_GetBucket(uint32_t sector)
+{
+    return sector & (CACHE_ZERO_HASH_BUCKETS - 1);
+}
+
+//! \brief Add the sector at a position of the zero sector list to its hash bucket.
+static void cache_zero_Link(MediaCacheShard * shard, unsigned position)
+{
+    uint8_t & head = shard->zeroHashHeads[cache_zero_GetBucket(shard->zeroSectors[position])];
+    shard->zeroHashNext[position] = head;
+    head = position;
+}
+
+//! \brief Take the sector at a position of the zero sector list out of its hash bucket.
+static void cache_zero_Unlink(MediaCacheShard * shard, unsigned position)
+{
+    uint8_t * link = &shard->zeroHashHeads[cache_zero_GetBucket(shard->zeroSectors[position])];
+    while (*link != position)
+    {
+        assert(*link != CACHE_ZERO_NONE);
+        link = &shard->zeroHashNext[*link];
+    }
+    *link = shard->zeroHashNext[position];
+}
+
+//! \brief Rebuild the hash buckets after the zero sector list was reordered.
+static void cache_zero_Rehash(MediaCacheShard * shard)
+{
+    memset(shard->zeroHashHeads, CACHE_ZERO_NONE, sizeof(shard->zeroHashHeads));
+    for (unsigned i = 0; i < shard->zeroCount; ++i)
+    {
+        cache_zero_Link(shard, i);
+    }
+}
+
+//! \brief Returns the position of a sector in the shard's zero sector list, or -1.
+//!
+//! \pre The shard must be locked.
+static int cache_zero_Find(MediaCacheShard * shard, uint32_t sector)
+{
+    unsigned i = shard->zeroHashHeads[cache_zero_GetBucket(sector)];
+    while (i != CACHE_ZERO_NONE)
+    {
+        if (shard->zeroSectors[i] == sector)
+        {
+            return i;
+        }
+        i = shard->zeroHashNext[i];
+    }
+
+    return -1;
+}
+
+//! \brief Remove the sector at a position of the zero sector list.
+//!
+//! The list is unordered, so the last sector takes the removed one's place.
+static void cache_zero_Remove(MediaCacheShard * shard, unsigned position)
+{
+    unsigned last = shard->zeroCount - 1;
+
+    cache_zero_Unlink(shard, position);
+    if (position != last)
+    {
+        cache_zero_Unlink(shard, last);
+        shard->zeroSectors[position] = shard->zeroSectors[last];
+        cache_zero_Link(shard, position);
+    }
+    shard->zeroCount = last;
+}
+
+//! \pre The shard must be locked.
+bool cache_zero_Contains(MediaCacheShard * shard, uint32_t sector)
+{
+    return shard->zeroCount && cache_zero_Find(shard, sector) != -1;
+}
+
+//! \pre The shard must be locked, unless the cache is still being initialized.
+void cache_zero_Clear(MediaCacheShard * shard)
+{
+    shard->zeroCount = 0;
+    memset(shard->zeroHashHeads, CACHE_ZERO_NONE, sizeof(shard->zeroHashHeads));
+}
+
+//! Called for every entry that is added to a sector index. The entry has just been
+//! loaded from media, or not loaded at all, so its contents are replaced with the
+//! zeroes the sector really holds, and it is dirty until they are written back.
+//!
+//! \pre The shard owning the entry must be locked.
+void cache_zero_Materialize(MediaCacheEntry * entry)
+{
+    MediaCacheShard & shard = entry->getShard();
+    if (!shard.zeroCount)
+    {
+        return;
+    }
+
+    int i = cache_zero_Find(&shard, entry->sector);
+    if (i == -1)
+    {
+        return;
+    }
+
+    cache_zero_Remove(&shard, i);
+
+    memset(entry->buffer, 0, g_mediaCacheContext.entryBufferSize);
+    entry->setDirty();
+}
+
+//! Any entry holding the sector is dropped, so its buffer can be reused right away.
+//! When the list is full, it is written back first to make room.
+//!
+//! \param shard The drive's shard.
+//! \param sector The native sector that is all zeroes.
+//! \param[out] isAdded Set to whether the sector is now in the zero sector list. It is
+//!     false if the sector's entry has an owner, in which case the entry has to be
+//!     zeroed through a regular write.
+//! \retval SUCCESS
+//! \retval other Writing back the full list failed. Nothing has changed.
+//!
+//! \pre The shard must be locked.
+static RtStatus_t cache_zero_Add(MediaCacheShard * shard, uint32_t sector, bool * isAdded)
+{
+    *isAdded = false;
+
+    MediaCacheEntry * entry = cache_index_LookupSectorEntry(shard->drive, sector);
+    if (entry && !entry->isUnowned())
+    {
+        return SUCCESS;
+    }
+    else if (!entry && cache_zero_Find(shard, sector) != -1)
+    {
+        *isAdded = true;
+        return SUCCESS;
+    }
+
+    if (shard->zeroCount == CACHE_ZERO_SECTOR_COUNT)
+    {
+        RtStatus_t status = cache_zero_WriteBack(shard);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    if (entry)
+    {
+        // Whatever the entry held, dirty or not, is being replaced.
+        cache_index_RemoveSectorEntry(entry);
+        shard->lru->remove(entry);
+        entry->reset(); // Invalid entries are inserted at the head of the LRU list, to be reused first.
+        shard->lru->insert(entry);
+    }
+
+    if (shard->zeroCount == 0)
+    {
+        shard->zeroTime = tx_time_get();
+    }
+    shard->zeroSectors[shard->zeroCount] = sector;
+    cache_zero_Link(shard, shard->zeroCount++);
+    *isAdded = true;
+
+    return SUCCESS;
+}
+
+//! \brief Write a buffer of zeroes to a run of sequential sectors.
+//!
+//! Sectors are written in groups of the drive's optimal transfer size, each wrapped in
+//! a multisector transaction.
+static RtStatus_t cache_zero_WriteRun(DriveTag_t drive, uint32_t startSector, unsigned count, SECTOR_BUFFER * zeroes)
+{
+    unsigned planeCount = DriveGetInfoTyped<uint32_t>(drive, kDriveInfoOptimalTransferSectorCount);
+    planeCount = std::max<unsigned>(std::min<unsigned>(planeCount, CACHE_MAX_CHAINED_ENTRIES), 1);
+
+    RtStatus_t status = SUCCESS;
+    for (unsigned done = 0; done < count && status == SUCCESS; )
+    {
+        unsigned groupCount = std::min(planeCount, count - done);
+        if (groupCount > 1)
+        {
+            status = DriveOpenMultisectorTransaction(drive, startSector + done, groupCount, false);
+            if (status != SUCCESS)
+            {
+                break;
+            }
+        }
+
+        for (unsigned i = 0; i < groupCount && status == SUCCESS; ++i)
+        {
+            status = DriveWriteSector(drive, startSector + done + i, zeroes);
+        }
+
+        if (groupCount > 1)
+        {
+            RtStatus_t commitStatus = DriveCommitMultisectorTransaction(drive);
+            if (status == SUCCESS)
+            {
+                status = commitStatus;
+            }
+        }
+
+        done += groupCount;
+    }
+
+    return status;
+}
+
+//! \brief Write the lowest sectors of a shard's zero sector list to media.
+//!
+//! The list is sorted, and each run of sequential sectors is written from a single
+//! buffer of zeroes. Sectors that fail to be written stay in the list.
+//!
+//! \param shard The shard whose zero sectors are written.
+//! \param maxCount Most sectors to write.
+//!
+//! \pre The shard must be locked.
+static RtStatus_t cache_zero_WriteSorted(MediaCacheShard * shard, unsigned maxCount)
+{
+    if (!shard->zeroCount)
+    {
+        return SUCCESS;
+    }
+
+    MediaTask task("cache_zero_WriteBack");
+
+    uint32_t * sectors = shard->zeroSectors;
+    unsigned count = shard->zeroCount;
+    unsigned limit = std::min(count, maxCount);
+    std::sort(sectors, sectors + count);
+
+    SECTOR_BUFFER * zeroes = NULL;
+    RtStatus_t status = media_buffer_acquire(kMediaBufferType_Sector, kMediaBufferFlag_None, &zeroes);
+    unsigned done = 0;
+    if (status == SUCCESS)
+    {
+        memset(zeroes, 0, g_mediaCacheContext.entryBufferSize);
+
+        while (done < limit)
+        {
+            unsigned runLength = 1;
+            while (done + runLength < limit && sectors[done + runLength] == sectors[done] + runLength)
+            {
+                ++runLength;
+            }
+
+            status = cache_zero_WriteRun(shard->drive, sectors[done], runLength, zeroes);
+            if (status != SUCCESS)
+            {
+                break;
+            }
+
+            done += runLength;
+        }
+
+        media_buffer_release(zeroes);
+    }
+
+    // Keep the sectors that were not written.
+    shard->zeroCount = count - done;
+    memmove(sectors, sectors + done, shard->zeroCount * sizeof(uint32_t));
+    cache_zero_Rehash(shard);
+
+    return status;
+}
+
+//! \pre The shard must be locked.
+RtStatus_t cache_zero_WriteBack(MediaCacheShard * shard)
+{
+    RtStatus_t status = cache_zero_WriteSorted(shard, CACHE_ZERO_SECTOR_COUNT);
+    shard->zeroTime = tx_time_get();
+
+    return status;
+}
+
+//! Only as many sectors as the drive writes at once are written, starting with the
+//! lowest, so the shard is held for a single program operation. The rest of the list
+//! keeps its age, so that it goes out on the flusher's next passes.
+//!
+//! \pre The shard must be locked.
+RtStatus_t cache_zero_WriteBackGroup(MediaCacheShard * shard)
+{
+    unsigned planeCount = DriveGetInfoTyped<uint32_t>(shard->drive, kDriveInfoOptimalTransferSectorCount);
+    planeCount = std::max<unsigned>(std::min<unsigned>(planeCount, CACHE_MAX_CHAINED_ENTRIES), 1);
+
+    return cache_zero_WriteSorted(shard, planeCount);
+}
+
+//! \brief Zero nominal sectors with regular cache writes.
+//!
+//! \param pb The caller's param block, for its drive, weight, and flags.
+//! \param sector First nominal sector to zero, with the partition offset already applied.
+//! \param count Number of nominal sectors to zero.
+//! \param[in,out] zeroes Buffer of zeroes, which is acquired if it is NULL.
+//!
+//! \pre The shard must be locked.
+static RtStatus_t cache_zero_WriteNominal(MediaCacheParamBlock_t * pb, uint32_t sector, unsigned count, SECTOR_BUFFER ** zeroes)
+{
+    RtStatus_t status;
+
+    if (!*zeroes)
+    {
+        status = media_buffer_acquire(kMediaBufferType_Sector, kMediaBufferFlag_None, zeroes);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+        memset(*zeroes, 0, g_mediaCacheContext.entryBufferSize);
+    }
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        MediaCacheParamBlock_t writePb = *pb;
+        writePb.sector = sector + i;
+        writePb.flags = (pb->flags & ~kMediaCacheFlag_UseNativeSectors) | kMediaCacheFlag_NoPartitionOffset;
+        writePb.buffer = (uint8_t *)*zeroes;
+        writePb.writeOffset = 0;
+        writePb.writeByteCount = DriveGetInfoTyped<uint32_t>(pb->drive, kDriveInfoSectorSizeInBytes);
+
+        status = media_cache_write(&writePb);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    return SUCCESS;
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_write_zeroes(MediaCacheParamBlock_t * pb)
+{
+    RtStatus_t status;
+
+    assert(g_mediaCacheContext.isInited);
+    assert(pb->requestSectorCount > 0);
+
+    // Adjust the first sector and convert it to a native sector, which also checks the drive.
+    unsigned nativeSector;
+    unsigned subsectorOffset;
+    status = cache_AdjustAndConvertSector(pb, &nativeSector, &subsectorOffset, NULL);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    // The first sector was checked against the drive size, so check the last one the same way.
+    LogicalDrive * driveDescriptor = DriveGetDriveFromTag(pb->drive);
+    bool isNative = (pb->flags & kMediaCacheFlag_UseNativeSectors) != 0;
+    uint32_t driveSectors = isNative ? driveDescriptor->m_numberOfNativeSectors : driveDescriptor->m_u32NumberOfSectors;
+    if (pb->requestSectorCount > driveSectors - pb->sector)
+    {
+        return ERROR_DDI_LDL_LDRIVE_SECTOR_OUT_OF_BOUNDS;
+    }
+
+    // Work in nominal sectors from here on.
+    unsigned shift = driveDescriptor->m_nativeSectorShift;
+    unsigned nominalPerNative = 1 << shift;
+    uint32_t sector = (nativeSector << shift) + subsectorOffset / driveDescriptor->m_u32SectorSizeInBytes;
+    uint32_t remaining = isNative ? (pb->requestSectorCount << shift) : pb->requestSectorCount;
+
+    // Get the drive's shard, which may be assigned now if the drive is new to the cache.
+    MediaCacheShard * shard;
+    status = cache_GetShard(pb->drive, &shard);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    MediaTask task("media_cache_write_zeroes");
+
+    // Lock the drive's shard of the cache. The regular writes made for sectors that
+    // can't be added to the zero sector list lock it again.
+    MediaCacheLock lockCache(shard);
+
+    SECTOR_BUFFER * zeroes = NULL;
+    while (remaining && status == SUCCESS)
+    {
+        // Number of requested nominal sectors in this native sector.
+        unsigned count = std::min<uint32_t>(remaining, nominalPerNative - (sector & (nominalPerNative - 1)));
+
+        bool isAdded = false;
+        if (count == nominalPerNative)
+        {
+            status = cache_zero_Add(shard, sector >> shift, &isAdded);
+        }
+        if (status == SUCCESS && !isAdded)
+        {
+            status = cache_zero_WriteNominal(pb, sector, count, &zeroes);
+        }
+
+        sector += count;
+        remaining -= count;
+    }
+
+    if (zeroes)
+    {
+        media_buffer_release(zeroes);
+    }
+
+    // Handle the write-through option by committing the zero sectors immediately.
+    if (status == SUCCESS && (pb->flags & kMediaCacheFlag_WriteThrough))
+    {
+        status = cache_zero_WriteBack(shard);
+    }
+
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
+//! @}
@@ -26,10 +26,11 @@
 
 void MediaCacheEntry::reset()
 {
+    clearDirty();
     isValid = 0;
-    isDirty = 0;
     isWritePending = 0;
     isWriteThrough = 0;
+    isReadAhead = 0;
     refcount = 0;
     drive = 0;
     sector = 0;
@@ -57,7 +58,7 @@ RtStatus_t MediaCacheEntry::write()
     if (status == SUCCESS)
     {
         // Clear dirty flag on a successful write.
-        isDirty = 0;
+        clearDirty();
     }
 
     return status;
@@ -74,6 +75,71 @@ RtStatus_t MediaCacheEntry::flush()
     return status;
 }
 
+void MediaCacheEntry::setDirty()
+{
+    if (isDirty)
+    {
+        return;
+    }
+    
+    MediaCacheShard & state = getShard();
+    assert(state.drive == drive);
+    
+    // Link in at the tail, which is just before the head of the circular list.
+    if (state.dirtyHead)
+    {
+        MediaCacheEntry * tail = state.dirtyHead->dirtyPrev;
+        dirtyPrev = tail;
+        dirtyNext = state.dirtyHead;
+        tail->dirtyNext = this;
+        state.dirtyHead->dirtyPrev = this;
+    }
+    else
+    {
+        dirtyPrev = this;
+        dirtyNext = this;
+        state.dirtyHead = this;
+    }
+    
+    isDirty = 1;
+    dirtyTime = tx_time_get();
+    state.dirtyCount++;
+    
+    // Let the background flusher know if there is a lot to write back.
+    cache_flusher_CheckWatermark();
+}
+
+void MediaCacheEntry::clearDirty()
+{
+    if (!isDirty)
+    {
+        return;
+    }
+    
+    MediaCacheShard & state = getShard();
+    
+    if (dirtyNext == this)
+    {
+        // This was the only dirty entry for the drive.
+        state.dirtyHead = NULL;
+    }
+    else
+    {
+        dirtyPrev->dirtyNext = dirtyNext;
+        dirtyNext->dirtyPrev = dirtyPrev;
+        if (state.dirtyHead == this)
+        {
+            state.dirtyHead = dirtyNext;
+        }
+    }
+    dirtyPrev = NULL;
+    dirtyNext = NULL;
+    
+    isDirty = 0;
+    assert(state.dirtyCount > 0);
+    state.dirtyCount--;
+}
+
 void MediaCacheEntry::retain()
 {
     // Disable interrupts while modifying the ref count.
@@ -101,13 +167,14 @@ RtStatus_t MediaCacheEntry::waitUntilWriteCompletes()
 {
     uint64_t startTime = hw_profile_GetMicroseconds();
     uint64_t elapsed = 0;
+    MediaCacheShard * shard = &getShard();
     while (isWritePending && elapsed < CACHE_WAIT_TIMEOUT)
     {
         uint32_t u32OwnershipCount;
 
-        u32OwnershipCount = release_cache_lock(); //cache_unlock();
+        u32OwnershipCount = release_cache_lock(shard); //cache_unlock();
         tx_thread_sleep(1);
-        resume_cache_lock(u32OwnershipCount); //cache_lock();
+        resume_cache_lock(shard, u32OwnershipCount); //cache_lock();
         elapsed = hw_profile_GetMicroseconds() - startTime;
     }
     
@@ -124,14 +191,15 @@ RtStatus_t MediaCacheEntry::waitUntilRefcountReaches(unsigned targetCount)
 {
     uint64_t startTime = hw_profile_GetMicroseconds();
     uint64_t elapsed = 0;
+    MediaCacheShard * shard = &getShard();
     while (refcount > targetCount && elapsed < CACHE_WAIT_TIMEOUT)
     {
         uint32_t u32OwnershipCount;
 
-        // Unlock the cache while waiting so other threads can have a chance to release this entry.
-        u32OwnershipCount = release_cache_lock(); //cache_unlock();
+        // Unlock the shard while waiting so other threads can have a chance to release this entry.
+        u32OwnershipCount = release_cache_lock(shard); //cache_unlock();
         tx_thread_sleep(1);
-        resume_cache_lock(u32OwnershipCount); //cache_lock();
+        resume_cache_lock(shard, u32OwnershipCount); //cache_lock();
         elapsed = hw_profile_GetMicroseconds() - startTime;
     }
     
@@ -144,11 +212,6 @@ RtStatus_t MediaCacheEntry::waitUntilRefcountReaches(unsigned targetCount)
     return SUCCESS;
 }
 
-RedBlackTree::Key_t MediaCacheEntry::getKey() const
-{
-    return cache_BuildIndexKey(drive, sector);
-}
-
 bool MediaCacheEntry::isNodeValid() const
 {
     return static_cast<bool>(isValid);
@@ -191,19 +254,24 @@ void MediaCacheEntry::validate() const
 //! \retval NULL No entry exists in the cache for \a sectorNumber.
 MediaCacheEntry * cache_index_LookupSectorEntry(unsigned driveNumber, unsigned sectorNumber)
 {
+    // A drive without a shard has nothing cached.
+    MediaCacheShard * shard = cache_FindShard(driveNumber);
+    if (!shard)
+    {
+        return NULL;
+    }
+    
 #if CACHE_STATISTICS
     // Time the map search.
     SimpleTimer timer;
 #endif // CACHE_STATISTICS
     
-    // Make sure we have a valid tree.
-    assert(g_mediaCacheContext.tree);
+    // Make sure we have a valid index.
+    assert(shard->index);
     
-    // Look for the sector in the tree.
-    MediaCacheEntry * entry = NULL;
-    RedBlackTree::Key_t key = cache_BuildIndexKey(driveNumber, sectorNumber);
-    entry = static_cast<MediaCacheEntry *>(g_mediaCacheContext.tree->find(key));
-    assert(!entry || entry->getKey() == key);
+    // Look for the sector in the index.
+    MediaCacheEntry * entry = shard->index->find(driveNumber, sectorNumber);
+    assert(!entry || (entry->drive == driveNumber && entry->sector == sectorNumber));
     
 #if CACHE_STATISTICS
     g_mediaCacheContext.indexSearchTime += timer.getElapsed();
@@ -221,10 +289,11 @@ void cache_index_RemoveSectorEntry(MediaCacheEntry * entry)
     SimpleTimer timer;
 #endif // CACHE_STATISTICS
     
-    // Make sure we have a valid tree.
-    assert(g_mediaCacheContext.tree);
+    // Make sure we have a valid index.
+    MediaCacheShard & shard = entry->getShard();
+    assert(shard.index);
 
-    g_mediaCacheContext.tree->remove(entry);
+    shard.index->remove(entry);
     
 #if CACHE_STATISTICS
     g_mediaCacheContext.indexRemoveTime += timer.getElapsed();
@@ -240,60 +309,109 @@ void cache_index_AddSectorEntry(MediaCacheEntry * entry)
     SimpleTimer timer;
 #endif // CACHE_STATISTICS
     
-    // Make sure we have a valid tree.
-    assert(g_mediaCacheContext.tree);
+    // Make sure we have a valid index.
+    MediaCacheShard & shard = entry->getShard();
+    assert(shard.index && shard.drive == entry->drive);
 
-    g_mediaCacheContext.tree->insert(entry);
+    shard.index->insert(entry);
     
 #if CACHE_STATISTICS
     g_mediaCacheContext.indexInsertTime += timer.getElapsed();
 #endif // CACHE_STATISTICS
+
+    // A sector in the zero sector list gets its zeroes back now that it has a buffer.
+    cache_zero_Materialize(entry);
 }
 
 #if CACHE_VALIDATE
+//! Shards are checked one at a time. A shard that is locked by another thread is
+//! skipped, rather than waiting for it while this thread may hold a shard lock itself.
 void cache_ValidateEntries()
 {
-    MediaCacheLock lockCache;
-    
-    std::set<RedBlackTreeKey_t> sectors;
-    unsigned i;
-    MediaCacheEntry * entry = g_mediaCacheContext.entries;
-    
-    for (i = 0; i < g_mediaCacheContext.entryCount; i++, entry++)
+    for (unsigned shardIndex = 0; shardIndex < CACHE_SHARD_COUNT; shardIndex++)
     {
-        // Nothing to verify on invalid entries.
-        if (!entry->isValid)
+        MediaCacheShard * shard = &g_mediaCacheContext.shards[shardIndex];
+        if (!shard->isAssigned || tx_mutex_get(&shard->mutex, TX_NO_WAIT) != TX_SUCCESS)
         {
             continue;
         }
         
-        // Make sure there isn't a duplicate.
-        RedBlackTreeKey_t key = cache_BuildIndexKey(entry->drive, entry->sector);
-        std::set<RedBlackTreeKey_t>::iterator it = sectors.find(key);
-        if (it == sectors.end())
+        std::set<int64_t> sectors;
+        unsigned i;
+        unsigned entryCount = 0;
+        unsigned dirtyCount = 0;
+        MediaCacheEntry * entry = g_mediaCacheContext.entries;
+        
+        for (i = 0; i < g_mediaCacheContext.entryCount; i++, entry++)
         {
-            sectors.insert(key);
+            if (entry->shard != shardIndex)
+            {
+                continue;
+            }
+            entryCount++;
+            
+            // Dirty entries must be linked on their shard's dirty list.
+            if (entry->isDirty)
+            {
+                dirtyCount++;
+                if (!entry->dirtyNext || !entry->dirtyPrev || entry->dirtyNext->dirtyPrev != entry)
+                {
+                    printf("Warning! Dirty entry 0x%08x is not properly linked on the dirty list\n", entry);
+                }
+            }
+            else if (entry->dirtyNext || entry->dirtyPrev)
+            {
+                printf("Warning! Clean entry 0x%08x is still linked on a dirty list\n", entry);
+            }
+            
+            // Nothing to verify on invalid entries.
+            if (!entry->isValid)
+            {
+                continue;
+            }
+            
+            // Valid entries must belong to the shard's drive.
+            if (entry->drive != shard->drive)
+            {
+                printf("Warning! Entry 0x%08x for drive %d is owned by the shard for drive %d\n", entry, entry->drive, shard->drive);
+            }
+            
+            // Make sure there isn't a duplicate.
+            int64_t key = cache_BuildIndexKey(entry->drive, entry->sector);
+            std::set<int64_t>::iterator it = sectors.find(key);
+            if (it == sectors.end())
+            {
+                sectors.insert(key);
+            }
+            else
+            {
+                printf("Warning! Duplicate cache sector key: 0x%08x\n", key);
+            }
+            
+            // Let the entry validate itself.
+            entry->validate();
+            
+            // Now check that the index maps this sector to the entry. Entries that are valid
+            // but not indexed are temporarily removed while being evicted, so only an index
+            // hit on a different entry is an error.
+            MediaCacheEntry * indexed = shard->index->find(entry->drive, entry->sector);
+            if (indexed && indexed != entry)
+            {
+                printf("Warning! Index for drive %d maps sector %d to entry 0x%08x instead of 0x%08x\n", entry->drive, entry->sector, indexed, entry);
+            }
         }
-        else
+        
+        if (entryCount != shard->entryCount)
         {
-            printf("Warning! Duplicate cache sector key: 0x%08x\n", key);
+            printf("Warning! Found %d entries owned by the shard for drive %d but it counts %d\n", entryCount, shard->drive, shard->entryCount);
         }
         
-        // Let the entry validate itself.
-        entry->validate();
-        
-        // Now check that the entry is in the correct sector index tree. We skip this
-        // check if the parent is NULL because that means it has been removed from the
-        // index tree.
-        if (entry->getParent() != NULL)
+        if (dirtyCount != shard->dirtyCount)
         {
-            RedBlackTreeNode * node = g_mediaCacheContext.tree->find(entry->getKey());
-            
-            if ((MediaCacheEntry *)node != entry)
-            {
-                printf("Warning! Tree for drive %d doesn't contain entry 0x%08x (sector %d)\n", entry->drive, entry, entry->sector);
-            }
+            printf("Warning! Found %d dirty entries for drive %d but the dirty list holds %d\n", dirtyCount, shard->drive, shard->dirtyCount);
         }
+        
+        tx_mutex_put(&shard->mutex);
     }
 }
 #endif // CACHE_VALIDATE
@@ -406,33 +524,33 @@ RtStatus_t cache_AdjustAndConvertSector(MediaCacheParamBlock_t * pb, unsigned *
     return SUCCESS;
 }
 
-void resume_cache_lock(uint32_t u32OwnershipCount)
+void resume_cache_lock(MediaCacheShard * shard, uint32_t u32OwnershipCount)
 {
     while(u32OwnershipCount > 0)
     {
         // Wait forever in the release build so we don't blow up due to colliding threads.
-        tx_mutex_get(&g_mediaCacheContext.mutex, TX_WAIT_FOREVER);
+        tx_mutex_get(&shard->mutex, TX_WAIT_FOREVER);
         u32OwnershipCount--;
     }
 }
     
-uint32_t release_cache_lock()
+uint32_t release_cache_lock(MediaCacheShard * shard)
 {
     TX_THREAD   *pCurTx;
     uint32_t    u32Count;
     uint32_t    u32OwnershipCount = 0;
     
     pCurTx = tx_thread_identify();
-    u32OwnershipCount = g_mediaCacheContext.mutex.tx_mutex_ownership_count;
+    u32OwnershipCount = shard->mutex.tx_mutex_ownership_count;
 
     // check if the current thread is the owner of this mutex
     if(u32OwnershipCount > 0 && 
-       pCurTx->tx_thread_id == g_mediaCacheContext.mutex.tx_mutex_owner->tx_thread_id)
+       pCurTx->tx_thread_id == shard->mutex.tx_mutex_owner->tx_thread_id)
     {    
         u32Count = u32OwnershipCount;
         while(u32Count > 0)
         {
-            tx_mutex_put(&g_mediaCacheContext.mutex);            
+            tx_mutex_put(&shard->mutex);            
             u32Count--;
         }
     }
@@ -22,8 +22,9 @@
 #include <string.h>
 #include <error.h>
 #include <stdio.h>
-#include "RedBlackTree.h"
 #include "wlru.h"
+#include "cache_index.h"
+#include "cache_2q.h"
 #include "access_record.h"
 #include "cache_statistics.h"
 #include "drivers/media/ddi_media.h"
@@ -55,6 +56,90 @@ extern "C" {
  * soon as possible. However, only unused, or unowned, entries are ever allowed
  * to be in the list. As soon as an entry is retained, it is removed from the list.
  *
+ * When the cache is initialized with the #kMediaCachePolicy_2Q policy, the list is
+ * a MediaCacheTwoQueueList instead. It has the same interface, but splits the
+ * entries between a probation queue and a main queue so that sectors read only
+ * once can't push out sectors that are reused.
+ *
+ * \section Index
+ *
+ * The sector index maps a drive tag and native sector number pair to the cache entry
+ * holding that sector. It is a MediaCacheIndex, an open addressing hash table sized
+ * when the cache is initialized, so lookups are O(1) regardless of the number of cache
+ * entries. Nothing in the cache needs to visit sectors in sorted order through the
+ * index, so no ordered structure is maintained alongside it.
+ *
+ * \section Shards
+ *
+ * The cache is split into shards, one per drive that uses the cache. Each shard has
+ * its own mutex, sector index, and LRU list, and owns a subset of the cache entries.
+ * An operation on a drive only locks that drive's shard, so reads of one drive are
+ * never held up behind a slow write or flush on another.
+ *
+ * Entries start out in a free pool and are claimed by shards as they miss. Once the
+ * pool is empty, a shard that owns fewer than its target share of the entries may take
+ * clean, unowned entries from the LRU end of the shard that owns the most beyond its
+ * own target. A shard with no unowned entry of its own may also write back and take a
+ * dirty one, so that it can't be starved by another drive's dirty entries. The target
+ * is an even share of the entries, clamped to the minimum and maximum set with
+ * media_cache_set_partition(). A shard at or below its minimum is never stolen from,
+ * free entries are held back for shards below their minimum, and a shard at its
+ * maximum only reuses its own entries. The entry's \a shard member
+ * always identifies which shard owns it, and an entry only changes owner while it is
+ * unowned and both shards are locked.
+ *
+ * The context mutex protects assignment of shards to drives, the free pool, and the
+ * access records. It may be acquired while holding a shard mutex, but never the other
+ * way around. When more than one shard must be locked, they are locked in array order
+ * or with a non-blocking attempt, so that threads locking shards can't deadlock.
+ *
+ * \section Resizing
+ *
+ * media_cache_resize() changes the number of entries in use without disturbing the
+ * cached sectors. New entries go into the free pool. When shrinking, each entry past
+ * the new end has its sector moved into an unused or clean entry that remains, and is
+ * only dropped, after being written back if dirty, once no clean entry is left. The
+ * cache never shrinks below its initial entries, whose buffers are part of the buffer
+ * passed to media_cache_init(). Entries added later have separately allocated buffers,
+ * so a chain of entries returned to a caller ends where the buffers stop being
+ * contiguous. The MediaCacheGhostList of recently evicted sectors lets the cache estimate how many
+ * misses a larger size would have turned into hits.
+ *
+ * \section Zero sectors
+ *
+ * File systems zero a lot of whole sectors, for new directory clusters for instance.
+ * media_cache_write_zeroes() records such native sectors in the shard's zero sector
+ * list instead of giving each one an entry, and drops any entry already holding one.
+ * A sector in the list is materialized when it is loaded again: the entry is filled
+ * with zeroes and marked dirty instead of being read from media. Read-ahead skips
+ * such sectors, and a read of several sectors only reads the ones that are not in
+ * the list. The list is written back as runs of sequential sectors from a single
+ * buffer of zeroes borrowed from the media buffer manager. The background flusher
+ * only writes one group of them at a time, so it doesn't hold the shard for long.
+ *
+ * \section Asynchronous reads
+ *
+ * media_cache_read_async() completes hits right away and queues misses to the cache
+ * I/O thread, which loads each sector with a regular media_cache_read(). Requests come
+ * from a fixed pool, so queuing never allocates memory. A request for a sector that is
+ * already queued or being loaded is chained to that request as a waiter rather than
+ * queued itself. Once the load is done, the waiters are completed with reads that hit
+ * the entry that was just loaded. The queue and the pool are protected by the context
+ * mutex.
+ *
+ * The I/O thread also loads the sectors that read-ahead decides to fetch, so that a
+ * sequential reader never waits for sectors it has not asked for yet. A read-ahead fill
+ * is queued as a request without a callback, and asynchronous reads of its first sector
+ * wait for it like they would for any other load.
+ *
+ * \section Latency
+ *
+ * Each shard keeps a histogram of the latencies of reads, writes, flushes, and
+ * eviction write backs on its drive, with power of two microsecond buckets. The
+ * public operations time themselves with a MediaCacheLatencyRecorder, which costs
+ * two timer reads and a few counter updates with interrupts disabled, so the
+ * histograms are always kept, unlike the CACHE_STATISTICS counters.
+ *
  * \section Notes
  *
  * The sector indices are not only used to improve search time, but also work as a sort of
@@ -83,11 +168,98 @@ extern "C" {
 //! Number of ticks to wait to obtain the cache mutex.
 #define CACHE_WAIT_TICKS (OS_MSECS_TO_TICKS(CACHE_WAIT_TIMEOUT/1000))
 
+//! \def CACHE_READ_AHEAD_WINDOW
+//!
+//! Default maximum number of native sectors that are read ahead of a sequential
+//! stream. The window can be changed at runtime with media_cache_set_read_ahead().
+#if !defined(CACHE_READ_AHEAD_WINDOW)
+    #define CACHE_READ_AHEAD_WINDOW (16)
+#endif
+
+//! Number of sequential native sectors that must be read before read-ahead starts.
+#define CACHE_READ_AHEAD_TRIGGER (2)
+
+//! \def CACHE_FLUSHER_PRIORITY
+//!
+//! ThreadX priority of the background flusher thread. It should be lower (a larger
+//! number) than any thread that does foreground media I/O. While the flusher holds a
+//! shard that a foreground thread is waiting for, it runs at that thread's priority.
+#if !defined(CACHE_FLUSHER_PRIORITY)
+    #define CACHE_FLUSHER_PRIORITY (20)
+#endif
+
+//! Stack size in bytes of the background flusher thread.
+#define CACHE_FLUSHER_STACK_SIZE (2048)
+
+//! Longest interval in milliseconds between flusher checks of dirty entry age.
+#define CACHE_FLUSHER_MAX_POLL_MS (500)
+
+//! \def CACHE_IO_PRIORITY
+//!
+//! ThreadX priority of the cache I/O thread that serves asynchronous reads. It should
+//! be higher (a smaller number) than the threads waiting on those reads.
+#if !defined(CACHE_IO_PRIORITY)
+    #define CACHE_IO_PRIORITY (12)
+#endif
+
+//! Stack size in bytes of the cache I/O thread. Read completion callbacks run on it.
+#define CACHE_IO_STACK_SIZE (4096)
+
+//! \def CACHE_ASYNC_REQUEST_COUNT
+//!
+//! Number of asynchronous read requests that can be outstanding at once.
+#if !defined(CACHE_ASYNC_REQUEST_COUNT)
+    #define CACHE_ASYNC_REQUEST_COUNT (16)
+#endif
+
+//! Number of cache shards. There is one for each logical drive, so a drive
+//! never has to share its shard with another.
+#define CACHE_SHARD_COUNT (MAX_LOGICAL_DRIVES)
+
+//! Value of MediaCacheEntry::shard for an entry in the free pool.
+#define CACHE_NO_SHARD (0xff)
+
 //! Maximum number of chained cache entries. This value is limited by the number
 //! of bits available for the chained count in the token, although it is
 //! currently set much lower than that limit.
 #define CACHE_MAX_CHAINED_ENTRIES (8)
 
+//! \def CACHE_MAX_ENTRY_MULTIPLE
+//!
+//! The entry descriptor array is allocated with room for this many times the number
+//! of entries that fit in the buffer passed to media_cache_init(). This is the limit
+//! of growth with media_cache_resize().
+#if !defined(CACHE_MAX_ENTRY_MULTIPLE)
+    #define CACHE_MAX_ENTRY_MULTIPLE (4)
+#endif
+
+//! \def CACHE_GHOST_COUNT
+//!
+//! Number of keys of evicted sectors remembered to estimate the hits that a larger
+//! cache would get. Set to 0 to disable the estimate.
+#if !defined(CACHE_GHOST_COUNT)
+    #define CACHE_GHOST_COUNT (128)
+#endif
+
+//! \def CACHE_ZERO_SECTOR_COUNT
+//!
+//! Number of zeroed native sectors each shard can hold without a buffer before they
+//! have to be written back. Must be at least 1 and less than #CACHE_ZERO_NONE.
+#if !defined(CACHE_ZERO_SECTOR_COUNT)
+    #define CACHE_ZERO_SECTOR_COUNT (64)
+#endif
+
+//! \def CACHE_ZERO_HASH_BUCKETS
+//!
+//! Number of hash buckets each shard uses to find sectors in its zero sector list.
+//! Must be a power of two.
+#if !defined(CACHE_ZERO_HASH_BUCKETS)
+    #define CACHE_ZERO_HASH_BUCKETS (32)
+#endif
+
+//! Position in the zero sector list that ends a hash bucket chain.
+#define CACHE_ZERO_NONE (0xff)
+
 ////////////////////////////////////////////////////////////////////////////////
 // Types
 ////////////////////////////////////////////////////////////////////////////////
@@ -115,6 +287,8 @@ enum cache_token_field_masks
 // Classes
 ////////////////////////////////////////////////////////////////////////////////
 
+struct MediaCacheShard;
+
 /*!
  * \brief Media cache entry.
  * 
@@ -123,8 +297,8 @@ enum cache_token_field_masks
  * is smaller than the native sector size. Read and write operations are always
  * performed on an entire native sector at once.
  *
- * This structure is a subclass of the red black tree node class. The entries are
- * themselves the nodes in the tree.
+ * This structure is a subclass of the LRU list node class. The entries are themselves
+ * the nodes in the list. The sector index refers to entries by their array index.
  *
  * The \a refcount field is used to keep track of the number of users of the
  * cache entry. When this field has a value of 0, there are no users. There can be
@@ -140,24 +314,41 @@ enum cache_token_field_masks
  *
  * \ingroup media_cache_internal
  */
-struct MediaCacheEntry : public RedBlackTree::Node, public WeightedLRUList::Node
+struct MediaCacheEntry : public WeightedLRUList::Node
 {
     //! \name Flags
     //@{
     
         uint8_t isValid:1;                  //!< Indicates whether the entry contains valid data (i.e. data has been read from storage into this cache entry).
-        uint8_t isDirty:1;                  //!< Indicates that this cache entry has been modified and needs to be written to media.
+        uint8_t isDirty:1;                  //!< Indicates that this cache entry has been modified and needs to be written to media. Only change with setDirty() and clearDirty().
         volatile uint8_t isWritePending:1;  //!< True when a pinned write is in progress.
         uint8_t isWriteThrough:1;           //!< Whether the pending write is a write-through.
         uint8_t bInsertToLRU:1;             //!< Indicates that this cache entry should be inserted on the LRU end instead of the (usual) MRU end.
-        uint8_t _pad:3;                     //!< Unused pad field.
+        uint8_t isReadAhead:1;              //!< Set when the entry was filled by read-ahead and has not been read by a caller yet.
+        uint8_t _pad:2;                     //!< Unused pad field.
+    
+    //@}
+
+    //! \name Replacement queue state
+    //!
+    //! These fields are only used by the 2Q replacement policy. See MediaCacheTwoQueueList.
+    //@{
+    
+        uint8_t queue:2;        //!< Queue the entry is currently linked into, one of #cache_2q_queues.
+        uint8_t homeQueue:2;    //!< Queue the entry's contents belong to.
+        uint8_t isQueueNew:1;   //!< Set when the entry was taken for reuse, so its next contents are new to the cache.
+        uint8_t _pad2:3;        //!< Unused pad field.
     
     //@}
 
     volatile uint8_t refcount; //!< Current number of owners of this entry. The entry has no owners when this value is zero.
 	uint8_t weight;          //!< 
     DriveTag_t drive;         //!< Unique tag value for the logical drive.
+    uint8_t shard;          //!< Index of the shard that owns the entry, or #CACHE_NO_SHARD if it is in the free pool.
 	uint32_t sector;       //!< Native sector number. Always drive relative, not partition relative.
+    MediaCacheEntry * dirtyPrev;    //!< Previous entry in the drive's dirty list.
+    MediaCacheEntry * dirtyNext;    //!< Next entry in the drive's dirty list.
+    uint32_t dirtyTime;     //!< System tick count when the entry last became dirty.
 
 #if CACHE_STATISTICS
     //! \name Statistics
@@ -177,11 +368,17 @@ struct MediaCacheEntry : public RedBlackTree::Node, public WeightedLRUList::Node
 
     //! \brief Constructor.
     MediaCacheEntry(uint8_t * theBuffer)
-    :   RedBlackTree::Node(),
-        WeightedLRUList::Node(),
+    :   WeightedLRUList::Node(),
+        shard(CACHE_NO_SHARD),
+        dirtyPrev(NULL),
+        dirtyNext(NULL),
         buffer(theBuffer)
     {
         // Clear the rest of the fields to zero.
+        isDirty = 0;
+        queue = kCache2QQueue_None;
+        homeQueue = kCache2QQueue_Probation;
+        isQueueNew = 1;
         reset();
     }
     
@@ -189,9 +386,24 @@ struct MediaCacheEntry : public RedBlackTree::Node, public WeightedLRUList::Node
     //@{
     
         //! \brief Clears and invalidates the entry.
-        //! \pre The entry must have already been removed from any lists or indices.
+        //!
+        //! The entry is taken off its drive's dirty list, if it is dirty.
+        //!
+        //! \pre The entry must have already been removed from the LRU list and index.
         void reset();
         
+        //! \brief Marks the entry dirty and adds it to the tail of its shard's dirty list.
+        //! \pre The entry must be owned by a shard, and that shard must be locked.
+        void setDirty();
+        
+        //! \brief Marks the entry clean and removes it from its shard's dirty list.
+        //! \pre The entry's shard must be locked.
+        void clearDirty();
+        
+        //! \brief Returns the shard that owns the entry.
+        //! \pre The entry must not be in the free pool.
+        inline MediaCacheShard & getShard() const;
+        
         //! \brief Calculates the cache entry's index in an array.
         //! \param arrayStart The pointer to the start of the array of which the entry is a element.
         //! \return An integer index into \a arrayStart is calculated and returned.
@@ -207,14 +419,6 @@ struct MediaCacheEntry : public RedBlackTree::Node, public WeightedLRUList::Node
 
     //@}
 
-    //! \name Tree node methods
-    //@{
-    
-        //! \brief Return the node's key value.
-        virtual RedBlackTree::Key_t getKey() const;
-    
-    //@}
-    
     //! \name LRU node methods
     //@{
     
@@ -301,45 +505,218 @@ struct MediaCacheEntry : public RedBlackTree::Node, public WeightedLRUList::Node
     //@}
 };
 
+/*!
+ * \brief Sequential stream detector state for one drive.
+ *
+ * The stream tracks the last native sector read from the drive. Once
+ * #CACHE_READ_AHEAD_TRIGGER sequential sectors have been read, sectors ahead of
+ * the caller are loaded into the cache. The window doubles each time more sectors
+ * are read ahead, up to \a limit. The limit itself is adapted to how useful read-ahead
+ * has been on the drive: it grows by one every time a read-ahead entry is hit, and is
+ * halved every time one is evicted without ever having been read.
+ *
+ * The sectors are loaded by the cache I/O thread. Only one fill per drive is queued
+ * at a time, and \a nextSector is only advanced once the fill has completed.
+ *
+ * \ingroup media_cache_internal
+ */
+struct MediaCacheReadAheadStream
+{
+    uint32_t lastSector;    //!< Last native sector read by a caller.
+    uint32_t nextSector;    //!< First sector beyond those already read ahead.
+    uint16_t runLength;     //!< Number of sequential native sectors read, or 0 if there is no stream.
+    uint16_t window;        //!< Current read-ahead window in native sectors.
+    uint16_t limit;         //!< Adaptive upper bound on \a window.
+    bool isFillQueued;      //!< A fill starting at \a nextSector is queued to the cache I/O thread.
+};
+
+/*!
+ * \brief One shard of the media cache.
+ *
+ * A shard is assigned to a drive the first time the drive is accessed through the
+ * cache, and holds everything the cache keeps for that drive. The shard's mutex
+ * protects all of its members except the latency histograms, as well as the entries
+ * it owns. The histograms are updated with interrupts disabled, so that operations
+ * can record their latency after releasing the mutex, and so that reading them never
+ * waits for a slow operation on the drive.
+ *
+ * The index and LRU list only ever contain entries owned by the shard. The index and
+ * flush list are sized for the largest size the cache can grow to, since a shard may
+ * end up owning every entry.
+ *
+ * The zero sector list holds sectors that have been filled with zeroes by
+ * media_cache_write_zeroes() and not written back yet. These sectors are dirty, but
+ * take no entry or buffer. A sector is never in both the zero sector list and the
+ * index. Since every miss checks the list, it is hashed by sector: each bucket chains
+ * the positions of its sectors through \a zeroHashNext.
+ *
+ * The dirty list links every dirty entry of the shard through the entries'
+ * \a dirtyPrev and \a dirtyNext members. It is circular, and entries are added at
+ * the tail as they become dirty, so the head is always the entry that has been
+ * dirty the longest. The list is maintained by MediaCacheEntry::setDirty() and
+ * MediaCacheEntry::clearDirty().
+ *
+ * \ingroup media_cache_internal
+ */
+struct MediaCacheShard
+{
+    TX_MUTEX mutex;     //!< Mutex protecting the shard and the entries it owns.
+    DriveTag_t drive;   //!< Tag of the drive the shard is assigned to.
+    bool isAssigned;    //!< Whether the shard has been assigned to a drive.
+    unsigned entryCount;    //!< Number of cache entries owned by the shard.
+    MediaCacheIndex * index;    //!< Hash table indexing the shard's cached sectors.
+    WeightedLRUList * lru;  //!< The shard's unowned entries, ordered by the replacement policy.
+    MediaCacheEntry ** flushList; //!< Scratch array, with room for every entry descriptor, used to sort dirty entries during a flush.
+    MediaCacheReadAheadStream readAhead;    //!< Sequential read-ahead stream.
+    MediaCacheEntry * dirtyHead;    //!< Oldest dirty entry, or NULL if no entries are dirty.
+    unsigned dirtyCount;    //!< Number of entries on the dirty list.
+    MediaCacheLatencyHistogram_t latency[kMediaCacheLatencyOpCount];  //!< Latencies of the operations on the drive.
+    uint32_t zeroSectors[CACHE_ZERO_SECTOR_COUNT];  //!< Native sectors that are all zeroes in the cache but not yet on media, in no particular order.
+    unsigned zeroCount;     //!< Number of sectors in \a zeroSectors.
+    uint8_t zeroHashHeads[CACHE_ZERO_HASH_BUCKETS]; //!< Position in \a zeroSectors of a sector in each hash bucket, or #CACHE_ZERO_NONE.
+    uint8_t zeroHashNext[CACHE_ZERO_SECTOR_COUNT];  //!< Position of the next sector in the same hash bucket, or #CACHE_ZERO_NONE.
+    uint32_t zeroTime;      //!< System tick count when the first sector was put in \a zeroSectors.
+    uint8_t minPercent;     //!< Reserved percentage of the cache entries. Changed under the context mutex.
+    uint8_t maxPercent;     //!< Largest percentage of the cache entries the shard may own. Changed under the context mutex.
+};
+
+/*!
+ * \brief State of the background write-back flusher.
+ * \ingroup media_cache_internal
+ */
+struct MediaCacheFlusher
+{
+    MediaCacheFlusherConfig_t config;   //!< Current configuration.
+    TX_THREAD * thread;     //!< The flusher thread, or NULL if it is not running.
+    TX_SEMAPHORE wakeSem;   //!< Put to wake the flusher thread.
+    TX_SEMAPHORE exitSem;   //!< Put by the flusher thread just before it returns.
+    bool isSemCreated;      //!< Whether \a wakeSem and \a exitSem have been created.
+    volatile bool shouldExit;   //!< Set to ask the flusher thread to exit.
+    bool isSignaled;        //!< The high watermark was reached and the thread has been woken.
+};
+
+/*!
+ * \brief An asynchronous read request.
+ *
+ * Requests that are not in use are linked through \a next on the free list. A queued
+ * request is linked through \a next on the queue, and heads its own list of waiters,
+ * which are linked through \a nextWaiter.
+ *
+ * A request with a nonzero \a readAheadCount is a read-ahead fill queued by
+ * cache_ReadAhead(). It has no callback, and loads \a readAheadCount sectors starting
+ * with \a nativeSector instead of reading one sector through \a pb.
+ *
+ * \ingroup media_cache_internal
+ */
+struct MediaCacheAsyncRequest
+{
+    MediaCacheParamBlock_t pb;  //!< Copy of the caller's param block, which receives the result.
+    MediaCacheReadCallback_t callback;  //!< Function to invoke with the result.
+    void * refcon;          //!< Value passed to \a callback.
+    unsigned nativeSector;  //!< Native sector the request loads, for finding requests to coalesce with.
+    unsigned readAheadCount;    //!< Number of sectors a read-ahead fill loads, or 0 for a read.
+    MediaCacheAsyncRequest * next;  //!< Next request on the queue or free list.
+    MediaCacheAsyncRequest * nextWaiter;    //!< Next request waiting for the same sector.
+};
+
+/*!
+ * \brief State of the cache I/O thread that serves asynchronous reads.
+ *
+ * All members except the thread's exit flags are protected by the context mutex.
+ *
+ * \ingroup media_cache_internal
+ */
+struct MediaCacheAsyncReader
+{
+    MediaCacheAsyncRequest requests[CACHE_ASYNC_REQUEST_COUNT];  //!< Pool of requests.
+    MediaCacheAsyncRequest * freeHead;  //!< Requests not in use.
+    MediaCacheAsyncRequest * queueHead; //!< Oldest queued request, which is loaded next.
+    MediaCacheAsyncRequest * queueTail; //!< Newest queued request.
+    MediaCacheAsyncRequest * active;    //!< Request being loaded by the thread, which may still gain waiters.
+    TX_THREAD * thread;     //!< The I/O thread, or NULL if it is not running.
+    TX_SEMAPHORE wakeSem;   //!< Put once for each queued request.
+    TX_SEMAPHORE exitSem;   //!< Put by the thread just before it returns.
+    bool isSemCreated;      //!< Whether \a wakeSem and \a exitSem have been created.
+    volatile bool shouldExit;   //!< Set to ask the thread to exit once the queue is empty.
+};
+
+/*!
+ * \brief Keys of recently evicted sectors.
+ *
+ * Each time a valid sector is evicted to make room for another one, its index key
+ * is written to the next slot of the \a keys ring, replacing the oldest key. When a
+ * later miss finds its sector in the ring, a cache larger by the number of evictions
+ * made since then would have still held the sector, so the miss is counted in \a hits
+ * under that distance. Evictions are made by each shard from its own LRU list, so
+ * this is an estimate rather than an exact simulation of a larger cache.
+ *
+ * All members are protected by the context mutex.
+ *
+ * \ingroup media_cache_internal
+ */
+struct MediaCacheGhostList
+{
+    int64_t * keys;     //!< Ring of the index keys of evicted sectors. Unused slots are -1.
+    uint32_t * hits;    //!< Number of misses found in the ring, by distance from the newest key.
+    unsigned capacity;  //!< Number of elements in \a keys and \a hits.
+    unsigned next;      //!< Slot the next evicted key is written to.
+    uint32_t missCount; //!< Number of misses since the counts were last reset.
+};
+
 /*!
  * \brief Contains global media cache information.
  *
  * The statistics and access record members are only present when their respective
  * compile time option is enabled.
  *
- * The \a cacheIndexTree member is a red-black tree that maps from drive tag to the index
- * tree for that drive. The nodes of this tree have the drive tag as their key and hold
- * a pointer to the drive's cache index tree. The cache index tree then maps from 
- * drive-relative sector numbers to cache entries.
- *
  * The \a entries member is an array of fixed size containing all of the cache entry
- * descriptor structures. These descriptors are themselves both red-black tree nodes and
- * LRU list nodes, allowing them to be present in both a drive's cache index and the LRU
- * list as the same time. Because the cache entry descriptors are pre-allocated, there
- * is never a need to allocate a new tree or list node during runtime.
+ * descriptor structures. These descriptors are themselves LRU list nodes, and the shard
+ * indices refer to them by array position, allowing them to be present in both a sector
+ * index and an LRU list as the same time. Because the cache entry descriptors are
+ * pre-allocated, and a shard's index is allocated once when the shard is assigned to
+ * a drive, there is never a need to allocate memory while handling a cache miss.
+ *
+ * The array has room for \a entryCapacity descriptors, of which the first \a entryCount
+ * are in use. Resizing the cache only moves that boundary, so the array itself, and the
+ * entry indexes held by the shard indexes and tokens, never change. The buffers of the
+ * first \a initialEntryCount entries are in the buffer passed to media_cache_init().
+ * Those of any entries after them were allocated by media_cache_resize().
+ *
+ * The \a shardOfDrive table maps each drive tag to the index of its shard. Entries are
+ * only ever set, under the context mutex, after the shard is ready for use, so the table
+ * can be read without locking.
  *
  * \ingroup media_cache_internal
  */
 struct MediaCacheContext
 {
     bool isInited;  //!< True if the media cache has been initialized.
-    TX_MUTEX mutex; //!< Mutex to protect access to the media cache.
+    TX_MUTEX mutex; //!< Mutex protecting shard assignment, the free pool, and the access records.
     unsigned entryBufferSize;     //!< Size in bytes of the cache entry sector buffers. This is the maximum sector size for all drives.
     unsigned entryCount;    //!< Number of cache entries.
+    unsigned entryCapacity; //!< Number of descriptors in \a entries, and the most entries the cache can grow to.
+    unsigned initialEntryCount; //!< Number of entries whose buffers are in the buffer passed to media_cache_init().
     MediaCacheEntry * entries;    //!< Pointer to the array of cache entries.
+    void ** extraBuffers;   //!< Blocks allocated for the buffers of the entries after \a initialEntryCount, starting with that entry.
     unsigned maxChainedEntries;   //!< Maximum number of entries that may be chained for a read or pinned write.
-    RedBlackTree * tree;    //!< Tree indexing all cached sectors.
-    WeightedLRUList * lru;  //!< The LRU list.
+    DoubleList * freeList;  //!< Entries not owned by any shard.
+    unsigned readAheadMaxWindow;    //!< Maximum read-ahead window in native sectors. Zero disables read-ahead.
+    MediaCachePolicy_t policy;  //!< Replacement policy used by the shard LRU lists.
+    unsigned lruWindowSize; //!< Weighting window size used for shard LRU lists.
+    unsigned shardCount;    //!< Number of shards assigned to drives.
+    MediaCacheShard shards[CACHE_SHARD_COUNT];  //!< The cache shards.
+    uint8_t shardOfDrive[256];  //!< Shard index for each drive tag, or #CACHE_NO_SHARD.
+    MediaCacheFlusher flusher;  //!< Background write-back flusher.
+    MediaCacheAsyncReader async;    //!< Cache I/O thread and its queue of asynchronous reads.
+    MediaCacheGhostList ghosts; //!< Keys of recently evicted sectors.
 
 #if CACHE_STATISTICS
     //! \name Statistics
     //@{
     
-        MediaCacheDriveStatistics statistics[MAX_LOGICAL_DRIVES];   //!< Access statistics for all drives.
-        MediaCacheDriveStatistics combinedStatistics; //!< Statistics for all drives together. 
-        MediaCacheAverageTime indexSearchTime;  //!< Average microseconds spent searching the cache tree.
-        MediaCacheAverageTime indexInsertTime;  //!< Average time to insert an entry into the cache tree.
-        MediaCacheAverageTime indexRemoveTime;  //!< Average time to remove an entry from the cache tree.
+        MediaCacheAverageTime indexSearchTime;  //!< Average microseconds spent searching the cache index.
+        MediaCacheAverageTime indexInsertTime;  //!< Average time to insert an entry into the cache index.
+        MediaCacheAverageTime indexRemoveTime;  //!< Average time to remove an entry from the cache index.
         
     //@}
 #endif
@@ -372,15 +749,49 @@ extern MediaCacheContext g_mediaCacheContext;
 
 // This comes down here because it needs g_mediaCacheContext to be declared.
 /*!
- * \brief Helper class to automatically lock and unlock the media cache mutex.
+ * \brief Helper class to automatically lock and unlock a media cache shard.
  */
 class MediaCacheLock : public SimpleMutex
 {
 public:
-    //! \brief Constructor; locks the mutex.
-    MediaCacheLock() : SimpleMutex(g_mediaCacheContext.mutex) {}
+    //! \brief Constructor; locks the shard's mutex.
+    MediaCacheLock(MediaCacheShard * shard) : SimpleMutex(shard->mutex) {}
 };
 
+/*!
+ * \brief Helper class to lock every shard of the media cache.
+ *
+ * Shards are locked in array order and unlocked in reverse. This must not be used
+ * while holding a shard lock.
+ */
+class MediaCacheLockAll
+{
+public:
+    //! \brief Constructor; locks all shards.
+    MediaCacheLockAll()
+    {
+        for (unsigned i = 0; i < CACHE_SHARD_COUNT; ++i)
+        {
+            tx_mutex_get(&g_mediaCacheContext.shards[i].mutex, TX_WAIT_FOREVER);
+        }
+    }
+    
+    //! \brief Destructor; unlocks all shards.
+    ~MediaCacheLockAll()
+    {
+        for (unsigned i = CACHE_SHARD_COUNT; i > 0; --i)
+        {
+            tx_mutex_put(&g_mediaCacheContext.shards[i - 1].mutex);
+        }
+    }
+};
+
+inline MediaCacheShard & MediaCacheEntry::getShard() const
+{
+    assert(shard < CACHE_SHARD_COUNT);
+    return g_mediaCacheContext.shards[shard];
+}
+
 //! \addtogroup media_cache_internal
 //@{
 
@@ -391,18 +802,50 @@ public:
     RtStatus_t cache_AdjustAndConvertSector(MediaCacheParamBlock_t * pb, unsigned * nativeSector, unsigned * subsectorOffset, unsigned * actualSectorCount);
 
     //! \brief Creates a 64-bit index key from a drive and sector number pair.
-    inline RedBlackTree::Key_t cache_BuildIndexKey(unsigned drive, unsigned sector)
+    inline int64_t cache_BuildIndexKey(unsigned drive, unsigned sector)
     {
         return (static_cast<int64_t>(sector) | (static_cast<int64_t>(drive) << 32));
     }
 
-    //! \brief Fully unlocks the cache mutex and returns its lock count.
+    //! \brief Fully unlocks a shard's mutex and returns its lock count.
     //! \return The lock count before it was unlocked.
-    uint32_t release_cache_lock();
+    uint32_t release_cache_lock(MediaCacheShard * shard);
     
-    //! \brief Restores the lock count for the media cache mutex.
+    //! \brief Restores the lock count for a shard's mutex.
+    //! \param shard The shard that was unlocked.
     //! \param u32OwnershipCount The previous lock count for the mutex, as returned from release_cache_lock().
-    void resume_cache_lock(uint32_t u32OwnershipCount);
+    void resume_cache_lock(MediaCacheShard * shard, uint32_t u32OwnershipCount);
+
+//@}
+
+//! \name Shards
+//@{
+
+    //! \brief Returns the shard for a drive, assigning one if the drive doesn't have one yet.
+    RtStatus_t cache_GetShard(DriveTag_t drive, MediaCacheShard ** shard);
+    
+    //! \brief Returns the shard assigned to a drive.
+    //! \return The drive's shard, or NULL if the drive has never been accessed through the cache.
+    inline MediaCacheShard * cache_FindShard(DriveTag_t drive)
+    {
+        unsigned i = g_mediaCacheContext.shardOfDrive[drive];
+        return (i < CACHE_SHARD_COUNT) ? &g_mediaCacheContext.shards[i] : NULL;
+    }
+    
+    //! \brief Get an entry the shard can reuse, from the free pool, another shard, or its own LRU.
+    MediaCacheEntry * cache_shard_SelectEntry(MediaCacheShard * shard, bool canSteal);
+    
+    //! \brief Returns the total number of dirty entries in all shards.
+    unsigned cache_GetDirtyCount();
+    
+    //! \brief Put every entry in the free pool and reallocate the assigned shards.
+    RtStatus_t cache_ResetShards();
+
+    //! \brief Size the LRU list state of every assigned shard for the current entry count.
+    void cache_ResizeShards();
+    
+    //! \brief Dispose of the index, LRU, and flush list of every shard.
+    void cache_DisposeShards();
 
 //@}
 
@@ -411,8 +854,9 @@ public:
 //! These functions maintain an index of sector numbers to media sector cache entries.
 //! Drive number is also considered. Using these functions to find a given cache entry is much
 //! faster than using a linear search over all entries, especially as the number of entries
-//! gets to be relatively large. A RedBlackTree is used to index the sectors for each drive.
-//! Thus, the access times are O(log N) versus O(N) for linear operations.
+//! gets to be relatively large. Each shard has a MediaCacheIndex hash table indexing the
+//! sectors of its drive. Thus, the access times are O(1) versus O(N) for linear operations.
+//! The shard of the drive or entry in question must be locked.
 //@{
 
     //! \brief Search for a matching sector in the sector cache.
@@ -438,6 +882,83 @@ public:
     //! \brief Finish up a pinned write operation.
     RtStatus_t cache_CompletePinnedWrite(MediaCacheEntry * cache);
 
+    //! \brief Write a group of sequential dirty entries to media.
+    RtStatus_t cache_WriteBackGroup(MediaCacheEntry ** group, unsigned count);
+
+    //! \brief Track sequential reads and queue loads of sectors ahead of the caller.
+    void cache_ReadAhead(uint8_t drive, MediaCacheEntry * cache);
+
+    //! \brief Load sectors ahead of a sequential reader, on the cache I/O thread.
+    void cache_CompleteReadAhead(DriveTag_t drive, unsigned startSector, unsigned count);
+
+    //! \brief Forget the read-ahead stream state for every shard.
+    void cache_ResetReadAhead();
+
+//@}
+
+//! \name Resizing
+//@{
+
+    //! \brief Allocate the state used to resize the cache and estimate hits of a larger cache.
+    RtStatus_t cache_InitResizing();
+
+    //! \brief Free the buffers of entries added by resizing, and the ghost list.
+    void cache_DisposeResizing();
+
+    //! \brief Set the maximum number of chained entries for the current entry count.
+    void cache_UpdateMaxChainedEntries();
+
+    //! \brief Remember the sector of an entry that is being evicted.
+    void cache_ghost_AddEvicted(const MediaCacheEntry * entry);
+
+    //! \brief Count a miss, and whether the ghost list shows a larger cache would have hit.
+    void cache_ghost_CheckMiss(DriveTag_t drive, unsigned sector);
+
+//@}
+
+//! \name Zero sectors
+//@{
+
+    //! \brief Returns whether a sector is in a shard's zero sector list.
+    bool cache_zero_Contains(MediaCacheShard * shard, uint32_t sector);
+
+    //! \brief Empty a shard's zero sector list without writing anything.
+    void cache_zero_Clear(MediaCacheShard * shard);
+
+    //! \brief Fill an entry with zeroes if its sector is in the shard's zero sector list.
+    void cache_zero_Materialize(MediaCacheEntry * entry);
+
+    //! \brief Write all of a shard's zero sectors to media.
+    RtStatus_t cache_zero_WriteBack(MediaCacheShard * shard);
+
+    //! \brief Write the first group of a shard's zero sectors to media.
+    RtStatus_t cache_zero_WriteBackGroup(MediaCacheShard * shard);
+
+//@}
+
+//! \name Background flusher
+//@{
+
+    //! \brief Wake the flusher thread if the dirty count has reached the high watermark.
+    void cache_flusher_CheckWatermark();
+
+    //! \brief Stop the flusher thread and wait for it to exit.
+    void cache_flusher_Stop();
+
+//@}
+
+//! \name Asynchronous reads
+//@{
+
+    //! \brief Set up the asynchronous read request pool.
+    void cache_async_Init();
+
+    //! \brief Stop the cache I/O thread once it has completed every queued request.
+    void cache_async_Stop();
+
+    //! \brief Queue a read-ahead fill to the cache I/O thread.
+    RtStatus_t cache_async_QueueReadAhead(DriveTag_t drive, unsigned startSector, unsigned count);
+
 //@}
 
 #if CACHE_VALIDATE
@@ -0,0 +1,348 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor. All rights reserved.
+//
+// Freescale Semiconductor
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \addtogroup media_cache_internal
+//! @{
+//! \file flusher.cpp
+//! \brief Background write-back of dirty media cache entries.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "cacheutil.h"
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants
+////////////////////////////////////////////////////////////////////////////////
+
+//! Maximum number of entries examined on each shard's dirty list when looking for
+//! one that can be written back right now.
+const unsigned kMaxDirtyEntriesExamined = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+static void cache_flusher_Thread(uint32_t arg);
+static void cache_flusher_WriteBack();
+static RtStatus_t cache_flusher_WriteBackShard(MediaCacheShard * shard, bool isDraining, bool * didWrite, bool * isContended);
+static RtStatus_t cache_flusher_WriteBackOldest(MediaCacheEntry * oldest);
+static MediaCacheEntry * cache_flusher_FindOldest(MediaCacheShard * shard);
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_set_flusher(const MediaCacheFlusherConfig_t * config)
+{
+    assert(g_mediaCacheContext.isInited);
+    assert(config);
+
+    MediaCacheFlusher & flusher = g_mediaCacheContext.flusher;
+
+    if (config->isEnabled && (config->highWatermark > 100 || config->lowWatermark > config->highWatermark))
+    {
+        return ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER;
+    }
+
+    // Stop a running flusher so it starts over with the new configuration.
+    cache_flusher_Stop();
+
+    {
+        SimpleMutex lockContext(g_mediaCacheContext.mutex);
+        flusher.config = *config;
+    }
+
+    if (!config->isEnabled)
+    {
+        return SUCCESS;
+    }
+
+    // The semaphores live until the cache is shut down.
+    if (!flusher.isSemCreated)
+    {
+        RtStatus_t status = os_thi_ConvertTxStatus(tx_semaphore_create(&flusher.wakeSem, "mc:flusher", 0));
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+        status = os_thi_ConvertTxStatus(tx_semaphore_create(&flusher.exitSem, "mc:flusher:exit", 0));
+        if (status != SUCCESS)
+        {
+            tx_semaphore_delete(&flusher.wakeSem);
+            return status;
+        }
+        flusher.isSemCreated = true;
+    }
+
+    flusher.shouldExit = false;
+    flusher.isSignaled = false;
+
+    os_txi_ThreadAllocate(&flusher.thread,
+        "mc:flusher",
+        cache_flusher_Thread,
+        0,
+        DMI_MEM_SOURCE_DONTCARE,
+        CACHE_FLUSHER_STACK_SIZE,
+        CACHE_FLUSHER_PRIORITY,
+        CACHE_FLUSHER_PRIORITY,
+        TX_NO_TIME_SLICE,
+        TX_AUTO_START);
+    if (!flusher.thread)
+    {
+        return ERROR_GENERIC;   //! \todo Better error!
+    }
+
+    return SUCCESS;
+}
+
+//! The flusher thread is only woken once per crossing of the high watermark. It resets
+//! the \a isSignaled flag when it runs out of work.
+//!
+//! \pre The shard of the entry that was just dirtied must be locked.
+void cache_flusher_CheckWatermark()
+{
+    MediaCacheFlusher & flusher = g_mediaCacheContext.flusher;
+
+    if (!flusher.thread || flusher.isSignaled || flusher.config.highWatermark == 0)
+    {
+        return;
+    }
+
+    if (cache_GetDirtyCount() * 100 >= flusher.config.highWatermark * g_mediaCacheContext.entryCount)
+    {
+        flusher.isSignaled = true;
+        tx_semaphore_put(&flusher.wakeSem);
+    }
+}
+
+//! \pre No shard may be locked by the caller, since the flusher thread may be waiting
+//!     for a shard lock.
+void cache_flusher_Stop()
+{
+    MediaCacheFlusher & flusher = g_mediaCacheContext.flusher;
+
+    if (!flusher.thread)
+    {
+        return;
+    }
+
+    // Ask the thread to exit, wake it up in case it is idle, and wait for it to finish
+    // the group it may be writing.
+    flusher.shouldExit = true;
+    tx_semaphore_put(&flusher.wakeSem);
+    tx_semaphore_get(&flusher.exitSem, TX_WAIT_FOREVER);
+
+    os_txi_ThreadRelease(flusher.thread);
+    flusher.thread = NULL;
+}
+
+//! \param arg Unused.
+static void cache_flusher_Thread(uint32_t arg)
+{
+    MediaCacheFlusher & flusher = g_mediaCacheContext.flusher;
+
+    while (!flusher.shouldExit)
+    {
+        // Sleep until woken by the high watermark, or until it is time to look for aged
+        // entries. Without an age limit there is nothing to poll for.
+        uint32_t waitTicks = TX_WAIT_FOREVER;
+        if (flusher.config.maxAgeMs)
+        {
+            uint32_t pollMs = std::min<uint32_t>(flusher.config.maxAgeMs / 2, CACHE_FLUSHER_MAX_POLL_MS);
+            waitTicks = std::max<uint32_t>(OS_MSECS_TO_TICKS(pollMs), 1);
+        }
+        tx_semaphore_get(&flusher.wakeSem, waitTicks);
+
+        if (!flusher.shouldExit)
+        {
+            cache_flusher_WriteBack();
+        }
+    }
+
+    tx_semaphore_put(&flusher.exitSem);
+}
+
+//! Only a few entries at the head of the shard's dirty list are examined, so the search
+//! is bounded no matter how many entries are dirty. Entries with a pending pinned write
+//! cannot be written back and are passed over.
+//!
+//! \param shard The shard to search.
+//! \return The entry that has been dirty the longest, or NULL if there is none.
+//!
+//! \pre The shard must be locked.
+static MediaCacheEntry * cache_flusher_FindOldest(MediaCacheShard * shard)
+{
+    MediaCacheEntry * cache = shard->dirtyHead;
+    unsigned examineCount = std::min<unsigned>(shard->dirtyCount, kMaxDirtyEntriesExamined);
+
+    // The dirty list is kept in the order entries became dirty, so the first entry that
+    // can be written is the oldest.
+    for (unsigned i = 0; i < examineCount; ++i, cache = cache->dirtyNext)
+    {
+        if (cache->isValid && !cache->isWritePending)
+        {
+            return cache;
+        }
+    }
+
+    return NULL;
+}
+
+//! Locks the shard, writes its oldest dirty entry along with any dirty entries for the
+//! sectors following it, up to the drive's optimal transfer size, and unlocks the shard
+//! again. Zero sectors that are old enough are written first, also one group at a time.
+//! Only the shard's own lock is held, so the other drives are never held off.
+//!
+//! \param shard The shard to write back from.
+//! \param isDraining Whether the dirty count is above the low watermark, in which case the
+//!     oldest entry is written back regardless of its age.
+//! \param[out] didWrite Set to whether a group of entries was written.
+//! \param[out] isContended Set to whether a foreground thread is waiting for the shard.
+//! \retval SUCCESS A group was written, or the shard has nothing to write back yet.
+//!
+//! \pre The shard must not be locked by the caller.
+static RtStatus_t cache_flusher_WriteBackShard(MediaCacheShard * shard, bool isDraining, bool * didWrite, bool * isContended)
+{
+    const MediaCacheFlusherConfig_t & config = g_mediaCacheContext.flusher.config;
+
+    MediaCacheLock lockCache(shard);
+
+    uint32_t now = tx_time_get();
+    *didWrite = false;
+    *isContended = false;
+
+    RtStatus_t status;
+
+    // Zero sectors don't hold any entries, so they only go out once they are old enough,
+    // one group per pass like the entries.
+    if (shard->zeroCount && config.maxAgeMs && (now - shard->zeroTime) >= OS_MSECS_TO_TICKS(config.maxAgeMs))
+    {
+        status = cache_zero_WriteBackGroup(shard);
+    }
+    else
+    {
+        MediaCacheEntry * oldest = cache_flusher_FindOldest(shard);
+        bool isAged = oldest && config.maxAgeMs && (now - oldest->dirtyTime) >= OS_MSECS_TO_TICKS(config.maxAgeMs);
+
+        if (!oldest || (!isDraining && !isAged))
+        {
+            return SUCCESS;
+        }
+
+        status = cache_flusher_WriteBackOldest(oldest);
+    }
+
+    ULONG suspendedCount = 0;
+    tx_mutex_info_get(&shard->mutex, NULL, NULL, NULL, NULL, &suspendedCount, NULL);
+
+    *didWrite = true;
+    *isContended = suspendedCount > 0;
+
+    return status;
+}
+
+//! Writes an entry along with any dirty entries for the sectors following it, up to the
+//! drive's optimal transfer size.
+//!
+//! \param oldest The entry that has been dirty the longest.
+//! \return Status of writing the group.
+//!
+//! \pre The shard owning \a oldest must be locked.
+static RtStatus_t cache_flusher_WriteBackOldest(MediaCacheEntry * oldest)
+{
+    // Pick up the dirty sectors that follow the oldest one, so they go out together.
+    MediaCacheEntry * group[CACHE_MAX_CHAINED_ENTRIES];
+    unsigned planeCount = DriveGetInfoTyped<uint32_t>(oldest->drive, kDriveInfoOptimalTransferSectorCount);
+    planeCount = std::max<unsigned>(std::min<unsigned>(planeCount, CACHE_MAX_CHAINED_ENTRIES), 1);
+    unsigned groupCount = 1;
+    group[0] = oldest;
+    while (groupCount < planeCount)
+    {
+        MediaCacheEntry * next = cache_index_LookupSectorEntry(oldest->drive, oldest->sector + groupCount);
+        if (!next || !next->isDirty || next->isWritePending)
+        {
+            break;
+        }
+        group[groupCount++] = next;
+    }
+
+    MediaTask task("cache_flusher_WriteBack");
+    return cache_WriteBackGroup(group, groupCount);
+}
+
+//! Each pass through the loop visits the assigned shards in turn, writing back one group
+//! from each, so a drive with a long backlog of dirty entries doesn't starve the others.
+//! Foreground threads waiting on a shard get it as soon as its group is written, so they
+//! are never held off for more than one program operation. Write-back stops once the
+//! dirty count falls to the low watermark and no entry is older than the age limit, or
+//! if a write fails. Errors are left for the next foreground flush or eviction to report.
+static void cache_flusher_WriteBack()
+{
+    MediaCacheFlusher & flusher = g_mediaCacheContext.flusher;
+    bool isDraining = false;
+
+    while (!flusher.shouldExit)
+    {
+        const MediaCacheFlusherConfig_t & config = flusher.config;
+        unsigned dirtyPercent = g_mediaCacheContext.entryCount ? (cache_GetDirtyCount() * 100 / g_mediaCacheContext.entryCount) : 0;
+
+        // Start draining at the high watermark and keep going down to the low watermark.
+        if (config.highWatermark && dirtyPercent >= config.highWatermark)
+        {
+            isDraining = true;
+        }
+        else if (dirtyPercent <= config.lowWatermark)
+        {
+            isDraining = false;
+        }
+
+        bool didWrite = false;
+        bool didFail = false;
+        bool isContended = false;
+
+        // Shards are assigned in order and never unassigned, so it is safe to check without a lock.
+        for (unsigned i = 0; i < CACHE_SHARD_COUNT && g_mediaCacheContext.shards[i].isAssigned && !flusher.shouldExit; ++i)
+        {
+            bool didWriteShard;
+            bool isShardContended;
+            if (cache_flusher_WriteBackShard(&g_mediaCacheContext.shards[i], isDraining, &didWriteShard, &isShardContended) != SUCCESS)
+            {
+                didFail = true;
+                break;
+            }
+            didWrite = didWrite || didWriteShard;
+            isContended = isContended || isShardContended;
+        }
+
+        if (!didWrite || didFail)
+        {
+            flusher.isSignaled = false;
+            break;
+        }
+
+        // Let waiting foreground threads have the cache before writing the next groups.
+        if (isContended)
+        {
+            tx_thread_sleep(1);
+        }
+        else
+        {
+            tx_thread_relinquish();
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
+//! @}
@@ -17,6 +17,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "cacheutil.h"
+#include <algorithm>
 
 ///////////////////////////////////////////////////////////////////////////////
 // Prototypes
@@ -25,6 +26,10 @@
 static RtStatus_t flush_sector(DriveTag_t drive, int32_t sectorNumber, int32_t ix, uint32_t flags);
 static RtStatus_t flush_cache(uint32_t flags);
 static RtStatus_t flush_drive_cache(DriveTag_t drive, uint32_t flags);
+static RtStatus_t flush_shard(MediaCacheShard * shard, uint32_t flags, bool stopOnError);
+static void flush_write_back_sorted(MediaCacheShard * shard, unsigned count);
+static unsigned flush_collect_dirty(MediaCacheShard * shard);
+static RtStatus_t flush_dirty_entries(MediaCacheShard * shard, unsigned count, uint32_t flags, bool stopOnError);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Code
@@ -33,7 +38,7 @@ static RtStatus_t flush_drive_cache(DriveTag_t drive, uint32_t flags);
 ///////////////////////////////////////////////////////////////////////////////
 //! \brief Flushes the given sector to disk.
 //!
-//! \pre Cache must be locked.
+//! \pre The shard of \a drive must be locked.
 ///////////////////////////////////////////////////////////////////////////////
 static RtStatus_t flush_sector(DriveTag_t drive, int32_t sectorNumber, int32_t ix, uint32_t flags)
 {
@@ -67,6 +72,14 @@ static RtStatus_t flush_sector(DriveTag_t drive, int32_t sectorNumber, int32_t i
         
         // Look up this sector in the cache index.
         cache = cache_index_LookupSectorEntry(drive, nativeSector);
+
+        // A zero sector has no entry, so it is written back along with the rest of the
+        // drive's zero sectors.
+        MediaCacheShard * shard = cache_FindShard(drive);
+        if (!cache && shard && cache_zero_Contains(shard, nativeSector))
+        {
+            rslt = cache_zero_WriteBack(shard);
+        }
     }
     
     // Only need to actually flush if the entry is dirty.
@@ -79,6 +92,7 @@ static RtStatus_t flush_sector(DriveTag_t drive, int32_t sectorNumber, int32_t i
         // wait routines we unlock the cache so that a deadlock does not occur with the
         // flushing thread waiting for an entry to become unowned while another thread
         // that owns that entry is waiting for the lock.
+        uint8_t shardIndex = cache->shard;
         if (flags & kMediaCacheFlag_Invalidate)
         {
             // Make certain that there are no owners of this cache entry.
@@ -96,6 +110,13 @@ static RtStatus_t flush_sector(DriveTag_t drive, int32_t sectorNumber, int32_t i
             return rslt;
         }
         
+        // While the shard was unlocked, another shard may have taken the entry. It can
+        // only do that to a clean entry, so there is nothing left to flush.
+        if (cache->shard != shardIndex)
+        {
+            return SUCCESS;
+        }
+        
         // Flush if dirty.
         rslt = cache->flush();  // We will ignore errors if coming from the function here
                                 // so that we can process the invalidate flag check.  
@@ -112,43 +133,306 @@ static RtStatus_t flush_sector(DriveTag_t drive, int32_t sectorNumber, int32_t i
             }
     
             // Invalidate the entry and place it at the head/LRU of LRU list.
-            g_mediaCacheContext.lru->remove(cache);
+            cache->getShard().lru->remove(cache);
             cache->reset(); // Note that reset() clears the "valid" flag, which causes insert()
                             // to insert to the head/LRU of the list.
-            g_mediaCacheContext.lru->insert(cache);
+            cache->getShard().lru->insert(cache);
         }
 
         if(flags & kMediaCacheFlag_RemoveEntry)
         {
-            g_mediaCacheContext.lru->remove(cache);            
+            cache->getShard().lru->remove(cache);            
         }
     }
 
     return rslt;
 }
 
+//! \brief Ordering used to sort dirty entries before they are written back.
+static bool flush_compare_entries(const MediaCacheEntry * a, const MediaCacheEntry * b)
+{
+    if (a->drive != b->drive)
+    {
+        return a->drive < b->drive;
+    }
+    return a->sector < b->sector;
+}
+
+//! \brief Returns true if an entry can be written back by the sorted flush.
+static inline bool flush_is_writable(const MediaCacheEntry * cache)
+{
+    return cache->isValid && cache->isDirty && !cache->isWritePending;
+}
+
+//! The entries must all belong to the same drive and hold sequential native sectors,
+//! starting with \a group[0]. When there is more than one entry, the writes are wrapped
+//! in a multisector transaction so the drive can program them together. Writing stops
+//! at the first error.
+//!
+//! \param group Array of entries to write.
+//! \param count Number of entries in \a group.
+//! \retval SUCCESS All entries were written and are now clean.
+//!
+//! \pre The entries' shard must be locked. All entries are valid, dirty, and have no
+//!     pending write.
+RtStatus_t cache_WriteBackGroup(MediaCacheEntry ** group, unsigned count)
+{
+    assert(count > 0);
+    DriveTag_t drive = group[0]->drive;
+    
+    bool useMulti = count > 1
+        && DriveOpenMultisectorTransaction(drive, group[0]->sector, count, false) == SUCCESS;
+    
+    RtStatus_t status = SUCCESS;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        assert(group[i]->drive == drive && group[i]->sector == group[0]->sector + i);
+        
+        cache_RecordFlush(group[i]);
+        status = group[i]->write();
+        if (status != SUCCESS)
+        {
+            break;
+        }
+    }
+    
+    if (useMulti)
+    {
+        RtStatus_t commitStatus = DriveCommitMultisectorTransaction(drive);
+        if (status == SUCCESS)
+        {
+            status = commitStatus;
+        }
+    }
+    
+    return status;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
-//! \brief Flushes all the cache dirty buffers.
+//! \brief Writes back dirty entries in drive and sector order.
+//!
+//! The first \a count elements of the shard's flush list must be filled in with
+//! dirty entries. They are sorted by drive and sector, and each run of sequential
+//! sectors is written in groups of the drive's optimal transfer size inside a
+//! multisector transaction. This presents the drive with sequential writes that
+//! can go to consecutive pages using multiplane programs, instead of
+//! writing sectors in whatever order the entries happen to sit in the array.
 //!
+//! Waiting for a pending write to complete temporarily releases the cache lock,
+//! so each group is re-checked before it is written. Entries that changed in the
+//! meantime or failed to write are left alone. The caller's normal per-entry
+//! pass then handles them, as well as invalidation, and reports any errors.
+//!
+//! \pre The shard must be locked.
 ///////////////////////////////////////////////////////////////////////////////
-static RtStatus_t flush_cache(uint32_t flags)
+static void flush_write_back_sorted(MediaCacheShard * shard, unsigned count)
 {
-    RtStatus_t rslt = SUCCESS;
-    int ix;
+    MediaCacheEntry ** list = shard->flushList;
+    unsigned shardIndex = shard - g_mediaCacheContext.shards;
+    assert(list);
+    
+    std::sort(list, list + count, flush_compare_entries);
+    
+    MediaTask task("flush_write_back_sorted");
+    
+    unsigned planeCount = 1;
+    int planeCountDrive = -1;
+    unsigned i = 0;
+    while (i < count)
+    {
+        MediaCacheEntry * first = list[i];
+        DriveTag_t drive = first->drive;
+        uint32_t firstSector = first->sector;
+        
+        // Look up the optimal transfer size once per drive.
+        if (planeCountDrive != drive)
+        {
+            planeCount = DriveGetInfoTyped<uint32_t>(drive, kDriveInfoOptimalTransferSectorCount);
+            planeCount = std::max<unsigned>(planeCount, 1);
+            planeCountDrive = drive;
+        }
+        
+        // Build a group of sequential sectors, up to the plane count.
+        unsigned groupCount = 1;
+        while (groupCount < planeCount
+            && i + groupCount < count
+            && list[i + groupCount]->drive == drive
+            && list[i + groupCount]->sector == firstSector + groupCount)
+        {
+            ++groupCount;
+        }
+        
+        // Readers can keep the entries, but a writer must finish first. This may unlock the cache.
+        unsigned j;
+        bool isIntact = true;
+        for (j = 0; j < groupCount; ++j)
+        {
+            if (list[i + j]->waitUntilWriteCompletes() != SUCCESS)
+            {
+                isIntact = false;
+            }
+        }
+        
+        // Make sure the group is still what it was when the list was sorted.
+        for (j = 0; j < groupCount && isIntact; ++j)
+        {
+            MediaCacheEntry * cache = list[i + j];
+            isIntact = flush_is_writable(cache) && cache->shard == shardIndex
+                && cache->drive == drive && cache->sector == firstSector + j;
+        }
+        
+        if (isIntact)
+        {
+            cache_WriteBackGroup(&list[i], groupCount);
+        }
+        
+        i += groupCount;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! \brief Fills in a shard's flush list with its dirty entries.
+//!
+//! Only the shard's dirty list is walked, so the cost is proportional to the
+//! number of dirty entries rather than the size of the cache.
+//!
+//! \param shard Shard whose dirty entries are collected.
+//! \return The number of entries in the flush list.
+//!
+//! \pre The shard must be locked.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned flush_collect_dirty(MediaCacheShard * shard)
+{
+    MediaCacheEntry * cache = shard->dirtyHead;
+    unsigned count = 0;
+    
+    for (unsigned i = 0; i < shard->dirtyCount; ++i, cache = cache->dirtyNext)
+    {
+        assert(cache->isDirty && cache->drive == shard->drive);
+        shard->flushList[count++] = cache;
+    }
+    
+    return count;
+}
 
-    // Flush the entire cache.
-    for (ix = 0; ix < g_mediaCacheContext.entryCount; ix++)
+///////////////////////////////////////////////////////////////////////////////
+//! \brief Flushes the entries in the flush list that are still dirty.
+//!
+//! The list was built before the shard was last unlocked, so entries that have been
+//! cleaned or moved to another shard since then are skipped.
+//!
+//! \pre The shard must be locked.
+///////////////////////////////////////////////////////////////////////////////
+static RtStatus_t flush_dirty_entries(MediaCacheShard * shard, unsigned count, uint32_t flags, bool stopOnError)
+{
+    RtStatus_t rslt = SUCCESS;
+    unsigned shardIndex = shard - g_mediaCacheContext.shards;
+    
+    for (unsigned i = 0; i < count; ++i)
     {
-        MediaCacheEntry * cache = &g_mediaCacheContext.entries[ix];
-        if (cache->isValid)
+        MediaCacheEntry * cache = shard->flushList[i];
+        if (!cache->isValid || !cache->isDirty || cache->shard != shardIndex)
+        {
+            continue;
+        }
+        
+        RtStatus_t status = flush_sector(cache->drive, cache->sector, cache->getArrayIndex(g_mediaCacheContext.entries), flags);
+        if (status != SUCCESS)
         {
-            rslt = flush_sector(cache->drive, cache->sector, ix, flags);
-            if (SUCCESS != rslt)
+            rslt = status;
+            if (stopOnError)
             {
                 break;
             }
         }
     }
+    
+    return rslt;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! \brief Flushes all the cache buffers owned by one shard.
+//!
+//! \param shard The shard to flush.
+//! \param flags Flags passed to media_cache_flush().
+//! \param stopOnError Whether to give up on the remaining entries after the first error.
+//!
+//! \pre The shard must be locked.
+///////////////////////////////////////////////////////////////////////////////
+static RtStatus_t flush_shard(MediaCacheShard * shard, uint32_t flags, bool stopOnError)
+{
+    RtStatus_t rslt = SUCCESS;
+    RtStatus_t status;
+    int32_t ix;
+    unsigned shardIndex = shard - g_mediaCacheContext.shards;
+
+    // Write back the shard's zero sectors, then its dirty entries in sorted order.
+    rslt = cache_zero_WriteBack(shard);
+    if (rslt != SUCCESS && stopOnError)
+    {
+        return rslt;
+    }
+    flush_write_back_sorted(shard, flush_collect_dirty(shard));
+
+    if (flags & (kMediaCacheFlag_Invalidate | kMediaCacheFlag_RemoveEntry))
+    {
+        // Zero sectors that could not be written are dropped along with the entries.
+        cache_zero_Clear(shard);
+
+        // Every valid entry owned by the shard has to be visited to invalidate or remove it.
+        for (ix = 0; ix < g_mediaCacheContext.entryCount; ix++)
+        {
+            MediaCacheEntry * cache = &g_mediaCacheContext.entries[ix];
+            if (cache->isValid && cache->shard == shardIndex)
+            {
+                status = flush_sector(cache->drive, cache->sector, ix, flags);
+                if (SUCCESS != status)
+                {
+                    rslt = status;
+                    if (stopOnError)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    else
+    {
+        // Retry entries that are still dirty one at a time, to report any errors.
+        status = flush_dirty_entries(shard, flush_collect_dirty(shard), flags, stopOnError);
+        if (status != SUCCESS)
+        {
+            rslt = status;
+        }
+    }
+
+    return rslt;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//! \brief Flushes all the cache dirty buffers.
+//!
+//! The shards are locked and flushed one at a time, so drives that are not being
+//! flushed at the moment remain usable.
+///////////////////////////////////////////////////////////////////////////////
+static RtStatus_t flush_cache(uint32_t flags)
+{
+    RtStatus_t rslt = SUCCESS;
+
+    // Shards are assigned in order and never unassigned, so it is safe to check without a lock.
+    for (unsigned i = 0; i < CACHE_SHARD_COUNT && g_mediaCacheContext.shards[i].isAssigned; i++)
+    {
+        MediaCacheShard * shard = &g_mediaCacheContext.shards[i];
+        MediaCacheLatencyRecorder latency(shard, kMediaCacheLatency_Flush);
+        MediaCacheLock lockCache(shard);
+        
+        rslt = flush_shard(shard, flags, true);
+        if (SUCCESS != rslt)
+        {
+            break;
+        }
+    }
 
     // Flush all drives.
     DriveIterator_t iter;
@@ -172,22 +456,17 @@ static RtStatus_t flush_cache(uint32_t flags)
 static RtStatus_t flush_drive_cache(DriveTag_t drive, uint32_t flags)
 {
     RtStatus_t rslt = SUCCESS;
-    int32_t ix;
 
-    // Flush all the caches for this drive
-    for (ix = 0; ix < g_mediaCacheContext.entryCount; ix++)
+    // A drive without a shard has nothing in the cache.
+    MediaCacheShard * shard = cache_FindShard(drive);
+    MediaCacheLatencyRecorder latency(shard, kMediaCacheLatency_Flush);
+    if (shard)
     {
-        MediaCacheEntry * cache = &g_mediaCacheContext.entries[ix];
-        if (cache->isValid && drive == cache->drive)
-        {
-            rslt = flush_sector(cache->drive, cache->sector, ix, flags);
-            // If error is returned , we will continue the loop for external drive 
-            // as we need to invalidte and clear cache for all entries when we remove external media.
-            if (SUCCESS != rslt && drive!=DRIVE_TAG_DATA_EXTERNAL)
-            {
-                break;
-            }
-        }
+        MediaCacheLock lockCache(shard);
+        
+        // If error is returned , we will continue for external drive as we need to
+        // invalidte and clear cache for all entries when we remove external media.
+        rslt = flush_shard(shard, flags, drive != DRIVE_TAG_DATA_EXTERNAL);
     }
 
     // Flush the drive
@@ -201,13 +480,10 @@ RtStatus_t media_cache_flush(MediaCacheParamBlock_t * pb)
 {
     assert(g_mediaCacheContext.isInited);
     
-    // Lock the cache.
-    MediaCacheLock lockCache;
-    
-    RtStatus_t status;
+    RtStatus_t status = SUCCESS;
     
     // Depending on the flags that are set, flush a single sector, a single drive,
-    // or the entire cache.
+    // or the entire cache. The drive and entire cache flushes lock the shards themselves.
     if (pb->flags & kMediaCacheFlag_FlushAllDrives)
     {
         status = flush_cache(pb->flags);
@@ -218,7 +494,14 @@ RtStatus_t media_cache_flush(MediaCacheParamBlock_t * pb)
     }
     else
     {
-        status = flush_sector(pb->drive, pb->sector, 0, pb->flags);
+        // A drive without a shard has nothing in the cache.
+        MediaCacheShard * shard = cache_FindShard(pb->drive);
+        if (shard)
+        {
+            MediaCacheLatencyRecorder latency(shard, kMediaCacheLatency_Flush);
+            MediaCacheLock lockCache(shard);
+            status = flush_sector(pb->drive, pb->sector, -1, pb->flags);
+        }
     }
     
     return status;
@@ -24,7 +24,6 @@
 #include "cacheutil.h"
 #include <stdlib.h>
 #include "drivers/media/sectordef.h"
-#include "os/dmi/os_dmi_api.h"
 
 extern "C" {
 #include "hw/profile/hw_profile.h"
@@ -34,28 +33,32 @@ extern "C" {
 // Variables
 ///////////////////////////////////////////////////////////////////////////////
 
-#define MAX_NUM_EXTENDED_CACHE_BUFFERS  8
-
 //! Global context information for the media cache.
 MediaCacheContext g_mediaCacheContext;
 
-static unsigned g_mediaCacheCnt_bak = 0;
-static uint8_t *g_mediaCacheBuffer_org = NULL;
-static SECTOR_BUFFER *g_mediaCacheBuffer_extend[MAX_NUM_EXTENDED_CACHE_BUFFERS];
-static SECTOR_BUFFER *g_mediaCacheBuffer_org_extend[MAX_NUM_EXTENDED_CACHE_BUFFERS];
-
 ///////////////////////////////////////////////////////////////////////////////
 // Code
 ///////////////////////////////////////////////////////////////////////////////
 
 // See media_cache.h for the documentation of this function.
 RtStatus_t media_cache_init(uint8_t * cacheBuffer, uint32_t cacheBufferLength)
+{
+    return media_cache_init_with_policy(cacheBuffer, cacheBufferLength, kMediaCachePolicy_LRU);
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_init_with_policy(uint8_t * cacheBuffer, uint32_t cacheBufferLength, MediaCachePolicy_t policy)
 {
     // We only want to initialize once.
     if (g_mediaCacheContext.isInited)
     {
         return SUCCESS;
     }
+    
+    if (policy != kMediaCachePolicy_LRU && policy != kMediaCachePolicy_2Q)
+    {
+        return ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER;
+    }
 
     // Create the media cache mutex.
     if (tx_mutex_create(&g_mediaCacheContext.mutex, "mc", TX_NO_INHERIT) != TX_SUCCESS)
@@ -63,6 +66,34 @@ RtStatus_t media_cache_init(uint8_t * cacheBuffer, uint32_t cacheBufferLength)
         return ERROR_OS_KERNEL_TX_MUTEX_ERROR;
     }
     
+    // Create the shard mutexes. Shards are assigned to drives as the drives are first used.
+    // The low priority flusher holds a shard while it writes to media, so the mutexes
+    // inherit the priority of a foreground thread waiting for one.
+    unsigned shardIndex;
+    for (shardIndex = 0; shardIndex < CACHE_SHARD_COUNT; ++shardIndex)
+    {
+        MediaCacheShard & shard = g_mediaCacheContext.shards[shardIndex];
+        if (tx_mutex_create(&shard.mutex, "mc:shard", TX_INHERIT) != TX_SUCCESS)
+        {
+            return ERROR_OS_KERNEL_TX_MUTEX_ERROR;
+        }
+        shard.isAssigned = false;
+        shard.entryCount = 0;
+        shard.index = NULL;
+        shard.lru = NULL;
+        shard.flushList = NULL;
+        shard.dirtyHead = NULL;
+        shard.dirtyCount = 0;
+        cache_zero_Clear(&shard);
+        shard.zeroTime = 0;
+        shard.minPercent = 0;
+        shard.maxPercent = 100;
+        memset(shard.latency, 0, sizeof(shard.latency));
+    }
+    g_mediaCacheContext.shardCount = 0;
+    memset(g_mediaCacheContext.shardOfDrive, CACHE_NO_SHARD, sizeof(g_mediaCacheContext.shardOfDrive));
+    
+
 	// Figure out the maximum sector size we'll have to cache by asking the LDL.
 	uint32_t cacheSectorSize = MediaGetMaximumSectorSize();
     
@@ -79,8 +110,14 @@ RtStatus_t media_cache_init(uint8_t * cacheBuffer, uint32_t cacheBufferLength)
         return ERROR_DDI_MEDIA_CACHE_INVALID_BUFFER;
     }
 	
+    // Leave room in the descriptor array for the cache to grow. Every entry index must
+    // fit in a token and in a sector index slot.
+    g_mediaCacheContext.initialEntryCount = g_mediaCacheContext.entryCount;
+    g_mediaCacheContext.entryCapacity = std::max<unsigned>(g_mediaCacheContext.entryCount,
+        std::min<unsigned>(g_mediaCacheContext.entryCount * CACHE_MAX_ENTRY_MULTIPLE, kMediaCacheTokenEntryIndexMask - 1));
+
     // Dynamically allocate the cache entry descriptors.
-    unsigned cacheDescriptorsSize = g_mediaCacheContext.entryCount * sizeof(MediaCacheEntry);
+    unsigned cacheDescriptorsSize = g_mediaCacheContext.entryCapacity * sizeof(MediaCacheEntry);
     g_mediaCacheContext.entries =  (MediaCacheEntry *)malloc(cacheDescriptorsSize);
     if (g_mediaCacheContext.entries == NULL)
     {
@@ -88,14 +125,13 @@ RtStatus_t media_cache_init(uint8_t * cacheBuffer, uint32_t cacheBufferLength)
     }
     memset(g_mediaCacheContext.entries, 0, cacheDescriptorsSize);
     
-    // Create the drive tag to cache index tree.
-    g_mediaCacheContext.tree = new RedBlackTree;
-    assert(g_mediaCacheContext.tree);
+    // Create the list of entries not yet owned by any shard.
+    g_mediaCacheContext.freeList = new DoubleList;
+    assert(g_mediaCacheContext.freeList);
     
-    // Create the LRU with a window size of 0 in order to disable weighting.
-    unsigned windowSize = 0; //std::min<unsigned>(16, g_mediaCacheContext.entryCount / 2);
-    g_mediaCacheContext.lru = new WeightedLRUList(kMediaCacheWeight_Low, kMediaCacheWeight_High, windowSize);
-    assert(g_mediaCacheContext.lru);
+    // Shard LRUs are created with a window size of 0 in order to disable weighting.
+    g_mediaCacheContext.policy = policy;
+    g_mediaCacheContext.lruWindowSize = 0; //std::min<unsigned>(16, g_mediaCacheContext.entryCount / 2);
 
     // Init cache entries.
     int i = 0;
@@ -106,31 +142,36 @@ RtStatus_t media_cache_init(uint8_t * cacheBuffer, uint32_t cacheBufferLength)
     {
         // Use new in place operator to construct the media cache entry.
         new(entry) MediaCacheEntry(&cacheBuffer[j]);
-        
-        // Insert the entry in the LRU.
-        g_mediaCacheContext.lru->insert(entry);
 	}
-
-    // Set the max chained entries so that it is never greater than half
-    // the total number of entries. If the chain can encompass the all entries,
-    // then we can end up in a deadlock in the SCSI code that overlaps two reads
-    // or two pinned writes in a single thread. We subtract 1 from the value because
-    // the chain always includes the base entry but the max entries count does not.
-    g_mediaCacheContext.maxChainedEntries = std::min<unsigned>(CACHE_MAX_CHAINED_ENTRIES, g_mediaCacheContext.entryCount / 2);
-    if (g_mediaCacheContext.maxChainedEntries > 0)
+    
+    // Place all the entries in the free pool.
+    RtStatus_t status = cache_ResetShards();
+    if (status != SUCCESS)
     {
-        g_mediaCacheContext.maxChainedEntries--;
+        return status;
     }
+
+    cache_UpdateMaxChainedEntries();
     
-    for(i=0; i<MAX_NUM_EXTENDED_CACHE_BUFFERS; i++)
+    // Allocate the table of grown entry buffers and the ghost list.
+    status = cache_InitResizing();
+    if (status != SUCCESS)
     {
-        g_mediaCacheBuffer_org_extend[i] = NULL;
-        g_mediaCacheBuffer_extend[i] = NULL;
+        return status;
     }
 
+    // Start with the default read-ahead window and no streams.
+    g_mediaCacheContext.readAheadMaxWindow = CACHE_READ_AHEAD_WINDOW;
+    cache_ResetReadAhead();
+
+    // The background flusher is off until configured.
+    memset(&g_mediaCacheContext.flusher, 0, sizeof(g_mediaCacheContext.flusher));
+
+    // The cache I/O thread is started by the first asynchronous read.
+    cache_async_Init();
+
     // We're now finished initing.
     g_mediaCacheContext.isInited = true;
-    g_mediaCacheBuffer_org = cacheBuffer;
     
     return SUCCESS;
 }
@@ -138,27 +179,58 @@ RtStatus_t media_cache_init(uint8_t * cacheBuffer, uint32_t cacheBufferLength)
 // See media_cache.h for the documentation of this function.
 RtStatus_t media_cache_shutdown(void)
 {
-    // We lock the mutex and never unlock it before it is disposed of.
-    tx_mutex_get(&g_mediaCacheContext.mutex, TX_WAIT_FOREVER);
+    unsigned i;
+    
+    // Complete the queued asynchronous reads and stop the background threads before
+    // taking the lock, since they may be waiting on it.
+    cache_async_Stop();
+    cache_flusher_Stop();
+    
+    // We lock the shard mutexes and never unlock them before they are disposed of.
+    for (i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        tx_mutex_get(&g_mediaCacheContext.shards[i].mutex, TX_WAIT_FOREVER);
+    }
     
     // Flush and invalidate everything before shutting down.
     MediaCacheParamBlock_t pb = {0};
     pb.flags = kMediaCacheFlag_FlushAllDrives | kMediaCacheFlag_Invalidate;
     media_cache_flush(&pb);
     
-    // Dispose of the cache entry descriptors.
+    // The context mutex is taken last, following the lock order.
+    tx_mutex_get(&g_mediaCacheContext.mutex, TX_WAIT_FOREVER);
+    
+    // Dispose of the buffers of entries added by resizing, and the cache entry descriptors.
+    cache_DisposeResizing();
     free(g_mediaCacheContext.entries);
     g_mediaCacheContext.entries = NULL;
 
-    // Dispose of the sector index tree.
-    delete g_mediaCacheContext.tree;
-    g_mediaCacheContext.tree = NULL;
+    // Dispose of the shards' sector indexes and LRU lists, and the free pool.
+    cache_DisposeShards();
+    delete g_mediaCacheContext.freeList;
+    g_mediaCacheContext.freeList = NULL;
+    
+    // Dispose of the flusher's semaphores.
+    if (g_mediaCacheContext.flusher.isSemCreated)
+    {
+        tx_semaphore_delete(&g_mediaCacheContext.flusher.wakeSem);
+        tx_semaphore_delete(&g_mediaCacheContext.flusher.exitSem);
+        g_mediaCacheContext.flusher.isSemCreated = false;
+    }
     
-    // Dispose of the LRU list.
-    delete g_mediaCacheContext.lru;
-    g_mediaCacheContext.lru = NULL;
+    // Dispose of the cache I/O thread's semaphores.
+    if (g_mediaCacheContext.async.isSemCreated)
+    {
+        tx_semaphore_delete(&g_mediaCacheContext.async.wakeSem);
+        tx_semaphore_delete(&g_mediaCacheContext.async.exitSem);
+        g_mediaCacheContext.async.isSemCreated = false;
+    }
     
-    // Kill the cache mutex.
+    // Kill the cache mutexes.
+    for (i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        tx_mutex_delete(&g_mediaCacheContext.shards[i].mutex);
+    }
     tx_mutex_delete(&g_mediaCacheContext.mutex);
     
     // Done.
@@ -167,237 +239,39 @@ RtStatus_t media_cache_shutdown(void)
     return SUCCESS;
 }
 
-
-RtStatus_t media_cache_increase(int cacheNumIncreased)
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_set_read_ahead(uint32_t maxSectors)
 {
-    RtStatus_t status = SUCCESS;
-    int i,j;
-        
     assert(g_mediaCacheContext.isInited);
     
-    // already increased
-    if(g_mediaCacheBuffer_org_extend[0] != NULL)
-        return SUCCESS;
-
-    if(cacheNumIncreased > MAX_NUM_EXTENDED_CACHE_BUFFERS)
-        cacheNumIncreased = MAX_NUM_EXTENDED_CACHE_BUFFERS;
-
-    for(i=0; i<cacheNumIncreased; i++)
-    {
-        g_mediaCacheBuffer_org_extend[i] = (SECTOR_BUFFER *)os_dmi_malloc_phys_contiguous(g_mediaCacheContext.entryBufferSize);
-        if(g_mediaCacheBuffer_org_extend[i] == NULL)
-        {
-no_memory:
-            // Not enough memory, stop here
-            if(i == 0)  
-            {   // not even 1 entry can be allocated, return error
-                status = ERROR_OS_MEMORY_MANAGER_NOMEMORY;
-                return ERROR_GENERIC;
-            }
-
-            // Update cacheNumIncreased with the number of entries allocated
-            cacheNumIncreased = i;
-            break;
-        }
-
-        // ensure the media cache buffer is 32 bytes aligned
-        if( (((uint32_t)g_mediaCacheBuffer_org_extend[i])&(BUFFER_CACHE_LINE_MULTIPLE-1)) == 0)
-        {
-            g_mediaCacheBuffer_extend[i] = g_mediaCacheBuffer_org_extend[i];
-        }
-        else
-        {
-            // Not 32 bytes aligned, need to align the buffer manually
-            free(g_mediaCacheBuffer_org_extend[i]);
-            g_mediaCacheBuffer_org_extend[i] = (SECTOR_BUFFER *)os_dmi_malloc_phys_contiguous(g_mediaCacheContext.entryBufferSize+BUFFER_CACHE_LINE_MULTIPLE);
-            if(g_mediaCacheBuffer_org_extend[i] == NULL)
-            {
-                goto no_memory;
-            }
-            
-            g_mediaCacheBuffer_extend[i] = (SECTOR_BUFFER *)( (((uint32_t)g_mediaCacheBuffer_org_extend[i])+(BUFFER_CACHE_LINE_MULTIPLE-1)) & (~(BUFFER_CACHE_LINE_MULTIPLE-1)) );
-        }
-    }
-
-    // Lock the cache.
-    MediaCacheLock lockCache;
-
-    MediaCacheParamBlock_t pb = {0};
-    pb.flags = kMediaCacheFlag_FlushAllDrives | kMediaCacheFlag_Invalidate | kMediaCacheFlag_RemoveEntry;
-    //flush all the cache first
-    status =  media_cache_flush(&pb);            
-    if(status!=SUCCESS)
-        goto done;
-
-    g_mediaCacheCnt_bak = g_mediaCacheContext.entryCount;
-    
-    free(g_mediaCacheContext.entries);
-    g_mediaCacheContext.entries = NULL;
-
-    delete g_mediaCacheContext.tree;
-    g_mediaCacheContext.tree = NULL;
-    
-    // Dispose of the LRU list.
-    delete g_mediaCacheContext.lru;
-    g_mediaCacheContext.lru = NULL;
-
-
-    g_mediaCacheContext.entryCount += cacheNumIncreased;
-    
-    // Dynamically allocate the cache entry descriptors.
-    unsigned cacheDescriptorsSize = g_mediaCacheContext.entryCount * sizeof(MediaCacheEntry);
-    g_mediaCacheContext.entries =  (MediaCacheEntry *)malloc(cacheDescriptorsSize);
-    if (g_mediaCacheContext.entries == NULL)
-    {
-        status = ERROR_OS_MEMORY_MANAGER_NOMEMORY;
-        goto done;
-    }
-    memset(g_mediaCacheContext.entries, 0, cacheDescriptorsSize);
-    
-    // Create the drive tag to cache index tree.
-    g_mediaCacheContext.tree = new RedBlackTree;
-    assert(g_mediaCacheContext.tree);
+    MediaCacheLockAll lockCache;
     
-
-    // Create the LRU with a window size of 0 in order to disable weighting.
-    unsigned windowSize = g_mediaCacheContext.entryCount / 2;
-    g_mediaCacheContext.lru = new WeightedLRUList(kMediaCacheWeight_Low, kMediaCacheWeight_High, windowSize);
-    assert(g_mediaCacheContext.lru);
-
-    // Init cache entries.
-    i = 0;
-    j = 0;
-    MediaCacheEntry * entry = &g_mediaCacheContext.entries[0];
+    g_mediaCacheContext.readAheadMaxWindow = maxSectors;
+    cache_ResetReadAhead();
     
-    for (; i < g_mediaCacheCnt_bak; i++, entry++, j += g_mediaCacheContext.entryBufferSize)
-    {
-        // Use new in place operator to construct the media cache entry.
-        new(entry) MediaCacheEntry(&g_mediaCacheBuffer_org[j]);
-        
-        // Insert the entry in the LRU.
-        g_mediaCacheContext.lru->insert(entry);
-	}
-    j = 0;
-    for (; i < g_mediaCacheContext.entryCount; i++, entry++, j++)
-    {
-        // Use new in place operator to construct the media cache entry.
-        new(entry) MediaCacheEntry((uint8_t *)(g_mediaCacheBuffer_extend[j]));
-        
-        // Insert the entry in the LRU.
-        g_mediaCacheContext.lru->insert(entry);
-	}
+    return SUCCESS;
+}
 
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_increase(int cacheNumIncreased)
+{
+    assert(g_mediaCacheContext.isInited);
     
-    g_mediaCacheContext.maxChainedEntries = std::min<unsigned>(CACHE_MAX_CHAINED_ENTRIES, g_mediaCacheContext.entryCount / 2);
-    if (g_mediaCacheContext.maxChainedEntries > 0)
+    if (cacheNumIncreased <= 0)
     {
-        g_mediaCacheContext.maxChainedEntries--;
-    }
-
-done:
-    if(status!=SUCCESS)
-    {
-        for(i=0; i<MAX_NUM_EXTENDED_CACHE_BUFFERS; i++)
-        {
-            if(g_mediaCacheBuffer_org_extend[i] != NULL)
-            {
-                free(g_mediaCacheBuffer_org_extend[i]);
-                g_mediaCacheBuffer_org_extend[i] = NULL;
-                g_mediaCacheBuffer_extend[i] = NULL;
-            }
-        }
+        return SUCCESS;
     }
-         
-    return status;
     
+    unsigned targetEntries = std::min<unsigned>(g_mediaCacheContext.entryCount + cacheNumIncreased, g_mediaCacheContext.entryCapacity);
+    return media_cache_resize(targetEntries);
 }
 
+// See media_cache.h for the documentation of this function.
 RtStatus_t media_cache_resume(void)
 {
-    RtStatus_t status = SUCCESS;
-    int i,j;
-        
     assert(g_mediaCacheContext.isInited);
     
-    // not increase
-    if(g_mediaCacheBuffer_org_extend[0] == NULL)
-        return SUCCESS;
-
-    // Lock the cache.
-    MediaCacheLock lockCache;
-    
-    MediaCacheParamBlock_t pb = {0};
-    pb.flags = kMediaCacheFlag_FlushAllDrives | kMediaCacheFlag_Invalidate | kMediaCacheFlag_RemoveEntry;
-    //flush all the cache first
-    status =  media_cache_flush(&pb);            
-    if(status!=SUCCESS)
-        return status;
-
-    free(g_mediaCacheContext.entries);
-    g_mediaCacheContext.entries = NULL;
-
-    delete g_mediaCacheContext.tree;
-    g_mediaCacheContext.tree = NULL;
-
-    delete g_mediaCacheContext.lru;
-    g_mediaCacheContext.lru = NULL;
-
-
-    g_mediaCacheContext.entryCount = g_mediaCacheCnt_bak;
-    
-	printf("Media Cache Entry Count = %d\r\n",g_mediaCacheContext.entryCount);
-	
-    // Dynamically allocate the cache entry descriptors.
-    unsigned cacheDescriptorsSize = g_mediaCacheContext.entryCount * sizeof(MediaCacheEntry);
-    g_mediaCacheContext.entries =  (MediaCacheEntry *)malloc(cacheDescriptorsSize);
-    if (g_mediaCacheContext.entries == NULL)
-    {
-        return ERROR_OS_MEMORY_MANAGER_NOMEMORY;
-    }
-    memset(g_mediaCacheContext.entries, 0, cacheDescriptorsSize);
-    
-    // Create the drive tag to cache index tree.
-    g_mediaCacheContext.tree = new RedBlackTree;
-    assert(g_mediaCacheContext.tree);
-
-    // Create the LRU with a window size of 0 in order to disable weighting.
-    unsigned windowSize = 0; //std::min<unsigned>(16, g_mediaCacheContext.entryCount / 2);
-    g_mediaCacheContext.lru = new WeightedLRUList(kMediaCacheWeight_Low, kMediaCacheWeight_High, windowSize);
-    assert(g_mediaCacheContext.lru);
-
-    // Init cache entries.
-    i = 0;
-    j = 0;
-    MediaCacheEntry * entry = &g_mediaCacheContext.entries[0];
-    
-    for (; i < g_mediaCacheCnt_bak; i++, entry++, j += g_mediaCacheContext.entryBufferSize)
-    {
-        // Use new in place operator to construct the media cache entry.
-        new(entry) MediaCacheEntry(&g_mediaCacheBuffer_org[j]);
-        
-        // Insert the entry in the LRU.
-        g_mediaCacheContext.lru->insert(entry);
-	}
-
-    
-    g_mediaCacheContext.maxChainedEntries = std::min<unsigned>(CACHE_MAX_CHAINED_ENTRIES, g_mediaCacheContext.entryCount / 2);
-    if (g_mediaCacheContext.maxChainedEntries > 0)
-    {
-        g_mediaCacheContext.maxChainedEntries--;
-    }
-    
-    for(i=0; i<MAX_NUM_EXTENDED_CACHE_BUFFERS; i++)
-    {
-        if(g_mediaCacheBuffer_org_extend[i] != NULL)
-        {
-            free(g_mediaCacheBuffer_org_extend[i]);
-            g_mediaCacheBuffer_org_extend[i] = NULL;
-            g_mediaCacheBuffer_extend[i] = NULL;
-        }
-    }
-    
-    return status;
-
+    return media_cache_resize(g_mediaCacheContext.initialEntryCount);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -31,6 +31,82 @@ const unsigned kMaxSupportedPlanes = 2;
 // Code
 ////////////////////////////////////////////////////////////////////////////////
 
+//! \brief Retain an entry that was found in the index for a read.
+//!
+//! The entry is removed from the LRU list so nobody else tries to evict it until the
+//! read is complete. If a write is pending, we retain the entry before waiting, which
+//! unlocks the shard, to prevent it from being flushed by another thread between when
+//! the write completes and we relock the cache.
+//!
+//! \retval SUCCESS The entry is retained and holds no pending write.
+//! \retval ERROR_DDI_MEDIA_CACHE_TIMEOUT The pending write didn't complete. The entry
+//!     has been released again.
+//!
+//! \pre The shard must be locked.
+static RtStatus_t cache_hit_RetainEntry(MediaCacheShard * shard, MediaCacheEntry * cache)
+{
+    shard->lru->remove(cache);
+    cache->retain();
+    
+    RtStatus_t status = cache->waitUntilWriteCompletes();
+    if (status != SUCCESS)
+    {
+        cache->release();
+        if (cache->isUnowned())
+        {
+            // Insert this entry at the MRU position of the LRU list, since we got a hit.
+            shard->lru->insert(cache);
+        }
+    }
+    
+    return status;
+}
+
+//! \brief Release one entry returned to a caller of the cache.
+//!
+//! Finishes a pinned write on the entry, if there is one. If there are no more owners
+//! after the entry is released, it is placed back into the LRU list.
+//!
+//! \pre The shard must be locked.
+static RtStatus_t cache_release_Entry(MediaCacheShard * shard, MediaCacheEntry * cache)
+{
+    // Handle the end of a pinned write.
+    if (cache->isWritePending)
+    {
+        RtStatus_t status = cache_CompletePinnedWrite(cache);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+    }
+
+#if CACHE_STATISTICS            
+    // Update the entry's timestamp.
+    cache->timestamp = hw_profile_GetMicroseconds();
+#endif // CACHE_STATISTICS
+    
+    // Release this entry.
+    cache->release();
+    
+    // Only insert the entry in the LRU list if there are no other owners.
+    if (cache->isUnowned())
+    {
+        // Place this entry back in the LRU list...
+        if (cache->bInsertToLRU)
+        {
+            // ...at the LRU position.
+            shard->lru->deselect(cache);
+        }
+        else
+        {
+            // ...at the MRU position.
+            shard->lru->insert(cache);
+        }
+    }
+    
+    return SUCCESS;
+}
+
 // See media_cache.h for the documentation of this function.
 RtStatus_t media_cache_read(MediaCacheParamBlock_t * pb)
 {
@@ -54,15 +130,19 @@ RtStatus_t media_cache_read(MediaCacheParamBlock_t * pb)
         return status;
     }
     
-    MediaTask task("media_cache_read");
+    // Get the drive's shard, which may be assigned now if the drive is new to the cache.
+    MediaCacheShard * shard;
+    status = cache_GetShard(pb->drive, &shard);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
     
-    // Lock the cache.
-    MediaCacheLock lockCache;
+    MediaTask task("media_cache_read");
+    MediaCacheLatencyRecorder latency(shard, kMediaCacheLatency_ReadHit);
     
-#if CACHE_STATISTICS
-    g_mediaCacheContext.statistics[pb->drive].readCount++;
-    g_mediaCacheContext.combinedStatistics.readCount++;
-#endif // CACHE_STATISTICS
+    // Lock the drive's shard of the cache.
+    MediaCacheLock lockCache(shard);
 
     // Find the cache entry for this device and sector. Cache entries
     // are always in terms of native sectors.
@@ -71,6 +151,8 @@ RtStatus_t media_cache_read(MediaCacheParamBlock_t * pb)
     bool didHit = cache != NULL;
     if (!cache)
     {
+        latency.setOp(kMediaCacheLatency_ReadMiss);
+        
 		// Evict a sector from the cache, and load the needed sector into the cache.
         // Upon successful load, this sector is cached but not yet tracked in the LRU list.
         status = cache_HandleCacheMiss(pb, nativeSector, true, &cache);
@@ -82,37 +164,10 @@ RtStatus_t media_cache_read(MediaCacheParamBlock_t * pb)
     }
     else
     {
-#if CACHE_STATISTICS
-        // Update statistics.
-        g_mediaCacheContext.statistics[pb->drive].hit();
-        g_mediaCacheContext.combinedStatistics.hit();
-#endif // CACHE_STATISTICS
-        
-        // Remove this entry from the LRU list since it is now in use. This prevents any other
-        // callers from trying to evict this entry until the read is complete.
-        g_mediaCacheContext.lru->remove(cache);
-
-        // Retain this entry. If a write is pending, we do this before unlocking to prevent
-        // it from being flushed by another thread between when the write completes and we
-        // subsequently relock the cache.
-        cache->retain();
-            
-        // Make sure that no write is pending on this cache entry.
-        status = cache->waitUntilWriteCompletes();
+        // Take the entry out of the LRU list and make sure that no write is pending on it.
+        status = cache_hit_RetainEntry(shard, cache);
         if (status != SUCCESS)
         {
-#if CACHE_STATISTICS
-            g_mediaCacheContext.statistics[pb->drive].errors++;
-            g_mediaCacheContext.combinedStatistics.errors++;
-#endif // CACHE_STATISTICS
-
-            cache->release();
-            if (cache->isUnowned())
-            {
-                // Insert this entry at the MRU position of the LRU list, since we got a hit.
-                g_mediaCacheContext.lru->insert(cache);
-            }
-            
             return status;
         }
     }
@@ -155,6 +210,9 @@ RtStatus_t media_cache_read(MediaCacheParamBlock_t * pb)
     
     cache_RecordAccess(cache, false, didHit, false, 0);
     
+    // Follow sequential streams and load the sectors the caller is likely to ask for next.
+    cache_ReadAhead(pb->drive, cache);
+    
 //     cache_ExtendResultChain(pb, cache, false);
 
 #if CACHE_VALIDATE
@@ -178,46 +236,21 @@ RtStatus_t media_cache_release(uint32_t token)
         
         MediaTask task("media_cache_release");
 
-        // Have to lock the cache because we may modify the LRU list.
-        MediaCacheLock lockCache;
+        // Have to lock the cache because we may modify the LRU list. The entries are owned
+        // by the caller, so they can't move to another shard before we get the lock. All
+        // entries in a chain belong to the same shard.
+        MediaCacheShard * shard = &cache->getShard();
+        MediaCacheLock lockCache(shard);
         
         // This loop will finish pinned writes and release all cache entries in a chain.
         // If there are no chained entries, then only the primary entry will be handled.
         // Also, if there are no more owners after we release the entry in question, then
         // it will be placed into the LRU list.
         do {
-            // Handle the end of a pinned write.
-            if (cache->isWritePending)
-            {
-                RtStatus_t status = cache_CompletePinnedWrite(cache);
-                if (status != SUCCESS)
-                {
-                    return status;
-                }
-            }
-
-#if CACHE_STATISTICS            
-            // Update the entry's timestamp.
-            cache->timestamp = hw_profile_GetMicroseconds();
-#endif // CACHE_STATISTICS
-            
-            // Release this entry.
-            cache->release();
-            
-            // Only insert the entry in the LRU list if there are no other owners.
-            if (cache->isUnowned())
+            RtStatus_t status = cache_release_Entry(shard, cache);
+            if (status != SUCCESS)
             {
-                // Place this entry back in the LRU list...
-                if (cache->bInsertToLRU)
-                {
-                    // ...at the LRU position.
-                    g_mediaCacheContext.lru->deselect(cache);
-                }
-                else
-                {
-                    // ...at the MRU position.
-                    g_mediaCacheContext.lru->insert(cache);
-                }
+                return status;
             }
             
             // Move to next entry in the chain.
@@ -230,22 +263,32 @@ RtStatus_t media_cache_release(uint32_t token)
 
 //! \brief Gets and returns the least recently used cache entry.
 //!
-//! It waits forever for an LRU entry to become available.
-static MediaCacheEntry *cache_miss_GetLRUEntry()
+//! The entry may come from the free pool or another shard, as well as the shard's own
+//! LRU list. It waits forever for an entry to become available.
+static MediaCacheEntry *cache_miss_GetLRUEntry(MediaCacheShard * shard)
 {
     MediaCacheEntry * cache;
 
-    // Note that the select() action removes a node from the LRU end of the list.
-    while (!(cache = static_cast<MediaCacheEntry *>(g_mediaCacheContext.lru->select())))
+    // Note that selecting an entry removes it from the LRU end of the list.
+    while (!(cache = cache_shard_SelectEntry(shard, true)))
     {
-        const uint32_t u32OwnershipCount = release_cache_lock();
+        const uint32_t u32OwnershipCount = release_cache_lock(shard);
         tx_thread_sleep(1);
-        resume_cache_lock(u32OwnershipCount);
+        resume_cache_lock(shard, u32OwnershipCount);
     }
 
     return cache;
 }
 
+//! \brief Shrink the read-ahead limit of a drive whose read-ahead entry went unused.
+static void cache_readahead_Wasted(MediaCacheEntry * cache)
+{
+    MediaCacheReadAheadStream & stream = cache->getShard().readAhead;
+    stream.limit = std::max<unsigned>(stream.limit / 2, 1);
+    stream.window = std::min(stream.window, stream.limit);
+    cache->isReadAhead = 0;
+}
+
 //! \brief Remove, evict, and retain a cache entry.
 static void cache_miss_RemoveAndRetainEntry(MediaCacheEntry * cache, uint8_t drive)
 {
@@ -254,6 +297,13 @@ static void cache_miss_RemoveAndRetainEntry(MediaCacheEntry * cache, uint8_t dri
     {
         // ...remove that data from sector storage in the cache.
         cache_index_RemoveSectorEntry(cache);
+        cache_ghost_AddEvicted(cache);
+        
+        // Read-ahead guessed wrong if this entry was never read.
+        if (cache->isReadAhead)
+        {
+            cache_readahead_Wasted(cache);
+        }
     }
 
     // Record that we're evicting this sector from the cache.
@@ -261,33 +311,16 @@ static void cache_miss_RemoveAndRetainEntry(MediaCacheEntry * cache, uint8_t dri
 
     // Claim ownership of the cache entry early on.
     cache->retain();
-
-#if CACHE_STATISTICS
-    // Update statistics.
-    g_mediaCacheContext.statistics[drive].miss();
-    g_mediaCacheContext.combinedStatistics.miss();
-
-    if (cache->isValid)
-    {
-        g_mediaCacheContext.statistics[cache->drive].evictionCount++;
-        g_mediaCacheContext.combinedStatistics.evictionCount++;
-        if (cache->isDirty)
-        {
-            g_mediaCacheContext.statistics[cache->drive].dirtyEvictionCount++;
-            g_mediaCacheContext.combinedStatistics.dirtyEvictionCount++;
-        }
-    }
-#endif // CACHE_STATISTICS
 }
 
 //! \brief Find and evict a cache entry for each plane. Flush entries to storage if necessary.
-static RtStatus_t cache_miss_FindAndEvictEntries(uint8_t drive, unsigned startSector, bool doRead, MediaCacheEntry ** cache, uint32_t planeCount, unsigned * resultCount)
+static RtStatus_t cache_miss_FindAndEvictEntries(MediaCacheShard * shard, uint8_t drive, unsigned startSector, bool doRead, MediaCacheEntry ** cache, uint32_t planeCount, unsigned * resultCount)
 {
     RtStatus_t status;
     int i;
 
     // Find the LRU entry.
-    cache[0] = cache_miss_GetLRUEntry();
+    cache[0] = cache_miss_GetLRUEntry(shard);
     assert(cache[0]);
     
     bool firstNeedsFlush = cache[0]->isValid && cache[0]->isDirty;
@@ -330,7 +363,7 @@ static RtStatus_t cache_miss_FindAndEvictEntries(uint8_t drive, unsigned startSe
                 ++numEntriesToEvict;
                 
                 // Remove this entry from the LRU. We'll reinsert it later, below.
-                g_mediaCacheContext.lru->remove(cache[i]);
+                shard->lru->remove(cache[i]);
             }
 
             ++numEntriesToFlush;
@@ -347,7 +380,7 @@ static RtStatus_t cache_miss_FindAndEvictEntries(uint8_t drive, unsigned startSe
             // Note that we dont call cache_miss_GetLRUEntry(), because we don't want to
             // wait around if there are no entries. In that case, the read will just have to be
             // non-multi.
-            cache[i] = static_cast<MediaCacheEntry *>(g_mediaCacheContext.lru->select());
+            cache[i] = cache_shard_SelectEntry(shard, false);
 
             if (!cache[i])
             {
@@ -366,6 +399,9 @@ static RtStatus_t cache_miss_FindAndEvictEntries(uint8_t drive, unsigned startSe
     // are in sequential order.
     const bool useMulti = numEntriesToFlush > 1 && isSequential;
 
+    // Time the write back, if there is one, as part of the miss.
+    MediaCacheLatencyRecorder writeBackLatency(firstNeedsFlush ? shard : NULL, kMediaCacheLatency_EvictionWriteBack);
+
     // Open a multi-plane write operation to support cache entry flushes.
     if (useMulti)
     {
@@ -412,7 +448,7 @@ static RtStatus_t cache_miss_FindAndEvictEntries(uint8_t drive, unsigned startSe
     for (i = 0; i < numEntriesToEvict; i++)
     {
         cache[i]->isValid = 0;
-        cache[i]->isDirty = 0;
+        cache[i]->clearDirty();
         cache[i]->isWritePending = 0;
         cache[i]->isWriteThrough = 0;
         cache[i]->drive = drive;
@@ -430,8 +466,8 @@ static RtStatus_t cache_miss_FindAndEvictEntries(uint8_t drive, unsigned startSe
     return SUCCESS;
 }
 
-//! \brief Read from storage into cache entries.
-static RtStatus_t cache_miss_ReadEntries(uint8_t drive, unsigned startSector, MediaCacheEntry ** cache, unsigned numEntries)
+//! \brief Read a run of sequential sectors from storage into cache entries.
+static RtStatus_t cache_miss_ReadRun(uint8_t drive, unsigned startSector, MediaCacheEntry ** cache, unsigned numEntries)
 {
     RtStatus_t status;
 
@@ -470,6 +506,41 @@ static RtStatus_t cache_miss_ReadEntries(uint8_t drive, unsigned startSector, Me
     return readStatus;
 }
 
+//! \brief Read from storage into cache entries for sequential sectors.
+//!
+//! Sectors in the shard's zero sector list are not read, since their entries are filled
+//! with zeroes when they are added to the index. The other sectors are read in runs.
+static RtStatus_t cache_miss_ReadEntries(uint8_t drive, unsigned startSector, MediaCacheEntry ** cache, unsigned numEntries)
+{
+    MediaCacheShard * shard = cache_FindShard(drive);
+    unsigned done = 0;
+
+    while (done < numEntries)
+    {
+        if (cache_zero_Contains(shard, startSector + done))
+        {
+            ++done;
+            continue;
+        }
+
+        unsigned runLength = 1;
+        while (done + runLength < numEntries && !cache_zero_Contains(shard, startSector + done + runLength))
+        {
+            ++runLength;
+        }
+
+        RtStatus_t status = cache_miss_ReadRun(drive, startSector + done, cache + done, runLength);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+
+        done += runLength;
+    }
+
+    return SUCCESS;
+}
+
 //! \brief Return entries to LRU (and optionally to the cache).
 //!
 //! Called if an error occurs during cache miss operations.
@@ -480,7 +551,7 @@ static void cache_miss_ReturnEntries(MediaCacheEntry ** cache, unsigned numEntri
         cache[i]->release();
 
         // Put the entry back into the LRU.
-        g_mediaCacheContext.lru->deselect(cache[i]);
+        cache[i]->getShard().lru->deselect(cache[i]);
 
         // If requested, also add back to cache.
         if (addIndex)
@@ -534,6 +605,8 @@ RtStatus_t cache_HandleCacheMiss(MediaCacheParamBlock_t * pb, unsigned nativeSec
 
     const uint8_t drive = pb->drive;
     const bool isExternalDrive = (drive == DRIVE_TAG_DATA_EXTERNAL);
+    MediaCacheShard * shard = cache_FindShard(drive);
+    assert(shard);
 
     // If this is the external drive, set a retry count.
     int retryCount = isExternalDrive ? 2 : 0;
@@ -549,12 +622,22 @@ RtStatus_t cache_HandleCacheMiss(MediaCacheParamBlock_t * pb, unsigned nativeSec
     RtStatus_t status;
     unsigned numEntries = 0;
 
+    // Let the ghost list see whether a larger cache would have hit. This must come
+    // before the eviction made for this miss.
+    cache_ghost_CheckMiss(drive, nativeSector);
+
+    // There is no point reading a sector that is going to be replaced by zeroes.
+    if (doRead && cache_zero_Contains(shard, nativeSector))
+    {
+        doRead = false;
+    }
+
     do
     {
         // Find and evict as many cache entries as we can, up to the plane count.
         // Cache entries are retained.
         // Dirty cache entries are flushed to storage.
-        status = cache_miss_FindAndEvictEntries(drive, nativeSector, doRead, cache, planeCount, &numEntries);
+        status = cache_miss_FindAndEvictEntries(shard, drive, nativeSector, doRead, cache, planeCount, &numEntries);
         if (status != SUCCESS)
         {
             // A flush failed, so put the entries back into both the LRU and index since we haven't
@@ -617,7 +700,7 @@ RtStatus_t cache_HandleCacheMiss(MediaCacheParamBlock_t * pb, unsigned nativeSec
         // Entry is valid now that it contains data (if we did a read).
         entry->isValid = 1;
 
-        // Insert this new sector into the sector index tree.
+        // Insert this new sector into the sector index.
         cache_index_AddSectorEntry(entry);
         
         // Only the cache entry we return should be retained. Otherwise the other entries
@@ -628,7 +711,7 @@ RtStatus_t cache_HandleCacheMiss(MediaCacheParamBlock_t * pb, unsigned nativeSec
             entry->release();
             
             // Put the entry back into the LRU.
-            g_mediaCacheContext.lru->insert(entry);
+            shard->lru->insert(entry);
         }
     }
 
@@ -638,6 +721,569 @@ RtStatus_t cache_HandleCacheMiss(MediaCacheParamBlock_t * pb, unsigned nativeSec
     return SUCCESS;
 }
 
+//! \brief Load a run of sectors into the cache ahead of a sequential reader.
+//!
+//! Sectors already present in the cache are skipped, and so are sectors in the zero
+//! sector list, which need no read and would only become dirty entries if loaded now.
+//! Uncached sectors are read in groups of
+//! up to the drive's plane count using a multisector transaction, the same way misses are
+//! filled. Only clean entries at the LRU end of the list are reused; read-ahead never
+//! waits for an entry or flushes a dirty one, since that would defeat its purpose.
+//!
+//! Entries that are filled are inserted at the MRU end of the LRU list with the
+//! \a isReadAhead flag set.
+//!
+//! \return The number of sectors, starting with \a startSector, that are now in the cache.
+//!
+//! \pre The cache must be locked.
+static unsigned cache_readahead_Fill(MediaCacheShard * shard, uint8_t drive, unsigned startSector, unsigned count, unsigned planeCount)
+{
+    unsigned filled = 0;
+
+    while (filled < count)
+    {
+        // Skip over sectors that are already cached or are zero sectors.
+        if (cache_index_LookupSectorEntry(drive, startSector + filled) || cache_zero_Contains(shard, startSector + filled))
+        {
+            ++filled;
+            continue;
+        }
+
+        // Claim an entry for each sector in the next group of uncached sectors.
+        MediaCacheEntry * group[kMaxSupportedPlanes];
+        unsigned groupCount = 0;
+        unsigned groupStart = startSector + filled;
+        while (groupCount < planeCount && filled + groupCount < count)
+        {
+            if (groupCount > 0 && (cache_index_LookupSectorEntry(drive, groupStart + groupCount) || cache_zero_Contains(shard, groupStart + groupCount)))
+            {
+                break;
+            }
+
+            MediaCacheEntry * entry = cache_shard_SelectEntry(shard, false);
+            if (!entry)
+            {
+                break;
+            }
+            else if (entry->isValid && (entry->isDirty || entry->isWritePending))
+            {
+                // Leave dirty entries for the miss path or a flush to write back.
+                shard->lru->deselect(entry);
+                break;
+            }
+
+            if (entry->isValid)
+            {
+                cache_index_RemoveSectorEntry(entry);
+                cache_ghost_AddEvicted(entry);
+                if (entry->isReadAhead)
+                {
+                    cache_readahead_Wasted(entry);
+                }
+            }
+
+            entry->retain();
+            entry->isValid = 0;
+            entry->isReadAhead = 0;
+            entry->drive = drive;
+            entry->sector = groupStart + groupCount;
+            entry->weight = kMediaCacheWeight_Low;
+            entry->bInsertToLRU = FALSE;
+
+#if CACHE_STATISTICS
+            entry->creationTimestamp = hw_profile_GetMicroseconds();
+            entry->readCount = 0;
+            entry->writeCount = 0;
+#endif // CACHE_STATISTICS
+
+            group[groupCount++] = entry;
+        }
+
+        // Out of clean entries.
+        if (groupCount == 0)
+        {
+            break;
+        }
+
+        RtStatus_t status;
+        {
+            MediaTask task("cache_ReadAhead");
+            status = cache_miss_ReadEntries(drive, groupStart, group, groupCount);
+        }
+        if (status != SUCCESS)
+        {
+            // The entries are still invalid, so they go back to the LRU end for immediate reuse.
+            cache_miss_ReturnEntries(group, groupCount, false);
+            break;
+        }
+
+        for (unsigned i = 0; i < groupCount; ++i)
+        {
+            group[i]->isValid = 1;
+            group[i]->isReadAhead = 1;
+            cache_index_AddSectorEntry(group[i]);
+            group[i]->release();
+            shard->lru->insert(group[i]);
+        }
+
+        filled += groupCount;
+
+        // A partial group means we ran out of entries to reuse, unless it ended at a
+        // sector that is skipped.
+        if (groupCount < planeCount && filled < count && !cache_index_LookupSectorEntry(drive, startSector + filled) && !cache_zero_Contains(shard, startSector + filled))
+        {
+            break;
+        }
+    }
+
+    return filled;
+}
+
+//! Called for every successful read with the entry being returned to the caller. The
+//! drive's stream is extended when \a cache holds the sector following the last one read,
+//! or restarted otherwise. Repeated reads of the same native sector, as happens when the
+//! nominal sector size is smaller than the native size, leave the stream unchanged.
+//!
+//! Once a stream is established, sectors are read ahead whenever the caller has consumed
+//! half of the sectors read ahead by the previous fill, keeping the cache ahead of the
+//! reader so that sequential reads hit. The fill is queued to the cache I/O thread
+//! rather than done here, so the caller gets its sector without waiting for the media
+//! reads of sectors it has not asked for yet.
+//!
+//! \param drive Tag of the drive being read.
+//! \param cache The retained entry that will be returned to the caller.
+//!
+//! \pre The cache must be locked.
+void cache_ReadAhead(uint8_t drive, MediaCacheEntry * cache)
+{
+    if (g_mediaCacheContext.readAheadMaxWindow == 0)
+    {
+        return;
+    }
+
+    MediaCacheShard * shard = &cache->getShard();
+    MediaCacheReadAheadStream & stream = shard->readAhead;
+    unsigned maxWindow = std::min<unsigned>(g_mediaCacheContext.readAheadMaxWindow, g_mediaCacheContext.entryCount / 4);
+
+    // A hit on a read-ahead entry means the window is paying off, so let it grow.
+    if (cache->isReadAhead)
+    {
+        cache->isReadAhead = 0;
+        if (stream.limit < maxWindow)
+        {
+            ++stream.limit;
+        }
+    }
+
+    unsigned nativeSector = cache->sector;
+    if (stream.runLength && nativeSector == stream.lastSector)
+    {
+        return;
+    }
+    else if (stream.runLength && nativeSector == stream.lastSector + 1)
+    {
+        if (stream.runLength < 0xffff)
+        {
+            ++stream.runLength;
+        }
+    }
+    else
+    {
+        stream.runLength = 1;
+        stream.window = 0;
+        stream.nextSector = nativeSector + 1;
+    }
+    stream.lastSector = nativeSector;
+
+    if (stream.runLength < CACHE_READ_AHEAD_TRIGGER || maxWindow == 0)
+    {
+        return;
+    }
+
+    // The next fill can't be placed until the one in flight has moved nextSector.
+    if (stream.isFillQueued)
+    {
+        return;
+    }
+
+    if (stream.nextSector <= nativeSector)
+    {
+        stream.nextSector = nativeSector + 1;
+    }
+
+    // Wait until the caller is halfway through the previous window before reading more.
+    unsigned ahead = stream.nextSector - nativeSector - 1;
+    if (stream.window && ahead > stream.window / 2)
+    {
+        return;
+    }
+
+    uint32_t planeCount = DriveGetInfoTyped<uint32_t>(drive, kDriveInfoOptimalTransferSectorCount);
+    planeCount = std::max<uint32_t>(std::min<uint32_t>(planeCount, kMaxSupportedPlanes), 1);
+
+    // Open the window up to the drive's plane count, then double it on each fill.
+    unsigned limit = std::max<unsigned>(std::min<unsigned>(stream.limit, maxWindow), 1);
+    stream.window = std::min<unsigned>(stream.window ? stream.window * 2 : planeCount, limit);
+
+    // Don't read beyond the end of the drive.
+    uint32_t driveSectors = DriveGetInfoTyped<uint32_t>(drive, kDriveInfoSizeInNativeSectors);
+    unsigned endSector = std::min<uint32_t>(nativeSector + 1 + stream.window, driveSectors);
+    if (stream.nextSector >= endSector)
+    {
+        return;
+    }
+
+    // Read-ahead is only a hint, so nothing is read if the queue is full.
+    if (cache_async_QueueReadAhead(drive, stream.nextSector, endSector - stream.nextSector) == SUCCESS)
+    {
+        stream.isFillQueued = true;
+    }
+}
+
+//! Called by the cache I/O thread for each fill queued by cache_ReadAhead(). The fill is
+//! dropped if the drive's stream has been restarted or reset since it was queued.
+//!
+//! \param drive Tag of the drive being read.
+//! \param startSector First native sector to load. This was the stream's \a nextSector
+//!     when the fill was queued.
+//! \param count Number of native sectors to load.
+//!
+//! \pre No shard may be locked by the caller.
+void cache_CompleteReadAhead(DriveTag_t drive, unsigned startSector, unsigned count)
+{
+    MediaCacheShard * shard = cache_FindShard(drive);
+    if (!shard)
+    {
+        return;
+    }
+
+    MediaCacheLock lockCache(shard);
+    MediaCacheReadAheadStream & stream = shard->readAhead;
+
+    stream.isFillQueued = false;
+    if (!shard->isAssigned || shard->drive != drive || stream.nextSector != startSector || stream.runLength == 0)
+    {
+        return;
+    }
+
+    uint32_t planeCount = DriveGetInfoTyped<uint32_t>(drive, kDriveInfoOptimalTransferSectorCount);
+    planeCount = std::max<uint32_t>(std::min<uint32_t>(planeCount, kMaxSupportedPlanes), 1);
+
+    stream.nextSector += cache_readahead_Fill(shard, drive, startSector, count, planeCount);
+}
+
+void cache_ResetReadAhead()
+{
+    for (unsigned i = 0; i < CACHE_SHARD_COUNT; ++i)
+    {
+        MediaCacheReadAheadStream & stream = g_mediaCacheContext.shards[i].readAhead;
+        stream.lastSector = 0;
+        stream.nextSector = 0;
+        stream.runLength = 0;
+        stream.window = 0;
+        stream.limit = std::min<unsigned>(g_mediaCacheContext.readAheadMaxWindow, 0xffff);
+        stream.isFillQueued = false;
+    }
+}
+
+//! \brief Claim an entry to load a sector into for a vectored read.
+//!
+//! As with a regular miss, a dirty entry is written back before it is reused. The entry
+//! returned through \a result is retained, invalid, and in neither the index nor the LRU
+//! list.
+//!
+//! \param shard The drive's shard.
+//! \param drive Tag of the drive being read.
+//! \param sector Native sector that will be loaded into the entry.
+//! \param mayWait Whether to wait for an entry if none is available right now.
+//! \param[out] result The claimed entry, or NULL if none was available without waiting.
+//! \retval SUCCESS An entry was claimed, or none was available.
+//! \retval other Writing back the entry's previous contents failed. The entry has been
+//!     returned to the index and LRU list.
+//!
+//! \pre The shard must be locked.
+static RtStatus_t cache_vec_ClaimEntry(MediaCacheShard * shard, uint8_t drive, unsigned sector, bool mayWait, MediaCacheEntry ** result)
+{
+    cache_ghost_CheckMiss(drive, sector);
+    
+    MediaCacheEntry * cache = mayWait ? cache_miss_GetLRUEntry(shard) : cache_shard_SelectEntry(shard, true);
+    *result = NULL;
+    if (!cache)
+    {
+        return SUCCESS;
+    }
+    
+    bool needsFlush = cache->isValid && cache->isDirty;
+    cache_miss_RemoveAndRetainEntry(cache, drive);
+    
+    if (needsFlush)
+    {
+        RtStatus_t status;
+        {
+            MediaTask task("media_cache_read_vec:flush");
+            MediaCacheLatencyRecorder writeBackLatency(shard, kMediaCacheLatency_EvictionWriteBack);
+            status = cache->flush();
+        }
+        if (status != SUCCESS)
+        {
+            cache_miss_ReturnEntries(&cache, 1, true);
+            return status;
+        }
+    }
+    
+    cache->isValid = 0;
+    cache->clearDirty();
+    cache->isWritePending = 0;
+    cache->isWriteThrough = 0;
+    cache->isReadAhead = 0;
+    cache->drive = drive;
+    cache->sector = sector;
+
+#if CACHE_STATISTICS
+    // Record when the entry was created.
+    cache->creationTimestamp = hw_profile_GetMicroseconds();
+    cache->readCount = 0;
+    cache->writeCount = 0;
+#endif // CACHE_STATISTICS
+    
+    *result = cache;
+    return SUCCESS;
+}
+
+//! \brief Fill in the result element for a retained entry of a vectored read.
+//!
+//! \param pb The caller's param block. Its \a actualSectorCount is increased by \a sectorCount.
+//! \param iov The element to fill in.
+//! \param cache The retained entry.
+//! \param byteOffset Offset of the first requested sector in the entry's buffer.
+//! \param sectorCount Number of requested sectors in the entry.
+//! \param chainIndex Position of the entry in the run.
+//! \param didHit Whether the entry was already in the cache.
+static void cache_vec_SetResult(MediaCacheParamBlock_t * pb, MediaCacheIovec_t * iov, MediaCacheEntry * cache, unsigned byteOffset, unsigned sectorCount, unsigned chainIndex, bool didHit)
+{
+#if CACHE_STATISTICS
+    cache->timestamp = hw_profile_GetMicroseconds();
+    cache->readCount++;
+#endif // CACHE_STATISTICS
+
+    // Set options for the cache entry, the same as for a single read.
+    if (pb->flags & kMediaCacheFlag_ApplyWeight)
+    {
+        cache->weight = pb->weight;
+    }
+    else
+    {
+        cache->weight = kMediaCacheWeight_Low;
+    }
+    cache->bInsertToLRU = (pb->flags & kMediaCacheFlag_BypassCache) ? TRUE : FALSE;
+    
+    iov->buffer = cache->buffer + byteOffset;
+    iov->sectorCount = sectorCount;
+    iov->token = kMediaCacheTokenSignature | cache->getArrayIndex(g_mediaCacheContext.entries);
+    pb->actualSectorCount += sectorCount;
+    
+    cache_RecordAccess(cache, false, didHit, false, chainIndex);
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_read_vec(MediaCacheParamBlock_t * pb, MediaCacheIovec_t * iov, uint32_t * iovCount)
+{
+    RtStatus_t status;
+    
+    assert(g_mediaCacheContext.isInited);
+    assert(pb->requestSectorCount > 0);
+    assert(iov);
+    assert(iovCount);
+    
+    // Clear return values until we know the read is successful.
+    pb->buffer = 0;
+    pb->token = 0;
+    pb->actualSectorCount = 0;
+    uint32_t maxEntries = *iovCount;
+    *iovCount = 0;
+    
+    if (maxEntries == 0)
+    {
+        return ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER;
+    }
+    
+    // Adjust the sector that was passed in the param block and convert nominal to native sectors.
+    unsigned nativeSector;
+    unsigned subsectorOffset;
+    unsigned firstSectorCount;
+    status = cache_AdjustAndConvertSector(pb, &nativeSector, &subsectorOffset, &firstSectorCount);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+    
+    unsigned nominalPerNative = 1;
+    if (!(pb->flags & kMediaCacheFlag_UseNativeSectors))
+    {
+        nominalPerNative = 1 << DriveGetDriveFromTag(pb->drive)->m_nativeSectorShift;
+    }
+    
+    // Work out how many entries the run needs. Never pin more than half of the cache, so
+    // that other callers can still get entries, and don't run off the end of the drive.
+    unsigned remainingSectors = pb->requestSectorCount - firstSectorCount;
+    unsigned runLength = 1 + (remainingSectors + nominalPerNative - 1) / nominalPerNative;
+    uint32_t driveSectors = DriveGetInfoTyped<uint32_t>(pb->drive, kDriveInfoSizeInNativeSectors);
+    runLength = std::min<unsigned>(runLength, maxEntries);
+    runLength = std::min<unsigned>(runLength, std::max<unsigned>(g_mediaCacheContext.entryCount / 2, 1));
+    runLength = std::min<unsigned>(runLength, driveSectors - nativeSector);
+    
+    // Get the drive's shard, which may be assigned now if the drive is new to the cache.
+    MediaCacheShard * shard;
+    status = cache_GetShard(pb->drive, &shard);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+    
+    uint32_t planeCount = DriveGetInfoTyped<uint32_t>(pb->drive, kDriveInfoOptimalTransferSectorCount);
+    planeCount = std::max<uint32_t>(std::min<uint32_t>(planeCount, kMaxSupportedPlanes), 1);
+    
+    MediaTask task("media_cache_read_vec");
+    MediaCacheLatencyRecorder latency(shard, kMediaCacheLatency_ReadHit);
+    
+    // Lock the drive's shard of the cache once for the whole run.
+    MediaCacheLock lockCache(shard);
+
+    unsigned count = 0;
+    while (count < runLength)
+    {
+        unsigned sector = nativeSector + count;
+        unsigned byteOffset = count ? 0 : subsectorOffset;
+        unsigned sectorCount = count ? std::min<unsigned>(pb->requestSectorCount - pb->actualSectorCount, nominalPerNative) : firstSectorCount;
+        
+        MediaCacheEntry * cache = cache_index_LookupSectorEntry(pb->drive, sector);
+        if (cache)
+        {
+            status = cache_hit_RetainEntry(shard, cache);
+            if (status != SUCCESS)
+            {
+                break;
+            }
+            
+            cache_vec_SetResult(pb, &iov[count], cache, byteOffset, sectorCount, count, true);
+            ++count;
+            continue;
+        }
+        
+        latency.setOp(kMediaCacheLatency_ReadMiss);
+        
+        // Claim an entry for each sector in the next group of uncached sectors. Only the very
+        // first sector of the run is worth waiting for an entry.
+        MediaCacheEntry * group[kMaxSupportedPlanes];
+        unsigned groupCount = 0;
+        while (groupCount < planeCount && count + groupCount < runLength)
+        {
+            if (groupCount > 0 && cache_index_LookupSectorEntry(pb->drive, sector + groupCount))
+            {
+                break;
+            }
+            
+            MediaCacheEntry * entry;
+            status = cache_vec_ClaimEntry(shard, pb->drive, sector + groupCount, count + groupCount == 0, &entry);
+            if (status != SUCCESS || !entry)
+            {
+                break;
+            }
+            
+            group[groupCount++] = entry;
+        }
+        
+        if (groupCount == 0)
+        {
+            break;
+        }
+        
+        // Read the group using a multisector transaction.
+        status = cache_miss_ReadEntries(pb->drive, sector, group, groupCount);
+        if (status != SUCCESS)
+        {
+            // The entries are still invalid, so they go back to the LRU end for immediate reuse.
+            cache_miss_ReturnEntries(group, groupCount, false);
+            break;
+        }
+        
+        for (unsigned i = 0; i < groupCount; ++i)
+        {
+            group[i]->isValid = 1;
+            cache_index_AddSectorEntry(group[i]);
+            
+            cache_vec_SetResult(pb, &iov[count], group[i], byteOffset, sectorCount, count, false);
+            ++count;
+            
+            byteOffset = 0;
+            sectorCount = std::min<unsigned>(pb->requestSectorCount - pb->actualSectorCount, nominalPerNative);
+        }
+        
+        // A partial group means we ran out of entries to reuse without waiting, or that
+        // writing back a victim failed.
+        if (groupCount < planeCount && count < runLength && !cache_index_LookupSectorEntry(pb->drive, nativeSector + count))
+        {
+            break;
+        }
+    }
+    
+    // Nothing is returned if even the first sector couldn't be read. Otherwise the caller
+    // gets what we have so far, and will get the error if it asks again.
+    if (count == 0)
+    {
+        pb->actualSectorCount = 0;
+        return status;
+    }
+    
+    *iovCount = count;
+    
+    // Let read-ahead follow the run, so the next call hits.
+    for (unsigned i = 0; i < count; ++i)
+    {
+        cache_ReadAhead(pb->drive, &g_mediaCacheContext.entries[iov[i].token & kMediaCacheTokenEntryIndexMask]);
+    }
+
+    return SUCCESS;
+}
+
+// See media_cache.h for the documentation of this function.
+RtStatus_t media_cache_release_vec(const MediaCacheIovec_t * iov, uint32_t iovCount)
+{
+    if (iovCount == 0 || (iov[0].token & kMediaCacheTokenSignatureMask) != kMediaCacheTokenSignature)
+    {
+        return SUCCESS;
+    }
+    
+    MediaTask task("media_cache_release_vec");
+    
+    // All entries of a vectored read belong to the same shard, which can't change while
+    // the caller owns them.
+    MediaCacheShard * shard = &g_mediaCacheContext.entries[iov[0].token & kMediaCacheTokenEntryIndexMask].getShard();
+    MediaCacheLock lockCache(shard);
+    
+    RtStatus_t result = SUCCESS;
+    for (unsigned i = 0; i < iovCount; ++i)
+    {
+        // The token has to have a valid signature, or we ignore it.
+        if ((iov[i].token & kMediaCacheTokenSignatureMask) != kMediaCacheTokenSignature)
+        {
+            continue;
+        }
+        
+        MediaCacheEntry * cache = &g_mediaCacheContext.entries[iov[i].token & kMediaCacheTokenEntryIndexMask];
+        assert(&cache->getShard() == shard);
+        
+        // Keep releasing the rest of the batch after an error.
+        RtStatus_t status = cache_release_Entry(shard, cache);
+        if (status != SUCCESS && result == SUCCESS)
+        {
+            result = status;
+        }
+    }
+    
+    return result;
+}
+
 //! Scan cache entries to see if we can return more sectors. This functionality is based on
 //! the requirement that sequential elements of the cache entry array have physically contiguous
 //! sector buffers. If the drive has a native sector size smaller than the size of the cache
@@ -703,6 +1349,14 @@ void cache_ExtendResultChain(MediaCacheParamBlock_t * pb, MediaCacheEntry * cach
     {
         assert(scanEntry->getArrayIndex(g_mediaCacheContext.entries) == entryIndex);
         
+        // The caller gets one pointer to the data of the whole chain, so the chain has to
+        // end where the buffers stop being contiguous. Entries added by growing the cache
+        // have buffers of their own.
+        if (scanEntry->buffer != (scanEntry - 1)->buffer + g_mediaCacheContext.entryBufferSize)
+        {
+            break;
+        }
+        
         // Make sure the next sector in sequence isn't already in the cache. However, it's
         // ok if the sector is in the cache but is the entry we're examining.
         MediaCacheEntry * match = cache_index_LookupSectorEntry(pb->drive, nativeSectorInSequence);
@@ -711,6 +1365,13 @@ void cache_ExtendResultChain(MediaCacheParamBlock_t * pb, MediaCacheEntry * cach
             break;
         }
         
+        // Stop looking if we run into an entry that belongs to another shard, since
+        // we don't hold its lock.
+        if (scanEntry->shard != cache->shard)
+        {
+            break;
+        }
+        
         // Stop looking if we run into an entry that has owners or is dirty.
         if (scanEntry->isValid && (!scanEntry->isUnowned() || scanEntry->isDirty))
         {
@@ -763,7 +1424,14 @@ void cache_ExtendResultChain(MediaCacheParamBlock_t * pb, MediaCacheEntry * cach
         }
         
         // Update fields that are changed whether the entry was already in sequence or not.
-        scanEntry->isDirty = isWrite;
+        if (isWrite)
+        {
+            scanEntry->setDirty();
+        }
+        else
+        {
+            scanEntry->clearDirty();
+        }
         scanEntry->isWritePending = isWrite;
         scanEntry->isWriteThrough = isWrite && (pb->flags & kMediaCacheFlag_WriteThrough);
             
@@ -781,7 +1449,7 @@ void cache_ExtendResultChain(MediaCacheParamBlock_t * pb, MediaCacheEntry * cach
         scanEntry->retain();
         
         // Remove this entry from the LRU.
-        g_mediaCacheContext.lru->remove(scanEntry);
+        scanEntry->getShard().lru->remove(scanEntry);
 
 #if CACHE_STATISTICS
         scanEntry->timestamp = hw_profile_GetMicroseconds();
@@ -923,14 +1591,29 @@ RtStatus_t media_cache_DiscardDrive (int iDrive)
     int ii;
     MediaCacheEntry *cache;
 
-    // Lock the cache.
-    MediaCacheLock lockCache;
+    // Nothing is cached for a drive that doesn't have a shard.
+    MediaCacheShard * shard = cache_FindShard(iDrive);
+    if (!shard)
+    {
+        return SUCCESS;
+    }
+    unsigned shardIndex = shard - g_mediaCacheContext.shards;
+
+    // Lock the drive's shard.
+    MediaCacheLock lockCache(shard);
+
+    // Drop the drive's read-ahead stream.
+    shard->readAhead.runLength = 0;
+    shard->readAhead.window = 0;
+
+    // Forget the drive's zero sectors without writing them.
+    cache_zero_Clear(shard);
 
     for(ii=0; ii<g_mediaCacheContext.entryCount; ii++)
     {
         cache = &g_mediaCacheContext.entries[ii];
         
-        if(cache->drive == iDrive)
+        if(cache->shard == shardIndex)
         {
             cache->waitUntilUnowned(); 
 
@@ -941,10 +1624,10 @@ RtStatus_t media_cache_DiscardDrive (int iDrive)
             }
             
             // Invalidate the entry and place it at the head/LRU of LRU list. 
-            g_mediaCacheContext.lru->remove(cache); 
+            shard->lru->remove(cache); 
             cache->reset(); // Note that reset() clears the "valid" flag, which causes insert() 
             // to insert to the head/LRU of the list. 
-            g_mediaCacheContext.lru->insert(cache); 
+            shard->lru->insert(cache); 
         }
     }
     
@@ -43,15 +43,19 @@ RtStatus_t media_cache_write(MediaCacheParamBlock_t * pb)
         return status;
     }
     
+    // Get the drive's shard, which may be assigned now if the drive is new to the cache.
+    MediaCacheShard * shard;
+    status = cache_GetShard(pb->drive, &shard);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+    
     MediaTask task("media_cache_write");
+    MediaCacheLatencyRecorder latency(shard, kMediaCacheLatency_Write);
     
-    // Lock the cache.
-    MediaCacheLock lockCache;
-
-#if CACHE_STATISTICS
-    g_mediaCacheContext.statistics[pb->drive].writeCount++;
-    g_mediaCacheContext.combinedStatistics.writeCount++;
-#endif // CACHE_STATISTICS
+    // Lock the drive's shard of the cache.
+    MediaCacheLock lockCache(shard);
     
     // Try to find a preexisting cache entry for this drive and sector. Cache entries are always
     // in native sectors.
@@ -84,14 +88,8 @@ RtStatus_t media_cache_write(MediaCacheParamBlock_t * pb)
     }
     else
     {
-#if CACHE_STATISTICS
-        // Update statistics.
-        g_mediaCacheContext.statistics[pb->drive].hit();
-        g_mediaCacheContext.combinedStatistics.hit();
-#endif // CACHE_STATISTICS
-        
         // Remove this entry from the LRU list before we retain it.
-        g_mediaCacheContext.lru->remove(cache);
+        shard->lru->remove(cache);
         
         // Retain the cache entry until the write operation completes. We retain before
         // waiting so that the entry cannot be flushed and invalidated by another thread
@@ -103,16 +101,11 @@ RtStatus_t media_cache_write(MediaCacheParamBlock_t * pb)
         status = cache->waitUntilOneOwner();
         if (status != SUCCESS)
         {
-#if CACHE_STATISTICS
-            g_mediaCacheContext.statistics[pb->drive].errors++;
-            g_mediaCacheContext.combinedStatistics.errors++;
-#endif // CACHE_STATISTICS
-
             cache->release();
             if (cache->isUnowned())
             {
                 // Re-insert this entry in list at the MRU position of the LRU list, since we got a hit.
-                g_mediaCacheContext.lru->insert(cache);
+                shard->lru->insert(cache);
             }
             
             return status;
@@ -123,7 +116,7 @@ RtStatus_t media_cache_write(MediaCacheParamBlock_t * pb)
     cache->release();
     
     // Update cache entry fields.
-    cache->isDirty = 1;
+    cache->setDirty();
 
 #if CACHE_STATISTICS
     // Update statistics.
@@ -161,12 +154,12 @@ RtStatus_t media_cache_write(MediaCacheParamBlock_t * pb)
     if (cache->bInsertToLRU)
     {
         // ...at the LRU position.
-        g_mediaCacheContext.lru->deselect(cache);
+        shard->lru->deselect(cache);
     }
     else
     {
         // ...at the MRU position.
-        g_mediaCacheContext.lru->insert(cache);
+        shard->lru->insert(cache);
     }
     
     // Record the write access.
@@ -179,11 +172,6 @@ RtStatus_t media_cache_write(MediaCacheParamBlock_t * pb)
         status = cache->write();
         if (status != SUCCESS)
         {
-#if CACHE_STATISTICS
-            g_mediaCacheContext.statistics[pb->drive].errors++;
-            g_mediaCacheContext.combinedStatistics.errors++;
-#endif // CACHE_STATISTICS
-
             return status;
         }
     }
@@ -214,15 +202,19 @@ RtStatus_t media_cache_pinned_write(MediaCacheParamBlock_t * pb)
         return status;
     }
     
+    // Get the drive's shard, which may be assigned now if the drive is new to the cache.
+    MediaCacheShard * shard;
+    status = cache_GetShard(pb->drive, &shard);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+    
     MediaTask task("media_cache_pinned_write");
+    MediaCacheLatencyRecorder latency(shard, kMediaCacheLatency_PinnedWrite);
     
-    // Lock the cache.
-    MediaCacheLock lockCache;
-
-#if CACHE_STATISTICS
-    g_mediaCacheContext.statistics[pb->drive].writeCount++;
-    g_mediaCacheContext.combinedStatistics.writeCount++;
-#endif // CACHE_STATISTICS
+    // Lock the drive's shard of the cache.
+    MediaCacheLock lockCache(shard);
     
     // Try to find a preexisting cache entry for this drive and sector. Cache entries are always
     // in native sectors.
@@ -257,15 +249,9 @@ RtStatus_t media_cache_pinned_write(MediaCacheParamBlock_t * pb)
     }
     else
     {
-#if CACHE_STATISTICS
-        // Update statistics.
-        g_mediaCacheContext.statistics[pb->drive].hit();
-        g_mediaCacheContext.combinedStatistics.hit();
-#endif // CACHE_STATISTICS
-        
         // Now remove this entry from the LRU list. This prevents any other
         // callers from trying to evict this entry until the pinned write is complete.
-        g_mediaCacheContext.lru->remove(cache);
+        shard->lru->remove(cache);
         
         // Retain the cache entry until the write operation completes. We retain before
         // waiting so that the entry cannot be flushed and invalidated by another thread
@@ -277,15 +263,10 @@ RtStatus_t media_cache_pinned_write(MediaCacheParamBlock_t * pb)
         status = cache->waitUntilOneOwner();
         if (status != SUCCESS)
         {
-#if CACHE_STATISTICS
-            g_mediaCacheContext.statistics[pb->drive].errors++;
-            g_mediaCacheContext.combinedStatistics.errors++;
-#endif // CACHE_STATISTICS
-
             cache->release();
             if (cache->isUnowned())
             {
-                g_mediaCacheContext.lru->insert(cache);
+                shard->lru->insert(cache);
             }
             
             return status;
@@ -293,7 +274,7 @@ RtStatus_t media_cache_pinned_write(MediaCacheParamBlock_t * pb)
     }
     
     // Update cache entry fields.
-    cache->isDirty = 1;
+    cache->setDirty();
     cache->isWritePending = 1;
     cache->isWriteThrough = (pb->flags & kMediaCacheFlag_WriteThrough) != 0;
 
@@ -354,11 +335,6 @@ RtStatus_t cache_CompletePinnedWrite(MediaCacheEntry * cache)
         RtStatus_t status = cache->write();
         if (status != SUCCESS)
         {
-#if CACHE_STATISTICS
-            g_mediaCacheContext.statistics[cache->drive].errors++;
-            g_mediaCacheContext.combinedStatistics.errors++;
-#endif // CACHE_STATISTICS
-
             return status;
         }
     }
@@ -0,0 +1,238 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor, Inc. All rights reserved.
+//
+// Freescale Semiconductor, Inc.
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor, Inc.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \file cache_policy_benchmark.cpp
+//! \brief Compares hit rates of the media cache replacement policies.
+//!
+//! Synthetic access traces that mix FAT, directory, and streaming file data
+//! sectors are replayed against the cache's own LRU lists and sector index. No
+//! media is accessed, so the results only reflect the replacement policies, and
+//! every run of the benchmark produces the same numbers.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "drivers/media/common/media_unit_test_helpers.h"
+#include "cacheutil.h"
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+// Definitions
+////////////////////////////////////////////////////////////////////////////////
+
+//! Number of sector accesses in each trace.
+const unsigned kTraceLength = 200000;
+
+//! Number of sectors in the simulated FAT.
+const uint32_t kFatSectorCount = 64;
+
+//! First sector of the simulated directory area.
+const uint32_t kDirectoryStartSector = kFatSectorCount;
+
+//! Number of sectors in the simulated directory area.
+const uint32_t kDirectorySectorCount = 256;
+
+//! First sector of the simulated file data area.
+const uint32_t kDataStartSector = 4096;
+
+//! Shortest and longest streaming file reads, in sectors.
+const uint32_t kMinStreamLength = 64;
+const uint32_t kMaxStreamLength = 2048;
+
+//! Cache sizes, in entries, that each trace is run against.
+const unsigned kCacheSizes[] = { 16, 32, 64, 128 };
+
+//! \brief Description of one synthetic trace.
+struct TraceMix
+{
+    const char * name;      //!< Name printed with the results.
+    unsigned fatPercent;    //!< Percentage of accesses to FAT sectors.
+    unsigned directoryPercent;  //!< Percentage of accesses to directory sectors.
+    bool useWeights;        //!< Whether FAT and directory accesses carry weight hints.
+};
+
+//! The traces. Accesses that are neither FAT nor directory continue a streaming read.
+const TraceMix kTraceMixes[] = {
+        { "metadata only",          60, 40, true },
+        { "mixed",                  30, 20, true },
+        { "mixed, no weights",      30, 20, false },
+        { "streaming heavy",        10, 10, true },
+        { "streaming, no weights",  10, 10, false }
+    };
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Picks a sector in a region, favoring its start.
+//!
+//! Taking the smaller of two uniform picks skews accesses toward low sectors, the
+//! same way the start of the FAT and the root directory are hotter than the rest.
+static uint32_t pick_skewed(Taus88 & random, uint32_t start, uint32_t count)
+{
+    return start + std::min(random.next(count), random.next(count));
+}
+
+//! \brief Replays one trace and returns the number of hits.
+//!
+//! \param mix The trace to generate.
+//! \param policy Replacement policy to use.
+//! \param entryCount Number of cache entries.
+//! \param[out] hitCount Number of accesses that hit in the cache.
+//! \retval SUCCESS The trace was replayed.
+//! \retval ERROR_OS_MEMORY_MANAGER_NOMEMORY The simulated cache could not be allocated.
+static RtStatus_t run_trace(const TraceMix & mix, MediaCachePolicy_t policy, unsigned entryCount, unsigned * hitCount)
+{
+    // The entries never hold data, so they don't need buffers.
+    auto_free<MediaCacheEntry> entries(malloc(entryCount * sizeof(MediaCacheEntry)));
+    if (!entries)
+    {
+        return ERROR_OS_MEMORY_MANAGER_NOMEMORY;
+    }
+
+    MediaCacheIndex index(entries, entryCount);
+    auto_delete<WeightedLRUList> lru;
+    if (policy == kMediaCachePolicy_2Q)
+    {
+        MediaCacheTwoQueueList * twoQueue = new MediaCacheTwoQueueList(kMediaCacheWeight_Low, kMediaCacheWeight_High, 0, entryCount / 2);
+        lru = twoQueue;
+        if (!twoQueue || !twoQueue->isValid())
+        {
+            return ERROR_OS_MEMORY_MANAGER_NOMEMORY;
+        }
+    }
+    else
+    {
+        lru = new WeightedLRUList(kMediaCacheWeight_Low, kMediaCacheWeight_High, 0);
+    }
+    if (!lru || !index.isValid())
+    {
+        return ERROR_OS_MEMORY_MANAGER_NOMEMORY;
+    }
+
+    unsigned i;
+    for (i = 0; i < entryCount; ++i)
+    {
+        new(&entries[i]) MediaCacheEntry(NULL);
+        lru->insert(&entries[i]);
+    }
+
+    // Every trace uses the same seed, so the policies see identical accesses.
+    Taus88 random;
+    uint32_t streamSector = kDataStartSector;
+    uint32_t streamRemaining = 0;
+    unsigned hits = 0;
+
+    for (i = 0; i < kTraceLength; ++i)
+    {
+        uint32_t sector;
+        int weight = kMediaCacheWeight_Low;
+        uint32_t choice = random.next(100);
+
+        if (choice < mix.fatPercent)
+        {
+            sector = pick_skewed(random, 0, kFatSectorCount);
+            weight = mix.useWeights ? kMediaCacheWeight_High : kMediaCacheWeight_Low;
+        }
+        else if (choice < mix.fatPercent + mix.directoryPercent)
+        {
+            sector = pick_skewed(random, kDirectoryStartSector, kDirectorySectorCount);
+            weight = mix.useWeights ? kMediaCacheWeight_Medium : kMediaCacheWeight_Low;
+        }
+        else
+        {
+            // Start a new file once the current one has been read. Files are never read twice.
+            if (streamRemaining == 0)
+            {
+                streamRemaining = kMinStreamLength + random.next(kMaxStreamLength - kMinStreamLength);
+            }
+            sector = streamSector++;
+            streamRemaining--;
+        }
+
+        MediaCacheEntry * entry = index.find(0, sector);
+        if (entry)
+        {
+            ++hits;
+            lru->remove(entry);
+        }
+        else
+        {
+            entry = static_cast<MediaCacheEntry *>(lru->select());
+            assert(entry);
+            if (entry->isValid)
+            {
+                index.remove(entry);
+            }
+
+            entry->isValid = 1;
+            entry->drive = 0;
+            entry->sector = sector;
+            index.insert(entry);
+        }
+
+        entry->weight = weight;
+        lru->insert(entry);
+    }
+
+    *hitCount = hits;
+    return SUCCESS;
+}
+
+RtStatus_t test_main(ULONG param)
+{
+    RtStatus_t status = SUCCESS;
+    unsigned mixIndex;
+    unsigned sizeIndex;
+
+    FASTPRINT("Media cache replacement policy hit rates, %u accesses per trace\n", kTraceLength);
+    FASTPRINT("%-24s %8s %8s %8s\n", "trace", "entries", "LRU", "2Q");
+
+    for (mixIndex = 0; mixIndex < sizeof(kTraceMixes) / sizeof(kTraceMixes[0]) && status == SUCCESS; ++mixIndex)
+    {
+        const TraceMix & mix = kTraceMixes[mixIndex];
+
+        for (sizeIndex = 0; sizeIndex < sizeof(kCacheSizes) / sizeof(kCacheSizes[0]); ++sizeIndex)
+        {
+            unsigned lruHits;
+            unsigned twoQueueHits;
+
+            status = run_trace(mix, kMediaCachePolicy_LRU, kCacheSizes[sizeIndex], &lruHits);
+            if (status == SUCCESS)
+            {
+                status = run_trace(mix, kMediaCachePolicy_2Q, kCacheSizes[sizeIndex], &twoQueueHits);
+            }
+            if (status != SUCCESS)
+            {
+                break;
+            }
+
+            FASTPRINT("%-24s %8u %7.2f%% %7.2f%%\n", mix.name, kCacheSizes[sizeIndex],
+                (float)lruHits * 100.0 / (float)kTraceLength,
+                (float)twoQueueHits * 100.0 / (float)kTraceLength);
+        }
+    }
+
+    if (status == SUCCESS)
+    {
+        FASTPRINT("benchmark finished\n");
+    }
+    else
+    {
+        FASTPRINT("benchmark failed: 0x%08x\n", status);
+    }
+
+    exit(status);
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
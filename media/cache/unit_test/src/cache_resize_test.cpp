@@ -0,0 +1,269 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor, Inc. All rights reserved.
+//
+// Freescale Semiconductor, Inc.
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor, Inc.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \file cache_resize_test.cpp
+//! \brief Tests multisector reads and writes through a media cache that is resized.
+//!
+//! The cache is grown past the entries in the buffer passed to media_cache_init(), so
+//! that runs of sectors span both those entries and the ones with separately allocated
+//! buffers. Every run is written with media_cache_pinned_write() and read back with
+//! media_cache_read(), asking for several sectors each time, and every sector returned
+//! is verified. The cache is shrunk and grown again between passes. The data drive is
+//! on the simulated NAND HAL, so the test needs no particular NAND.
+///////////////////////////////////////////////////////////////////////////////
+#include "drivers/media/common/media_unit_test_helpers.h"
+#include "drivers/media/ddi_media_errordefs.h"
+#include "drivers/media/cache/media_cache.h"
+#include "drivers/media/nand/hal/ddi_nand_hal.h"
+#include "drivers/media/nand/hal/sim/ddi_nand_hal_sim.h"
+#include "drivers/media/nand/include/ddi_nand.h"
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+// Definitions
+////////////////////////////////////////////////////////////////////////////////
+
+//! Number of maximum size sector buffers in the buffer passed to media_cache_init().
+const unsigned kInitialEntryCount = 8;
+
+//! Number of sectors requested by each read and pinned write.
+const uint32_t kRunLength = 8;
+
+//! Number of passes. Odd passes run on the grown cache, even ones on the initial size.
+const unsigned kPassCount = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+RtStatus_t run_test();
+
+////////////////////////////////////////////////////////////////////////////////
+// Variables
+////////////////////////////////////////////////////////////////////////////////
+
+//! Buffer for the initial cache entries.
+static SECTOR_BUFFER s_cacheBuffer[CACHED_BUFFER_SIZE_IN_WORDS(kMaxBufferBytes * kInitialEntryCount)];
+
+//! Native sector size of the data drive.
+static uint32_t s_sectorSize = 0;
+
+//! Number of sectors covered by each pass, four times the size of the grown cache.
+static uint32_t s_sectorCount = 0;
+
+//! Media layout used by the test: a single data drive filling the media.
+static MediaAllocationTable_t s_mediaTable = {
+    1,
+    {
+        { 1, kDriveTypeData, DRIVE_TAG_DATA, 0, true }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Returns the number the fill pattern of a sector is built from in a pass.
+static uint32_t get_pattern_number(uint32_t sector, unsigned pass)
+{
+    return sector + pass * s_sectorCount;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Erases the media, allocates a data drive on it, and initializes the cache.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t setup()
+{
+    NandSimConfig_t config = { };
+    config.nandType = kNandType6;
+    config.chipSelectCount = 1;
+    config.blocksPerChip = 1024;
+    config.delayMode = kNandSimDelay_None;
+    config.randomSeed = 1;
+    REQ_SUCCESS(ddi_nand_hal_sim_configure(&config));
+
+    REQ_SUCCESS(MediaInit(kInternalMedia));
+    REQ_SUCCESS(MediaErase(kInternalMedia, 0, true));
+    REQ_SUCCESS(MediaAllocate(kInternalMedia, &s_mediaTable));
+    REQ_SUCCESS(MediaDiscoverAllocation(kInternalMedia));
+    REQ_SUCCESS(DriveInit(DRIVE_TAG_DATA));
+
+    REQ_SUCCESS(DriveGetInfo(DRIVE_TAG_DATA, kDriveInfoNativeSectorSizeInBytes, &s_sectorSize));
+    REQ_TRUE(s_sectorSize <= kMaxBufferBytes);
+    g_actualBufferBytes = s_sectorSize;
+
+    REQ_SUCCESS(media_cache_init((uint8_t *)s_cacheBuffer, sizeof(s_cacheBuffer)));
+
+    MediaCacheSizeInfo_t info;
+    REQ_SUCCESS(media_cache_get_size_info(&info));
+    REQ_TRUE(info.maxEntryCount > info.minEntryCount);
+    REQ_RESULT(info.entryCount, info.minEntryCount);
+    s_sectorCount = info.maxEntryCount * 4;
+
+    uint32_t driveSectorCount;
+    REQ_SUCCESS(DriveGetInfo(DRIVE_TAG_DATA, kDriveInfoSizeInNativeSectors, &driveSectorCount));
+    REQ_TRUE(driveSectorCount >= s_sectorCount);
+
+    FASTPRINT("Cache: %u entries, up to %u, sectors of %u bytes\n", info.entryCount, info.maxEntryCount, s_sectorSize);
+
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Checks that the cache can't shrink below its initial size, then grows it.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t test_limits()
+{
+    MediaCacheSizeInfo_t info;
+    REQ_SUCCESS(media_cache_get_size_info(&info));
+
+    REQ_STATUS(media_cache_resize(info.minEntryCount - 1), ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER);
+    REQ_STATUS(media_cache_resize(info.maxEntryCount + 1), ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER);
+    REQ_SUCCESS(media_cache_resize(info.maxEntryCount));
+
+    REQ_SUCCESS(media_cache_get_size_info(&info));
+    REQ_RESULT(info.entryCount, info.maxEntryCount);
+
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Writes every sector of a pass with multisector pinned writes.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t write_runs(unsigned pass)
+{
+    uint32_t sector = 0;
+
+    while (sector < s_sectorCount)
+    {
+        MediaCacheParamBlock_t pb = {0};
+        pb.drive = DRIVE_TAG_DATA;
+        pb.sector = sector;
+        pb.flags = kMediaCacheFlag_UseNativeSectors | kMediaCacheFlag_NoPartitionOffset | kMediaCacheFlag_NoReadback;
+        pb.requestSectorCount = std::min<uint32_t>(kRunLength, s_sectorCount - sector);
+
+        REQ_SUCCESS(media_cache_pinned_write(&pb));
+        REQ_TRUE(pb.actualSectorCount > 0 && pb.actualSectorCount <= pb.requestSectorCount);
+
+        for (uint32_t i = 0; i < pb.actualSectorCount; ++i)
+        {
+            fill_data_buffer(s_dataBuffer, get_pattern_number(sector + i, pass));
+            memcpy(pb.buffer + i * s_sectorSize, s_dataBuffer, s_sectorSize);
+        }
+
+        REQ_SUCCESS(media_cache_release(pb.token));
+        sector += pb.actualSectorCount;
+    }
+
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Reads back every sector of a pass with multisector reads and verifies them.
+//!
+//! \param pass The pass whose data is expected.
+//! \param firstSector Where to start, so that runs are not always aligned the same
+//!     way as the writes.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t verify_runs(unsigned pass, uint32_t firstSector)
+{
+    uint32_t sector = firstSector;
+
+    while (sector < s_sectorCount)
+    {
+        MediaCacheParamBlock_t pb = {0};
+        pb.drive = DRIVE_TAG_DATA;
+        pb.sector = sector;
+        pb.flags = kMediaCacheFlag_UseNativeSectors | kMediaCacheFlag_NoPartitionOffset;
+        pb.requestSectorCount = std::min<uint32_t>(kRunLength, s_sectorCount - sector);
+
+        REQ_SUCCESS(media_cache_read(&pb));
+        REQ_TRUE(pb.actualSectorCount > 0 && pb.actualSectorCount <= pb.requestSectorCount);
+
+        for (uint32_t i = 0; i < pb.actualSectorCount; ++i)
+        {
+            fill_data_buffer(s_dataBuffer, get_pattern_number(sector + i, pass));
+            if (!compare_buffers(s_dataBuffer, pb.buffer + i * s_sectorSize, s_sectorSize))
+            {
+                FASTPRINT("Sector %u does not match in pass %u\n", sector + i, pass);
+                media_cache_release(pb.token);
+                return ERROR_GENERIC;
+            }
+        }
+
+        REQ_SUCCESS(media_cache_release(pb.token));
+        sector += pb.actualSectorCount;
+    }
+
+    return SUCCESS;
+}
+
+RtStatus_t run_test()
+{
+    REQ_SUCCESS(setup());
+    REQ_SUCCESS(test_limits());
+
+    MediaCacheSizeInfo_t info;
+    REQ_SUCCESS(media_cache_get_size_info(&info));
+
+    for (unsigned pass = 1; pass <= kPassCount; ++pass)
+    {
+        REQ_SUCCESS(write_runs(pass));
+        REQ_SUCCESS(verify_runs(pass, pass % kRunLength));
+
+        // Shrinking moves the sectors of the grown entries into the initial ones, and
+        // writes back what doesn't fit.
+        REQ_SUCCESS(media_cache_resize((pass & 1) ? info.minEntryCount : info.maxEntryCount));
+        REQ_SUCCESS(verify_runs(pass, 0));
+
+        FASTPRINT("Pass %u passed\n", pass);
+    }
+
+    MediaCacheParamBlock_t pb = {0};
+    pb.flags = kMediaCacheFlag_FlushAllDrives;
+    REQ_SUCCESS(media_cache_flush(&pb));
+    REQ_SUCCESS(media_cache_shutdown());
+    REQ_SUCCESS(MediaShutdown(kInternalMedia));
+
+    tss_logtext_Flush(TX_WAIT_FOREVER);
+
+    return SUCCESS;
+}
+
+RtStatus_t test_main(ULONG param)
+{
+    RtStatus_t status;
+
+    // Initialize the Media
+    status = SDKInitialization();
+
+    if (status == SUCCESS)
+    {
+        status = run_test();
+    }
+
+    if (status == SUCCESS)
+    {
+        FASTPRINT("unit test passed!\n");
+    }
+    else
+    {
+        FASTPRINT("unit test failed: 0x%08x\n", status);
+    }
+
+    exit(status);
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
@@ -16,6 +16,8 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "wlru.h"
+#include <algorithm>
+#include "arm_ghs.h" // for __CLZ32
 
 ///////////////////////////////////////////////////////////////////////////////
 // Code
@@ -23,11 +25,17 @@
 
 #pragma ghs section text=".init.text"
 WeightedLRUList::WeightedLRUList(int minWeight, int maxWeight, unsigned windowSize)
-:   DoubleList(),
+:   m_minWeight(minWeight),
     m_maxWeight(maxWeight),
     m_scaleNumerator(1),
-    m_scaleDenominator(1)
+    m_scaleDenominator(1),
+    m_nextStamp(0),
+    m_bandMask(0),
+    m_size(0),
+    m_front()
 {
+    assert(maxWeight >= minWeight && maxWeight - minWeight < kMaxBandCount);
+
     // Compute window size.
     if (windowSize == 0)
     {
@@ -48,51 +56,77 @@ WeightedLRUList::WeightedLRUList(int minWeight, int maxWeight, unsigned windowSi
 #pragma ghs section text=default
 
 WeightedLRUList::Node::Node()
-:   DoubleList::Node()
+:   DoubleList::Node(),
+    m_lruStamp(0),
+    m_lruBand(kNotListed)
+{
+}
+
+unsigned WeightedLRUList::getBand(int weight) const
 {
+    // If the window size is 0 then every node goes at the tail/MRU.
+    if (m_scaleDenominator == 0)
+    {
+        return 0;
+    }
+
+    weight = std::max(m_minWeight, std::min(m_maxWeight, weight));
+    return (m_maxWeight - weight) * m_scaleNumerator / m_scaleDenominator;
 }
 
 void WeightedLRUList::insert(Node * node)
 {
-    Node * insertPos;
-    
-    // Find where to insert the entry.
     if (!node->isNodeValid())
     {
         // Invalid cache entries get inserted at the head/LRU of the list,
         // because we want to use them immediately.
-        insertPos = NULL;
+        node->m_lruBand = kFrontBand;
+        m_front.insertFront(node);
     }
     else
     {
-        // If the window size is 0 then we just insert at the tail/MRU.
-        insertPos = static_cast<Node *>(getTail());
+        // The band is how many positions toward the head/LRU this node's weight
+        // puts it. Backdating the stamp by that much orders the node after exactly
+        // that many of the most recently inserted nodes.
+        unsigned band = getBand(node->getWeight());
+        node->m_lruBand = band;
+        node->m_lruStamp = m_nextStamp++ - band;
+        m_bands[band].insertBack(node);
+        m_bandMask |= 1U << band;
+    }
+    
+    ++m_size;
+}
 
-        if (m_scaleDenominator > 0)
+WeightedLRUList::Node * WeightedLRUList::getHead()
+{
+    Node * node = static_cast<Node *>(m_front.getHead());
+    if (node)
+    {
+        return node;
+    }
+
+    // Pick the oldest stamp among the heads of the bands. Stamps wrap, so compare
+    // them by their difference.
+    uint32_t mask = m_bandMask;
+    while (mask)
+    {
+        unsigned band = 31 - __CLZ32(mask);
+        mask &= ~(1U << band);
+
+        Node * bandHead = static_cast<Node *>(m_bands[band].getHead());
+        if (!node || static_cast<int32_t>(bandHead->m_lruStamp - node->m_lruStamp) < 0)
         {
-            // The LRU window size is nonzero, so we need to use the weight on
-            // this node to choose an insertion point proportionally toward the head/LRU.
-            int ki = (m_maxWeight - node->getWeight()) * m_scaleNumerator / m_scaleDenominator;
-            int i = 0;
-            
-            // Work from tail to head to find the insert position in the window for this
-            // node's weight.
-            while (insertPos && i < ki)
-            {
-                insertPos = static_cast<Node *>(insertPos->getPrevious());
-                i++;
-            }
-            
+            node = bandHead;
         }
     }
     
-    // Insert in sorted position.
-    insertAfter(node, insertPos);
+    return node;
 }
 
 WeightedLRUList::Node * WeightedLRUList::select()
 {
-    Node * node = static_cast<Node *>(getHead());
+    Node * node = getHead();
     if (node)
     {
         remove(node);
@@ -102,9 +136,9 @@ WeightedLRUList::Node * WeightedLRUList::select()
 
 WeightedLRUList::Node * WeightedLRUList::select(const NodeMatch & matcher)
 {
-    Iterator myit = getBegin();
+    DoubleList::Iterator myit = m_front.getBegin();
 
-    for (; myit != getEnd(); ++myit)
+    for (; myit != m_front.getEnd(); ++myit)
     {
         Node * node = static_cast<Node *>(*myit);
         if (matcher.isMatch(node))
@@ -113,12 +147,78 @@ WeightedLRUList::Node * WeightedLRUList::select(const NodeMatch & matcher)
             return node;
         }
     }
+
+    for (unsigned band = 0; band < kMaxBandCount; ++band)
+    {
+        myit = m_bands[band].getBegin();
+        
+        for (; myit != m_bands[band].getEnd(); ++myit)
+        {
+            Node * node = static_cast<Node *>(*myit);
+            if (matcher.isMatch(node))
+            {
+                remove(node);
+                return node;
+            }
+        }
+    }
     return 0;
 }
 
 void WeightedLRUList::deselect(Node * node)
 {
-    insertFront(node);
+    node->m_lruBand = kFrontBand;
+    m_front.insertFront(node);
+    ++m_size;
+}
+
+void WeightedLRUList::reinsert(Node * node)
+{
+    assert(node->isNodeValid() && node->m_lruBand == kNotListed);
+
+    unsigned band = getBand(node->getWeight());
+    DoubleList & list = m_bands[band];
+
+    // Walk back from the tail to the last node inserted before this one.
+    Node * position = static_cast<Node *>(list.getTail());
+    while (position && static_cast<int32_t>(position->m_lruStamp - node->m_lruStamp) > 0)
+    {
+        position = static_cast<Node *>(position->getPrevious());
+    }
+
+    node->m_lruBand = band;
+    list.insertAfter(node, position);
+    m_bandMask |= 1U << band;
+    
+    ++m_size;
+}
+
+void WeightedLRUList::remove(Node * node)
+{
+    if (node->m_lruBand == kNotListed)
+    {
+        return;
+    }
+
+    DoubleList & list = getList(node);
+    list.remove(node);
+    
+    if (node->m_lruBand != kFrontBand && list.isEmpty())
+    {
+        m_bandMask &= ~(1U << node->m_lruBand);
+    }
+    
+    node->m_lruBand = kNotListed;
+    --m_size;
+}
+
+void WeightedLRUList::clear()
+{
+    // Mark every node as not listed, so a later remove() of one is ignored.
+    while (!isEmpty())
+    {
+        select();
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
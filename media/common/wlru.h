@@ -26,22 +26,36 @@
 /*!
  * \brief Class to manage a weighted LRU list.
  *
- * This class maintains a doubly linked list of node sorted in LRU order, which is
- * equivalent to FIFO order. In addition to strict LRU ordering, the class features
- * support for weighted LRU ordering. That is, highly weighted objects have a
- * higher "recency" than low weighted objects. This allows the user to retain objects
- * with a high cost of loading or known high access frequency more than other objects.
+ * This class maintains a set of nodes in LRU order, which is equivalent to FIFO
+ * order. In addition to strict LRU ordering, the class features support for weighted
+ * LRU ordering. That is, highly weighted objects have a higher "recency" than low
+ * weighted objects. This allows the user to retain objects with a high cost of
+ * loading or known high access frequency more than other objects.
  *
  * The constuctor takes a maximum window size parameter. If the computed window size
  * is larger than the maximum, then weights will be scaled down to fit. Pass 0 to
  * disable weighting entirely and enforce strict LRU ordering.
  *
+ * Nodes are kept in one FIFO sub-list per weight band, where a band is the number
+ * of positions that the node's weight moves it away from the tail/MRU. Each node is
+ * stamped with an insertion sequence number less its band, so every sub-list is
+ * sorted by stamp and an insert is just an append. select() takes the head of the
+ * sub-list with the lowest stamp, which only requires looking at the head of each
+ * non-empty band. Invalid and deselected nodes are kept in a separate front list
+ * that is always selected from first.
+ *
+ * The list operations are virtual so that a subclass can implement a different
+ * replacement policy behind the same interface.
+ *
  * \ingroup media_cache_internal
  */
-class WeightedLRUList : public DoubleList
+class WeightedLRUList
 {
 public:
 
+    //! Maximum number of distinct weights, from the minimum through the maximum.
+    static const unsigned kMaxBandCount = 16;
+
     /*!
      * \brief Abstract base class for a node in an LRU list.
      * \ingroup media_cache_internal
@@ -59,6 +73,14 @@ public:
         //! \brief Pure virtual method to return the node's weight value.
         virtual int getWeight() const = 0;
 
+        //! \brief Gives this node the insertion order of \a other, for use with reinsert().
+        void copyOrder(const Node * other) { m_lruStamp = other->m_lruStamp; }
+
+    protected:
+        uint32_t m_lruStamp;    //!< Insertion sequence number less the weight band. Lower stamps are selected first.
+        uint8_t m_lruBand;      //!< Sub-list the node is in, #kFrontBand, or #kNotListed.
+        
+        friend class WeightedLRUList;
     };
 
     /*!
@@ -77,6 +99,9 @@ public:
     //! \brief Constructor.
     WeightedLRUList(int minWeight, int maxWeight, unsigned windowSize);
     
+    //! \brief Destructor.
+    virtual ~WeightedLRUList() {}
+    
     //! \name List operations
     //@{
     //! \brief Insert \a node into the list at or near the tail/MRU position.
@@ -86,21 +111,74 @@ public:
     //! If weights are being used in this LRU, then a weight of \a m_maxWeight on \a node will cause
     //! insertion at the tail, and a weight of zero on \a node will cause insertion
     //! at the head.
-    void insert(Node * node);
+    virtual void insert(Node * node);
     
     //! \brief Get the oldest entry (head/LRU) in the list.
-    Node * select();
+    virtual Node * select();
 
     //! \brief Find a matching node in the list.
+    //!
+    //! The front list is searched first, and then each band in turn, so the node
+    //! returned is not necessarily the least recently used match.
     Node * select(const NodeMatch & matcher);
 
     //! \brief Put \a node back on the head/LRU of the list.
-    void deselect(Node * node);
+    virtual void deselect(Node * node);
+
+    //! \brief Put a valid \a node that was removed from the list back in its old place.
+    //!
+    //! The node keeps the stamp it was given when it was last inserted, so it goes
+    //! back among the nodes of its band in insertion order instead of at the tail. The
+    //! place is searched for from the tail, so a recently inserted node is quick to put back.
+    void reinsert(Node * node);
+    
+    //! \brief Remove \a node from the list.
+    //!
+    //! Nodes that are not in the list are ignored, so callers can remove a node
+    //! without knowing whether another owner already has.
+    virtual void remove(Node * node);
+    
+    //! \brief Returns true if the list has no nodes in it.
+    virtual bool isEmpty() const { return m_size == 0; }
+    
+    //! \brief Remove all nodes from the list.
+    void clear();
+    //@}
+    
+    //! \name List info
+    //@{
+    //! \brief Returns the node that select() would return next, without removing it.
+    Node * getHead();
+    
+    //! \brief Returns the number of nodes currently in the list.
+    int getSize() const { return m_size; }
+    //@}
 
 protected:
+    //! Value of Node::m_lruBand for nodes in the front list.
+    static const uint8_t kFrontBand = 0xff;
+    
+    //! Value of Node::m_lruBand for nodes that are not in the list.
+    static const uint8_t kNotListed = 0xfe;
+
+    int m_minWeight;    //!< Minimum weight value.
     int m_maxWeight;    //!< Maximum weight value.
     int m_scaleNumerator;   //!< Scale multiplier.
     int m_scaleDenominator; //!< Scale divider.
+    uint32_t m_nextStamp;   //!< Sequence number given to the next inserted node.
+    uint32_t m_bandMask;    //!< Bit mask of the bands that have nodes in them.
+    int m_size;             //!< Number of nodes in all the lists.
+    DoubleList m_front;     //!< Invalid and deselected nodes, selected before any band.
+    DoubleList m_bands[kMaxBandCount];  //!< Valid nodes, one FIFO per weight band.
+
+    //! \brief Returns the band for a weight.
+    unsigned getBand(int weight) const;
+    
+    //! \brief Returns the list that holds \a node.
+    DoubleList & getList(const Node * node)
+    {
+        return node->m_lruBand == kFrontBand ? m_front : m_bands[node->m_lruBand];
+    }
 };
 
 #endif // _wlru_h_
@@ -151,6 +151,15 @@
 
         //! The address given for the storage media (either origin or range) is incorrect. [0xf021e003]
         #define ERROR_DDI_MEDIA_CACHE_INVALID_MEDIA_ADDRESS              (ERROR_DDI_MEDIA_CACHE_GROUP + 3)
+
+        //! A configuration parameter passed to the media cache is out of range. [0xf021e004]
+        #define ERROR_DDI_MEDIA_CACHE_INVALID_PARAMETER                  (ERROR_DDI_MEDIA_CACHE_GROUP + 4)
+
+        //! More drives were accessed through the media cache than it has shards for. [0xf021e005]
+        #define ERROR_DDI_MEDIA_CACHE_TOO_MANY_DRIVES                    (ERROR_DDI_MEDIA_CACHE_GROUP + 5)
+
+        //! Every asynchronous read request is already in use. [0xf021e006]
+        #define ERROR_DDI_MEDIA_CACHE_QUEUE_FULL                         (ERROR_DDI_MEDIA_CACHE_GROUP + 6)
     //@}
 //! @}
 
@@ -33,6 +33,7 @@
 #include "ZoneMapSectionPage.h"
 #include "ZoneMapCache.h"
 #include "PersistentPhyMap.h"
+#include "MapperCheckpoint.h"
 #include "BlockAllocator.h"
 #include "NssmManager.h"
 #include "NonsequentialSectorsMap.h"
@@ -49,6 +50,7 @@ Mapper::Mapper(Media * media)
 :   m_media(media),
     m_zoneMap(NULL),
     m_phyMapOnMedia(NULL),
+    m_checkpoint(NULL),
     m_physMap(NULL),
     m_prebuiltPhymap(NULL),
     m_isInitialized(false),
@@ -56,6 +58,7 @@ Mapper::Mapper(Media * media)
     m_isPhysMapCreated(false),
     m_isMapDirty(false),
     m_isBuildingMaps(false),
+    m_isReservedRangeClean(false),
     m_unallocatedBlockAddress(0),
     m_blockAllocator(NULL),
     m_mapAllocator(NULL)
@@ -92,6 +95,7 @@ RtStatus_t Mapper::init()
     RtStatus_t retCode = SUCCESS;
     uint32_t trustMediaResidentMaps;
     bool bRangeMoved=false;
+    bool isCheckpointRestored = false;
     
     // Only need to initialize these values once.
     if (!m_isInitialized)
@@ -135,6 +139,13 @@ RtStatus_t Mapper::init()
             m_phyMapOnMedia->setPhyMap(m_physMap);
         }
     }
+    
+    // Allocate the mount checkpoint.
+    if (!m_checkpoint)
+    {
+        m_checkpoint = new MapperCheckpoint(*this);
+        m_checkpoint->init(m_zoneMap->getSectionCount(), m_phyMapOnMedia->getSectionCount());
+    }
 
     // We need the know the reserved block range before doing anything that touches
     // the zone or phy maps on the media.
@@ -180,6 +191,7 @@ RtStatus_t Mapper::init()
     m_isZoneMapCreated = false;
     m_isPhysMapCreated = false;
     m_isBuildingMaps = false;
+    m_isReservedRangeClean = false;
     
     if (bRangeMoved || m_prebuiltPhymap)
     {
@@ -198,13 +210,18 @@ RtStatus_t Mapper::init()
         // Try to load the zone and phy maps from media.
         tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP, "Loading maps from media\n");
         
+        // Use the checkpoint saved at the last shutdown to locate both maps, instead of
+        // searching the reserved range for each of them and scanning their blocks.
+        isCheckpointRestored = (m_checkpoint->restore(*m_zoneMap, *m_phyMapOnMedia, m_reserved.startBlock, m_reserved.blockCount, &m_isReservedRangeClean) == SUCCESS);
+        
         // Find and load the phy map.
-        retCode = m_phyMapOnMedia->load();
+        retCode = m_phyMapOnMedia->load(isCheckpointRestored);
         
         if (retCode == SUCCESS)
         {
-            // Locate and init the zone map.
-            retCode = m_zoneMap->findZoneMap();
+            // Locate and init the zone map, unless the checkpoint already located it, and
+            // load its journal.
+            retCode = m_zoneMap->findZoneMap(isCheckpointRestored);
         }
 
         if (retCode == SUCCESS)
@@ -223,6 +240,9 @@ RtStatus_t Mapper::init()
         // The maps are corrupted or can not be found on the media, or the system was
         // shutdown uncleanly and we cannot trust the maps.
         tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP, "Scanning media to create maps\n");
+        
+        // Don't rely on a checkpoint for the maps that failed to load.
+        m_isReservedRangeClean = false;
 
         // Rebuild the Zone Map and Phy Map from RA data on the media.
         // This function will also erase any pre-existing maps which are stored
@@ -255,11 +275,18 @@ RtStatus_t Mapper::init()
     
     // Go clean out the reserved block range of any blocks that shouldn't be there.
     // This is necessary because the reserved block range may potentially move or grow
-    // between boots due to new bad blocks.
-    retCode = evacuateReservedBlockRange();
-    if (retCode)
+    // between boots due to new bad blocks. A restored checkpoint records whether the
+    // range had been cleaned out when it was saved, and is only restored if the range
+    // hasn't changed since.
+    if (!m_isReservedRangeClean)
     {
-        return retCode;
+        retCode = evacuateReservedBlockRange();
+        if (retCode)
+        {
+            return retCode;
+        }
+        
+        m_isReservedRangeClean = true;
     }
 
     return SUCCESS;
@@ -571,11 +598,28 @@ RtStatus_t Mapper::evacuateReservedBlockRange()
             }
         }
         
+        // Check for a checkpoint block.
+        if (!isMapBlock)
+        {
+            isMapBlock = isBlockMapBlock(blockPhysicalAddress, kMapperCheckpoint, &status);
+            if (status)
+            {
+                break;
+            }
+            
+            // Keep the current checkpoint block.
+            if (isMapBlock && m_checkpoint && m_checkpoint->isMapBlock(scanBlock))
+            {
+                continue;
+            }
+        }
+        
         // Handle different block types separately.
         if (isMapBlock)
         {
             // Map blocks get erased and marked unused. This is OK because we've already
-            // made sure that we're not erasing the current zone or phy map blocks above.
+            // made sure that we're not erasing the current zone or phy map or checkpoint
+            // blocks above.
             status = m_physMap->markBlockFreeAndErase(blockPhysicalAddress);
             if (status)
             {
@@ -713,6 +757,9 @@ RtStatus_t Mapper::shutdown()
         return ret;
     }
     
+    // Record where the maps are for the next boot.
+    saveCheckpoint();
+    
     // Free the block allocators.
     if (m_mapAllocator)
     {
@@ -1021,6 +1068,10 @@ RtStatus_t Mapper::flush()
          return SUCCESS;
     }
 
+    // The maps are about to be written, so the checkpoint saved at the last shutdown
+    // can't be used to find them any more.
+    retireCheckpoint();
+
 start_flush:
     
     // Maps are no longer dirty.
@@ -1057,6 +1108,58 @@ start_flush:
     return SUCCESS;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//! Saves the locations of the zone and phy maps in the mount checkpoint, so the next
+//! boot can load them without searching the reserved block range for each of them.
+//! Nothing is written if the latest checkpoint has not been retired, since the maps
+//! have not been written since it was saved or restored. A failure is only logged,
+//! because the maps themselves are already safely on the media and the next boot will
+//! search for them as before.
+//!
+//! \pre The maps have been flushed.
+////////////////////////////////////////////////////////////////////////////////
+void Mapper::saveCheckpoint()
+{
+    RtStatus_t status;
+    bool wasDirtied;
+    
+    if (m_checkpoint->isLive())
+    {
+        return;
+    }
+    
+    do
+    {
+        status = m_checkpoint->save(*m_zoneMap, *m_phyMapOnMedia, m_reserved.startBlock, m_reserved.blockCount, m_isReservedRangeClean);
+        
+        // Allocating or consolidating the checkpoint block changes the phy map. Flushing
+        // it retires the checkpoint that was just saved, so it has to be saved again.
+        wasDirtied = m_isMapDirty;
+        if (status == SUCCESS && wasDirtied)
+        {
+            status = flush();
+        }
+    } while (status == SUCCESS && wasDirtied);
+    
+    if (status != SUCCESS)
+    {
+        tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP, "Saving mapper checkpoint failed with error 0x%08x\n", status);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! Adds a retired checkpoint if the latest one has not been retired yet, so the next
+//! boot searches for the maps unless they are checkpointed again before then. This
+//! must be done before either map is written.
+////////////////////////////////////////////////////////////////////////////////
+void Mapper::retireCheckpoint()
+{
+    if (m_checkpoint)
+    {
+        m_checkpoint->retire();
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //! \brief   Search the NAND for a zone map.
 //!
@@ -1124,7 +1227,7 @@ void Mapper::handleNewBadBlock(const BlockAddress & badBlockAddress)
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
-//! This function searches for and erases all occurrences of zone-map and phymap.
+//! This function searches for and erases all occurrences of zone-map, phymap and checkpoint.
 //! This is done when we find out that power was lost.  Consequently, we cannot trust
 //! zone-map and phys-map which is stored in Nand.
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -1138,13 +1241,20 @@ void Mapper::searchAndDestroy()
     {
         // If there isn't a match, continue search.
         if (isBlockMapBlock(i, kMapperZoneMap, &retCode)
-            || isBlockMapBlock(i, kMapperPhyMap, &retCode))
+            || isBlockMapBlock(i, kMapperPhyMap, &retCode)
+            || isBlockMapBlock(i, kMapperCheckpoint, &retCode))
         {
             m_physMap->markBlockFreeAndErase(i);
         }
 
     }
 
+    // The checkpoint block is gone, so the next checkpoint goes into a new one.
+    if (m_checkpoint)
+    {
+        m_checkpoint->invalidate();
+    }
+
     // Clear the valid flags for the maps.
     m_isZoneMapCreated = false;
     m_isPhysMapCreated = false;
@@ -1157,6 +1267,10 @@ void Mapper::searchAndDestroy()
 //! by reading the RA, and extract the LBA <-> Physical Block Address
 //! information so that a Zone map can be created.
 //!
+//! The media is only scanned once. The phymap scan records the LBA held by each block,
+//! and the zone map is built from that record afterwards, once the phymap is complete
+//! and blocks can be allocated for the maps.
+//!
 //! \return Status of call or error.
 //! \retval SUCCESS If no error has occurred.
 ////////////////////////////////////////////////////////////////////////////////
@@ -1188,6 +1302,11 @@ RtStatus_t Mapper::createZoneMap()
     // Don't let the NAND go to sleep during the scans.
     NandHal::SleepHelper disableSleep(false);
     
+    // The LBA of each block found by the phymap scan, so the zone map can be built without
+    // reading the media a second time. If there is not enough memory for it, or the phymap
+    // was prebuilt, the zone map scan reads the blocks itself.
+    auto_array_delete<uint32_t> blockLbas;
+    
     if (m_prebuiltPhymap)
     {
         tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP,
@@ -1216,7 +1335,8 @@ RtStatus_t Mapper::createZoneMap()
     else
     {
         // Nobody gave us a phymap, so we have to build one of our own.
-        ret = scanAndBuildPhyMap(auxBuffer);
+        blockLbas = new uint32_t[m_media->getTotalBlockCount()];
+        ret = scanAndBuildPhyMap(auxBuffer, blockLbas.get());
         if (ret != SUCCESS)
         {
             return ret;
@@ -1241,7 +1361,7 @@ RtStatus_t Mapper::createZoneMap()
     }
 
     // Scan the NAND to build the zone map.
-    ret = scanAndBuildZoneMap(auxBuffer);
+    ret = scanAndBuildZoneMap(auxBuffer, blockLbas.get());
     if (ret != SUCCESS)
     {
         return ret;
@@ -1260,22 +1380,118 @@ RtStatus_t Mapper::createZoneMap()
     return SUCCESS;
 }
 
-RtStatus_t Mapper::scanAndBuildPhyMap(AuxiliaryBuffer & auxBuffer)
+//! Value recorded by the mount scan for a block that has no entry in the zone map, because
+//! it is free, bad, outside the data regions, or holds one of the maps.
+static const uint32_t kScanNoLba = 0xffffffff;
+
+//! \brief Returns the mask that separates data blocks from map blocks by their RSI.
+//!
+//! Permissible LSI values are 0 to the number of virtual pages per block minus one, so
+//! L = log2(pages per block * planes) bits are required for the LSI, and for data blocks
+//! the bits of the RSI above them are zero. For 256 pages per block and 2 planes, L is 9
+//! and the mask for the low byte of the RSI is 0xfe.
+static uint8_t get_data_block_rsi_mask()
+{
+    VirtualBlock::determinePlanesToUse(); 
+    unsigned int L = 32 - __CLZ32(VirtualBlock::getVirtualPagesPerBlock()-1);
+    unsigned int u32Mask = (-1) << L;
+    return (u32Mask >> 8);
+}
+
+//! Checks whether the metadata of the first page of a used block identifies it as a data
+//! block. A data block claiming an LBA past the end of the media is freed and erased, as
+//! something is seriously wrong with its redundant area.
+//!
+//! \param block The block the metadata was read from.
+//! \param md Metadata of the block's first page. Must not be erased.
+//! \param rsiMask Mask from get_data_block_rsi_mask().
+//!
+//! \return The LBA that the block holds.
+//! \retval kScanNoLba The block is not a data block, or was freed.
+uint32_t Mapper::getScannedBlockLba(const BlockAddress & block, Metadata & md, uint8_t rsiMask)
+{
+    uint32_t u32LogicalBlockAddr = md.getLba();
+    
+    // Check to see if this is a system block or not. If it is then ignore the LBA.
+    // The bottom half-word of the Stmp code is equivalent to the RSI.
+    uint16_t rsiFull = md.getSignature() & 0xffff;
+    uint8_t rsi1 = rsiFull & rsiMask;  // Low byte of the Stmp code. 
+
+    // If this block is the zone or phy map (indicated by a valid Stmp code),
+    // then skip it. It's not the zone map if either the full RSI half-word is 0,
+    // or the high byte of the RSI is 0 and the LBA is valid (within range).
+    if (!(((rsi1 == 0) && (u32LogicalBlockAddr < m_media->getTotalBlockCount())) || (rsiFull == 0)))
+    {
+        return kScanNoLba;
+    }
+    
+    if (u32LogicalBlockAddr > m_media->getTotalBlockCount())
+    {
+        // Something is seriously wrong with what was in
+        // redundant area.  Ignore for now and continue.
+        // Mark the location in the available block as unused, which will also erase it.
+        // Note that this will destroy data, but there is no other choice at this point.
+        m_physMap->markBlockFreeAndErase(block);
+        
+        return kScanNoLba;
+    }
+    
+    return u32LogicalBlockAddr;
+}
+
+//! This is the only pass over the media when the maps are built from scratch. Each block of
+//! the data regions is checked for bad block marks, then the first pages of the good blocks
+//! in each plane group are read with one multiplane metadata read.
+//!
+//! \param auxBuffer Buffer to read metadata into.
+//! \param[out] blockLbas Optional array with an entry for every block of the media. It is
+//!     filled in with the LBA held by each data block, or #kScanNoLba for other blocks, so
+//!     that scanAndBuildZoneMap() need not read the media again.
+RtStatus_t Mapper::scanAndBuildPhyMap(AuxiliaryBuffer & auxBuffer, uint32_t * blockLbas)
 {
     assert(m_physMap);
 
     RtStatus_t ret;
+    unsigned i;
 
     // Zero out the phys map so that all blocks are marked used.
     m_physMap->markAll(PhyMap::kUsed);
     
+    // Only blocks in the data regions can end up in the zone map.
+    if (blockLbas)
+    {
+        memset(blockLbas, 0xff, m_media->getTotalBlockCount() * sizeof(uint32_t));
+    }
+    
+    uint8_t rsiMask = get_data_block_rsi_mask();
+    unsigned planeCount = VirtualBlock::getPlaneCount();
+    
+    // Each plane of a multiplane read needs its own buffer.
+    AuxiliaryBuffer planeBuffers[VirtualBlock::kMaxPlanes - 1];
+    NandPhysicalMedia::MultiplaneParamBlock pb[VirtualBlock::kMaxPlanes];
+    Block groupBlocks[VirtualBlock::kMaxPlanes];
+    
+    for (i = 0; i < planeCount; ++i)
+    {
+        if (i > 0)
+        {
+            if ((ret = planeBuffers[i - 1].acquire()) != SUCCESS)
+            {
+                return ret;
+            }
+        }
+        
+        pb[i].m_buffer = NULL;
+        pb[i].m_auxiliaryBuffer = (i > 0) ? planeBuffers[i - 1] : auxBuffer;
+        pb[i].m_eccInfo = NULL;
+    }
+    
     // Create an iterator over all of the media's regions.
     Region::Iterator it = m_media->createRegionIterator();
     Region * region;
     
     SimpleTimer timer;
     
-    // first loop to fill in phy-map
     while ((region = it.getNext()))
     {
         // System Drives need to be marked as used in the map so only check Data Drives.
@@ -1284,69 +1500,108 @@ RtStatus_t Mapper::scanAndBuildPhyMap(AuxiliaryBuffer & auxBuffer)
             continue;
         }
         
-        int32_t numBlocksInRegion = region->m_iNumBlks;
+        uint32_t numBlocksInRegion = region->m_iNumBlks;
         Block blockInRegion(region->m_u32AbPhyStartBlkAddr);
         
-        for (; numBlocksInRegion; --numBlocksInRegion, ++blockInRegion)
+        while (numBlocksInRegion)
         {
-            assert(blockInRegion < m_media->getTotalBlockCount());
+            // The group runs to the next plane boundary, so its blocks are all on the same
+            // chip select and in different planes.
+            unsigned groupSize = planeCount - (blockInRegion.getRelativeBlock() & (planeCount - 1));
+            unsigned readCount = 0;
             
-            // Check to see if the block is bad or not
-            if (blockInRegion.isMarkedBad(auxBuffer))
+            if (groupSize > numBlocksInRegion)
             {
-                // mark the block bad in phys map
-                // Since this array contains the map across all chips, we need to add the
-                // offset from all previous chips.
-                ret = m_physMap->markBlockUsed(blockInRegion);
-                if (ret)
+                groupSize = numBlocksInRegion;
+            }
+            
+            for (i = 0; i < groupSize; ++i, ++blockInRegion, --numBlocksInRegion)
+            {
+                assert(blockInRegion < m_media->getTotalBlockCount());
+                
+                // Check to see if the block is bad or not
+                if (blockInRegion.isMarkedBad(auxBuffer))
                 {
-                    return ret;
+                    // mark the block bad in phys map
+                    // Since this array contains the map across all chips, we need to add the
+                    // offset from all previous chips.
+                    ret = m_physMap->markBlockUsed(blockInRegion);
+                    if (ret)
+                    {
+                        return ret;
+                    }
+                    
+                    continue;
                 }
                 
-                continue;
+                // The block is good, so read its first page below to see what kind of block it is.
+                groupBlocks[readCount] = blockInRegion;
+                pb[readCount].m_address = PageAddress(blockInRegion, kFirstPageInBlock).getRelativePage();
+                ++readCount;
             }
             
-            // The block is good, so what kind of block is it?
-            ret = blockInRegion.readMetadata(kFirstPageInBlock, auxBuffer);
-            if (ret == ERROR_DDI_NAND_HAL_ECC_FIX_FAILED)
+            if (readCount == 0)
             {
-                // Mark the location in the available block as unused, which will also erase it.
-                // Note that this will destroy data, but there is no other choice at this point.
-                ret = m_physMap->markBlockFreeAndErase(blockInRegion);
-                
-                // On to the next block
                 continue;
             }
-            else if (!is_read_status_success_or_ecc_fixed(ret))
+            
+            ret = groupBlocks[0].getNand()->readMultipleMetadata(pb, readCount);
+            if (ret)
             {
-                // Some other error occurred, that we cannot process.
-                #ifdef DEBUG_MAPPER2
-                tss_logtext_Print(LOGTEXT_VERBOSITY_3 | LOGTEXT_EVENT_DDI_NAND_GROUP,
-                                            "Problem reading first page of block %u, ret=0x%08x\n", blockInRegion.get(), ret);
-                #endif
-                
                 return ret;
             }
+            
+            for (i = 0; i < readCount; ++i)
+            {
+                Block & thisBlock = groupBlocks[i];
+                
+                ret = pb[i].m_resultStatus;
+                if (ret == ERROR_DDI_NAND_HAL_ECC_FIX_FAILED)
+                {
+                    // Mark the location in the available block as unused, which will also erase it.
+                    // Note that this will destroy data, but there is no other choice at this point.
+                    m_physMap->markBlockFreeAndErase(thisBlock);
+                    
+                    // On to the next block
+                    continue;
+                }
+                else if (!is_read_status_success_or_ecc_fixed(ret))
+                {
+                    // Some other error occurred, that we cannot process.
+                    #ifdef DEBUG_MAPPER2
+                    tss_logtext_Print(LOGTEXT_VERBOSITY_3 | LOGTEXT_EVENT_DDI_NAND_GROUP,
+                                                "Problem reading first page of block %u, ret=0x%08x\n", thisBlock.get(), ret);
+                    #endif
+                    
+                    return ret;
+                }
 
-            // Get Logical Block Address and Relative Sector Index from RA
-            Metadata md(auxBuffer);
+                // Get Logical Block Address and Relative Sector Index from RA
+                Metadata md(pb[i].m_auxiliaryBuffer);
 
-            // if Erased, the this block has not been allocated
-            if (md.isErased())
-            {
-                // Mark the location in the available block as free. No need to erase since
-                // we've already checked that.
-                ret = m_physMap->markBlockFree(blockInRegion);
-            }
-            else
-            {
-                // Mark the location in the available block as taken
-                ret = m_physMap->markBlockUsed(blockInRegion);
-            }
+                // if Erased, the this block has not been allocated
+                if (md.isErased())
+                {
+                    // Mark the location in the available block as free. No need to erase since
+                    // we've already checked that.
+                    ret = m_physMap->markBlockFree(thisBlock);
+                }
+                else
+                {
+                    // Mark the location in the available block as taken
+                    ret = m_physMap->markBlockUsed(thisBlock);
+                    
+                    // Remember which LBA the block holds for building the zone map.
+                    if (ret == SUCCESS && blockLbas)
+                    {
+                        blockLbas[thisBlock.get()] = getScannedBlockLba(thisBlock, md, rsiMask);
+                    }
+                }
 
-            if (ret)
-            {
-                return ret;
+                if (ret)
+                {
+                    return ret;
+                }
             }
         }
     }
@@ -1357,7 +1612,10 @@ RtStatus_t Mapper::scanAndBuildPhyMap(AuxiliaryBuffer & auxBuffer)
     return SUCCESS;
 }
 
-RtStatus_t Mapper::scanAndBuildZoneMap(AuxiliaryBuffer & auxBuffer)
+//! \param auxBuffer Buffer to read metadata into.
+//! \param blockLbas The LBA of each block as recorded by scanAndBuildPhyMap(). If this is
+//!     NULL, the first page of each used block is read to find its LBA.
+RtStatus_t Mapper::scanAndBuildZoneMap(AuxiliaryBuffer & auxBuffer, const uint32_t * blockLbas)
 {
     RtStatus_t ret;
 
@@ -1368,10 +1626,7 @@ RtStatus_t Mapper::scanAndBuildZoneMap(AuxiliaryBuffer & auxBuffer)
     m_cr.setRange(m_reserved.endBlock + 1, m_media->getTotalBlockCount() - 1);
     m_cr.invalidate();
 
-    VirtualBlock::determinePlanesToUse(); 
-    unsigned int L = 32 - __CLZ32(VirtualBlock::getVirtualPagesPerBlock()-1);
-    unsigned int u32Mask = (-1) << L;
-    uint8_t u8Mask =  ( u32Mask >> 8 );
+    uint8_t rsiMask = get_data_block_rsi_mask();
 
     SimpleTimer timer;
     
@@ -1390,99 +1645,91 @@ RtStatus_t Mapper::scanAndBuildZoneMap(AuxiliaryBuffer & auxBuffer)
         {
             assert(blockInRegion < m_media->getTotalBlockCount());
         
-            // Skip over blocks that are not marked as used in the phymap or are marked bad.
-            if (!m_physMap->isBlockUsed(blockInRegion) || blockInRegion.isMarkedBad(auxBuffer))
+            // Skip over blocks that are not marked as used in the phymap.
+            if (!m_physMap->isBlockUsed(blockInRegion))
             {
                 continue;
             }
             
-            ret = blockInRegion.readMetadata(kFirstPageInBlock, auxBuffer);
-            if (ret == ERROR_DDI_NAND_HAL_ECC_FIX_FAILED)
-            {
-                // Mark the location in the available block as unused, which will also erase it.
-                // Note that this will destroy data, but there is no other choice at this point.
-                m_physMap->markBlockFreeAndErase(blockInRegion);
-            
-                // On to the next block
-                continue;
-            }
-            else if (!is_read_status_success_or_ecc_fixed(ret))
-            {
-                // Some other error occurred, that we cannot process.
-                #ifdef DEBUG_MAPPER2
-                tss_logtext_Print(LOGTEXT_VERBOSITY_3 | LOGTEXT_EVENT_DDI_NAND_GROUP,
-                                            "Problem reading first page of block %u, ret=0x%08x\n", blockInRegion.get(), ret);
-                #endif
+            uint32_t u32LogicalBlockAddr;
             
-                return ret;
-            }
-
-            // Get Logical Block Address and Relative Sector Index from RA
-            Metadata md(auxBuffer);
-            uint32_t u32LogicalBlockAddr = md.getLba();
-
-            // if Erased, the this block has not been allocated
-            if (md.isErased())
+            if (blockLbas)
             {
-                continue;
+                // The phymap scan already read this block.
+                u32LogicalBlockAddr = blockLbas[blockInRegion.get()];
             }
-            
-            // Check to see if this is a system block or not. If it is then ignore the LBA.
-            // The bottom half-word of the Stmp code is equivalent to the RSI.
-            uint16_t rsiFull = md.getSignature() & 0xffff;
-            //uint8_t rsi1 = rsiFull & 0xff;  // Low byte of the Stmp code.
-            //Note: Permissible LSI value is 0-511 as a result 9 bits are required
-            // Mask = (~((1<<L)-1)) = 0xfffffe00
-            //rsi1 = rsiFull & (Mask>>8)
-            // Where 
-            //      A generic equation can be
-            //      L = log 2 of ( PagesPerBlock * Plane ) 
-            // For PagePerBlock = 256 and Plane = 2. L = 9 
-            // As a result 1st byte should use 0xfe            
-            uint8_t rsi1 = rsiFull & u8Mask;  // Low byte of the Stmp code. 
-
-            // If this block is the zone or phy map (indicated by a valid Stmp code),
-            // then skip it. It's not the zone map if either the full RSI half-word is 0,
-            // or the high byte of the RSI is 0 and the LBA is valid (within range).
-            if (((rsi1 == 0) && (u32LogicalBlockAddr < m_media->getTotalBlockCount())) || (rsiFull == 0))
+            else
             {
-                // Allocated this block in the zone map
-                if (u32LogicalBlockAddr > m_media->getTotalBlockCount())
+                // Skip over blocks that are marked bad.
+                if (blockInRegion.isMarkedBad(auxBuffer))
+                {
+                    continue;
+                }
+                
+                ret = blockInRegion.readMetadata(kFirstPageInBlock, auxBuffer);
+                if (ret == ERROR_DDI_NAND_HAL_ECC_FIX_FAILED)
                 {
-                    // Something is seriously wrong with what was in
-                    // redundant area.  Ignore for now and continue.
                     // Mark the location in the available block as unused, which will also erase it.
                     // Note that this will destroy data, but there is no other choice at this point.
                     m_physMap->markBlockFreeAndErase(blockInRegion);
-                    
+                
+                    // On to the next block
                     continue;
                 }
-
-                uint32_t u32PhysicalBlockNumber;
-                ret = getBlockInfo(u32LogicalBlockAddr, &u32PhysicalBlockNumber);
-                if (ret)
+                else if (!is_read_status_success_or_ecc_fixed(ret))
                 {
+                    // Some other error occurred, that we cannot process.
+                    #ifdef DEBUG_MAPPER2
+                    tss_logtext_Print(LOGTEXT_VERBOSITY_3 | LOGTEXT_EVENT_DDI_NAND_GROUP,
+                                                "Problem reading first page of block %u, ret=0x%08x\n", blockInRegion.get(), ret);
+                    #endif
+                
                     return ret;
                 }
 
-                if (!isBlockUnallocated(u32PhysicalBlockNumber) && (u32PhysicalBlockNumber != blockInRegion))
-                {
-                    tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP,
-                        "LBA conflict for virtual block %u between physical blocks %u and %u\n", 
-                        u32LogicalBlockAddr, u32PhysicalBlockNumber, blockInRegion);
+                // Get Logical Block Address and Relative Sector Index from RA
+                Metadata md(auxBuffer);
 
-                    m_cr.addBlocks(u32LogicalBlockAddr, u32PhysicalBlockNumber);
-                    m_cr.addBlocks(u32LogicalBlockAddr, blockInRegion);                    
-                }
-                else
-                {
-                    ret = setBlockInfo(u32LogicalBlockAddr, blockInRegion);
-                } 
-
-                if (ret)
+                // if Erased, the this block has not been allocated
+                if (md.isErased())
                 {
-                    return ret;
+                    continue;
                 }
+                
+                u32LogicalBlockAddr = getScannedBlockLba(blockInRegion, md, rsiMask);
+            }
+            
+            // Skip blocks that are not data blocks.
+            if (u32LogicalBlockAddr == kScanNoLba)
+            {
+                continue;
+            }
+
+            // Allocated this block in the zone map
+            uint32_t u32PhysicalBlockNumber;
+            ret = getBlockInfo(u32LogicalBlockAddr, &u32PhysicalBlockNumber);
+            if (ret)
+            {
+                return ret;
+            }
+
+            if (!isBlockUnallocated(u32PhysicalBlockNumber) && (u32PhysicalBlockNumber != blockInRegion))
+            {
+                tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP,
+                    "LBA conflict for virtual block %u between physical blocks %u and %u\n", 
+                    u32LogicalBlockAddr, u32PhysicalBlockNumber, blockInRegion);
+
+                m_cr.addBlocks(u32LogicalBlockAddr, u32PhysicalBlockNumber);
+                m_cr.addBlocks(u32LogicalBlockAddr, blockInRegion);                    
+            }
+            else
+            {
+                ret = setBlockInfo(u32LogicalBlockAddr, blockInRegion);
+            } 
+
+            if (ret)
+            {
+                return ret;
             }
         }
     }
@@ -2204,6 +2451,9 @@ bool Mapper::isBlockMapBlock(uint32_t u32PhysicalBlockNum, MapperMapTypes_t eMap
         case kMapperPhyMap:
             u32LbaCode1 = (uint32_t)PHYS_STRING_PAGE1;
             break;
+        case kMapperCheckpoint:
+            u32LbaCode1 = (uint32_t)CKPT_STRING_PAGE1;
+            break;
     }
 
     // Read the Stmp code
@@ -33,8 +33,8 @@ namespace nand {
 #define MAPPER_MAX_TOTAL_NAND_BLOCKS            (1<<24)
 
 //! The number of blocks reserved to be used only for holding the zone and phy maps.
-//! This value must be at least large enough to hold both the zone and phy map,
-//! plus another copy of the zone map used during consolidation.
+//! This value must be at least large enough to hold both the zone and phy map and the
+//! mount checkpoint, plus another copy of the zone map used during consolidation.
 const unsigned kNandMapperReservedBlockCount = 12;
 
 //! \brief Enumeration to indicate what type of blocks to be obtained.
@@ -56,7 +56,8 @@ typedef enum
 typedef enum
 {
     kMapperZoneMap,
-    kMapperPhyMap
+    kMapperPhyMap,
+    kMapperCheckpoint
 } MapperMapTypes_t;
 
 //! Constant used for setting block status in the phymap.
@@ -68,6 +69,8 @@ const bool kNandMapperBlockFree = PhyMap::kFree;
 // Forward declaration
 class ZoneMapCache;
 class PersistentPhyMap;
+class MapperCheckpoint;
+class Metadata;
 
 /*!
  * \brief The virtual to physical block mapper.
@@ -128,12 +131,16 @@ public:
     
     //! \brief Processes a newly discovered bad block.
     void handleNewBadBlock(const BlockAddress & badBlockAddress);
+    
+    //! \brief Keeps the mount checkpoint from being used once the maps are written.
+    void retireCheckpoint();
 
 protected:
 
     Media * m_media;    //!< The NAND logical media that we're mapping.
     ZoneMapCache * m_zoneMap;  //!< Our zone map cache.
     PersistentPhyMap * m_phyMapOnMedia;  //!< Object to save and load the phymap on the NAND.
+    MapperCheckpoint * m_checkpoint;    //!< Records where the maps are, to skip searching for them.
     PhyMap * m_physMap; //!< The physical block map array.
     PhyMap * m_prebuiltPhymap;  //!< A phymap built during media erase.
     uint32_t m_unallocatedBlockAddress;   //!< Special value that represents an unallocated block, i.e. a logical block that doesn't have a physical block assigned to it.
@@ -151,6 +158,7 @@ protected:
     bool m_isPhysMapCreated;   //!< This flag indicates that phys map has been created.
     bool m_isMapDirty;         //!< This indicates that the map has been touched.
     bool m_isBuildingMaps;     //!< True if in the middle of createZoneMap().
+    bool m_isReservedRangeClean;   //!< True once evacuateReservedBlockRange() has cleaned out the reserved range.
     //@}
     
     //! \brief Reserved block range
@@ -176,10 +184,12 @@ protected:
     static void phymapDirtyListener(PhyMap * thePhymap, bool wasDirty, bool isDirty, void * refCon);
 
     RtStatus_t createZoneMap();
-    RtStatus_t scanAndBuildPhyMap(AuxiliaryBuffer & auxBuffer);
-    RtStatus_t scanAndBuildZoneMap(AuxiliaryBuffer & auxBuffer);
+    RtStatus_t scanAndBuildPhyMap(AuxiliaryBuffer & auxBuffer, uint32_t * blockLbas);
+    RtStatus_t scanAndBuildZoneMap(AuxiliaryBuffer & auxBuffer, const uint32_t * blockLbas);
+    uint32_t getScannedBlockLba(const BlockAddress & block, Metadata & md, uint8_t rsiMask);
 
     void searchAndDestroy();
+    void saveCheckpoint();
 
     bool isBlockMapBlock(uint32_t u32PhysicalBlockNum, MapperMapTypes_t eMapType, RtStatus_t *pRtStatus);
 
@@ -0,0 +1,321 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor, Inc. All rights reserved.
+// 
+// Freescale Semiconductor, Inc.
+// Proprietary & Confidential
+// 
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor, Inc.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+////////////////////////////////////////////////////////////////////////////////
+//! \addtogroup ddi_nand_mapper
+//! @{
+//! \file MapperCheckpoint.cpp
+//! \brief Implementation of the mount checkpoint class.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "MapperCheckpoint.h"
+#include "Mapper.h"
+#include "ZoneMapSectionPage.h"
+#include <string.h>
+
+using namespace nand;
+
+///////////////////////////////////////////////////////////////////////////////
+// Code
+///////////////////////////////////////////////////////////////////////////////
+
+MapperCheckpoint::MapperCheckpoint(Mapper & mapper)
+:   PersistentMap(mapper, kNandMapperCheckpointSignature, CKPT_STRING_PAGE1),
+    m_sequenceNumber(0),
+    m_isLive(false)
+{
+}
+
+MapperCheckpoint::~MapperCheckpoint()
+{
+}
+
+//! \param zoneSectionCount Number of sections in the zone map.
+//! \param phySectionCount Number of sections in the phy map.
+void MapperCheckpoint::init(uint32_t zoneSectionCount, uint32_t phySectionCount)
+{
+    // The checkpoint is a single section of bytes holding the record and both maps'
+    // section page offsets.
+    PersistentMap::init(1, sizeof(NandMapperCheckpoint_t) + zoneSectionCount + phySectionCount);
+
+    invalidate();
+}
+
+void MapperCheckpoint::invalidate()
+{
+    // There is no block past the last one, so the next save allocates a new block.
+    m_block = NandHal::getTotalBlockCount();
+    m_topPageIndex = 0;
+    m_sectionPageOffsets.clear();
+    m_isLive = false;
+}
+
+//! A checkpoint is not saved if the record does not fit in one page, or if either map has
+//! a section that has never been written. The maps are searched for when they are loaded
+//! in that case, as they are without a checkpoint.
+//!
+//! \param zoneMap The zone map.
+//! \param phyMap The persistent phy map.
+//! \param reservedStartBlock First block of the reserved block range.
+//! \param reservedBlockCount Number of blocks in the reserved block range.
+//! \param isReservedRangeClean Whether the reserved block range has been cleaned out, so
+//!     the next boot doesn't have to do it again.
+RtStatus_t MapperCheckpoint::save(const PersistentMap & zoneMap, const PersistentMap & phyMap, uint32_t reservedStartBlock, uint32_t reservedBlockCount, bool isReservedRangeClean)
+{
+    RtStatus_t status;
+    uint32_t zoneSectionCount = zoneMap.getSectionCount();
+
+    // Maps with too many sections for the record to fit in one page are not checkpointed.
+    if (m_totalSectionCount > 1)
+    {
+        return SUCCESS;
+    }
+
+    // Get a temp buffer.
+    SectorBuffer buffer;
+    if ((status = buffer.acquire()) != SUCCESS)
+    {
+        return status;
+    }
+
+    NandMapperCheckpoint_t * record = (NandMapperCheckpoint_t *)buffer.getBuffer();
+    uint8_t * offsets = (uint8_t *)(record + 1);
+
+    if (!zoneMap.getSectionPageOffsets(offsets) || !phyMap.getSectionPageOffsets(offsets + zoneSectionCount))
+    {
+        return SUCCESS;
+    }
+
+    // Fill in the record.
+    record->version = kNandMapperCheckpointVersion;
+    record->isRetired = 0;
+    record->isReservedRangeClean = isReservedRangeClean;
+    record->totalBlockCount = m_mapper.getMedia()->getTotalBlockCount();
+    record->reservedStartBlock = reservedStartBlock;
+    record->reservedBlockCount = reservedBlockCount;
+    record->zoneMap.block = zoneMap.getAddress().get();
+    record->zoneMap.topPageIndex = zoneMap.getTopPageIndex();
+    record->zoneMap.sectionCount = zoneSectionCount;
+    record->zoneMap.logPageIndex = zoneMap.getLogPageIndex();
+    record->phyMap.block = phyMap.getAddress().get();
+    record->phyMap.topPageIndex = phyMap.getTopPageIndex();
+    record->phyMap.sectionCount = phyMap.getSectionCount();
+    record->phyMap.logPageIndex = phyMap.getLogPageIndex();
+
+    // The new record replaces the latest one, which doesn't have to be retired if the
+    // checkpoint block is consolidated while adding it.
+    m_isLive = false;
+    status = addRecord(record);
+    if (status == SUCCESS)
+    {
+        m_isLive = true;
+    }
+
+    return status;
+}
+
+//! Nothing is written if the latest checkpoint has already been retired, so this only
+//! costs a page write the first time the maps are written after a checkpoint is saved or
+//! restored. If the retired checkpoint can't be written, the checkpoint block is erased
+//! instead, which leaves the next boot without a checkpoint.
+RtStatus_t MapperCheckpoint::retire()
+{
+    RtStatus_t status;
+
+    if (!m_isLive)
+    {
+        return SUCCESS;
+    }
+
+    // The saved locations are about to go out of date whatever happens below.
+    m_isLive = false;
+
+    // Get a temp buffer.
+    SectorBuffer buffer;
+    if ((status = buffer.acquire()) != SUCCESS)
+    {
+        return status;
+    }
+
+    NandMapperCheckpoint_t * record = (NandMapperCheckpoint_t *)buffer.getBuffer();
+    memset(record, 0, m_totalEntryCount);
+    record->version = kNandMapperCheckpointVersion;
+    record->isRetired = 1;
+
+    status = addRecord(record);
+    if (status != SUCCESS)
+    {
+        tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP, "Retiring mapper checkpoint failed with error 0x%08x; erasing it\n", status);
+
+        if (m_block.isValid())
+        {
+            status = m_mapper.getPhymap()->markBlockFreeAndErase(m_block);
+        }
+        invalidate();
+    }
+
+    return status;
+}
+
+//! \param record The record to add. Its sequence number is filled in.
+RtStatus_t MapperCheckpoint::addRecord(NandMapperCheckpoint_t * record)
+{
+    RtStatus_t status;
+
+    record->sequenceNumber = m_sequenceNumber + 1;
+
+    // The first checkpoint goes into a newly allocated block.
+    if (!m_block.isValid())
+    {
+        uint32_t physicalBlock;
+        status = m_mapper.getBlock(&physicalBlock, kMapperBlockTypeMap, NULL);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+
+        m_block = physicalBlock;
+        m_topPageIndex = 0;
+    }
+
+    // Add the checkpoint to the block, consolidating into a new block if it is full.
+    status = addSection((uint8_t *)record, 0, m_totalEntryCount);
+    if (status == SUCCESS)
+    {
+        m_sequenceNumber = record->sequenceNumber;
+    }
+
+    return status;
+}
+
+//! The checkpoint block is found by searching the reserved range, which reads the
+//! metadata of each reserved block, and the last checkpoint in it by a binary search of
+//! its pages. Only that checkpoint is read. It is rejected if it has been retired, or if
+//! it was saved for a different media layout or reserved block range. Each map's location
+//! is then checked with PersistentMap::restoreLocation(), which takes two page reads.
+//!
+//! \param zoneMap The zone map, whose location is set on success.
+//! \param phyMap The persistent phy map, whose location is set on success.
+//! \param reservedStartBlock First block of the current reserved block range.
+//! \param reservedBlockCount Number of blocks in the current reserved block range.
+//! \param[out] isReservedRangeClean Set on success to whether the reserved block range
+//!     had already been cleaned out when the checkpoint was saved.
+//!
+//! \retval SUCCESS Both maps are located and can be loaded.
+//! \retval ERROR_DDI_NAND_MAPPER_FIND_LBAMAP_BLOCK_FAILED There is no checkpoint.
+//! \retval ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED The checkpoint is invalid, retired or out of date.
+RtStatus_t MapperCheckpoint::restore(PersistentMap & zoneMap, PersistentMap & phyMap, uint32_t reservedStartBlock, uint32_t reservedBlockCount, bool * isReservedRangeClean)
+{
+    RtStatus_t status;
+    bool needsRewrite = false;
+
+    // Search the reserved range for the checkpoint block.
+    uint32_t checkpointBlock;
+    status = m_mapper.findMapBlock(kMapperCheckpoint, &checkpointBlock);
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    // Until the last checkpoint is found, treat the block as full so the next checkpoint
+    // is consolidated into a new block and this one is erased. Until it is known to be
+    // retired, it has to be retired before the maps are written.
+    m_block = checkpointBlock;
+    m_topPageIndex = NandHal::getParameters().wPagesPerBlock;
+    m_isLive = true;
+
+    // Create an object for reading the checkpoint pages.
+    ZoneMapSectionPage mapPage(m_block.getPage());
+    mapPage.setEntrySize(m_entrySize);
+    mapPage.setMapType(m_signature);
+
+    status = mapPage.allocateBuffers();
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    // Find the last checkpoint in the block. A page that needs rewriting is left alone,
+    // since the checkpoint is never read back while consolidating.
+    status = findTopPageIndex(mapPage, needsRewrite);
+    if (status == SUCCESS && m_topPageIndex > 0)
+    {
+        mapPage = PageAddress(m_block, m_topPageIndex - 1);
+        status = mapPage.read();
+        if (is_read_status_success_or_ecc_fixed(status) && !mapPage.validateHeader())
+        {
+            status = ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+        }
+    }
+    else if (status == SUCCESS)
+    {
+        status = ERROR_DDI_NAND_MAPPER_FIND_LBAMAP_BLOCK_FAILED;
+    }
+
+    if (!is_read_status_success_or_ecc_fixed(status))
+    {
+        m_topPageIndex = NandHal::getParameters().wPagesPerBlock;
+        return status;
+    }
+
+    m_sectionPageOffsets.setEntry(0, m_topPageIndex - 1);
+
+    // Make sure the checkpoint was saved for the maps as they are laid out now.
+    const NandMapperCheckpoint_t * record = (const NandMapperCheckpoint_t *)mapPage.getEntries();
+    const uint8_t * offsets = (const uint8_t *)(record + 1);
+    uint32_t zoneSectionCount = zoneMap.getSectionCount();
+    uint32_t phySectionCount = phyMap.getSectionCount();
+
+    if (mapPage.getEntryCount() != m_totalEntryCount
+        || record->version != kNandMapperCheckpointVersion)
+    {
+        return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+    }
+
+    // Later checkpoints are numbered on from this one.
+    m_sequenceNumber = record->sequenceNumber;
+
+    // The maps have been written since the last checkpoint was saved.
+    if (record->isRetired)
+    {
+        m_isLive = false;
+        return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+    }
+
+    if (record->totalBlockCount != m_mapper.getMedia()->getTotalBlockCount()
+        || record->reservedStartBlock != reservedStartBlock
+        || record->reservedBlockCount != reservedBlockCount
+        || record->zoneMap.sectionCount != zoneSectionCount
+        || record->phyMap.sectionCount != phySectionCount)
+    {
+        return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+    }
+
+    status = zoneMap.restoreLocation(record->zoneMap.block, record->zoneMap.topPageIndex, offsets, record->zoneMap.logPageIndex);
+    if (status == SUCCESS)
+    {
+        status = phyMap.restoreLocation(record->phyMap.block, record->phyMap.topPageIndex, offsets + zoneSectionCount, record->phyMap.logPageIndex);
+    }
+
+    if (status == SUCCESS)
+    {
+        *isReservedRangeClean = record->isReservedRangeClean;
+
+        tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP, "Restored map locations from checkpoint %u\n", m_sequenceNumber);
+    }
+
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
+//! @}
@@ -0,0 +1,131 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor, Inc. All rights reserved.
+// 
+// Freescale Semiconductor, Inc.
+// Proprietary & Confidential
+// 
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor, Inc.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+////////////////////////////////////////////////////////////////////////////////
+//! \addtogroup ddi_nand_mapper
+//! @{
+//! \file MapperCheckpoint.h
+//! \brief Declaration of the mount checkpoint class.
+////////////////////////////////////////////////////////////////////////////////
+#if !defined(__mapper_checkpoint_h__)
+#define __mapper_checkpoint_h__
+
+#include "PersistentMap.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Definitions
+///////////////////////////////////////////////////////////////////////////////
+
+namespace nand {
+
+class Mapper;
+
+//! \brief Current version of the mount checkpoint record.
+//!
+//! Version 2 added the log page index to each map location. Version 3 added retired
+//! checkpoints and the reserved range flag.
+const uint32_t kNandMapperCheckpointVersion = 3;
+
+/*!
+ * \brief Location of one map as saved in the mount checkpoint.
+ */
+struct NandMapperCheckpointMap
+{
+    uint32_t block;         //!< Absolute address of the block holding the map.
+    uint32_t topPageIndex;  //!< Number of pages written to the block.
+    uint32_t sectionCount;  //!< Number of sections the map is split into.
+    int32_t logPageIndex;   //!< Page offset of the map's log page, or -1 if there is none.
+};
+
+/*!
+ * \brief Record saved in the mount checkpoint.
+ *
+ * The record is followed by the page offset of each zone map section and then of each
+ * phy map section, one byte per section. A retired checkpoint only has the version,
+ * sequence number and #isRetired filled in.
+ */
+struct NandMapperCheckpoint
+{
+    uint32_t version;           //!< See #kNandMapperCheckpointVersion.
+    uint32_t sequenceNumber;    //!< Incremented each time a checkpoint is saved.
+    uint32_t isRetired;         //!< Nonzero if the maps may have been written since the previous checkpoint.
+    uint32_t isReservedRangeClean;  //!< Nonzero if the reserved block range had been cleaned out.
+    uint32_t totalBlockCount;   //!< Number of blocks covered by the maps.
+    uint32_t reservedStartBlock;    //!< First block of the reserved block range.
+    uint32_t reservedBlockCount;    //!< Number of blocks in the reserved block range.
+    NandMapperCheckpointMap zoneMap;    //!< Location of the zone map.
+    NandMapperCheckpointMap phyMap;     //!< Location of the phy map.
+};
+
+//! Type for the mount checkpoint record.
+typedef struct NandMapperCheckpoint NandMapperCheckpoint_t;
+
+/*!
+ * \brief Records where the zone and phy maps are on the NAND.
+ *
+ * When the mapper is shut down, a checkpoint is added to its block in the reserved
+ * range, holding the blocks, page counts and section page offsets of both maps. When
+ * the maps are loaded on the next boot, the latest checkpoint lets them be used without
+ * searching the reserved range for each map and scanning each map's block. The block
+ * holding the checkpoints is still found by searching the reserved range, and the
+ * latest checkpoint in it by a binary search of the block's pages.
+ *
+ * The first time either map is written after a checkpoint is saved or restored, a retired
+ * checkpoint is added after it, so the saved locations are never used once they may be
+ * out of date. A checkpoint is also only trusted if the last page written to each map's
+ * block is where it says. Without a usable checkpoint, the maps are searched for as before.
+ *
+ * The checkpoint is stored as a map with a single section of byte-sized entries, so it
+ * is written and consolidated in the same way as the other maps.
+ */
+class MapperCheckpoint : public PersistentMap
+{
+public:
+
+    //! \brief Constructor.
+    MapperCheckpoint(Mapper & mapper);
+
+    //! \brief Destructor.
+    virtual ~MapperCheckpoint();
+
+    //! \brief Initializer.
+    void init(uint32_t zoneSectionCount, uint32_t phySectionCount);
+
+    //! \brief Saves the current locations of the zone and phy maps.
+    RtStatus_t save(const PersistentMap & zoneMap, const PersistentMap & phyMap, uint32_t reservedStartBlock, uint32_t reservedBlockCount, bool isReservedRangeClean);
+
+    //! \brief Marks the latest checkpoint as out of date, before the maps are written.
+    RtStatus_t retire();
+
+    //! \brief Finds the latest checkpoint and restores the map locations from it.
+    RtStatus_t restore(PersistentMap & zoneMap, PersistentMap & phyMap, uint32_t reservedStartBlock, uint32_t reservedBlockCount, bool * isReservedRangeClean);
+
+    //! \brief Returns whether the latest checkpoint on the media has not been retired.
+    bool isLive() const { return m_isLive; }
+
+    //! \brief Forgets the checkpoint block, once it has been erased.
+    void invalidate();
+
+protected:
+    uint32_t m_sequenceNumber;  //!< Sequence number of the latest checkpoint.
+    bool m_isLive;              //!< Whether the latest checkpoint on the media has not been retired.
+
+    //! \brief Adds a record to the checkpoint block.
+    RtStatus_t addRecord(NandMapperCheckpoint_t * record);
+};
+
+} // namespace nand
+
+#endif // __mapper_checkpoint_h__
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////
+//! @}
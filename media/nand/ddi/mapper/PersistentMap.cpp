@@ -45,9 +45,11 @@ PersistentMap::PersistentMap(Mapper & mapper, uint32_t mapType, uint32_t metadat
     m_maxEntriesPerPage(0),
     m_signature(mapType),
     m_metadataSignature(metadataSignature),
+    m_logSignature(0),
     m_topPageIndex(0),
     m_totalSectionCount(0),
-    m_sectionPageOffsets()
+    m_sectionPageOffsets(),
+    m_logPageIndex(-1)
 {
 }
 #pragma ghs section text=default
@@ -269,11 +271,13 @@ RtStatus_t PersistentMap::buildSectionOffsetTable()
 
     // Wipe map to be entirely unoccupied.
     m_sectionPageOffsets.clear();
+    m_logPageIndex = -1;
     
     // Create an object for reading the map page and set the buffers we're using.
     ZoneMapSectionPage mapPage(m_block.getPage());
     mapPage.setEntrySize(m_entrySize);
     mapPage.setMapType(m_signature);
+    mapPage.setLogMapType(m_logSignature);
     
     status = mapPage.allocateBuffers();
     if (status != SUCCESS)
@@ -424,6 +428,17 @@ RtStatus_t PersistentMap::fillUnknownSectionOffsets(ZoneMapSectionPage & mapPage
             return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
         }
         
+        // Only the latest log page counts. It is reached only if it is newer than the
+        // current copy of at least one section.
+        if (mapPage.isLogPage())
+        {
+            if (m_logPageIndex < 0)
+            {
+                m_logPageIndex = i;
+            }
+            continue;
+        }
+        
         // Update the page offset array if this is a section we haven't seen yet.
         unsigned sectionNumber = mapPage.getSectionNumber();
         if (!m_sectionPageOffsets.isOccupied(sectionNumber))
@@ -482,6 +497,9 @@ RtStatus_t PersistentMap::consolidate(
     // Disable auto sleep while consolidating.
     NandHal::SleepHelper disableSleep(false);
     
+    // The map is about to move, so the mount checkpoint can't be used to find it any more.
+    m_mapper.retireCheckpoint();
+    
     // Get the block to consolidate into. This block is guaranteed to be good and erased.
     ret = m_mapper.getBlock(&newMapBlockNumber, kMapperBlockTypeMap, NULL);
     if (SUCCESS != ret)
@@ -603,9 +621,11 @@ RtStatus_t PersistentMap::consolidate(
     // Mark previous zone-map block as un-used and erase it. We don't care if this fails.
     m_mapper.getPhymap()->markBlockFreeAndErase(m_block);
 
-    // Update the current map block number and current sector offset.
+    // Update the current map block number and current sector offset. No log page is
+    // copied, so the sections written here are the whole map.
     m_block = targetBlock;
     m_topPageIndex = u32NewSectorNum;
+    m_logPageIndex = -1;
     
     // After consolidation, the each section is written exactly in order within the zone map block.
     // We do this afterwards instead of during the consolidation process because it would be messy
@@ -753,6 +773,130 @@ RtStatus_t PersistentMap::addSection(uint8_t *pMap, uint32_t u32StartingEntryNum
     return ret;
 }
 
+//! \param[out] offsets Array of #m_totalSectionCount bytes to fill in.
+//!
+//! \retval true The offsets were copied.
+//! \retval false The location of at least one section is not known.
+bool PersistentMap::getSectionPageOffsets(uint8_t * offsets) const
+{
+    for (int i = 0; i < m_totalSectionCount; ++i)
+    {
+        if (!m_sectionPageOffsets.isOccupied(i))
+        {
+            return false;
+        }
+        
+        offsets[i] = m_sectionPageOffsets.getEntry(i);
+    }
+    
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Sets the map's location from a previously saved copy.
+//!
+//! This is used in place of buildSectionOffsetTable() when the map's location has been
+//! recorded elsewhere. The location is only accepted if the last page written to the
+//! block holds one of the map's sections or its log page and the page after it is erased,
+//! which means nothing has been written to the block since the location was saved. This
+//! takes at most two page reads, no matter how many sections the map has.
+//!
+//! \param block Block holding the map.
+//! \param topPageIndex Number of pages written to \a block.
+//! \param offsets Page offset within \a block of each of the #m_totalSectionCount sections.
+//! \param logPageIndex Page offset of the log page, or -1 if there is none.
+//!
+//! \retval SUCCESS The map's location has been set.
+//! \retval ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED The saved location is out of date.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t PersistentMap::restoreLocation(const BlockAddress & block, int topPageIndex, const uint8_t * offsets, int logPageIndex)
+{
+    RtStatus_t status;
+    int pagesPerBlock = NandHal::getParameters().wPagesPerBlock;
+    int lastSection = -1;
+    
+    if (!block.isValid() || topPageIndex <= 0 || topPageIndex > pagesPerBlock || logPageIndex >= topPageIndex)
+    {
+        return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+    }
+    
+    // Every section must be below the top page, and either the log page or one of the
+    // sections must be the last page.
+    for (int i = 0; i < m_totalSectionCount; ++i)
+    {
+        if (offsets[i] >= topPageIndex)
+        {
+            return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+        }
+        else if (offsets[i] == topPageIndex - 1)
+        {
+            lastSection = i;
+        }
+    }
+    
+    if (lastSection < 0 && logPageIndex != topPageIndex - 1)
+    {
+        return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+    }
+    
+    // Create an object for reading the map page and set the buffers we're using.
+    ZoneMapSectionPage mapPage(PageAddress(block, topPageIndex - 1));
+    mapPage.setEntrySize(m_entrySize);
+    mapPage.setMapType(m_signature);
+    mapPage.setLogMapType(m_logSignature);
+    
+    status = mapPage.allocateBuffers();
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+    
+    // The last page written must be the section or log page that was saved as the last one.
+    status = mapPage.read();
+    if (!is_read_status_success_or_ecc_fixed(status))
+    {
+        return status;
+    }
+    
+    if (mapPage.getMetadata().isErased() || !mapPage.validateHeader())
+    {
+        return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+    }
+    
+    if (lastSection < 0 ? !mapPage.isLogPage() : (mapPage.isLogPage() || mapPage.getSectionNumber() != lastSection))
+    {
+        return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+    }
+    
+    // And nothing can have been written after it.
+    if (topPageIndex < pagesPerBlock)
+    {
+        mapPage = PageAddress(block, topPageIndex);
+        status = mapPage.readMetadata();
+        if (!is_read_status_success_or_ecc_fixed(status))
+        {
+            return status;
+        }
+        
+        if (!mapPage.getMetadata().isErased())
+        {
+            return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+        }
+    }
+    
+    m_block = block;
+    m_topPageIndex = topPageIndex;
+    m_logPageIndex = logPageIndex;
+    
+    m_sectionPageOffsets.clear();
+    for (int i = 0; i < m_totalSectionCount; ++i)
+    {
+        m_sectionPageOffsets.setEntry(i, offsets[i]);
+    }
+    
+    return SUCCESS;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // EOF
 ////////////////////////////////////////////////////////////////////////////////
@@ -46,6 +46,12 @@ class ZoneMapSectionPage;
  * The content for sections of the map is not handled by this class. It is the
  * responsibility of subclasses or users of the class to provide that content.
  *
+ * A subclass may also keep log pages in the map's block by setting #m_logSignature. Log
+ * pages are skipped when looking for sections. Only the latest log page is tracked, in
+ * #m_logPageIndex, and only while it is newer than the current copy of some section.
+ * What a log page holds is up to the subclass, which must ignore whatever it records
+ * for sections written after it.
+ *
  * Right now, this class only supports storing the map within a single block. But it is
  * possible that in the future this restriction may be relaxed, in order to store maps
  * that are larger than will fit within one block.
@@ -88,6 +94,21 @@ public:
     //! \brief Returns the address of the block currently holding this map on the media.
     const BlockAddress & getAddress() const { return m_block; }
     
+    //! \brief Returns the number of pages written to the map's block.
+    int getTopPageIndex() const { return m_topPageIndex; }
+    
+    //! \brief Returns the number of sections the map is split into.
+    int getSectionCount() const { return m_totalSectionCount; }
+    
+    //! \brief Returns the page offset of the current log page, or -1 if there is none.
+    int getLogPageIndex() const { return m_logPageIndex; }
+    
+    //! \brief Copies the page offset of each section within the map's block.
+    bool getSectionPageOffsets(uint8_t * offsets) const;
+    
+    //! \brief Sets the map's location without scanning its block.
+    RtStatus_t restoreLocation(const BlockAddress & block, int topPageIndex, const uint8_t * offsets, int logPageIndex=-1);
+    
 protected:
 
     Mapper & m_mapper;      //!< Our parent mapper instance.
@@ -96,10 +117,12 @@ protected:
     int m_maxEntriesPerPage;    //!< Number of entries that fit in one NAND page.
     uint32_t m_signature;   //!< The map type signature.
     uint32_t m_metadataSignature;   //!< A signature written into the metadata of each map section page.
+    uint32_t m_logSignature;    //!< The map type signature of log pages, or 0 if the map has none.
     int m_topPageIndex;     //!< Number of sections currently in the map's block.
     int m_totalEntryCount;  //!< Total number of entries in the entire map.
     int m_totalSectionCount;    //!< Total number of sections in the entire map.
     PageOrderMap m_sectionPageOffsets;   //!< Map from zone map section number to page offset within the zone map block.
+    int m_logPageIndex;     //!< Page offset of the latest log page, or -1 if there is none that matters.
     bool m_didConsolidateDuringAddSection;  //!< Set to true if addSection() does a consolidate.
     int m_buildReadCount;
 
@@ -45,32 +45,39 @@ void PersistentPhyMap::init()
     PersistentMap::init(PhyMap::kEntrySizeInBytes, count);
 }
 
-RtStatus_t PersistentPhyMap::load()
+RtStatus_t PersistentPhyMap::load(bool isLocated)
 {
     assert(m_phymap);
+    
+    RtStatus_t status;
 
     // Automatically clear the is-loading flag when we leave this scope.
     m_isLoading = true;
     AutoClearFlag clearLoading(m_isLoading);
     
-    // Search the nand for the location of the phy map.
-    uint32_t mapPhysicalBlock;
-    RtStatus_t status = m_mapper.findMapBlock(kMapperPhyMap, &mapPhysicalBlock);
-    if (status != SUCCESS)
+    // The map doesn't need to be searched for if its location was restored from the
+    // mount checkpoint.
+    if (!isLocated)
     {
-        return status;
-    }
-    
-//    tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP, "Loading phymap from block %u\n", mapPhysicalBlock);
-    
-    // Save the phy map location.
-    m_block = mapPhysicalBlock;
-    
-    // Scan the block.
-    status = buildSectionOffsetTable();
-    if (status != SUCCESS)
-    {
-        return status;
+        // Search the nand for the location of the phy map.
+        uint32_t mapPhysicalBlock;
+        status = m_mapper.findMapBlock(kMapperPhyMap, &mapPhysicalBlock);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+        
+//        tss_logtext_Print(LOGTEXT_VERBOSITY_1 | LOGTEXT_EVENT_DDI_NAND_GROUP, "Loading phymap from block %u\n", mapPhysicalBlock);
+        
+        // Save the phy map location.
+        m_block = mapPhysicalBlock;
+        
+        // Scan the block.
+        status = buildSectionOffsetTable();
+        if (status != SUCCESS)
+        {
+            return status;
+        }
     }
     
     // Get a temp buffer.
@@ -107,6 +114,9 @@ RtStatus_t PersistentPhyMap::load()
         pStartAddr += u32NumBytes;
     }
     
+    // The entries were copied in directly.
+    m_phymap->rebuildSummary();
+    
     return SUCCESS;
 }
 
@@ -46,7 +46,7 @@ public:
     void init();
     
     //! \brief Finds and loads the map.
-    RtStatus_t load();
+    RtStatus_t load(bool isLocated=false);
     
     //! \brief Saves the map into the current block, consolidating if necessary.
     RtStatus_t save();
@@ -19,6 +19,8 @@
 #include "PhyMap.h"
 #include "Mapper.h"
 #include "Block.h"
+#include "drivers/media/nand/hal/ddi_nand_hal.h"
+#include "arm_ghs.h" // for __CLZ32
 #include <string.h>
 
 using namespace nand;
@@ -49,10 +51,28 @@ const uint8_t kNumBitsHighForAnIndex[16] =
     4  // index 0xF==1111 binary: 4 bits high
 };
 
+//! For each of the low five bits of a block's index within an entry, the entry bits
+//! of the blocks whose index has that bit set. Combined to build plane masks.
+const uint32_t kEntryBitsWithIndexBit[5] =
+{
+    0xaaaaaaaa,
+    0xcccccccc,
+    0xf0f0f0f0,
+    0xff00ff00,
+    0xffff0000
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Source
 ///////////////////////////////////////////////////////////////////////////////
 
+//! \brief Returns the index of the lowest set bit of a nonzero word.
+static inline int count_trailing_zeros(uint32_t value)
+{
+    // Isolate the lowest set bit, then find its position from the top.
+    return 31 - __CLZ32(value & (0 - value));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //! \brief Count the number of bits which are set in given 16-bit word.
 //!
@@ -92,6 +112,25 @@ RtStatus_t PhyMap::init(uint32_t totalBlockCount)
     m_entries = new uint32_t[m_entryCount];
     assert(m_entries);
     
+    // The summary has one bit for every entry.
+    m_summaryCount = ROUND_UP_DIV(m_entryCount, kBlocksPerEntry);
+    m_summary = new uint32_t[m_summaryCount];
+    assert(m_summary);
+    
+    // Record where each chip select ends and how blocks are spread over planes, so that
+    // free blocks can be counted by chip and plane.
+    uint32_t chipEndBlock = 0;
+    unsigned chip;
+    m_chipCount = NandHal::getChipSelectCount();
+    assert(m_chipCount > 0 && m_chipCount <= MAX_NAND_DEVICES);
+    for (chip = 0; chip < m_chipCount; ++chip)
+    {
+        chipEndBlock += NandHal::getNand(chip)->wTotalBlocks;
+        m_chipEndBlocks[chip] = chipEndBlock;
+    }
+    m_planeMask = NandHal::getParameters().planesPerDie - 1;
+    assert(m_planeMask < kMaxPlanes);
+    
     // The entries start out all marked as used.
     markAll(kUsed);
 
@@ -108,6 +147,12 @@ PhyMap::~PhyMap()
         delete [] m_entries;
         m_entries = NULL;
     }
+    
+    if (m_summary)
+    {
+        delete [] m_summary;
+        m_summary = NULL;
+    }
 }
 
 void PhyMap::relinquishEntries()
@@ -116,10 +161,99 @@ void PhyMap::relinquishEntries()
     clearDirty();
 }
 
+void PhyMap::rebuildSummary()
+{
+    uint32_t i;
+    
+    memset(m_summary, 0, m_summaryCount * kEntrySizeInBytes);
+    for (i = 0; i < m_entryCount; ++i)
+    {
+        updateSummary(i);
+    }
+    
+    recountFreeBlocks();
+}
+
+//! Blocks past the last one in the map are not counted, even though markAll() sets
+//! their bits in the last entry.
+void PhyMap::recountFreeBlocks()
+{
+    uint32_t planeBits[kMaxPlanes];
+    uint32_t i;
+    unsigned plane;
+    
+    memset(m_chipFreeCounts, 0, sizeof(m_chipFreeCounts));
+    m_freeCount = 0;
+    
+    for (plane = 0; plane <= m_planeMask; ++plane)
+    {
+        planeBits[plane] = getPlaneBits(m_planeMask, plane);
+    }
+    
+    for (i = 0; i < m_entryCount; ++i)
+    {
+        uint32_t firstBlock = i * kBlocksPerEntry;
+        uint32_t lastBlock = firstBlock + kBlocksPerEntry - 1;
+        uint32_t entry = m_entries[i];
+        unsigned chip = getChipForBlock(firstBlock);
+        
+        // Drop the bits past the last block.
+        if (lastBlock >= m_blockCount)
+        {
+            entry &= 0xffffffff >> (lastBlock + 1 - m_blockCount);
+            lastBlock = m_blockCount - 1;
+        }
+        
+        if (entry == kFullEntry)
+        {
+            continue;
+        }
+        
+        if (getChipForBlock(lastBlock) == chip)
+        {
+            // The whole entry is on one chip select, so count each plane in one go.
+            for (plane = 0; plane <= m_planeMask; ++plane)
+            {
+                uint32_t count = count_ones_32(entry & planeBits[plane]);
+                m_chipFreeCounts[chip][plane] += count;
+                m_freeCount += count;
+            }
+        }
+        else
+        {
+            // The entry straddles chip selects, so count its free blocks one at a time.
+            while (entry)
+            {
+                uint32_t block = firstBlock + count_trailing_zeros(entry);
+                entry &= entry - 1;
+                
+                m_chipFreeCounts[getChipForBlock(block)][block & m_planeMask]++;
+                m_freeCount++;
+            }
+        }
+    }
+}
+
+unsigned PhyMap::getChipForBlock(uint32_t absoluteBlock) const
+{
+    unsigned chip = 0;
+    
+    // Any blocks past the end of the last chip select are counted with it.
+    while (chip + 1 < m_chipCount && absoluteBlock >= m_chipEndBlocks[chip])
+    {
+        ++chip;
+    }
+    
+    return chip;
+}
+
 void PhyMap::markAll(bool isFree)
 {
-    // Used entries are marked 0, free are marked 1.
+    // Used entries are marked 0, free are marked 1. The summary follows suit; its bits
+    // past the last entry are never looked at.
     memset(m_entries, isFree ? 0xff : 0, m_entryCount * kEntrySizeInBytes);
+    memset(m_summary, isFree ? 0xff : 0, m_summaryCount * kEntrySizeInBytes);
+    recountFreeBlocks();
     
     // Set the map to be dirty.
     setDirty();
@@ -171,8 +305,26 @@ RtStatus_t PhyMap::markBlock(uint32_t absoluteBlock, bool isFree, bool doAutoEra
         entryValue &= ~blockMask;
     }
 
+    // Keep the free counts in step if the block changed state.
+    if ((entryValue ^ m_entries[coarseIndex]) & blockMask)
+    {
+        uint32_t & chipPlaneCount = m_chipFreeCounts[getChipForBlock(absoluteBlock)][absoluteBlock & m_planeMask];
+        
+        if (entryValue & blockMask)
+        {
+            ++chipPlaneCount;
+            ++m_freeCount;
+        }
+        else
+        {
+            --chipPlaneCount;
+            --m_freeCount;
+        }
+    }
+    
     // Update the map entry.
     m_entries[coarseIndex] = entryValue;
+    updateSummary(coarseIndex);
     
     // The phy map is now dirty.
     setDirty();
@@ -208,21 +360,34 @@ bool PhyMap::isBlockFree(uint32_t absoluteBlock) const
     return (m_entries[coarseIndex] & blockMask) != 0;
 }
 
-//! This function counts the number of unused blocks in the map by counting
-//! the number of bits which are set.
-//!
-//! \return Number of free blocks on all NANDs.
-uint32_t PhyMap::getFreeCount() const
+uint32_t PhyMap::getFreeCountForChip(unsigned chipSelect) const
 {
-    unsigned i;
-    uint32_t u32FreeCount = 0;
-
-    for (i = 0; i < m_entryCount; i++)
+    uint32_t count = 0;
+    unsigned plane;
+    
+    assert(chipSelect < m_chipCount);
+    
+    for (plane = 0; plane <= m_planeMask; ++plane)
     {
-        u32FreeCount += count_ones_32(m_entries[i]);
+        count += m_chipFreeCounts[chipSelect][plane];
     }
+    
+    return count;
+}
 
-    return u32FreeCount;
+uint32_t PhyMap::getFreeCountForPlane(unsigned plane) const
+{
+    uint32_t count = 0;
+    unsigned chip;
+    
+    assert(plane <= m_planeMask);
+    
+    for (chip = 0; chip < m_chipCount; ++chip)
+    {
+        count += m_chipFreeCounts[chip][plane];
+    }
+    
+    return count;
 }
 
 void PhyMap::setDirty()
@@ -252,48 +417,95 @@ void PhyMap::clearDirty()
 ////////////////////////////////////////////////////////////////////////////////
 //! \brief Searches a phy map entry for an empty block.
 //!
-//! \param entryBitField The 16-bit bit field to search, where a 1 bit is an
+//! \param entryBitField The 32-bit bit field to search, where a 1 bit is an
 //!     available slot and 0 is occupied.
 //! \param startIndex Starting bit to search from.
 //! \param endIndex The bit number at which the search will be stopped. This
 //!     is one position after the last bit examined.
-//! \param[out] foundFreeBlock Pointer to a boolean which is set to true upon
-//!     a positive match.
-//! \param planeMask Mask on block number to isolate the plane number. If zero is passed
-//!     then this parameter is effectively ignored.
-//! \param planeNumber The required plane that the result block must belong to. Ignored
-//!     if the \a planeMask is zero.
+//! \param planeBits Mask of the bits whose blocks are in the required plane, as
+//!     built by getPlaneBits().
 //!
 //! \return The index of an available block is returned, or -1 is returned if
 //!     the scanned range of the entry is completely occupied.
 ////////////////////////////////////////////////////////////////////////////////
-int PhyMap::searchEntryBitField(uint32_t entryBitField, int startIndex, int endIndex, bool * foundFreeBlock, unsigned planeMask, unsigned planeNumber)
+int PhyMap::searchEntryBitField(uint32_t entryBitField, int startIndex, int endIndex, uint32_t planeBits)
 {
-    int index = startIndex;
-    
     // Check index ranges.
     assert(startIndex >= 0 && startIndex < kBlocksPerEntry);
     assert(endIndex >= 0 && endIndex <= kBlocksPerEntry);
     
-    // Shift entry value to start index.
-    if (startIndex)
+    // Keep only the free blocks in the correct plane from the start index up to the end index.
+    entryBitField &= planeBits & (0xffffffff << startIndex);
+    if (endIndex < kBlocksPerEntry)
     {
-        entryBitField >>= startIndex;
+        entryBitField &= ~(0xffffffff << endIndex);
     }
     
-    // Scan each bit looking for a 1 that is in the correct plane.
-    while (index < endIndex
-        && ((entryBitField & 1) == 0
-            || (index & planeMask) != planeNumber))
+    // Return a -1 if no available slot was found.
+    return entryBitField ? count_trailing_zeros(entryBitField) : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Builds the mask of entry bits whose blocks belong to a plane.
+//!
+//! Entries start on a multiple of 32 blocks, so the low five bits of a block number
+//! are its index within the entry. Only those bits of the plane mask are applied.
+//!
+//! \param planeMask Mask on block number to isolate the plane number. If zero is passed
+//!     then every bit is in the mask.
+//! \param planeNumber The required plane.
+////////////////////////////////////////////////////////////////////////////////
+uint32_t PhyMap::getPlaneBits(unsigned planeMask, unsigned planeNumber)
+{
+    uint32_t planeBits = 0xffffffff;
+    unsigned bit;
+    
+    for (bit = 0; bit < 5; ++bit)
     {
-        index++;
-        entryBitField >>= 1;
+        if (planeMask & (1 << bit))
+        {
+            planeBits &= (planeNumber & (1 << bit)) ? kEntryBitsWithIndexBit[bit] : ~kEntryBitsWithIndexBit[bit];
+        }
+    }
+    
+    return planeBits;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Finds the first entry in a range that has a free block.
+//!
+//! \param firstEntry Index of the first entry to examine.
+//! \param lastEntry Index of the last entry to examine.
+//!
+//! \return The index of the first entry that is not full, or \a lastEntry + 1 if
+//!     every entry in the range is full.
+////////////////////////////////////////////////////////////////////////////////
+uint32_t PhyMap::findNonFullEntry(uint32_t firstEntry, uint32_t lastEntry) const
+{
+    uint32_t word = firstEntry / kBlocksPerEntry;
+    uint32_t lastWord = lastEntry / kBlocksPerEntry;
+    uint32_t bits;
+    
+    if (firstEntry > lastEntry)
+    {
+        return lastEntry + 1;
     }
     
-    *foundFreeBlock = index < endIndex;
+    // Ignore the entries before the first one in its summary word.
+    bits = m_summary[word] & (0xffffffff << (firstEntry % kBlocksPerEntry));
     
-    // Return a -1 if no available slot was found.
-    return index < endIndex ? index : -1;
+    // Skip over summary words whose entries are all full.
+    while (!bits)
+    {
+        if (++word > lastWord)
+        {
+            return lastEntry + 1;
+        }
+        bits = m_summary[word];
+    }
+    
+    uint32_t entry = word * kBlocksPerEntry + count_trailing_zeros(bits);
+    return entry <= lastEntry ? entry : lastEntry + 1;
 }
 
 bool PhyMap::findFirstFreeBlock(uint32_t startBlock, uint32_t endBlock, uint32_t * freeBlock, unsigned planeMask, unsigned planeNumber)
@@ -304,43 +516,42 @@ bool PhyMap::findFirstFreeBlock(uint32_t startBlock, uint32_t endBlock, uint32_t
     uint32_t startFineIndex = startBlock % kBlocksPerEntry;
     uint32_t endCoarseIndex = endBlock / kBlocksPerEntry;
     uint32_t endFineIndex = endBlock % kBlocksPerEntry;
-    uint32_t coarseIndex = startCoarseIndex;
-    int fineIndex;
-    bool didFindBlock = false;
+    uint32_t coarseIndex;
     
-    while (coarseIndex <= endCoarseIndex)
+    // Plane bits within an entry are handled by masking the entry. Any higher plane
+    // bits are the same for all blocks of an entry, so they select whole entries.
+    uint32_t planeBits = getPlaneBits(planeMask, planeNumber);
+    uint32_t entryPlaneMask = planeMask & ~(kBlocksPerEntry - 1);
+    uint32_t entryPlaneNumber = planeNumber & entryPlaneMask;
+    
+    // Visit only the entries that are not full, as found from the summary.
+    for (coarseIndex = findNonFullEntry(startCoarseIndex, endCoarseIndex);
+        coarseIndex <= endCoarseIndex;
+        coarseIndex = findNonFullEntry(coarseIndex + 1, endCoarseIndex))
     {
-        // Get this phy map entry.
-        uint32_t bitField = m_entries[coarseIndex];
-        
-        // Don't bother with the entry if it is full.
-        if (bitField != kFullEntry)
+        // Skip entries whose blocks are all in another plane.
+        if (((coarseIndex * kBlocksPerEntry) & entryPlaneMask) != entryPlaneNumber)
         {
-            // Figure out where to start and stop seaching in this entry.
-            int searchStart = (coarseIndex == startCoarseIndex) ? startFineIndex : 0;
-            int searchEnd = (coarseIndex == endCoarseIndex) ? (endFineIndex + 1) : kBlocksPerEntry;
-            
-            // Search this entry.
-            fineIndex = searchEntryBitField(bitField, searchStart, searchEnd, &didFindBlock, planeMask, planeNumber);
-            
-            // Exit the search loop if we've found an available block.
-            if (didFindBlock)
-            {
-                // Make sure the fine index is within range.
-                assert(fineIndex >= 0 && fineIndex < kBlocksPerEntry);
-
-                // Compute and return the physical block address.
-                *freeBlock = coarseIndex * kBlocksPerEntry + fineIndex;
-                
-                break;
-            }
+            continue;
         }
         
-        // Move to the next entry.
-        ++coarseIndex;
+        // Figure out where to start and stop seaching in this entry.
+        int searchStart = (coarseIndex == startCoarseIndex) ? startFineIndex : 0;
+        int searchEnd = (coarseIndex == endCoarseIndex) ? (endFineIndex + 1) : kBlocksPerEntry;
+        
+        // Search this entry.
+        int fineIndex = searchEntryBitField(m_entries[coarseIndex], searchStart, searchEnd, planeBits);
+        
+        // Exit the search if we've found an available block.
+        if (fineIndex >= 0)
+        {
+            // Compute and return the physical block address.
+            *freeBlock = coarseIndex * kBlocksPerEntry + fineIndex;
+            return true;
+        }
     }
     
-    return didFindBlock;
+    return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -21,6 +21,7 @@
 #include "types.h"
 #include "errordefs.h"
 #include "drivers/media/sectordef.h"
+#include "drivers/media/nand/gpmi/ddi_nand_gpmi.h"
 
 namespace nand
 {
@@ -38,6 +39,13 @@ namespace nand
  * contain valid data for any one of the drives, including system drives. They may be boot
  * blocks or other blocks used by the NAND driver for its own purposes. Finally, all bad blocks
  * are marked as used.
+ *
+ * To keep searches fast on large devices, a summary bitmap is kept alongside the entries.
+ * It has one bit per entry, which is set when the entry has at least one free block, so
+ * a search steps over a run of 32 full entries by looking at a single summary word.
+ *
+ * The number of free blocks is also kept up to date as blocks are marked, for each chip
+ * select and each plane, so that checking the free space left costs nothing.
  */
 class PhyMap
 {
@@ -47,7 +55,8 @@ public:
     {
         kEntrySizeInBytes = sizeof(uint32_t),
         kBlocksPerEntry = 32,
-        kFullEntry = 0  //!< An entry with a value of 0 means that all blocks are occupied.
+        kFullEntry = 0,  //!< An entry with a value of 0 means that all blocks are occupied.
+        kMaxPlanes = 4  //!< Most planes per die that free counts are kept for.
     };
     
     //! \brief Constants to use for marking blocks in the phymap.
@@ -108,8 +117,14 @@ public:
         //! \brief Returns the total number of entries.
         inline uint32_t getEntryCount() const { return m_entryCount; }
         
-        //! \brief Computes the number of free blocks.
-        uint32_t getFreeCount() const;
+        //! \brief Returns the number of free blocks.
+        inline uint32_t getFreeCount() const { return m_freeCount; }
+        
+        //! \brief Returns the number of free blocks on one chip select.
+        uint32_t getFreeCountForChip(unsigned chipSelect) const;
+        
+        //! \brief Returns the number of free blocks in one plane, over all chip selects.
+        uint32_t getFreeCountForPlane(unsigned plane) const;
     //@}
     
     //! \name Getting block state
@@ -147,6 +162,12 @@ public:
         
         //! \brief Gives up ownership of the map array.
         void relinquishEntries();
+        
+        //! \brief Brings the summary and free counts up to date after entries were written directly.
+        //!
+        //! Must be called after changing entries through getAllEntries() or the
+        //! [] operator, before the next search or count.
+        void rebuildSummary();
     //@}
     
     //! \brief Dirty flag
@@ -171,10 +192,42 @@ protected:
     bool m_isDirty;         //!< Whether the phymap has been modified recently.
     DirtyCallback_t m_dirtyListener;    //!< Callback function to invoke when the dirty state changes.
     void * m_dirtyRefCon;    //!< Arbitrary value passed to dirty listener.
+    uint32_t * m_summary;   //!< One bit per entry, set if the entry has a free block.
+    uint32_t m_summaryCount;    //!< Number of words in the summary.
+    uint32_t m_freeCount;   //!< Number of free blocks.
+    uint32_t m_chipFreeCounts[MAX_NAND_DEVICES][kMaxPlanes];  //!< Number of free blocks by chip select and plane.
+    uint32_t m_chipEndBlocks[MAX_NAND_DEVICES];    //!< First block after each chip select.
+    unsigned m_chipCount;   //!< Number of chip selects.
+    unsigned m_planeMask;   //!< Mask on block number to isolate the plane number.
 
+    //! \brief Updates the summary bit of one entry.
+    inline void updateSummary(uint32_t entryIndex)
+    {
+        uint32_t bit = 1 << (entryIndex % kBlocksPerEntry);
+        if (m_entries[entryIndex] != kFullEntry)
+        {
+            m_summary[entryIndex / kBlocksPerEntry] |= bit;
+        }
+        else
+        {
+            m_summary[entryIndex / kBlocksPerEntry] &= ~bit;
+        }
+    }
+
+    //! \brief Returns the chip select that a block is on.
+    unsigned getChipForBlock(uint32_t absoluteBlock) const;
+
+    //! \brief Recounts the free blocks from the entries.
+    void recountFreeBlocks();
+
+    //! \brief Finds the first entry in a range that has a free block.
+    uint32_t findNonFullEntry(uint32_t firstEntry, uint32_t lastEntry) const;
 
     //! \brief Find the first free block within an entry
-    int searchEntryBitField(uint32_t entryBitField, int startIndex, int endIndex, bool * foundFreeBlock, unsigned planeMask, unsigned planeNumber);
+    int searchEntryBitField(uint32_t entryBitField, int startIndex, int endIndex, uint32_t planeBits);
+
+    //! \brief Builds the mask of entry bits whose blocks belong to a plane.
+    static uint32_t getPlaneBits(unsigned planeMask, unsigned planeNumber);
 
 };
 
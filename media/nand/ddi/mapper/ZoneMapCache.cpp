@@ -32,6 +32,7 @@
 #include "drivers/media/buffer_manager/media_buffer.h"
 #include "drivers/media/include/ddi_media_timers.h"
 #include "ZoneMapSectionPage.h"
+#include "DdiNandLocker.h"
 #include "os/dmi/os_dmi_api.h"
 
 using namespace nand;
@@ -43,6 +44,12 @@ using namespace nand;
 //! Set this macro to 1 to print ECC corrections of zone map pages to TSS.
 #define LOG_ZONE_MAP_ECC_LEVELS 0
 
+/////////////////////////////////////////////////////////////////////////////////
+//  Variables
+/////////////////////////////////////////////////////////////////////////////////
+
+uint32_t g_nandZoneMapCacheBudget = MAPPER_CACHE_DEFAULT_BUDGET;
+
 /////////////////////////////////////////////////////////////////////////////////
 //  Code
 /////////////////////////////////////////////////////////////////////////////////
@@ -52,8 +59,20 @@ ZoneMapCache::ZoneMapCache(Mapper & mapper)
 :   PersistentMap(mapper, kNandZoneMapSignature, LBA_STRING_PAGE1),
     m_cacheSectionCount(0),
     m_descriptors(NULL),
-    m_cacheBuffers(NULL)
+    m_cacheBuffers(NULL),
+    m_sectionEntries(NULL),
+    m_lruHead(-1),
+    m_lruTail(-1),
+    m_journal(NULL),
+    m_journalCount(0),
+    m_journalCapacity(0),
+    m_isJournalDirty(false),
+    m_lastLookupLba(0),
+    m_sequentialLookupCount(0),
+    m_prefetchSection(kNoPrefetchSection)
 {
+    // Changes to the zone map are logged in its block.
+    m_logSignature = kNandZoneMapLogSignature;
 }
 #pragma ghs section text=default
 
@@ -66,8 +85,8 @@ ZoneMapCache::~ZoneMapCache()
 //! \brief   This function initializes zone-map cache.
 //!
 //! This function initializes the cache which will store a part or all of the
-//! zone-map in RAM.  If the Nand is small enough, it is possible that all of
-//! the zone-map will reside in RAM.
+//! zone-map in RAM.  If the Nand is small enough, or #g_nandZoneMapCacheBudget is
+//! large enough, it is possible that all of the zone-map will reside in RAM.
 ////////////////////////////////////////////////////////////////////////////////
 void ZoneMapCache::init()
 {
@@ -88,51 +107,81 @@ void ZoneMapCache::init()
     // Init our superclass.
     PersistentMap::init(entrySize, m_mapper.getMedia()->getTotalBlockCount());
     
+    // Allocate the cache itself.
+    if (!m_cacheBuffers)
+    {
+        RtStatus_t status = allocateCache(g_nandZoneMapCacheBudget);
+        if (status != SUCCESS)
+        {
+            // Fall back to the smallest cache so the zone map is still usable.
+            status = allocateCache(0);
+        }
+        assert(status == SUCCESS);
+    }
+    
+    // Allocate the journal, which holds as many records as fit in a log page.
+    if (!m_journal)
+    {
+        m_journalCapacity = (NandHal::getParameters().pageDataSize - sizeof(NandMapSectionHeader_t)) / sizeof(JournalRecord);
+        m_journal = reinterpret_cast<JournalRecord *>(malloc(m_journalCapacity * sizeof(JournalRecord)));
+        assert(m_journal);
+    }
+    
+    clearJournal();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Allocates the cached sections and their descriptors.
+//!
+//! The number of cached sections is as many as fit in \a budget bytes, but never fewer
+//! than #MAPPER_CACHE_COUNT or more than the number of sections in the zone map. All of
+//! the cache entries start out invalid.
+//!
+//! \param budget Memory budget in bytes for the cached section data.
+//!
+//! \retval SUCCESS The cache was allocated.
+//! \retval ERROR_DDI_NAND_MAPPER_ZONE_MAP_CACHE_INIT_FAILED Out of memory.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t ZoneMapCache::allocateCache(uint32_t budget)
+{
     // The size of a single cache buffer is the NAND page size minus the zone map header.
     uint32_t u32SizeOfData = NandHal::getParameters().pageDataSize - sizeof(NandMapSectionHeader_t);
 
-    m_cacheSectionCount = std::min<uint32_t>(m_totalSectionCount, MAPPER_CACHE_COUNT);
+    m_cacheSectionCount = std::max<uint32_t>(budget / u32SizeOfData, MAPPER_CACHE_COUNT);
+    m_cacheSectionCount = std::min<uint32_t>(m_cacheSectionCount, m_totalSectionCount);
     
     // Allocate the cache itself. The total cache buffer size is the number of caches times the
     // size of a cache buffer, which is the NAND page size minus the zone map header.
-    if (!m_cacheBuffers)
-    {
-        m_cacheBuffers = reinterpret_cast<uint8_t *>(os_dmi_malloc_phys_contiguous(u32SizeOfData * m_cacheSectionCount));
-        assert(m_cacheBuffers);
-    }
+    m_cacheBuffers = reinterpret_cast<uint8_t *>(os_dmi_malloc_phys_contiguous(u32SizeOfData * m_cacheSectionCount));
     
-    // Allocate the cache entry descriptor array.
-    if (m_descriptors == NULL)
+    // Allocate the cache entry descriptor array and the section lookup table.
+    m_descriptors = reinterpret_cast<CacheEntry *>(malloc(m_cacheSectionCount * sizeof(CacheEntry)));
+    m_sectionEntries = reinterpret_cast<int16_t *>(malloc(m_totalSectionCount * sizeof(int16_t)));
+    
+    if (!m_cacheBuffers || !m_descriptors || !m_sectionEntries)
     {
-        m_descriptors = reinterpret_cast<CacheEntry *>(malloc(m_cacheSectionCount * sizeof(CacheEntry)));
-        assert(m_descriptors);
+        freeCache();
+        return ERROR_DDI_NAND_MAPPER_ZONE_MAP_CACHE_INIT_FAILED;
     }
 
     int32_t i;
     uint32_t u32CurrentBufOffset = 0;
     for (i=0; i < m_cacheSectionCount; i++)
     {
-        CacheEntry * entry = &m_descriptors[i];
-        
-        entry->m_timestamp = 0;
-        entry->m_isValid = false;
-        entry->m_isDirty = 0;
-        entry->m_firstLBA = 0;
-        entry->m_entryCount = 0;
-        entry->m_entries = &m_cacheBuffers[u32CurrentBufOffset];
+        m_descriptors[i].m_entries = &m_cacheBuffers[u32CurrentBufOffset];
 
         u32CurrentBufOffset += u32SizeOfData;
     }
+    
+    invalidateAll();
+    
+    return SUCCESS;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-//! \brief Shuts down the zone-map cache and frees related memory.
-//!
-//! This function primarily frees the dynamically allocated memory associated
-//! with the zone map cache. The cache descriptors and cached section buffers
-//! are all deallocated.
+//! \brief Frees the cached sections and their descriptors.
 ////////////////////////////////////////////////////////////////////////////////
-void ZoneMapCache::shutdown()
+void ZoneMapCache::freeCache()
 {
     if (m_cacheBuffers)
     {
@@ -146,9 +195,65 @@ void ZoneMapCache::shutdown()
         m_descriptors = NULL;
     }
     
-    m_sectionPageOffsets.cleanup();
+    if (m_sectionEntries)
+    {
+        free(m_sectionEntries);
+        m_sectionEntries = NULL;
+    }
     
     m_cacheSectionCount = 0;
+    m_lruHead = -1;
+    m_lruTail = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Marks every cache entry invalid without writing back dirty entries.
+////////////////////////////////////////////////////////////////////////////////
+void ZoneMapCache::invalidateAll()
+{
+    int32_t i;
+    for (i=0; i < m_cacheSectionCount; i++)
+    {
+        CacheEntry * entry = &m_descriptors[i];
+        
+        entry->m_isValid = false;
+        entry->m_isDirty = 0;
+        entry->m_firstLBA = 0;
+        entry->m_entryCount = 0;
+        entry->m_prev = i - 1;
+        entry->m_next = (i + 1 < m_cacheSectionCount) ? i + 1 : -1;
+    }
+    
+    m_lruHead = m_cacheSectionCount ? 0 : -1;
+    m_lruTail = m_cacheSectionCount - 1;
+    
+    for (i=0; i < m_totalSectionCount; i++)
+    {
+        m_sectionEntries[i] = kNoCacheEntry;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Shuts down the zone-map cache and frees related memory.
+//!
+//! This function primarily frees the dynamically allocated memory associated
+//! with the zone map cache. The cache descriptors, cached section buffers, and
+//! journal are all deallocated.
+////////////////////////////////////////////////////////////////////////////////
+void ZoneMapCache::shutdown()
+{
+    freeCache();
+    
+    if (m_journal)
+    {
+        free(m_journal);
+        m_journal = NULL;
+    }
+    
+    m_journalCount = 0;
+    m_journalCapacity = 0;
+    
+    m_sectionPageOffsets.cleanup();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -179,21 +284,16 @@ RtStatus_t ZoneMapCache::writeEmptyMap()
 
     m_block = u32BlockPhysAddr;
     m_topPageIndex = 0;
+    m_logPageIndex = -1;
+    
+    // The empty map replaces every earlier change.
+    clearJournal();
 
     u32StartingEntryNum = 0;
     u32NumEntriesToWrite = m_mapper.getMedia()->getTotalBlockCount();
     
     // Invalidate all cache entries.
-    for (i=0; i < m_cacheSectionCount; i++)
-    {
-        CacheEntry * entry = &m_descriptors[i];
-        
-        entry->m_timestamp = 0;
-        entry->m_isValid = false;
-        entry->m_isDirty = 0;
-        entry->m_firstLBA = 0;
-        entry->m_entryCount = 0;
-    }
+    invalidateAll();
     
     // Use one of our cache descriptors as a temporary buffer.
     // Fill it with unallocated entries (all f's).
@@ -249,25 +349,43 @@ RtStatus_t ZoneMapCache::writeEmptyMap()
 
 ////////////////////////////////////////////////////////////////////////////////
 //! \brief Search for and init the zone map.
+//!
+//! \param isLocated Pass true if the zone map's location has already been restored,
+//!     in which case only the journal is loaded.
 ////////////////////////////////////////////////////////////////////////////////
-RtStatus_t ZoneMapCache::findZoneMap()
+RtStatus_t ZoneMapCache::findZoneMap(bool isLocated)
 {
-    // Search the nand for the location of the zone map
-    uint32_t u32StartZoneMapPhysAddr;
-    RtStatus_t rtCode = m_mapper.findMapBlock(kMapperZoneMap, &u32StartZoneMapPhysAddr);
-    if (rtCode != SUCCESS)
+    RtStatus_t rtCode;
+    
+    // Any changes in the journal belong to the map that was there before.
+    clearJournal();
+    
+    if (!isLocated)
     {
-        return rtCode;
-    }
+        // Search the nand for the location of the zone map
+        uint32_t u32StartZoneMapPhysAddr;
+        rtCode = m_mapper.findMapBlock(kMapperZoneMap, &u32StartZoneMapPhysAddr);
+        if (rtCode != SUCCESS)
+        {
+            return rtCode;
+        }
 
-    // For Zone-map loading, initializing cache and
-    // pointing g_MapperDescriptor.zoneMapPhysicalBlockNumber at block number
-    // containing zone-map is sufficient.
-    m_block = u32StartZoneMapPhysAddr;
-    m_topPageIndex = 0;
+        // For Zone-map loading, initializing cache and
+        // pointing g_MapperDescriptor.zoneMapPhysicalBlockNumber at block number
+        // containing zone-map is sufficient.
+        m_block = u32StartZoneMapPhysAddr;
+        m_topPageIndex = 0;
+        
+        // Scan the zone map block and build the section offset table.
+        rtCode = buildSectionOffsetTable();
+        if (rtCode != SUCCESS)
+        {
+            return rtCode;
+        }
+    }
     
-    // Scan the zone map block and build the section offset table.
-    return buildSectionOffsetTable();
+    // Read the changes that were logged after the sections were last written.
+    return loadJournal();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -336,16 +454,26 @@ read_section:
         return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
     }
     
+    // Forget the section this entry held before.
+    if (zone->m_isValid)
+    {
+        m_sectionEntries[zone->m_firstLBA / m_maxEntriesPerPage] = kNoCacheEntry;
+    }
+    
     // Fill in the zone map cache.
     zone->m_firstLBA = header->startLba; 
     zone->m_entryCount = header->entryCount;
-    zone->m_timestamp = hw_profile_GetMicroseconds();
     zone->m_isDirty = false;            
     zone->m_isValid = true;
+    m_sectionEntries[zone->m_firstLBA / m_maxEntriesPerPage] = i32SelectedEntry;
+    touchEntry(i32SelectedEntry);
 
     // Copy the entry data from the section into the zone map cache.
     uint8_t * pu8BufPtr = (uint8_t *)buffer + sizeof(*header);
     memcpy(zone->m_entries, pu8BufPtr, header->entryCount * header->entrySize);
+    
+    // Bring the section up to date with the changes that are only in the journal.
+    applyJournal(zone);
 
     return SUCCESS;
 }
@@ -356,27 +484,46 @@ RtStatus_t ZoneMapCache::consolidate(
     uint8_t * sectionData,
     uint32_t sectionDataEntryCount)
 {
-    // Clear this flag.
-    m_wroteCacheEntryDuringConsolidate = false;
+    RtStatus_t status;
+    
+    // The map may be consolidated while it is being located, before the journal has
+    // been read from the log page.
+    if (m_logPageIndex >= 0 && m_journalCount == 0)
+    {
+        status = loadJournal();
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+    }
+    
+    // The section data passed in may have been read straight from the NAND.
+    if (hasValidSectionData)
+    {
+        CacheEntry section;
+        section.m_firstLBA = sectionNumber * m_maxEntriesPerPage;
+        section.m_entryCount = sectionDataEntryCount;
+        section.m_entries = sectionData;
+        applyJournal(&section);
+    }
     
     // Call superclass implementation of consolidate.
-    RtStatus_t status = PersistentMap::consolidate(hasValidSectionData, sectionNumber, sectionData, sectionDataEntryCount);
+    status = PersistentMap::consolidate(hasValidSectionData, sectionNumber, sectionData, sectionDataEntryCount);
     if (status != SUCCESS)
     {
         return status;
     }
     
-    // If we use the in-memory cache for writing any part of the zone map, we need to go
-    // back and clear the dirty flag. This is postponed until after the consolidation is done
-    // because if we get a write error during the page copying and have to start the consolidation
-    // over again then we need to know the dirty cache entries again.
-    if (m_wroteCacheEntryDuringConsolidate)
+    // Every section written to the new block has the journal applied, so the journal
+    // and the dirty flags can be cleared. This is postponed until after the consolidation
+    // is done because if we get a write error during the page copying and have to start
+    // the consolidation over again then we still need the journal.
+    clearJournal();
+    
+    uint32_t i;
+    for (i=0; i < m_cacheSectionCount; i++)
     {
-        uint32_t i;
-        for (i=0; i < m_cacheSectionCount; i++)
-        {
-            m_descriptors[i].m_isDirty = false;
-        }
+        m_descriptors[i].m_isDirty = false;
     }
 
     return SUCCESS;    
@@ -389,36 +536,34 @@ RtStatus_t ZoneMapCache::getSectionForConsolidate(
     uint32_t & bufferEntryCount,
     uint8_t * sectorBuffer)
 {
-    int32_t cacheEntryIndex;
-    CacheEntry * cacheEntry;
-    
-    // Lookup the cache entry for this section.
-    RtStatus_t ret = lookupCacheEntry(u32EntryNum, &cacheEntryIndex);
-    if (ret)
-    {
-        return ret;
-    }
+    int32_t cacheEntryIndex = m_sectionEntries[thisSectionNumber];
     
-    // Is the cache entry valid and dirty? If so, we must use the cached copy
+    // Is the section cached? If so, the cached copy is up to date, so we can use it
     // rather than read from the media.
-    cacheEntry = &m_descriptors[cacheEntryIndex];
-    if (cacheEntry->m_isValid
-        && cacheEntry->m_isDirty
-        && u32EntryNum >= cacheEntry->m_firstLBA
-        && u32EntryNum < cacheEntry->m_firstLBA + cacheEntry->m_entryCount)
+    if (cacheEntryIndex != kNoCacheEntry)
     {
         // Just write the contents of the cache entry.
+        CacheEntry * cacheEntry = &m_descriptors[cacheEntryIndex];
         bufferToWrite = (uint8_t *)cacheEntry->m_entries;
         bufferEntryCount = cacheEntry->m_entryCount;
-        m_wroteCacheEntryDuringConsolidate = true;
+        return SUCCESS;
     }
-    else
+    
+    // We don't have a valid cache entry, so just read the section from the map
+    // block like normal.
+    RtStatus_t status = PersistentMap::getSectionForConsolidate(u32EntryNum, thisSectionNumber, bufferToWrite, bufferEntryCount, sectorBuffer);
+    if (status != SUCCESS)
     {
-        // We don't have a valid cache entry, so just read the section from the map
-        // block like normal.
-        return PersistentMap::getSectionForConsolidate(u32EntryNum, thisSectionNumber, bufferToWrite, bufferEntryCount, sectorBuffer);
+        return status;
     }
     
+    // Bring the section up to date with the changes that are only in the journal.
+    CacheEntry section;
+    section.m_firstLBA = ((NandMapSectionHeader_t *)sectorBuffer)->startLba;
+    section.m_entryCount = bufferEntryCount;
+    section.m_entries = bufferToWrite;
+    applyJournal(&section);
+    
     return SUCCESS;
 }
 
@@ -468,29 +613,20 @@ void ZoneMapCache::writeMapEntry(CacheEntry * zoneMapSection, uint32_t lba, uint
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Makes every change to the zone map persistent.
+//!
+//! Every change since the journal was last folded into the map is in the journal, so
+//! only the journal is written, as a single log page. Dirty sections stay in the cache.
+////////////////////////////////////////////////////////////////////////////////
 RtStatus_t ZoneMapCache::flush()
 {
-    // Clear this flag so we can watch for addSection() to set it.
-    m_didConsolidateDuringAddSection = false;
-            
-    // Store the entire contents of Cache out to the LBA designated Block.
-    unsigned i;
-    for (i=0; i < m_cacheSectionCount; ++i)
+    if (!m_isJournalDirty)
     {
-        CacheEntry * entry = &m_descriptors[i];
-
-        // Flush this cache entry if it is both valid and dirty.
-        if (entry->m_isValid && entry->m_isDirty)
-        {
-            RtStatus_t ret = addSection(entry->m_entries, entry->m_firstLBA, entry->m_entryCount);
-            if (ret || m_didConsolidateDuringAddSection)
-            {
-                return ret;
-            }
-        }
+        return SUCCESS;
     }
     
-    return SUCCESS;
+    return writeJournal();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -536,8 +672,434 @@ RtStatus_t ZoneMapCache::setBlockInfo(uint32_t u32Lba, uint32_t u32PhysAddr)
     writeMapEntry(zoneMapSection, u32Lba, u32PhysAddr);
 
     zoneMapSection->m_isDirty = true;  // Mark this zone map section as dirty.
-    zoneMapSection->m_timestamp = hw_profile_GetMicroseconds();   // Update the timestamp.
+    touchEntry(i32SelectedEntryNum);    // Make this the most recently used section.
+
+    // Record the change so it can be written without writing the section.
+    return appendJournal(u32Lba, u32PhysAddr);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Prefetches the next section if the zone map is being walked in order.
+//!
+//! After #MAPPER_PREFETCH_THRESHOLD lookups of ascending LBAs in a row, a
+//! PrefetchZoneMapSectionTask is posted for the section after the one holding \a u32Lba,
+//! unless it is already cached or being prefetched. Nothing is prefetched if the cache
+//! only has room for the current section.
+//!
+//! \param[in]   u32Lba   Logical Block Address that was just looked up.
+////////////////////////////////////////////////////////////////////////////////
+void ZoneMapCache::detectSequentialAccess(uint32_t u32Lba)
+{
+    // Looking up the same LBA again neither continues nor breaks a run.
+    if (u32Lba == m_lastLookupLba)
+    {
+        return;
+    }
+    
+    if (u32Lba == m_lastLookupLba + 1)
+    {
+        ++m_sequentialLookupCount;
+    }
+    else
+    {
+        m_sequentialLookupCount = 0;
+    }
+    
+    m_lastLookupLba = u32Lba;
+    
+    if (m_sequentialLookupCount < MAPPER_PREFETCH_THRESHOLD || m_cacheSectionCount < 2 || m_mapper.isBuildingMaps())
+    {
+        return;
+    }
+    
+    uint32_t nextSection = u32Lba / m_maxEntriesPerPage + 1;
+    if (nextSection >= m_totalSectionCount
+        || m_sectionEntries[nextSection] != kNoCacheEntry
+        || nextSection == m_prefetchSection)
+    {
+        return;
+    }
+    
+    m_prefetchSection = nextSection;
+    m_mapper.getMedia()->getDeferredQueue()->post(new PrefetchZoneMapSectionTask(m_mapper, nextSection));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Loads a section into the cache ahead of its use.
+//!
+//! The section is loaded into the least recently used cache entry, unless it is already
+//! cached. The most recently used entry is never evicted for a prefetch.
+//!
+//! \param[in]   sectionNumber   Number of the zone map section to load.
+//!
+//! \return Status of call or error.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t ZoneMapCache::prefetchSection(uint32_t sectionNumber)
+{
+    // Another prefetch can be posted from now on.
+    m_prefetchSection = kNoPrefetchSection;
+    
+    // The map may have been shut down or be in the middle of being rebuilt since the
+    // prefetch was posted.
+    if (!m_descriptors || !m_block.isValid() || m_mapper.isBuildingMaps() || sectionNumber >= m_totalSectionCount)
+    {
+        return SUCCESS;
+    }
+    
+    if (m_sectionEntries[sectionNumber] != kNoCacheEntry || m_lruTail == m_lruHead)
+    {
+        return SUCCESS;
+    }
+    
+    uint32_t u32Lba = sectionNumber * m_maxEntriesPerPage;
+    int32_t i32SelectedEntryNum;
+    RtStatus_t ret = lookupCacheEntry(u32Lba, &i32SelectedEntryNum);
+    if (ret)
+    {
+        return ret;
+    }
+    
+    return evictAndLoad(u32Lba, i32SelectedEntryNum);
+}
+
+#if !defined(__ghs__)
+#pragma mark --PrefetchZoneMapSectionTask--
+#endif
+
+PrefetchZoneMapSectionTask::PrefetchZoneMapSectionTask(Mapper & mapper, uint32_t sectionNumber)
+:   DeferredTask(kTaskPriority),
+    m_mapper(mapper),
+    m_sectionNumber(sectionNumber)
+{
+}
+
+uint32_t PrefetchZoneMapSectionTask::getTaskTypeID() const
+{
+    return kTaskTypeID;
+}
+
+bool PrefetchZoneMapSectionTask::examineOne(DeferredTask * task)
+{
+    // There's no reason to load the same section twice.
+    return (task->getTaskTypeID() == kTaskTypeID
+        && static_cast<PrefetchZoneMapSectionTask *>(task)->getSectionNumber() == m_sectionNumber);
+}
+
+void PrefetchZoneMapSectionTask::task()
+{
+    DdiNandLocker lock;
+    
+    // The zone map is deleted when the mapper is shut down, such as by a media erase,
+    // so it is looked up again rather than kept from when the task was posted.
+    ZoneMapCache * zoneMap = m_mapper.getZoneMap();
+    if (!zoneMap || !m_mapper.isInitialized())
+    {
+        return;
+    }
+    
+    RtStatus_t status = zoneMap->prefetchSection(m_sectionNumber);
+    if (status != SUCCESS)
+    {
+        tss_logtext_Print(LOGTEXT_EVENT_DDI_NAND_GROUP|LOGTEXT_VERBOSITY_1, "Failed to prefetch zone map section %u, error 0x%08x\n", m_sectionNumber, status);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Records a change to the zone map in the journal.
+//!
+//! A record for the same LBA is replaced, so the journal holds at most one record per
+//! LBA. If the journal is full, it is folded into the map first.
+//!
+//! \param[in]   u32Lba        Logical Block Address that was changed.
+//! \param[in]   u32PhysAddr   New physical address for \a u32Lba.
+//!
+//! \return Status of call or error.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t ZoneMapCache::appendJournal(uint32_t u32Lba, uint32_t u32PhysAddr)
+{
+    RtStatus_t ret;
+    int32_t i;
+    
+    // Recently changed LBAs are the most likely to be changed again.
+    for (i = m_journalCount - 1; i >= 0; --i)
+    {
+        if (m_journal[i].m_lba == u32Lba)
+        {
+            m_journal[i].m_physicalAddress = u32PhysAddr;
+            m_isJournalDirty = true;
+            return SUCCESS;
+        }
+    }
+    
+    if (m_journalCount >= m_journalCapacity)
+    {
+        ret = foldJournal();
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    
+    m_journal[m_journalCount].m_lba = u32Lba;
+    m_journal[m_journalCount].m_physicalAddress = u32PhysAddr;
+    ++m_journalCount;
+    m_isJournalDirty = true;
+    
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Applies the records in the journal to a section of the zone map.
+//!
+//! Records for LBAs outside of the section are ignored. Applying the journal to a
+//! section that already has the changes does nothing.
+//!
+//! \param zoneMapSection The section to update.
+////////////////////////////////////////////////////////////////////////////////
+void ZoneMapCache::applyJournal(CacheEntry * zoneMapSection)
+{
+    uint32_t u32StartingEntry = zoneMapSection->m_firstLBA;
+    uint32_t u32NumEntries = zoneMapSection->m_entryCount;
+    uint32_t i;
+    
+    for (i=0; i < m_journalCount; ++i)
+    {
+        uint32_t lba = m_journal[i].m_lba;
+        
+        if ((lba >= u32StartingEntry) && (lba < (u32StartingEntry + u32NumEntries)))
+        {
+            writeMapEntry(zoneMapSection, lba, m_journal[i].m_physicalAddress);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Empties the journal.
+////////////////////////////////////////////////////////////////////////////////
+void ZoneMapCache::clearJournal()
+{
+    m_journalCount = 0;
+    m_isJournalDirty = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Reads the journal from the zone map's log page.
+//!
+//! Records for sections that were written after the log page are dropped, since those
+//! sections already have the changes, and may have newer ones. Nothing is read if there
+//! is no log page or the journal already holds its records.
+//!
+//! \retval SUCCESS The journal was loaded.
+//! \retval ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED The log page is invalid.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t ZoneMapCache::loadJournal()
+{
+    RtStatus_t status;
+    
+    if (m_logPageIndex < 0 || m_journalCount)
+    {
+        return SUCCESS;
+    }
+    
+    // Create an object for reading the log page.
+    ZoneMapSectionPage logPage(PageAddress(m_block, m_logPageIndex));
+    logPage.setEntrySize(sizeof(JournalRecord));
+    logPage.setMapType(m_signature);
+    logPage.setLogMapType(m_logSignature);
+    
+    status = logPage.allocateBuffers();
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+    
+    status = logPage.read();
+    if (!is_read_status_success_or_ecc_fixed(status))
+    {
+        return status;
+    }
+    
+    if (!logPage.validateHeader()
+        || !logPage.isLogPage()
+        || logPage.getHeader()->entrySize != sizeof(JournalRecord)
+        || logPage.getEntryCount() > m_journalCapacity)
+    {
+        return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+    }
+    
+    const JournalRecord * records = (const JournalRecord *)logPage.getEntries();
+    uint32_t i;
+    for (i=0; i < logPage.getEntryCount(); ++i)
+    {
+        uint32_t sectionNumber = records[i].m_lba / m_maxEntriesPerPage;
+        
+        if (sectionNumber >= m_totalSectionCount)
+        {
+            return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+        }
+        
+        if (m_sectionPageOffsets[sectionNumber] < m_logPageIndex)
+        {
+            m_journal[m_journalCount++] = records[i];
+        }
+    }
+    
+    // Write the log page again on the next flush if it is close to being unreadable.
+    m_isJournalDirty = (status == ERROR_DDI_NAND_HAL_ECC_FIXED_REWRITE_SECTOR);
+    
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Writes the journal as a log page in the zone map block.
+//!
+//! If the block is full, the map is consolidated instead, which applies the journal to
+//! every section so that no log page is needed.
+//!
+//! \return Status of call or error.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t ZoneMapCache::writeJournal()
+{
+    RtStatus_t ret;
+    
+    // Disable auto sleep.
+    NandHal::SleepHelper disableSleep(false);
+    
+    if (m_topPageIndex >= NandHal::getParameters().wPagesPerBlock)
+    {
+        return consolidate(false, 0, NULL, 0);
+    }
+    
+    // Create the log page object.
+    ZoneMapSectionPage logPage(PageAddress(m_block, m_topPageIndex));
+    logPage.setEntrySize(sizeof(JournalRecord));
+    logPage.setMetadataSignature(m_metadataSignature);
+    logPage.setMapType(m_logSignature);
+    
+    ret = logPage.allocateBuffers();
+    if (ret != SUCCESS)
+    {
+        return ret;
+    }
+    
+    // Write the log page.
+    uint32_t u32NumEntriesWritten;
+    ret = logPage.writeSection(0, m_journalCount, (uint8_t *)m_journal, &u32NumEntriesWritten);
+    
+    if (ret == ERROR_DDI_NAND_HAL_WRITE_FAILED)
+    {
+        BlockAddress oldZoneMapBlock(m_block);
+        
+        tss_logtext_Print(LOGTEXT_EVENT_DDI_NAND_GROUP|LOGTEXT_VERBOSITY_1, ">>> Got write error for block %d page %d while writing zone map log: 0x%08x; consolidating and marking bad\n", m_block.get(), m_topPageIndex, ret);
+        
+        // Consolidate into another block. We do this before marking the old block bad so
+        // we can read data out of it during the consolidation process.
+        ret = consolidate(false, 0, NULL, 0);
+        
+        m_mapper.handleNewBadBlock(oldZoneMapBlock);
+    }
+    else if (ret == SUCCESS)
+    {
+        m_logPageIndex = m_topPageIndex;
+        m_topPageIndex++;
+        m_isJournalDirty = false;
+    }
+    
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Writes the changes in the journal into the zone map sections.
+//!
+//! Each section with at least one record in the journal is written once, in section
+//! order, and the journal is then emptied. Sections that are not cached are read from
+//! the NAND and have the journal applied. If the map block fills up and is consolidated,
+//! the consolidation writes every section, so the fold ends there.
+//!
+//! \return Status of call or error.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t ZoneMapCache::foldJournal()
+{
+    RtStatus_t ret;
+    
+    // Get a temp buffer for sections that are not cached.
+    SectorBuffer buffer;
+    if ((ret = buffer.acquire()) != SUCCESS)
+    {
+        return ret;
+    }
+    
+    // Clear this flag so we can watch for addSection() to set it.
+    m_didConsolidateDuringAddSection = false;
+    
+    uint32_t sectionNumber;
+    for (sectionNumber=0; sectionNumber < m_totalSectionCount; ++sectionNumber)
+    {
+        uint32_t i;
+        
+        // Skip sections the journal has no changes for.
+        for (i=0; i < m_journalCount; ++i)
+        {
+            if (m_journal[i].m_lba / m_maxEntriesPerPage == sectionNumber)
+            {
+                break;
+            }
+        }
+        
+        if (i == m_journalCount)
+        {
+            continue;
+        }
+        
+        CacheEntry * zoneMapSection;
+        CacheEntry uncachedSection;
+        
+        if (m_sectionEntries[sectionNumber] != kNoCacheEntry)
+        {
+            // The cached copy already has the changes.
+            zoneMapSection = &m_descriptors[m_sectionEntries[sectionNumber]];
+        }
+        else
+        {
+            ret = retrieveSection(sectionNumber * m_maxEntriesPerPage, (uint8_t *)buffer, false);
+            if (ret)
+            {
+                return ret;
+            }
+            
+            NandMapSectionHeader_t * header = (NandMapSectionHeader_t *)buffer.getBuffer();
+            if (header->entrySize != m_entrySize)
+            {
+                return ERROR_DDI_NAND_MAPPER_LBA_CORRUPTED;
+            }
+            
+            uncachedSection.m_firstLBA = header->startLba;
+            uncachedSection.m_entryCount = header->entryCount;
+            uncachedSection.m_entries = (uint8_t *)buffer + sizeof(*header);
+            applyJournal(&uncachedSection);
+            
+            zoneMapSection = &uncachedSection;
+        }
+        
+        ret = addSection(zoneMapSection->m_entries, zoneMapSection->m_firstLBA, zoneMapSection->m_entryCount);
+        if (ret)
+        {
+            return ret;
+        }
+        
+        // Consolidating wrote every section and emptied the journal.
+        if (m_didConsolidateDuringAddSection)
+        {
+            return SUCCESS;
+        }
+        
+        zoneMapSection->m_isDirty = false;
+    }
+    
+    // Every record is in its section now, so the log page no longer matters.
+    clearJournal();
+    m_logPageIndex = -1;
+    
     return SUCCESS;
 }
 
@@ -19,6 +19,7 @@
 #define __zone_map_cache_h__
 
 #include "PersistentMap.h"
+#include "DeferredTask.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 // Definitions
@@ -36,14 +37,33 @@ class Mapper;
 //@{
 // The number of cache entries varies depending on whether we have an SDRAM or no-SDRAM build.
 #if defined(NO_SDRAM)
-    //! \brief Number of cached zone map sections.
+    //! \brief Minimum number of cached zone map sections.
     #define MAPPER_CACHE_COUNT          (1)
 #else
-    //! \brief Number of cached zone map sections.
+    //! \brief Minimum number of cached zone map sections.
     #define MAPPER_CACHE_COUNT          (2)
 #endif
+
+//! \brief Default memory budget in bytes for cached zone map sections.
+//!
+//! The cache always holds at least #MAPPER_CACHE_COUNT sections, so the default of zero
+//! keeps the cache at that size.
+#define MAPPER_CACHE_DEFAULT_BUDGET     (0)
+
+//! \brief Number of lookups of ascending LBAs in a row before the next section is prefetched.
+#define MAPPER_PREFETCH_THRESHOLD       (4)
 //@}
 
+//! \brief Memory budget that keeps the entire zone map resident.
+const uint32_t kNandZoneMapCacheWholeMap = 0xffffffff;
+
+//! \brief Memory budget in bytes used when the zone map cache is initialized.
+//!
+//! Set this before the mapper is initialized. The cache keeps its size until the
+//! mapper is shut down. If the budget can't be allocated, the cache falls back to
+//! #MAPPER_CACHE_COUNT sections.
+extern uint32_t g_nandZoneMapCacheBudget;
+
 //! \name Zone map entry size constants
 //@{
 const unsigned kNandZoneMapSmallEntry = 2; //!< 16-bit entry.
@@ -58,6 +78,21 @@ const unsigned kNandMapperLargeUnallocatedBlockAddress = 0xffffff;  //!< 24-bit
 
 /*!
  * \brief Map of virtual to physical block numbers.
+ *
+ * Changes to the map are not written into its sections as they are made. Each change is
+ * recorded in a journal in RAM, and flush() writes the whole journal as a log page in the
+ * map's block. Only the latest log page is needed, so a flush costs one page write no
+ * matter how many sections were changed. When the journal fills up, it is folded into
+ * the map by writing each section it has changes for, and then starts out empty.
+ *
+ * Since every change is in the journal, a dirty section can be evicted from the cache
+ * without being written. Sections loaded from the NAND and sections copied while
+ * consolidating have the journal applied to them.
+ *
+ * When getBlockInfo() is called for ascending LBAs, as it is while a file is streamed, the
+ * section after the current one is loaded ahead of time by a deferred task. The task runs
+ * while the NAND driver is otherwise idle, so the lookups do not stall when they cross
+ * into the next section.
  */
 class ZoneMapCache : public PersistentMap
 {
@@ -71,15 +106,21 @@ public:
     void init();
     void shutdown();
 
+    //! \brief Returns the number of cached zone map sections.
+    uint32_t getCacheSectionCount() const { return m_cacheSectionCount; }
+
     RtStatus_t writeEmptyMap();
 
-    RtStatus_t findZoneMap();
+    RtStatus_t findZoneMap(bool isLocated=false);
 
     RtStatus_t flush();
     
     RtStatus_t getBlockInfo(uint32_t u32Lba, uint32_t *pu32PhysAddr);
     RtStatus_t setBlockInfo(uint32_t u32Lba, uint32_t u32PhysAddr);
     
+    //! \brief Loads a section into the cache ahead of its use.
+    RtStatus_t prefetchSection(uint32_t sectionNumber);
+    
     virtual RtStatus_t consolidate(
         bool hasValidSectionData,
         uint32_t sectionNumber,
@@ -88,27 +129,71 @@ public:
     
 protected:
 
+    //! \brief Value in the section table for a section that is not cached.
+    static const int16_t kNoCacheEntry = -1;
+
+    //! \brief Value of #m_prefetchSection when no prefetch is pending.
+    static const uint32_t kNoPrefetchSection = 0xffffffff;
+
+    /*!
+     * \brief One change to the zone map, as held in the journal and its log page.
+     */
+    struct JournalRecord
+    {
+        uint32_t m_lba;             //!< LBA whose entry was changed.
+        uint32_t m_physicalAddress; //!< New value of the entry.
+    };
+
     /*!
      * \brief Information about a cached section of the zone map.
+     *
+     * Entries are kept on a list in order of use, with the most recently used entry at
+     * the head. Invalid entries are kept at the tail, so the tail is always the entry to
+     * load a new section into.
      */
     struct CacheEntry
     {
         bool m_isValid;         //!< True if this entry is valid.
         bool m_isDirty;         //!< True if this entry is dirty.
-        uint64_t m_timestamp;   //!< The modification timestamp for this entry in microseconds since boot.
+        int32_t m_prev;         //!< Index of the next more recently used entry, or -1 for the head.
+        int32_t m_next;         //!< Index of the next less recently used entry, or -1 for the tail.
         uint32_t m_firstLBA;    //!< LBA number for the first entry in this section.
         uint32_t m_entryCount;  //!< Number of valid entries in this section.
         uint8_t * m_entries;    //!< Pointer to section entry data.
     };
 
     uint32_t m_cacheSectionCount; //!< Number of cached zone map sections.
-    CacheEntry * m_descriptors;  //!< Information about each of the cached sections. This array is #sectionCount entries long.
+    CacheEntry * m_descriptors;  //!< Information about each of the cached sections. This array is #m_cacheSectionCount entries long.
     uint8_t * m_cacheBuffers;  //!< Dynamically allocated buffer for the cached zone map sections.
-    bool m_wroteCacheEntryDuringConsolidate;
+    int16_t * m_sectionEntries;  //!< Index of the cache entry holding each zone map section, or #kNoCacheEntry.
+    int32_t m_lruHead;          //!< Index of the most recently used cache entry.
+    int32_t m_lruTail;          //!< Index of the least recently used cache entry.
+    JournalRecord * m_journal;  //!< Changes made since the journal was last folded into the map.
+    uint32_t m_journalCount;    //!< Number of records in #m_journal.
+    uint32_t m_journalCapacity; //!< Number of records that fit in a log page.
+    bool m_isJournalDirty;      //!< True if the journal has changed since its log page was written.
+    uint32_t m_lastLookupLba;   //!< LBA passed to the last call to getBlockInfo().
+    unsigned m_sequentialLookupCount;   //!< Number of lookups of ascending LBAs in a row.
+    uint32_t m_prefetchSection; //!< Section that a prefetch task has been posted for, or #kNoPrefetchSection.
+
+    RtStatus_t allocateCache(uint32_t budget);
+    void freeCache();
+    void invalidateAll();
+
+    void unlinkEntry(int32_t i32Entry);
+    void touchEntry(int32_t i32Entry);
 
     RtStatus_t loadCacheEntry(uint32_t u32Lba, int32_t i32SelectedEntry);
     RtStatus_t lookupCacheEntry(uint32_t u32Lba, int32_t * pi32SelectedEntryNum);
     RtStatus_t evictAndLoad(uint32_t u32Lba, int32_t i32SelectedEntry);
+    void detectSequentialAccess(uint32_t u32Lba);
+
+    RtStatus_t appendJournal(uint32_t u32Lba, uint32_t u32PhysAddr);
+    void applyJournal(CacheEntry * zoneMapSection);
+    void clearJournal();
+    RtStatus_t loadJournal();
+    RtStatus_t writeJournal();
+    RtStatus_t foldJournal();
 
     uint32_t readMapEntry(CacheEntry * zoneMapSection, uint32_t lba);
     void writeMapEntry(CacheEntry * zoneMapSection, uint32_t lba, uint32_t physicalAddress);
@@ -122,6 +207,45 @@ protected:
     
 };
 
+/*!
+ * \brief Task to load a zone map section into the cache before it is needed.
+ */
+class PrefetchZoneMapSectionTask : public DeferredTask
+{
+public:
+    
+    //! \brief Constants for the prefetch task.
+    enum _task_constants
+    {
+        //! \brief Unique ID for the type of this task.
+        kTaskTypeID = 'zmpf',
+        
+        //! \brief Priority for this task type.
+        kTaskPriority = 16
+    };
+
+    //! \brief Constructor.
+    PrefetchZoneMapSectionTask(Mapper & mapper, uint32_t sectionNumber);
+    
+    //! \brief Return a unique ID for this task type.
+    virtual uint32_t getTaskTypeID() const;
+    
+    //! \brief Check for preexisting duplicate tasks in the queue.
+    virtual bool examineOne(DeferredTask * task);
+
+    //! \brief Return the section that will be prefetched.
+    uint32_t getSectionNumber() const { return m_sectionNumber; }
+
+protected:
+
+    Mapper & m_mapper;          //!< The mapper whose zone map the section is loaded into.
+    uint32_t m_sectionNumber;   //!< Number of the section to load.
+
+    //! \brief The prefetch task implementation.
+    virtual void task();
+    
+};
+
 } // namespace nand
 
 #endif // __zone_map_cache_h__
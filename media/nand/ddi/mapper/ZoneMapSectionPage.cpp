@@ -30,7 +30,8 @@ ZoneMapSectionPage::ZoneMapSectionPage()
     m_header(NULL),
     m_entrySize(0),
     m_metadataSignature(0),
-    m_mapType(0)
+    m_mapType(0),
+    m_logMapType(0)
 {
 }
 
@@ -39,7 +40,8 @@ ZoneMapSectionPage::ZoneMapSectionPage(const PageAddress & addr)
     m_header(NULL),
     m_entrySize(0),
     m_metadataSignature(0),
-    m_mapType(0)
+    m_mapType(0),
+    m_logMapType(0)
 {
 }
 
@@ -68,7 +70,7 @@ bool ZoneMapSectionPage::validateHeader()
 {
     assert(m_mapType);
     return (m_header->signature == kNandMapHeaderSignature
-        && m_header->mapType == m_mapType
+        && (m_header->mapType == m_mapType || isLogPage())
         && m_header->version == kNandMapSectionHeaderVersion);
 }
 
@@ -35,6 +35,9 @@ namespace nand
 
     //! \brief Metadata STMP code value for phys map pages.
     #define PHYS_STRING_PAGE1          (('E'<<24)|('X'<<16)|('M'<<8)|'A')
+
+    //! \brief Metadata STMP code value for mount checkpoint pages.
+    #define CKPT_STRING_PAGE1          (('C'<<24)|('K'<<16)|('P'<<8)|'T')
 //@}
 
 //! \name Map section header constants
@@ -48,6 +51,12 @@ namespace nand
     //! \brief Unique signature used for the phy map.
     const uint32_t kNandPhysMapSignature = 'phys';
 
+    //! \brief Unique signature used for the mount checkpoint.
+    const uint32_t kNandMapperCheckpointSignature = 'ckpt';
+
+    //! \brief Unique signature used for zone map update log pages.
+    const uint32_t kNandZoneMapLogSignature = 'zlog';
+
     //! \brief Current version of the map header.
     //!
     //! The low byte is the minor version, all higher bytes form the major version.
@@ -93,7 +102,9 @@ typedef struct NandMapSectionHeader NandMapSectionHeader_t;
  * the map entry size in bytes by calling setEntrySize(). Once the object is configured, use
  * the superclass's #read() method to actually read the page. After the read completes, you can
  * access the section header with the #getHeader() and related getX methods. You should call
- * #validateHeader() to ensure that the section that was just read is valid.
+ * #validateHeader() to ensure that the section that was just read is valid. If the map's block
+ * also holds log pages, set their type with setLogMapType() so they are accepted by
+ * validateHeader(), and use isLogPage() to tell them apart from sections.
  *
  * To write a section page by way of the writeSection() method, call setEntrySize(),
  * setMetadataSignature(), and setMapType() after instatiating the object. writeSection() is
@@ -126,6 +137,9 @@ public:
         //! \brief Set the map type signature.
         void setMapType(uint32_t theType) { m_mapType = theType; }
 
+        //! \brief Set the map type signature of log pages that share the map's block.
+        void setLogMapType(uint32_t theType) { m_logMapType = theType; }
+
         //! \brief Computes the number of entries that will fit in a section page.
         unsigned getMaxEntriesPerPage() { return (getDataSize() - sizeof(NandMapSectionHeader_t)) / m_entrySize; }
     //@}
@@ -149,6 +163,9 @@ public:
         
         //! \brief Validates the header contents.
         bool validateHeader();
+        
+        //! \brief Returns whether the page is a log page rather than a section.
+        bool isLogPage() { return m_logMapType && m_header->mapType == m_logMapType; }
     //@}
     
     //! \brief Write one page of the map block.
@@ -174,6 +191,7 @@ protected:
     unsigned m_entrySize;   //!< Size in bytes of each entry.
     uint32_t m_metadataSignature;   //!< The signature set in the metadata of section pages.
     uint32_t m_mapType;     //!< Map type signature as used in the section page header.
+    uint32_t m_logMapType;  //!< Map type signature of log pages, or 0 if the map has none.
 
     //! \brief Specify the buffers to use for reading and writing.
     virtual void buffersDidChange();
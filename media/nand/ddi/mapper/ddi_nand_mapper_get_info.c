@@ -77,8 +77,11 @@ RtStatus_t ZoneMapCache::getBlockInfo(uint32_t u32Lba, uint32_t * pu32PhysAddr)
     // Construct the entry's address from the 24-bit value.
     *pu32PhysAddr = readMapEntry(&m_descriptors[i32SelectedEntryNum], u32Lba);
     
-    // Update the timestamp.
-    m_descriptors[i32SelectedEntryNum].m_timestamp = hw_profile_GetMicroseconds();
+    // Make this the most recently used section.
+    touchEntry(i32SelectedEntryNum);
+    
+    // Load the next section ahead of time if the LBAs are being looked up in order.
+    detectSequentialAccess(u32Lba);
 
     return SUCCESS;
 }
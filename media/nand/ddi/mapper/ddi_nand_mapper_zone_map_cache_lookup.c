@@ -33,6 +33,57 @@ using namespace nand;
 //  Code
 /////////////////////////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Removes a cache entry from the list of entries in order of use.
+//!
+//! \param[in]   i32Entry   Index of the cache entry.
+////////////////////////////////////////////////////////////////////////////////
+void ZoneMapCache::unlinkEntry(int32_t i32Entry)
+{
+    CacheEntry & entry = m_descriptors[i32Entry];
+    
+    if (entry.m_prev != -1)
+    {
+        m_descriptors[entry.m_prev].m_next = entry.m_next;
+    }
+    else
+    {
+        m_lruHead = entry.m_next;
+    }
+    
+    if (entry.m_next != -1)
+    {
+        m_descriptors[entry.m_next].m_prev = entry.m_prev;
+    }
+    else
+    {
+        m_lruTail = entry.m_prev;
+    }
+    
+    entry.m_prev = -1;
+    entry.m_next = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Makes a cache entry the most recently used one.
+//!
+//! \param[in]   i32Entry   Index of the cache entry.
+////////////////////////////////////////////////////////////////////////////////
+void ZoneMapCache::touchEntry(int32_t i32Entry)
+{
+    if (m_lruHead == i32Entry)
+    {
+        return;
+    }
+    
+    unlinkEntry(i32Entry);
+    
+    CacheEntry & entry = m_descriptors[i32Entry];
+    entry.m_next = m_lruHead;
+    m_descriptors[m_lruHead].m_prev = i32Entry;
+    m_lruHead = i32Entry;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //! \brief    Identifies the cache entry which is to be used with logical block.  
 //!
@@ -40,80 +91,35 @@ using namespace nand;
 //! section containing u32Lba or identifies the cache entry which should be
 //! loaded with zone-map section containing u32Lba.
 //!
+//! Cached sections are found through a table indexed by section number. If the
+//! section is not cached, the least recently used entry is selected. Invalid entries
+//! are always the least recently used, so they are filled before anything is evicted.
+//!
 //! \param[in]    u32Lba                Logical Block Address.
 //! \param[out]   pi32SelectedEntryNum  Entry for zone-map section containing u32Lba
 //!
 //! \return Status of call or error.
+//! \retval SUCCESS An entry was selected.
+//! \retval ERROR_DDI_NAND_MAPPER_LBA_OUTOFBOUND \a u32Lba is past the end of the zone map.
 ////////////////////////////////////////////////////////////////////////////////
 RtStatus_t ZoneMapCache::lookupCacheEntry(uint32_t u32Lba, int32_t * pi32SelectedEntryNum)
 {
-    uint64_t u32MinTimeStamp;
-    uint64_t u32SaveMinTimeStamp;
-    int32_t  i;
-    uint32_t u32StartingEntry;
-    uint32_t u32NumEntries;
-    uint32_t u32TimeStamp;
-    uint32_t bCacheValid;
-        
-    *pi32SelectedEntryNum = 0; // was -1 causes mem corruption when counter flips. 0 ok.
+    uint32_t u32Section = u32Lba / m_maxEntriesPerPage;
     
-    // first see if there exists a cache entry which already 
-    // contains u32Lba.
-    for (i=0; i < m_cacheSectionCount; ++i)
+    if (u32Section >= m_totalSectionCount)
     {
-        u32StartingEntry = m_descriptors[i].m_firstLBA;
-        u32NumEntries    = m_descriptors[i].m_entryCount;
-        bCacheValid      = m_descriptors[i].m_isValid;
-    
-        if ((bCacheValid) && 
-            (u32Lba >= u32StartingEntry) && 
-            (u32Lba < (u32StartingEntry + u32NumEntries)))
-        {
-            *pi32SelectedEntryNum = i;
-            return SUCCESS;
-        }
+        return ERROR_DDI_NAND_MAPPER_LBA_OUTOFBOUND;
     }
-
-    u32MinTimeStamp = hw_profile_GetMicroseconds();
-    u32SaveMinTimeStamp = u32MinTimeStamp;
     
-    // If there is an entry which has not been occupied yet,
-    // used it.  Otherwise, pick the entry which has the 
-    // earliest time-stamp (i.e LRU). 
-    for (i=0; i < m_cacheSectionCount; ++i)
+    // First see if there exists a cache entry which already contains u32Lba.
+    if (m_sectionEntries[u32Section] != kNoCacheEntry)
     {
-        u32TimeStamp = m_descriptors[i].m_timestamp;
-        bCacheValid = m_descriptors[i].m_isValid;
-        
-        // The entries have to be aged.  Otherwise, an early 
-        // flurry of accesses will insure that a cache entry
-        // will stay in Cache forever.
-          
-        if (!bCacheValid)
-        {
-            *pi32SelectedEntryNum = i;
-            return SUCCESS;   
-        }
-        else if (u32TimeStamp < u32MinTimeStamp)
-        {
-            u32MinTimeStamp = u32TimeStamp;
-            *pi32SelectedEntryNum = i;  
-        }
+        *pi32SelectedEntryNum = m_sectionEntries[u32Section];
+    }
+    else
+    {
+        *pi32SelectedEntryNum = m_lruTail;
     }
-
-    // This happens once in a blue moon.  The microsecond timer has rolled over, and the "current" 
-    // time is less than all of the time-stamps.  In this case, we'll just return with original
-    // value of pi32SelectedEntryNum, which is 0.  But we have to fix the time-stamps since they're
-    // likely to be greater than micro-second timer for the foreseeable future.  So, refresh all of
-    // the time-stamps.
-    if (u32MinTimeStamp == u32SaveMinTimeStamp)
-    {        
-        for (i=0; i < m_cacheSectionCount; ++i)
-        {
-            m_descriptors[i].m_timestamp = u32MinTimeStamp;
-        }
-            
-    } 
     
     assert(!(((*pi32SelectedEntryNum) < 0) || ((*pi32SelectedEntryNum) >= m_cacheSectionCount)));
     
@@ -155,16 +161,8 @@ RtStatus_t ZoneMapCache::evictAndLoad(uint32_t u32Lba, int32_t i32SelectedEntry)
     else if ((u32Lba < u32StartingEntry) || (u32Lba >= (u32StartingEntry + u32NumEntries)))
     {
         // Logical address was not found in cache, we need to evict an entry
-        // and read in the section which contains the logical address. 
-        if (entry.m_isDirty)
-        {
-            ret = addSection(entry.m_entries, entry.m_firstLBA, entry.m_entryCount);
-            if (ret)
-            {
-                return ret;
-            }
-        }
-        
+        // and read in the section which contains the logical address. The changes
+        // to a dirty entry are in the journal, so it does not have to be written.
         ret = loadCacheEntry(u32Lba, i32SelectedEntry);
         if (ret)
         {
@@ -0,0 +1,1177 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor, Inc. All rights reserved.
+//
+// Freescale Semiconductor, Inc.
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor, Inc.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \addtogroup ddi_media_nand_hal_sim
+//! @{
+//! \file ddi_nand_hal_sim.cpp
+//! \brief Host memory implementation of the NAND HAL with a timing model.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "types.h"
+#include "errordefs.h"
+#include "simple_mutex.h"
+#include "os/thi/os_thi_api.h"
+#include "drivers/media/ddi_media_errordefs.h"
+#include "drivers/media/nand/hal/sim/ddi_nand_hal_sim.h"
+#include "drivers/media/nand/gpmi/ddi_nand_gpmi.h"
+#include "drivers/media/common/Taus88.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+// Definitions
+////////////////////////////////////////////////////////////////////////////////
+
+//! Default number of blocks per chip select when the config does not specify one.
+#define NAND_SIM_DEFAULT_BLOCKS_PER_CHIP (4096)
+
+//! \brief Static description of one simulated NAND type.
+typedef struct _nand_sim_type_info {
+    NandType_t nandType;
+    NandCellType_t cellType;
+    uint8_t manufacturerCode;
+    uint8_t deviceCode;
+    uint32_t pageDataSize;
+    uint32_t pageMetadataSize;
+    uint32_t pagesPerBlock;
+    uint32_t planesPerDie;
+    NandSimTimings_t timings;   //!< tR, tPROG, tBERS, and bus time per KB.
+} NandSimTypeInfo_t;
+
+/*!
+ * \brief Simulated chip select.
+ *
+ * Pages are stored as the data area immediately followed by the metadata area, which is
+ * also the layout seen through the raw read and write methods. An erased page reads as
+ * all 0xff bytes, and programming can only clear bits, as on a real array.
+ *
+ * When the array is RAM backed, storage for a block is only allocated when one of its
+ * pages is first programmed, and is freed again when the block is erased. This keeps
+ * multi-gigabyte configurations practical on a host. When the array is file backed,
+ * each chip select is a window into the mapped image.
+ */
+class SimulatedNand : public NandPhysicalMedia
+{
+public:
+
+    SimulatedNand(unsigned chipSelect, uint32_t firstBlock, uint8_t * image);
+    virtual ~SimulatedNand();
+
+    virtual RtStatus_t reset();
+    virtual RtStatus_t readID(uint8_t * pReadIDCode);
+
+    virtual RtStatus_t readRawData(uint32_t wSectorNum, uint32_t columnOffset, uint32_t readByteCount, SECTOR_BUFFER * pBuf);
+    virtual RtStatus_t readPage(uint32_t uSectorNumber, SECTOR_BUFFER * pBuffer, SECTOR_BUFFER * pAuxiliary, NandEccCorrectionInfo_t * pECC);
+    virtual RtStatus_t readMetadata(uint32_t uSectorNumber, SECTOR_BUFFER * pBuffer, NandEccCorrectionInfo_t * pECC);
+    virtual RtStatus_t readPageWithEcc(const NandEccDescriptor_t * ecc, uint32_t pageNumber, SECTOR_BUFFER * pBuffer, SECTOR_BUFFER * pAuxiliary, NandEccCorrectionInfo_t * pECC);
+
+    virtual RtStatus_t readMultiplePages(MultiplaneParamBlock * pages, unsigned pageCount);
+    virtual RtStatus_t readMultipleMetadata(MultiplaneParamBlock * pages, unsigned pageCount);
+    virtual RtStatus_t writeMultiplePages(MultiplaneParamBlock * pages, unsigned pageCount);
+    virtual RtStatus_t eraseMultipleBlocks(MultiplaneParamBlock * blocks, unsigned blockCount);
+
+    virtual RtStatus_t writeRawData(uint32_t pageNumber, uint32_t columnOffset, uint32_t writeByteCount, const SECTOR_BUFFER * data);
+    virtual RtStatus_t writePage(uint32_t uSectorNum, const SECTOR_BUFFER * pBuffer, const SECTOR_BUFFER * pAuxiliary);
+
+    virtual RtStatus_t writeFirmwarePage(uint32_t uSectorNum, const SECTOR_BUFFER * pBuffer, const SECTOR_BUFFER * pAuxiliary);
+    virtual RtStatus_t readFirmwarePage(uint32_t uSectorNumber, SECTOR_BUFFER * pBuffer, SECTOR_BUFFER * pAuxiliary, NandEccCorrectionInfo_t * pECC);
+
+    virtual RtStatus_t eraseBlock(uint32_t uBlockNumber);
+    virtual RtStatus_t copyPages(NandPhysicalMedia * targetNand, uint32_t uSourceStartSectorNum, uint32_t uTargetStartSectorNum, uint32_t wNumSectors, SECTOR_BUFFER * sectorBuffer, SECTOR_BUFFER * auxBuffer, NandCopyPagesFilter * filter, uint32_t * successfulPages);
+
+    virtual bool isBlockBad(uint32_t blockAddress, SECTOR_BUFFER * auxBuffer, bool checkFactoryMarkings=false, RtStatus_t * readStatus=NULL);
+    virtual RtStatus_t markBlockBad(uint32_t blockAddress, SECTOR_BUFFER * pageBuffer, SECTOR_BUFFER * auxBuffer);
+
+    virtual RtStatus_t enableSleep(bool isEnabled) { m_isSleepEnabled = isEnabled; return SUCCESS; }
+    virtual bool isSleepEnabled() { return m_isSleepEnabled; }
+
+    virtual char * getDeviceName();
+
+    //! \brief Erase every block and apply factory bad block marks.
+    void format(Taus88 & random, uint32_t badBlockCount);
+
+protected:
+
+    uint8_t * m_image;          //!< Start of this chip's window into the backing file, or NULL.
+    uint8_t ** m_blocks;        //!< Per-block storage when RAM backed. NULL entries are erased.
+    bool m_isSleepEnabled;
+
+    //! \brief Return the storage for a page, or NULL if it is erased and \a allocate is false.
+    uint8_t * getPageStorage(uint32_t page, bool allocate);
+
+    //! \brief Copy a page's bytes out, substituting 0xff for an erased page.
+    void loadPage(uint32_t page, uint32_t offset, uint32_t count, void * buffer);
+
+    //! \brief Program bytes of a page, clearing bits only.
+    void programPage(uint32_t page, uint32_t offset, uint32_t count, const void * buffer);
+
+    //! \brief Erase one block without charging any time.
+    void clearBlock(uint32_t block);
+
+    //! \brief Fill in ECC results for a perfect read.
+    void setPerfectEcc(NandEccCorrectionInfo_t * pECC);
+
+    //! \brief Returns the plane that a page or block address belongs to.
+    inline uint32_t planeOfBlock(uint32_t block) const { return block % pNANDParams->planesPerDie; }
+};
+
+/*!
+ * \brief Global context for the simulated HAL.
+ *
+ * This is the simulated counterpart of NandHalContext_t. There is no DMA state.
+ */
+typedef struct NandSimContext {
+    TX_MUTEX serializationMutex;    //!< Serializes all access to the simulated HAL.
+    bool isConfigured;              //!< Whether ddi_nand_hal_sim_configure() has been called.
+    NandSimConfig_t config;         //!< Active configuration, with defaults applied.
+    unsigned chipSelectCount;       //!< Number of active chip selects.
+    uint32_t totalBlockCount;       //!< Combined number of blocks from all chip selects.
+    NandParameters_t parameters;    //!< Shared description of NAND properties.
+    NandPhysicalMedia * nands[MAX_NAND_DEVICES];    //!< The simulated chip selects.
+    int backingFile;                //!< File descriptor of the backing file, or -1.
+    uint8_t * image;                //!< Mapped backing file, or NULL when RAM backed.
+    size_t imageSize;               //!< Size in bytes of the mapped image.
+    NandSimStatistics_t stats;      //!< Operation counts and the simulated clock.
+} NandSimContext_t;
+
+/*!
+ * \brief Automatic locker for the simulated HAL serialization mutex.
+ */
+class NandSimMutex : public SimpleMutex
+{
+public:
+    NandSimMutex();
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Variables
+////////////////////////////////////////////////////////////////////////////////
+
+//! Global context for the simulated HAL.
+static NandSimContext_t s_simContext = { };
+
+//! GPMI timings last set through ddi_gpmi_set_timings(). The simulation ignores them.
+static NAND_Timing2_struct_t s_simTimings = NAND_SAFESTARTUP_TIMINGS;
+
+#if DEBUG
+//! Read error injection, shared with the real HAL so test code links against either one.
+RtStatus_t g_nand_hal_insertReadError = 0;
+#endif // DEBUG
+
+//! \brief Geometry and default latencies for each simulated type.
+//!
+//! Timings are representative datasheet values: SLC parts read in 25us and program in
+//! 200-300us, while MLC parts take 50-60us to read and most of a millisecond to program.
+static const NandSimTypeInfo_t kSimTypeTable[] = {
+    //  type         cell     mfr   dev   data  meta  ppb  planes   tR  tPROG  tBERS  xfer
+    { kNandType2,  kNandSLC, 0xec, 0xda, 2048,  64,   64, 2, {  25,  200, 1500, 40 } },
+    { kNandType5,  kNandMLC, 0x98, 0xd5, 2048,  64,  128, 2, {  50,  800, 2500, 40 } },
+    { kNandType6,  kNandMLC, 0xec, 0xd5, 2048,  64,  128, 2, {  60,  800, 1500, 40 } },
+    { kNandType7,  kNandSLC, 0x2c, 0xda, 2048,  64,  128, 2, {  25,  250, 2000, 40 } },
+    { kNandType8,  kNandMLC, 0xec, 0xd7, 4096, 128,  128, 2, {  60,  800, 1500, 40 } },
+    { kNandType9,  kNandMLC, 0x98, 0xd7, 4096, 218,  128, 2, {  50, 1000, 3000, 40 } },
+    { kNandType10, kNandSLC, 0xec, 0xd3, 4096, 128,  128, 2, {  25,  250, 2000, 40 } },
+    { kNandType11, kNandMLC, 0x98, 0xde, 8192, 376,  128, 2, {  60, 1200, 3000, 40 } },
+    { kNandType12, kNandMLC, 0xad, 0xd7, 4096, 218,  128, 2, {  60,  900, 2000, 40 } },
+    { kNandType13, kNandMLC, 0x2c, 0xd7, 4096, 218,  128, 2, {  50,  900, 2000, 40 } },
+    { kNandType14, kNandMLC, 0x2c, 0x68, 4096, 224,  256, 2, {  50, 1300, 3000, 40 } },
+    { kNandType15, kNandMLC, 0xec, 0xd7, 8192, 436,  128, 2, {  60, 1200, 3000, 40 } },
+    { kNandType16, kNandMLC, 0x98, 0xd7, 8192,  32,  128, 2, {  70, 1300, 3000, 40 } },
+    { kNandType17, kNandMLC, 0x2c, 0x88, 4096, 224,  256, 2, {  50, 1300, 3000, 40 } },
+    { kNandType18, kNandMLC, 0x2c, 0xa8, 8192, 448,  256, 2, {  75, 1300, 3800, 40 } }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+NandSimMutex::NandSimMutex()
+:   SimpleMutex(s_simContext.serializationMutex)
+{
+}
+
+//! \brief Look up the static description of a NAND type.
+static const NandSimTypeInfo_t * findTypeInfo(NandType_t nandType)
+{
+    unsigned i;
+    for (i = 0; i < sizeof(kSimTypeTable) / sizeof(kSimTypeTable[0]); ++i)
+    {
+        if (kSimTypeTable[i].nandType == nandType)
+        {
+            return &kSimTypeTable[i];
+        }
+    }
+
+    return NULL;
+}
+
+//! \brief Advance the simulated clock for an operation on one chip select.
+//!
+//! HAL calls are synchronous, so the caller observes the whole latency of each operation
+//! and the simulated clock simply advances by that amount.
+//!
+//! \param chipSelect The chip doing the work.
+//! \param arrayTime Array latency (tR, tPROG, or tBERS) in microseconds.
+//! \param byteCount Number of bytes moved over the bus.
+static void chargeTime(unsigned chipSelect, uint32_t arrayTime, uint32_t byteCount)
+{
+    uint32_t busTime = (uint32_t)(((uint64_t)byteCount * s_simContext.config.timings.transferTimePerKB) / 1024);
+    uint32_t total = arrayTime + busTime;
+
+    s_simContext.stats.busyTime[chipSelect] += total;
+    s_simContext.stats.elapsedTime += total;
+
+    if (s_simContext.config.delayMode == kNandSimDelay_Sleep && total)
+    {
+        usleep(total);
+    }
+}
+
+SimulatedNand::SimulatedNand(unsigned chipSelect, uint32_t firstBlock, uint8_t * image)
+:   NandPhysicalMedia(),
+    m_image(image),
+    m_blocks(NULL),
+    m_isSleepEnabled(false)
+{
+    const NandSimConfig_t & config = s_simContext.config;
+
+    pNANDParams = &s_simContext.parameters;
+    wChipNumber = chipSelect;
+    wTotalBlocks = config.blocksPerChip;
+    totalPages = wTotalBlocks * pNANDParams->wPagesPerBlock;
+    wTotalInternalDice = config.dicePerChip;
+    wBlocksPerDie = wTotalBlocks / wTotalInternalDice;
+    m_firstAbsoluteBlock = firstBlock;
+    m_firstAbsolutePage = blockToPage(firstBlock);
+
+    if (!m_image)
+    {
+        m_blocks = (uint8_t **)calloc(wTotalBlocks, sizeof(uint8_t *));
+        assert(m_blocks);
+    }
+}
+
+SimulatedNand::~SimulatedNand()
+{
+    if (m_blocks)
+    {
+        uint32_t i;
+        for (i = 0; i < wTotalBlocks; ++i)
+        {
+            free(m_blocks[i]);
+        }
+        free(m_blocks);
+    }
+}
+
+uint8_t * SimulatedNand::getPageStorage(uint32_t page, bool allocate)
+{
+    assert(page < totalPages);
+
+    uint32_t block;
+    uint32_t offset;
+    pageToBlockAndOffset(page, &block, &offset);
+
+    uint32_t blockSize = pNANDParams->wPagesPerBlock * pNANDParams->pageTotalSize;
+    uint8_t * blockStorage;
+
+    if (m_image)
+    {
+        blockStorage = m_image + (uint64_t)block * blockSize;
+    }
+    else
+    {
+        blockStorage = m_blocks[block];
+        if (!blockStorage)
+        {
+            if (!allocate)
+            {
+                return NULL;
+            }
+
+            blockStorage = (uint8_t *)malloc(blockSize);
+            assert(blockStorage);
+            memset(blockStorage, 0xff, blockSize);
+            m_blocks[block] = blockStorage;
+        }
+    }
+
+    return blockStorage + offset * pNANDParams->pageTotalSize;
+}
+
+void SimulatedNand::loadPage(uint32_t page, uint32_t offset, uint32_t count, void * buffer)
+{
+    assert(offset + count <= pNANDParams->pageTotalSize);
+
+    uint8_t * storage = getPageStorage(page, false);
+    if (storage)
+    {
+        memcpy(buffer, storage + offset, count);
+    }
+    else
+    {
+        memset(buffer, 0xff, count);
+    }
+}
+
+void SimulatedNand::programPage(uint32_t page, uint32_t offset, uint32_t count, const void * buffer)
+{
+    assert(offset + count <= pNANDParams->pageTotalSize);
+
+    uint8_t * storage = getPageStorage(page, true) + offset;
+    const uint8_t * source = (const uint8_t *)buffer;
+    bool wasErased = true;
+
+    // A program operation can only move bits from 1 to 0.
+    uint32_t i;
+    for (i = 0; i < count; ++i)
+    {
+        if (storage[i] != 0xff)
+        {
+            wasErased = false;
+        }
+        storage[i] &= source[i];
+    }
+
+    if (!wasErased)
+    {
+        ++s_simContext.stats.reprogrammedPages;
+    }
+}
+
+void SimulatedNand::clearBlock(uint32_t block)
+{
+    assert(block < wTotalBlocks);
+
+    if (m_image)
+    {
+        uint32_t blockSize = pNANDParams->wPagesPerBlock * pNANDParams->pageTotalSize;
+        memset(m_image + (uint64_t)block * blockSize, 0xff, blockSize);
+    }
+    else if (m_blocks[block])
+    {
+        free(m_blocks[block]);
+        m_blocks[block] = NULL;
+    }
+}
+
+void SimulatedNand::setPerfectEcc(NandEccCorrectionInfo_t * pECC)
+{
+    if (pECC)
+    {
+        memset(pECC, 0, sizeof(*pECC));
+        pECC->payloadCount = pNANDParams->pageDataSize / 512;
+        pECC->isMetadataValid = true;
+    }
+}
+
+void SimulatedNand::format(Taus88 & random, uint32_t badBlockCount)
+{
+    uint32_t block;
+    for (block = 0; block < wTotalBlocks; ++block)
+    {
+        clearBlock(block);
+    }
+
+    // Factory bad blocks read as all zeroes. Block 0 is always left good, as the boot
+    // ROM requires.
+    uint32_t i;
+    for (i = 0; i < badBlockCount && wTotalBlocks > 1; ++i)
+    {
+        block = 1 + random.next(wTotalBlocks - 1);
+        uint32_t page;
+        for (page = 0; page < pNANDParams->wPagesPerBlock; ++page)
+        {
+            memset(getPageStorage(blockToPage(block) + page, true), 0, pNANDParams->pageTotalSize);
+        }
+    }
+}
+
+RtStatus_t SimulatedNand::reset()
+{
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::readID(uint8_t * pReadIDCode)
+{
+    memset(pReadIDCode, 0, 6);
+    pReadIDCode[0] = pNANDParams->manufacturerCode;
+    pReadIDCode[1] = pNANDParams->deviceCode;
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::readRawData(uint32_t wSectorNum, uint32_t columnOffset, uint32_t readByteCount, SECTOR_BUFFER * pBuf)
+{
+    NandSimMutex mutexHolder;
+
+    loadPage(wSectorNum, columnOffset, readByteCount, pBuf);
+
+    ++s_simContext.stats.pageReads;
+    chargeTime(wChipNumber, s_simContext.config.timings.readPageTime, readByteCount);
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::readPage(uint32_t uSectorNumber, SECTOR_BUFFER * pBuffer, SECTOR_BUFFER * pAuxiliary, NandEccCorrectionInfo_t * pECC)
+{
+    NandSimMutex mutexHolder;
+
+    loadPage(uSectorNumber, 0, pNANDParams->pageDataSize, pBuffer);
+    loadPage(uSectorNumber, pNANDParams->pageDataSize, pNANDParams->pageMetadataSize, pAuxiliary);
+    setPerfectEcc(pECC);
+
+    ++s_simContext.stats.pageReads;
+    chargeTime(wChipNumber, s_simContext.config.timings.readPageTime, pNANDParams->pageTotalSize);
+
+#if DEBUG
+    // Insert a false read error if requested.
+    if (g_nand_hal_insertReadError)
+    {
+        RtStatus_t retval = g_nand_hal_insertReadError;
+        g_nand_hal_insertReadError = 0;
+        return retval;
+    }
+#endif
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::readMetadata(uint32_t uSectorNumber, SECTOR_BUFFER * pBuffer, NandEccCorrectionInfo_t * pECC)
+{
+    NandSimMutex mutexHolder;
+
+    loadPage(uSectorNumber, pNANDParams->pageDataSize, pNANDParams->pageMetadataSize, pBuffer);
+    setPerfectEcc(pECC);
+
+    ++s_simContext.stats.metadataReads;
+    chargeTime(wChipNumber, s_simContext.config.timings.readPageTime, pNANDParams->pageMetadataSize);
+
+#if DEBUG
+    if (g_nand_hal_insertReadError)
+    {
+        RtStatus_t retval = g_nand_hal_insertReadError;
+        g_nand_hal_insertReadError = 0;
+        return retval;
+    }
+#endif
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::readPageWithEcc(const NandEccDescriptor_t * ecc, uint32_t pageNumber, SECTOR_BUFFER * pBuffer, SECTOR_BUFFER * pAuxiliary, NandEccCorrectionInfo_t * pECC)
+{
+    // There is no ECC engine to reconfigure, so this is a normal page read.
+    return readPage(pageNumber, pBuffer, pAuxiliary, pECC);
+}
+
+RtStatus_t SimulatedNand::readFirmwarePage(uint32_t uSectorNumber, SECTOR_BUFFER * pBuffer, SECTOR_BUFFER * pAuxiliary, NandEccCorrectionInfo_t * pECC)
+{
+    return readPage(uSectorNumber, pBuffer, pAuxiliary, pECC);
+}
+
+//! Pages on distinct planes share a single tR when the type supports multiplane reads.
+//! Otherwise each page is charged as a separate read.
+RtStatus_t SimulatedNand::readMultiplePages(MultiplaneParamBlock * pages, unsigned pageCount)
+{
+    NandSimMutex mutexHolder;
+
+    const NandSimTimings_t & timings = s_simContext.config.timings;
+    bool isMultiplane = pNANDParams->supportsMultiplaneRead && pageCount > 1;
+    uint32_t bytes = 0;
+
+    unsigned i;
+    for (i = 0; i < pageCount; ++i)
+    {
+        MultiplaneParamBlock & thisPage = pages[i];
+        loadPage(thisPage.m_address, 0, pNANDParams->pageDataSize, thisPage.m_buffer);
+        loadPage(thisPage.m_address, pNANDParams->pageDataSize, pNANDParams->pageMetadataSize, thisPage.m_auxiliaryBuffer);
+        setPerfectEcc(thisPage.m_eccInfo);
+        thisPage.m_resultStatus = SUCCESS;
+
+        ++s_simContext.stats.pageReads;
+        bytes += pNANDParams->pageTotalSize;
+
+        if (!isMultiplane)
+        {
+            chargeTime(wChipNumber, timings.readPageTime, pNANDParams->pageTotalSize);
+            bytes = 0;
+        }
+    }
+
+    if (isMultiplane)
+    {
+        ++s_simContext.stats.multiplaneOperations;
+        chargeTime(wChipNumber, timings.readPageTime, bytes);
+    }
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::readMultipleMetadata(MultiplaneParamBlock * pages, unsigned pageCount)
+{
+    NandSimMutex mutexHolder;
+
+    const NandSimTimings_t & timings = s_simContext.config.timings;
+    bool isMultiplane = pNANDParams->supportsMultiplaneRead && pageCount > 1;
+
+    unsigned i;
+    for (i = 0; i < pageCount; ++i)
+    {
+        MultiplaneParamBlock & thisPage = pages[i];
+        loadPage(thisPage.m_address, pNANDParams->pageDataSize, pNANDParams->pageMetadataSize, thisPage.m_auxiliaryBuffer);
+        setPerfectEcc(thisPage.m_eccInfo);
+        thisPage.m_resultStatus = SUCCESS;
+
+        ++s_simContext.stats.metadataReads;
+
+        if (!isMultiplane)
+        {
+            chargeTime(wChipNumber, timings.readPageTime, pNANDParams->pageMetadataSize);
+        }
+    }
+
+    if (isMultiplane)
+    {
+        ++s_simContext.stats.multiplaneOperations;
+        chargeTime(wChipNumber, timings.readPageTime, pNANDParams->pageMetadataSize * pageCount);
+    }
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::writeRawData(uint32_t pageNumber, uint32_t columnOffset, uint32_t writeByteCount, const SECTOR_BUFFER * data)
+{
+    NandSimMutex mutexHolder;
+
+    programPage(pageNumber, columnOffset, writeByteCount, data);
+
+    ++s_simContext.stats.pageWrites;
+    chargeTime(wChipNumber, s_simContext.config.timings.programPageTime, writeByteCount);
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::writePage(uint32_t uSectorNum, const SECTOR_BUFFER * pBuffer, const SECTOR_BUFFER * pAuxiliary)
+{
+    NandSimMutex mutexHolder;
+
+    programPage(uSectorNum, 0, pNANDParams->pageDataSize, pBuffer);
+    programPage(uSectorNum, pNANDParams->pageDataSize, pNANDParams->pageMetadataSize, pAuxiliary);
+
+    ++s_simContext.stats.pageWrites;
+    chargeTime(wChipNumber, s_simContext.config.timings.programPageTime, pNANDParams->pageTotalSize);
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::writeFirmwarePage(uint32_t uSectorNum, const SECTOR_BUFFER * pBuffer, const SECTOR_BUFFER * pAuxiliary)
+{
+    return writePage(uSectorNum, pBuffer, pAuxiliary);
+}
+
+RtStatus_t SimulatedNand::writeMultiplePages(MultiplaneParamBlock * pages, unsigned pageCount)
+{
+    NandSimMutex mutexHolder;
+
+    const NandSimTimings_t & timings = s_simContext.config.timings;
+    bool isMultiplane = pNANDParams->supportsMultiplaneWrite && pageCount > 1;
+
+    unsigned i;
+    for (i = 0; i < pageCount; ++i)
+    {
+        MultiplaneParamBlock & thisPage = pages[i];
+        programPage(thisPage.m_address, 0, pNANDParams->pageDataSize, thisPage.m_buffer);
+        programPage(thisPage.m_address, pNANDParams->pageDataSize, pNANDParams->pageMetadataSize, thisPage.m_auxiliaryBuffer);
+        thisPage.m_resultStatus = SUCCESS;
+
+        ++s_simContext.stats.pageWrites;
+
+        if (!isMultiplane)
+        {
+            chargeTime(wChipNumber, timings.programPageTime, pNANDParams->pageTotalSize);
+        }
+    }
+
+    if (isMultiplane)
+    {
+        ++s_simContext.stats.multiplaneOperations;
+        chargeTime(wChipNumber, timings.programPageTime, pNANDParams->pageTotalSize * pageCount);
+    }
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::eraseBlock(uint32_t uBlockNumber)
+{
+    NandSimMutex mutexHolder;
+
+    clearBlock(uBlockNumber);
+
+    ++s_simContext.stats.blockErases;
+    chargeTime(wChipNumber, s_simContext.config.timings.eraseBlockTime, 0);
+
+    return SUCCESS;
+}
+
+RtStatus_t SimulatedNand::eraseMultipleBlocks(MultiplaneParamBlock * blocks, unsigned blockCount)
+{
+    NandSimMutex mutexHolder;
+
+    const NandSimTimings_t & timings = s_simContext.config.timings;
+    bool isMultiplane = pNANDParams->supportsMultiplaneErase && blockCount > 1;
+
+    unsigned i;
+    for (i = 0; i < blockCount; ++i)
+    {
+        MultiplaneParamBlock & thisBlock = blocks[i];
+        clearBlock(thisBlock.m_address);
+        thisBlock.m_resultStatus = SUCCESS;
+
+        ++s_simContext.stats.blockErases;
+
+        if (!isMultiplane)
+        {
+            chargeTime(wChipNumber, timings.eraseBlockTime, 0);
+        }
+    }
+
+    if (isMultiplane)
+    {
+        ++s_simContext.stats.multiplaneOperations;
+        chargeTime(wChipNumber, timings.eraseBlockTime, 0);
+    }
+
+    return SUCCESS;
+}
+
+//! Pages are always copied through the caller's buffers so the filter sees every page. When
+//! the copy stays within one chip and plane and the filter leaves the page alone, only the
+//! array latencies are charged, modelling an internal copyback.
+RtStatus_t SimulatedNand::copyPages(
+    NandPhysicalMedia * targetNand,
+    uint32_t uSourceStartSectorNum,
+    uint32_t uTargetStartSectorNum,
+    uint32_t wNumSectors,
+    SECTOR_BUFFER * sectorBuffer,
+    SECTOR_BUFFER * auxBuffer,
+    NandCopyPagesFilter * filter,
+    uint32_t * successfulPages)
+{
+    NandSimMutex mutexHolder;
+
+    SimulatedNand * target = static_cast<SimulatedNand *>(targetNand);
+    const NandSimTimings_t & timings = s_simContext.config.timings;
+    RtStatus_t status = SUCCESS;
+    uint32_t copiedPages = 0;
+
+    while (wNumSectors)
+    {
+        loadPage(uSourceStartSectorNum, 0, pNANDParams->pageDataSize, sectorBuffer);
+        loadPage(uSourceStartSectorNum, pNANDParams->pageDataSize, pNANDParams->pageMetadataSize, auxBuffer);
+
+        bool didModifyPage = false;
+        if (filter)
+        {
+            status = filter->filter(this, targetNand, uSourceStartSectorNum, uTargetStartSectorNum, sectorBuffer, auxBuffer, &didModifyPage);
+            if (status != SUCCESS)
+            {
+                break;
+            }
+        }
+
+        target->programPage(uTargetStartSectorNum, 0, pNANDParams->pageDataSize, sectorBuffer);
+        target->programPage(uTargetStartSectorNum, pNANDParams->pageDataSize, pNANDParams->pageMetadataSize, auxBuffer);
+
+        bool isCopyback = pNANDParams->supportsCopyback
+            && target == this
+            && !didModifyPage
+            && planeOfBlock(pageToBlock(uSourceStartSectorNum)) == planeOfBlock(pageToBlock(uTargetStartSectorNum));
+        uint32_t bytes = isCopyback ? 0 : pNANDParams->pageTotalSize;
+        chargeTime(wChipNumber, timings.readPageTime, bytes);
+        chargeTime(target->wChipNumber, timings.programPageTime, bytes);
+
+        ++s_simContext.stats.copiedPages;
+
+        --wNumSectors;
+        ++uSourceStartSectorNum;
+        ++uTargetStartSectorNum;
+        ++copiedPages;
+    }
+
+    if (successfulPages)
+    {
+        *successfulPages = copiedPages;
+    }
+
+    return status;
+}
+
+//! The same five pages that CommonNandBase::isBlockBad() checks are examined here. Since the
+//! simulated array has no ECC engine, the factory and SGTL marker positions coincide.
+bool SimulatedNand::isBlockBad(uint32_t blockAddress, SECTOR_BUFFER * auxBuffer, bool checkFactoryMarkings, RtStatus_t * readStatus)
+{
+    NandSimMutex mutexHolder;
+
+    const unsigned pagesPerBlock = pNANDParams->wPagesPerBlock;
+    const unsigned totalPagesToCheck = 5;
+    const unsigned pagesToCheck[totalPagesToCheck] = { 0, 1, pagesPerBlock - 3, pagesPerBlock - 2, pagesPerBlock - 1 };
+    uint32_t pageAddress = blockToPage(blockAddress);
+    bool isBad = false;
+
+    unsigned i;
+    for (i = 0; i < totalPagesToCheck && !isBad; ++i)
+    {
+        uint8_t marker;
+        loadPage(pageAddress + pagesToCheck[i], pNANDParams->pageDataSize, sizeof(marker), &marker);
+        isBad = (marker != 0xff);
+
+        ++s_simContext.stats.metadataReads;
+        chargeTime(wChipNumber, s_simContext.config.timings.readPageTime, pNANDParams->pageMetadataSize);
+    }
+
+    if (readStatus)
+    {
+        *readStatus = SUCCESS;
+    }
+
+    return isBad;
+}
+
+RtStatus_t SimulatedNand::markBlockBad(uint32_t blockAddress, SECTOR_BUFFER * pageBuffer, SECTOR_BUFFER * auxBuffer)
+{
+    NandSimMutex mutexHolder;
+
+    // Mimic a factory marked block by zeroing every byte of every page.
+    memset(pageBuffer, 0, pNANDParams->pageTotalSize);
+
+    eraseBlock(blockAddress);
+
+    uint32_t baseSector = blockToPage(blockAddress);
+    uint32_t i;
+    for (i = 0; i < pNANDParams->wPagesPerBlock; ++i)
+    {
+        writeRawData(baseSector + i, 0, pNANDParams->pageTotalSize, pageBuffer);
+    }
+
+    return isBlockBad(blockAddress, auxBuffer) ? SUCCESS : ERROR_DDI_NAND_PROGRAM_FAILED;
+}
+
+char * SimulatedNand::getDeviceName()
+{
+    char * nameString = reinterpret_cast<char *>(malloc(32));
+    if (nameString)
+    {
+        snprintf(nameString, 32, "Simulated Type %u NAND", (unsigned)pNANDParams->NandType);
+    }
+    return nameString;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal_sim.h for documentation.
+////////////////////////////////////////////////////////////////////////////////
+void ddi_nand_hal_sim_get_default_timings(NandType_t nandType, NandSimTimings_t * timings)
+{
+    assert(timings);
+
+    const NandSimTypeInfo_t * info = findTypeInfo(nandType);
+    if (info)
+    {
+        *timings = info->timings;
+    }
+    else
+    {
+        memset(timings, 0, sizeof(*timings));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal_sim.h for documentation.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t ddi_nand_hal_sim_configure(const NandSimConfig_t * config)
+{
+    assert(config);
+
+    const NandSimTypeInfo_t * info = findTypeInfo(config->nandType);
+    if (!info)
+    {
+        return ERROR_DDI_NAND_HAL_NANDTYPE_MISMATCH;
+    }
+
+    NandSimConfig_t & active = s_simContext.config;
+    active = *config;
+
+    // Apply defaults for anything left zero.
+    if (!active.chipSelectCount)
+    {
+        active.chipSelectCount = 1;
+    }
+    if (!active.blocksPerChip)
+    {
+        active.blocksPerChip = NAND_SIM_DEFAULT_BLOCKS_PER_CHIP;
+    }
+    if (!active.dicePerChip)
+    {
+        active.dicePerChip = 1;
+    }
+    if (!active.timings.readPageTime)
+    {
+        active.timings.readPageTime = info->timings.readPageTime;
+    }
+    if (!active.timings.programPageTime)
+    {
+        active.timings.programPageTime = info->timings.programPageTime;
+    }
+    if (!active.timings.eraseBlockTime)
+    {
+        active.timings.eraseBlockTime = info->timings.eraseBlockTime;
+    }
+    if (!active.timings.transferTimePerKB)
+    {
+        active.timings.transferTimePerKB = info->timings.transferTimePerKB;
+    }
+
+    // The address helpers in NandPhysicalMedia mask with the block count, so it must be a
+    // power of 2 and divide evenly among the dice.
+    if (active.chipSelectCount > MAX_NAND_DEVICES
+        || (active.blocksPerChip & (active.blocksPerChip - 1))
+        || (active.blocksPerChip % active.dicePerChip)
+        || active.factoryBadBlockCount >= active.blocksPerChip)
+    {
+        s_simContext.isConfigured = false;
+        return ERROR_DDI_NAND_HAL_INVALID_PARAMETER;
+    }
+
+    s_simContext.isConfigured = true;
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal_sim.h for documentation.
+////////////////////////////////////////////////////////////////////////////////
+void ddi_nand_hal_sim_get_statistics(NandSimStatistics_t * stats)
+{
+    assert(stats);
+    NandSimMutex mutexHolder;
+    *stats = s_simContext.stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal_sim.h for documentation.
+////////////////////////////////////////////////////////////////////////////////
+void ddi_nand_hal_sim_reset_statistics()
+{
+    NandSimMutex mutexHolder;
+    memset(&s_simContext.stats, 0, sizeof(s_simContext.stats));
+}
+
+//! \brief Fill in the shared parameters struct from the type table.
+static void setupParameters(const NandSimTypeInfo_t * info)
+{
+    NandParameters_t & params = s_simContext.parameters;
+    memset(&params, 0, sizeof(params));
+
+    params.manufacturerCode = info->manufacturerCode;
+    params.deviceCode = info->deviceCode;
+    params.NandType = info->nandType;
+    params.cellType = info->cellType;
+    params.eccDescriptor.eccType = (info->pageDataSize > 2048) ? kNandEccType_RS8 : kNandEccType_RS4;
+    params.maxBadBlockPercentage = 5;
+
+    params.pageDataSize = info->pageDataSize;
+    params.pageMetadataSize = info->pageMetadataSize;
+    params.pageTotalSize = info->pageDataSize + info->pageMetadataSize;
+    params.firmwarePageDataSize = params.pageDataSize;
+    params.firmwarePageMetadataSize = params.pageMetadataSize;
+    params.firmwarePageTotalSize = params.pageTotalSize;
+
+    params.wPagesPerBlock = info->pagesPerBlock;
+    params.pageInBlockMask = info->pagesPerBlock - 1;
+    params.pageToBlockShift = 0;
+    while ((1u << params.pageToBlockShift) < info->pagesPerBlock)
+    {
+        ++params.pageToBlockShift;
+    }
+
+    params.wNumColumnBytes = 2;
+    params.wNumRowBytes = 3;
+    params.planesPerDie = info->planesPerDie;
+
+    params.supportsDieInterleaving = s_simContext.config.dicePerChip > 1;
+    params.supportsMultiplaneRead = info->planesPerDie > 1;
+    params.supportsMultiplaneWrite = info->planesPerDie > 1;
+    params.supportsMultiplaneErase = info->planesPerDie > 1;
+    params.supportsCopyback = 1;
+}
+
+//! \brief Open and map the backing file.
+//! \retval true The file was newly created or resized, so the array must be formatted.
+static bool mapBackingFile(const char * path, size_t size, RtStatus_t * status)
+{
+    *status = SUCCESS;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        *status = ERROR_DDI_NAND_HAL_INVALID_PARAMETER;
+        return false;
+    }
+
+    // A file of the wrong size came from a different configuration, so start over.
+    bool isFresh = (lseek(fd, 0, SEEK_END) != (off_t)size);
+    if (isFresh && ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        *status = ERROR_DDI_NAND_HAL_INVALID_PARAMETER;
+        return false;
+    }
+
+    void * image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED)
+    {
+        close(fd);
+        *status = ERROR_DDI_NAND_HAL_INVALID_PARAMETER;
+        return false;
+    }
+
+    s_simContext.backingFile = fd;
+    s_simContext.image = (uint8_t *)image;
+    s_simContext.imageSize = size;
+    return isFresh;
+}
+
+RtStatus_t NandHal::init()
+{
+    if (!s_simContext.isConfigured)
+    {
+        // Fall back to a single 4K page MLC chip.
+        NandSimConfig_t defaultConfig = { };
+        defaultConfig.nandType = kNandType8;
+        RtStatus_t status = ddi_nand_hal_sim_configure(&defaultConfig);
+        if (status != SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    const NandSimConfig_t & config = s_simContext.config;
+    const NandSimTypeInfo_t * info = findTypeInfo(config.nandType);
+    assert(info);
+
+    RtStatus_t status = os_thi_ConvertTxStatus(tx_mutex_create(&s_simContext.serializationMutex, "NAND_HAL_SIM_MUTEX", TX_INHERIT));
+    if (status != SUCCESS)
+    {
+        return status;
+    }
+
+    setupParameters(info);
+    memset(&s_simContext.stats, 0, sizeof(s_simContext.stats));
+    s_simContext.backingFile = -1;
+    s_simContext.image = NULL;
+    s_simContext.imageSize = 0;
+
+    // Map the backing file, if there is one. A RAM backed array is always fresh.
+    uint64_t chipSize = (uint64_t)config.blocksPerChip * s_simContext.parameters.wPagesPerBlock * s_simContext.parameters.pageTotalSize;
+    bool isFresh = true;
+    if (config.backingFilePath)
+    {
+        isFresh = mapBackingFile(config.backingFilePath, chipSize * config.chipSelectCount, &status);
+        if (status != SUCCESS)
+        {
+            tx_mutex_delete(&s_simContext.serializationMutex);
+            return status;
+        }
+    }
+
+    Taus88 random(config.randomSeed ? config.randomSeed : (uint32_t)Taus88::kDefaultSeed);
+
+    s_simContext.chipSelectCount = config.chipSelectCount;
+    s_simContext.totalBlockCount = 0;
+
+    unsigned i;
+    for (i = 0; i < config.chipSelectCount; ++i)
+    {
+        uint8_t * chipImage = s_simContext.image ? s_simContext.image + chipSize * i : NULL;
+        SimulatedNand * nand = new SimulatedNand(i, s_simContext.totalBlockCount, chipImage);
+
+        if (isFresh)
+        {
+            nand->format(random, config.factoryBadBlockCount);
+        }
+
+        s_simContext.nands[i] = nand;
+        s_simContext.totalBlockCount += nand->wTotalBlocks;
+    }
+
+    return SUCCESS;
+}
+
+RtStatus_t NandHal::shutdown()
+{
+    unsigned i;
+    for (i = 0; i < s_simContext.chipSelectCount; ++i)
+    {
+        delete s_simContext.nands[i];
+        s_simContext.nands[i] = NULL;
+    }
+    s_simContext.chipSelectCount = 0;
+    s_simContext.totalBlockCount = 0;
+
+    if (s_simContext.image)
+    {
+        msync(s_simContext.image, s_simContext.imageSize, MS_SYNC);
+        munmap(s_simContext.image, s_simContext.imageSize);
+        close(s_simContext.backingFile);
+        s_simContext.image = NULL;
+        s_simContext.backingFile = -1;
+    }
+
+    memset(&s_simContext.parameters, 0, sizeof(s_simContext.parameters));
+
+    tx_mutex_delete(&s_simContext.serializationMutex);
+
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! Provides C linkage access to the HAL shutdown, as the real HAL does.
+////////////////////////////////////////////////////////////////////////////////
+extern "C" void ddi_nand_hal_shutdown(void)
+{
+    NandHal::shutdown();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+unsigned NandHal::getChipSelectCount()
+{
+    return s_simContext.chipSelectCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+NandParameters_t & NandHal::getParameters()
+{
+    return s_simContext.parameters;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+NandPhysicalMedia * NandHal::getNand(unsigned chipSelect)
+{
+    assert(chipSelect < MAX_NAND_DEVICES);
+    return s_simContext.nands[chipSelect];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+unsigned NandHal::getChipSelectForAbsoluteBlock(uint32_t block)
+{
+    // All simulated chip selects are the same size.
+    unsigned chipSelect = block / s_simContext.config.blocksPerChip;
+    assert(chipSelect < s_simContext.chipSelectCount);
+    return chipSelect;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+unsigned NandHal::getChipSelectForAbsolutePage(uint32_t page)
+{
+    return getChipSelectForAbsoluteBlock(page >> s_simContext.parameters.pageToBlockShift);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+NandPhysicalMedia * NandHal::getNandForAbsoluteBlock(uint32_t block)
+{
+    return getNand(getChipSelectForAbsoluteBlock(block));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+NandPhysicalMedia * NandHal::getNandForAbsolutePage(uint32_t page)
+{
+    return getNand(getChipSelectForAbsolutePage(page));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+uint32_t NandHal::getTotalBlockCount()
+{
+    return s_simContext.totalBlockCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+bool NandHal::isAbsoluteBlockValid(uint32_t block)
+{
+    return block < s_simContext.totalBlockCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_hal.h for documentation.
+///////////////////////////////////////////////////////////////////////////////
+bool NandHal::isAbsolutePageValid(uint32_t page)
+{
+    return isAbsoluteBlockValid(page >> s_simContext.parameters.pageToBlockShift);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_gpmi.h for documentation.
+//
+// The media layer writes the current GPMI timings into the NCB, so the simulation
+// keeps the values it is given even though they have no effect on the timing model.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t ddi_gpmi_set_timings(NAND_Timing2_struct_t const * pNT, bool bWriteToTheDevice)
+{
+    if (pNT)
+    {
+        s_simTimings = *pNT;
+    }
+
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_gpmi.h for documentation.
+////////////////////////////////////////////////////////////////////////////////
+const NAND_Timing2_struct_t * ddi_gpmi_get_current_timings()
+{
+    return &s_simTimings;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// See ddi_nand_gpmi.h for documentation.
+////////////////////////////////////////////////////////////////////////////////
+void ddi_gpmi_get_safe_timings(NAND_Timing2_struct_t * timings)
+{
+    const NAND_Timing2_struct_t safeTimings = NAND_SAFESTARTUP_TIMINGS;
+    *timings = safeTimings;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// End of file
+///////////////////////////////////////////////////////////////////////////////
+//! @}
@@ -0,0 +1,118 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor, Inc. All rights reserved.
+//
+// Freescale Semiconductor, Inc.
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor, Inc.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \addtogroup ddi_media_nand_hal_sim
+//! @{
+//! \file   ddi_nand_hal_sim.h
+//! \brief  Configuration interface for the simulated NAND HAL.
+//!
+//! The simulated HAL is a drop-in replacement for the real NAND HAL library. It
+//! implements the NandHal static interface and the NandPhysicalMedia class on top of
+//! host memory, so the NAND media, mapper, and data drive code can be run unmodified
+//! on a host. Link ddi_nand_hal_sim.a in place of ddi_nand_hal.a.
+//!
+//! The only functions declared in this header are the ones used to configure the
+//! simulation before NandHal::init() is called and to read back the timing model
+//! results. Everything else is accessed through ddi_nand_hal.h as usual.
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _DDI_NAND_HAL_SIM_H
+#define _DDI_NAND_HAL_SIM_H
+
+#include "types.h"
+#include "drivers/media/nand/hal/ddi_nand_hal.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Definitions
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Array operation latencies for one NAND type.
+//!
+//! All times are in microseconds. The bus transfer time is charged per kilobyte
+//! moved between the controller and the NAND page register, in either direction.
+typedef struct _nand_sim_timings {
+    uint32_t readPageTime;      //!< tR, the page read latency.
+    uint32_t programPageTime;   //!< tPROG, the page program latency.
+    uint32_t eraseBlockTime;    //!< tBERS, the block erase latency.
+    uint32_t transferTimePerKB; //!< Time to move 1KB over the NAND bus.
+} NandSimTimings_t;
+
+//! \brief How simulated latencies are applied.
+typedef enum _nand_sim_delay_mode {
+    //! Latencies are only accumulated in the simulated clock. Runs are reproducible and
+    //! as fast as the host allows.
+    kNandSimDelay_None,
+
+    //! The calling thread is also put to sleep for each modeled latency, so wall clock
+    //! measurements on the host reflect the timing model.
+    kNandSimDelay_Sleep
+} NandSimDelayMode_t;
+
+//! \brief Configuration of the simulated NAND array.
+//!
+//! Pass to ddi_nand_hal_sim_configure() before calling NandHal::init(). Any field left
+//! zero is replaced with the default for \a nandType.
+typedef struct _nand_sim_config {
+    NandType_t nandType;            //!< Type to simulate. Selects page geometry and default timings.
+    unsigned chipSelectCount;       //!< Number of chip selects, from 1 to #MAX_NAND_DEVICES.
+    uint32_t blocksPerChip;         //!< Blocks per chip select. Must be a power of 2.
+    uint32_t dicePerChip;           //!< Internal dice per chip select.
+
+    //! Optional path of a file used to back the array. The file is created or resized as
+    //! needed and mapped into memory, so the contents persist between runs. When NULL,
+    //! the array lives in RAM and pages are allocated a block at a time on first program.
+    const char * backingFilePath;
+
+    //! Timing model. Fields left zero use the defaults for \a nandType.
+    NandSimTimings_t timings;
+    NandSimDelayMode_t delayMode;   //!< How latencies are applied.
+
+    //! Number of blocks per chip to mark bad at format time, emulating factory bad
+    //! blocks. Only applied to a fresh array. The blocks are chosen with \a randomSeed.
+    uint32_t factoryBadBlockCount;
+    uint32_t randomSeed;            //!< Seed for factory bad block selection.
+} NandSimConfig_t;
+
+//! \brief Operation counts and simulated time.
+typedef struct _nand_sim_statistics {
+    uint64_t pageReads;             //!< Full page reads, including raw reads.
+    uint64_t metadataReads;         //!< Metadata-only reads.
+    uint64_t pageWrites;            //!< Page programs, including raw writes.
+    uint64_t blockErases;           //!< Block erases.
+    uint64_t copiedPages;           //!< Pages moved with copyPages().
+    uint64_t multiplaneOperations;  //!< Multiplane operations that shared one array latency.
+    uint64_t reprogrammedPages;     //!< Programs of a page that was not erased; always an FTL bug.
+    uint64_t busyTime[MAX_NAND_DEVICES];    //!< Total modeled busy time per chip select, in microseconds.
+    uint64_t elapsedTime;           //!< Modeled time for the whole run, in microseconds.
+} NandSimStatistics_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+//! \brief Set the configuration used by the next NandHal::init().
+//!
+//! \retval SUCCESS The configuration was accepted.
+//! \retval ERROR_DDI_NAND_HAL_INVALID_PARAMETER A field is out of range.
+//! \retval ERROR_DDI_NAND_HAL_NANDTYPE_MISMATCH The NAND type is not simulated.
+RtStatus_t ddi_nand_hal_sim_configure(const NandSimConfig_t * config);
+
+//! \brief Fill in the default timings for a NAND type.
+void ddi_nand_hal_sim_get_default_timings(NandType_t nandType, NandSimTimings_t * timings);
+
+//! \brief Copy out the current statistics.
+void ddi_nand_hal_sim_get_statistics(NandSimStatistics_t * stats);
+
+//! \brief Zero the statistics and the simulated clock.
+void ddi_nand_hal_sim_reset_statistics();
+
+#endif // _DDI_NAND_HAL_SIM_H
+//! @}
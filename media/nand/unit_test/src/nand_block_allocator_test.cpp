@@ -20,6 +20,7 @@
 #include "drivers/media/nand/ddi/mapper/BlockAllocator.h"
 #include "drivers/media/nand/ddi/mapper/Mapper.h"
 #include "drivers/media/nand/ddi/mapper/PhyMap.h"
+#include <stdlib.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Definitions
@@ -38,7 +39,10 @@ enum _alloc_constants
     kMaxBlockNumberPrintCutoff = 20,
     
     //! Whether to mark the allocated blocks as used in the phymap.
-    kMarkAllocatedBlocksUsed = false
+    kMarkAllocatedBlocksUsed = false,
+    
+    //! Number of random ranges to search when checking the phymap search.
+    kSearchIterations = 2000
 };
 
 //! \brief Special error codes for this test.
@@ -46,7 +50,9 @@ enum _test_errors
 {
     kBlockOutOfRangeError = 0x10000001,
     kBlockWrongPlaneError = 0x10000002,
-    kBlockNotAllocatedError = 0x10000003
+    kBlockNotAllocatedError = 0x10000003,
+    kSearchMismatchError = 0x10000004,
+    kFreeCountMismatchError = 0x10000005
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -55,6 +61,9 @@ enum _test_errors
 
 RtStatus_t test_alloc(nand::BlockAllocator & alloc, const char * msg);
 RtStatus_t test_constraints(nand::BlockAllocator & alloc);
+RtStatus_t check_free_counts(nand::PhyMap * phymap, const char * msg);
+RtStatus_t test_search(nand::PhyMap * phymap);
+RtStatus_t test_free_counts(nand::PhyMap * phymap);
 RtStatus_t test_core();
 RtStatus_t run_test();
 
@@ -244,6 +253,160 @@ RtStatus_t test_constraints(nand::BlockAllocator & alloc)
     return SUCCESS;
 }
     
+//! Compares phymap searches of random ranges against checking each block in turn, while
+//! randomly marking blocks used and free.
+RtStatus_t test_search(nand::PhyMap * phymap)
+{
+    uint32_t blockCount = phymap->getBlockCount();
+    unsigned planesPerDie = NandHal::getParameters().planesPerDie;
+    int i;
+    
+    for (i=0; i < kSearchIterations; ++i)
+    {
+        uint32_t start = rand() % blockCount;
+        uint32_t end = start + rand() % (blockCount - start);
+        unsigned planeMask = (rand() & 1) ? planesPerDie - 1 : 0;
+        unsigned planeNumber = planeMask ? (rand() % planesPerDie) : 0;
+        uint32_t expected;
+        uint32_t found = 0;
+        bool didFind;
+        
+        // Find the expected answer the slow way.
+        for (expected = start; expected <= end; ++expected)
+        {
+            if (phymap->isBlockFree(expected) && (expected & planeMask) == planeNumber)
+            {
+                break;
+            }
+        }
+        
+        didFind = phymap->findFirstFreeBlock(start, end, &found, planeMask, planeNumber);
+        if (didFind != (expected <= end) || (didFind && found != expected))
+        {
+            FASTPRINT("Search of %u-%u plane %u/%u found %u, expected %u\n", start, end, planeNumber, planeMask, didFind ? found : ~0, expected <= end ? expected : ~0);
+            return kSearchMismatchError;
+        }
+        
+        // Change the map a little for the next search.
+        uint32_t block = rand() % blockCount;
+        if (rand() & 1)
+        {
+            phymap->markBlockUsed(block);
+        }
+        else
+        {
+            phymap->markBlockFree(block);
+        }
+    }
+    
+    FASTPRINT("Searched %u ranges\n", kSearchIterations);
+    
+    return check_free_counts(phymap, "after search");
+}
+
+//! Compares the phymap's free counts against checking each block in turn. Blocks past
+//! the end of the last chip select are counted with it, like the phymap does.
+RtStatus_t check_free_counts(nand::PhyMap * phymap, const char * msg)
+{
+    uint32_t blockCount = phymap->getBlockCount();
+    unsigned planesPerDie = NandHal::getParameters().planesPerDie;
+    unsigned chipCount = NandHal::getChipSelectCount();
+    uint32_t totalFree = 0;
+    uint32_t planeTotal = 0;
+    uint32_t block;
+    unsigned chip;
+    unsigned plane;
+    
+    for (block = 0; block < blockCount; ++block)
+    {
+        if (phymap->isBlockFree(block))
+        {
+            ++totalFree;
+        }
+    }
+    
+    if (phymap->getFreeCount() != totalFree)
+    {
+        FASTPRINT("Free count %s is %u, expected %u\n", msg, phymap->getFreeCount(), totalFree);
+        return kFreeCountMismatchError;
+    }
+    
+    for (chip = 0; chip < chipCount; ++chip)
+    {
+        NandPhysicalMedia * nand = NandHal::getNand(chip);
+        uint32_t startBlock = nand->baseAbsoluteBlock();
+        uint32_t endBlock = (chip + 1 < chipCount) ? startBlock + nand->wTotalBlocks : blockCount;
+        uint32_t chipFree = 0;
+        
+        for (block = startBlock; block < endBlock; ++block)
+        {
+            if (phymap->isBlockFree(block))
+            {
+                ++chipFree;
+            }
+        }
+        
+        if (phymap->getFreeCountForChip(chip) != chipFree)
+        {
+            FASTPRINT("Free count of chip %u %s is %u, expected %u\n", chip, msg, phymap->getFreeCountForChip(chip), chipFree);
+            return kFreeCountMismatchError;
+        }
+    }
+    
+    for (plane = 0; plane < planesPerDie; ++plane)
+    {
+        planeTotal += phymap->getFreeCountForPlane(plane);
+    }
+    
+    if (planeTotal != totalFree)
+    {
+        FASTPRINT("Plane free counts %s add up to %u, expected %u\n", msg, planeTotal, totalFree);
+        return kFreeCountMismatchError;
+    }
+    
+    return SUCCESS;
+}
+
+//! Checks the free counts after the whole phymap is marked at once, and after the
+//! entries are copied back in and recounted.
+RtStatus_t test_free_counts(nand::PhyMap * phymap)
+{
+    uint32_t entryBytes = nand::PhyMap::kEntrySizeInBytes * phymap->getEntryCount();
+    auto_free<uint8_t> savedEntries(malloc(entryBytes));
+    RtStatus_t status;
+    assert(savedEntries);
+    memcpy(savedEntries, phymap->getAllEntries(), entryBytes);
+    
+    // Marking every block free also sets the bits past the last block.
+    phymap->markAll(nand::PhyMap::kFree);
+    status = check_free_counts(phymap, "after marking all free");
+    if (status == SUCCESS && phymap->getFreeCount() != phymap->getBlockCount())
+    {
+        FASTPRINT("Free count after marking all free is %u, expected %u\n", phymap->getFreeCount(), phymap->getBlockCount());
+        status = kFreeCountMismatchError;
+    }
+    
+    if (status == SUCCESS)
+    {
+        phymap->markAll(nand::PhyMap::kUsed);
+        status = check_free_counts(phymap, "after marking all used");
+    }
+    
+    if (status == SUCCESS)
+    {
+        memcpy(phymap->getAllEntries(), savedEntries, entryBytes);
+        phymap->rebuildSummary();
+        status = check_free_counts(phymap, "after rebuilding the summary");
+    }
+    
+    if (status == SUCCESS)
+    {
+        FASTPRINT("Checked free counts\n");
+    }
+    
+    return status;
+}
+
 RtStatus_t test_core()
 {
     RtStatus_t status = SUCCESS;
@@ -264,6 +427,7 @@ RtStatus_t test_core()
         return status;
     }
     memcpy(phymap->getAllEntries(), realPhymap->getAllEntries(), nand::PhyMap::kEntrySizeInBytes * phymap->getEntryCount());
+    phymap->rebuildSummary();
     
     FASTPRINT(">>>Random<<<\n");
     nand::RandomBlockAllocator random(phymap);
@@ -278,6 +442,18 @@ RtStatus_t test_core()
         status = test_constraints(linear);
     }
     
+    if (status == SUCCESS)
+    {
+        FASTPRINT(">>>Search<<<\n");
+        status = test_search(phymap);
+    }
+    
+    if (status == SUCCESS)
+    {
+        FASTPRINT(">>>Free counts<<<\n");
+        status = test_free_counts(phymap);
+    }
+    
     return status;
 }
 
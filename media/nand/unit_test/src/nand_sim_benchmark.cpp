@@ -0,0 +1,210 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Freescale Semiconductor, Inc. All rights reserved.
+//
+// Freescale Semiconductor, Inc.
+// Proprietary & Confidential
+//
+// This source code and the algorithms implemented therein constitute
+// confidential information and may comprise trade secrets of Freescale Semiconductor, Inc.
+// or its associates, and any use thereof is subject to the terms and
+// conditions of the Confidential Disclosure Agreement pursual to which this
+// source code was originally received.
+///////////////////////////////////////////////////////////////////////////////
+//! \file nand_sim_benchmark.cpp
+//! \brief Runs the NAND media, mapper, and data drive on the simulated HAL.
+//!
+//! The data drive is written sequentially and then at random, read back, and
+//! verified. The operation counts and modeled time from the simulation are printed
+//! for each phase so that FTL changes can be compared against a fixed baseline.
+///////////////////////////////////////////////////////////////////////////////
+#include "drivers/media/common/media_unit_test_helpers.h"
+#include "drivers/media/ddi_media_errordefs.h"
+#include "drivers/media/nand/hal/ddi_nand_hal.h"
+#include "drivers/media/nand/hal/sim/ddi_nand_hal_sim.h"
+#include "drivers/media/nand/include/ddi_nand.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Definitions
+////////////////////////////////////////////////////////////////////////////////
+
+//! Number of sectors written sequentially from the start of the data drive.
+const uint32_t kSequentialSectorCount = 4096;
+
+//! Number of sectors written at random addresses within the sequential range.
+const uint32_t kRandomSectorCount = 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+RtStatus_t run_test();
+
+////////////////////////////////////////////////////////////////////////////////
+// Variables
+////////////////////////////////////////////////////////////////////////////////
+
+//! Native sector size of the data drive.
+static uint32_t s_sectorSize = 0;
+
+//! Number of native sectors in the data drive.
+static uint32_t s_sectorCount = 0;
+
+//! Media layout used by the benchmark: a single data drive filling the media.
+static MediaAllocationTable_t s_mediaTable = {
+    1,
+    {
+        { 1, kDriveTypeData, DRIVE_TAG_DATA, 0, true }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Code
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Prints the simulation statistics for a phase and resets them.
+//!
+//! \param phaseName Name of the phase printed with the results.
+//! \param byteCount Number of data drive bytes transferred during the phase.
+//!
+//! \retval SUCCESS The phase did not reprogram any page.
+//! \retval ERROR_GENERIC The FTL programmed a page that was not erased.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t report_phase(const char * phaseName, uint64_t byteCount)
+{
+    NandSimStatistics_t stats;
+    ddi_nand_hal_sim_get_statistics(&stats);
+
+    FASTPRINT("%s: %s in %s (%.2f MB/s)\n", phaseName, bytes_to_pretty_string(byteCount), microseconds_to_pretty_string(stats.elapsedTime), get_mb_s(byteCount, stats.elapsedTime));
+    FASTPRINT("    page reads: %llu, metadata reads: %llu, page writes: %llu\n", stats.pageReads, stats.metadataReads, stats.pageWrites);
+    FASTPRINT("    block erases: %llu, copied pages: %llu, multiplane ops: %llu\n", stats.blockErases, stats.copiedPages, stats.multiplaneOperations);
+
+    ddi_nand_hal_sim_reset_statistics();
+
+    REQ_RESULT(stats.reprogrammedPages, 0);
+
+    return SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Erases the media and allocates a data drive on it.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t setup_media()
+{
+    NandSimConfig_t config = { };
+    config.nandType = kNandType6;
+    config.chipSelectCount = 2;
+    config.blocksPerChip = 2048;
+    config.delayMode = kNandSimDelay_None;
+    config.factoryBadBlockCount = 8;
+    config.randomSeed = 1;
+    REQ_SUCCESS(ddi_nand_hal_sim_configure(&config));
+
+    REQ_SUCCESS(MediaInit(kInternalMedia));
+    REQ_SUCCESS(MediaErase(kInternalMedia, 0, true));
+    REQ_SUCCESS(MediaAllocate(kInternalMedia, &s_mediaTable));
+    REQ_SUCCESS(MediaDiscoverAllocation(kInternalMedia));
+    REQ_SUCCESS(DriveInit(DRIVE_TAG_DATA));
+
+    REQ_SUCCESS(DriveGetInfo(DRIVE_TAG_DATA, kDriveInfoNativeSectorSizeInBytes, &s_sectorSize));
+    REQ_SUCCESS(DriveGetInfo(DRIVE_TAG_DATA, kDriveInfoSizeInNativeSectors, &s_sectorCount));
+    REQ_TRUE(s_sectorSize <= kMaxBufferBytes);
+    REQ_TRUE(s_sectorCount >= kSequentialSectorCount);
+    g_actualBufferBytes = s_sectorSize;
+
+    FASTPRINT("Data drive: %u sectors of %u bytes\n", s_sectorCount, s_sectorSize);
+
+    return report_phase("Format", 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Writes the benchmark range in order, then rewrites random sectors in it.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t write_sectors()
+{
+    uint32_t i;
+
+    for (i = 0; i < kSequentialSectorCount; ++i)
+    {
+        fill_data_buffer(s_dataBuffer, i);
+        REQ_SUCCESS(DriveWriteSector(DRIVE_TAG_DATA, i, s_dataBuffer));
+    }
+    REQ_SUCCESS(DriveFlush(DRIVE_TAG_DATA));
+    REQ_SUCCESS(report_phase("Sequential write", (uint64_t)kSequentialSectorCount * s_sectorSize));
+
+    // The fill pattern depends only on the sector number, so rewriting a sector
+    // leaves its expected contents unchanged.
+    for (i = 0; i < kRandomSectorCount; ++i)
+    {
+        uint32_t sector = g_rng->next(kSequentialSectorCount);
+        fill_data_buffer(s_dataBuffer, sector);
+        REQ_SUCCESS(DriveWriteSector(DRIVE_TAG_DATA, sector, s_dataBuffer));
+    }
+    REQ_SUCCESS(DriveFlush(DRIVE_TAG_DATA));
+
+    return report_phase("Random write", (uint64_t)kRandomSectorCount * s_sectorSize);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//! \brief Reads back the benchmark range and verifies its contents.
+////////////////////////////////////////////////////////////////////////////////
+RtStatus_t verify_sectors()
+{
+    uint32_t i;
+
+    for (i = 0; i < kSequentialSectorCount; ++i)
+    {
+        fill_data_buffer(s_dataBuffer, i);
+        REQ_SUCCESS(DriveReadSector(DRIVE_TAG_DATA, i, s_readBuffer));
+        if (!compare_buffers(s_dataBuffer, s_readBuffer, s_sectorSize))
+        {
+            FASTPRINT("Sector %u does not match\n", i);
+            return ERROR_GENERIC;
+        }
+    }
+
+    return report_phase("Sequential read", (uint64_t)kSequentialSectorCount * s_sectorSize);
+}
+
+RtStatus_t run_test()
+{
+    REQ_SUCCESS(setup_media());
+    REQ_SUCCESS(write_sectors());
+    REQ_SUCCESS(verify_sectors());
+
+    REQ_SUCCESS(MediaShutdown(kInternalMedia));
+    REQ_SUCCESS(report_phase("Shutdown", 0));
+
+    tss_logtext_Flush(TX_WAIT_FOREVER);
+
+    return SUCCESS;
+}
+
+RtStatus_t test_main(ULONG param)
+{
+    RtStatus_t status;
+
+    // Initialize the Media
+    status = SDKInitialization();
+
+    if (status == SUCCESS)
+    {
+        status = run_test();
+    }
+
+    if (status == SUCCESS)
+    {
+        FASTPRINT("unit test passed!\n");
+    }
+    else
+    {
+        FASTPRINT("unit test failed: 0x%08x\n", status);
+    }
+
+    exit(status);
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// End of file
+////////////////////////////////////////////////////////////////////////////////